@@ -0,0 +1,32 @@
+# FITS file access, shared by the viewer and the command-line tools.
+
+LIBS += -lcfitsio -lrt
+
+INCLUDEPATH += \
+    $$PWD/include
+
+SOURCES += \
+    $$PWD/src/fitsbandreader.cpp \
+    $$PWD/src/fitsbandwriter.cpp \
+    $$PWD/src/fitsbinner.cpp \
+    $$PWD/src/fitsbufferpool.cpp \
+    $$PWD/src/fitsexception.cpp \
+    $$PWD/src/fitsimage.cpp \
+    $$PWD/src/fitsmemorybudget.cpp \
+    $$PWD/src/fitsraster.cpp \
+    $$PWD/src/fitssharedcache.cpp \
+    $$PWD/src/fitstantrum.cpp \
+    $$PWD/src/fitstrace.cpp
+
+HEADERS += \
+    $$PWD/include/fitsbandreader.h \
+    $$PWD/include/fitsbandwriter.h \
+    $$PWD/include/fitsbinner.h \
+    $$PWD/include/fitsbufferpool.h \
+    $$PWD/include/fitsexception.h \
+    $$PWD/include/fitsimage.h \
+    $$PWD/include/fitsmemorybudget.h \
+    $$PWD/include/fitsraster.h \
+    $$PWD/include/fitssharedcache.h \
+    $$PWD/include/fitstantrum.h \
+    $$PWD/include/fitstrace.h
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <inttypes.h>
+#include <fitsio.h>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Reads an image a band of rows at a time, one channel plane per
+    // call, so a caller never needs the whole array in memory. Pixels
+    // are always delivered as float with BZERO/BSCALE applied.
+    class FITSBandReader
+    {
+    public:
+        FITSBandReader(const char *filename);
+        ~FITSBandReader();
+
+        const char *getFilename() const;
+
+        int getWidth() const;
+        int getHeight() const;
+        int getChannels() const;
+
+        void readBand(int channel,
+                      int firstRow,
+                      int numRows,
+                      float *pixels);
+
+    private:
+        char _filename[1024];
+        fitsfile *_fits;
+        FITSImage::Info _info;
+    };
+
+}
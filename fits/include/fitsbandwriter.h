@@ -0,0 +1,44 @@
+#pragma once
+
+#include <inttypes.h>
+#include <fitsio.h>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Creates an image (NAXIS3 = 3 for colour, planar) and writes it a
+    // band of rows at a time. Bands are always passed as floats; cfitsio
+    // converts them to the file's bit depth, so integer images expect
+    // values already within their unsigned range.
+    class FITSBandWriter
+    {
+    public:
+        FITSBandWriter(const char *filename,
+                       int width,
+                       int height,
+                       int channels,
+                       FITSImage::BitDepth bitDepth = FITSImage::BD_FLOAT);
+        ~FITSBandWriter();
+
+        void writeKey(const char *keyword,
+                      long value,
+                      const char *comment);
+        void writeHistory(const char *history);
+
+        void writeBand(int channel,
+                       int firstRow,
+                       int numRows,
+                       const float *pixels);
+
+        void close();
+
+    private:
+        fitsfile *_fits;
+        int _width;
+        int _height;
+        int _channels;
+    };
+
+}
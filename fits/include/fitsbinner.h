@@ -0,0 +1,34 @@
+#pragma once
+
+#include <fitsio.h>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Bins a plane factor x factor while reading it, a band of rows at a
+    // time, so the full-resolution array never exists. Blocks that don't
+    // fit at the right and bottom edges are dropped, as camera binning
+    // drops them.
+    class FITSBinner
+    {
+    public:
+        // Sums of integers need a wider type than the file's; averages
+        // keep it.
+        static FITSImage::BitDepth getBinnedDepth(FITSImage::BitDepth bitDepth,
+                                                  FITSImage::BinMode mode);
+
+        // Reads the plane info describes (as probe() and selectPlane()
+        // leave it, at full size) into pixels, which must hold the
+        // binned image in getBinnedDepth()'s type, laid out as the file
+        // is.
+        static void read(fitsfile *fits,
+                         const FITSImage::Info &info,
+                         FITSImage::BitDepth bitDepth,
+                         int factor,
+                         FITSImage::BinMode mode,
+                         void *pixels);
+    };
+
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+namespace ELS
+{
+
+    class FITSMemoryBudget;
+
+    // Recycles large pixel buffers between images. Requests are rounded
+    // up to size classes an eighth of a power of two apart, so frames of
+    // the same geometry and type always land in the same class and a
+    // released raster is handed straight to the next frame. Buffers of
+    // 2 MB or more are 2 MB aligned and, where the kernel supports it,
+    // backed by transparent huge pages.
+    //
+    // The global pool charges its idle memory to the global memory
+    // budget, which can take it back when something else needs room.
+    //
+    // Memory comes back uninitialized. Thread-safe.
+    class FITSBufferPool
+    {
+    public:
+        struct Stats
+        {
+            uint64_t hits;
+            uint64_t misses;
+            size_t outstandingBytes;
+            size_t retainedBytes;
+        };
+
+    public:
+        static FITSBufferPool *global();
+
+        // Idle memory is charged to budget if it isn't null.
+        explicit FITSBufferPool(FITSMemoryBudget *budget = 0);
+        ~FITSBufferPool();
+
+        // Never returns null; throws FITSException if the system is out
+        // of memory.
+        void *acquire(size_t bytes);
+
+        // ptr must have come from acquire() on this pool.
+        void release(void *ptr);
+
+        // The size actually reserved for ptr: its size class.
+        size_t sizeOf(void *ptr) const;
+
+        // How much idle memory to hold on to. Releases beyond this free
+        // the oldest idle buffers first.
+        void setRetainLimit(size_t bytes);
+        size_t getRetainLimit() const;
+
+        void setUseHugePages(bool useHugePages);
+        bool getUseHugePages() const;
+
+        // Frees every idle buffer.
+        void trim();
+
+        // Frees idle buffers, oldest first, until at least bytes are
+        // freed or none are left. Returns the amount freed.
+        size_t trimBy(size_t bytes);
+
+        Stats getStats() const;
+
+        static size_t sizeClass(size_t bytes);
+
+        // Scratch space from the global pool, or, below the size worth
+        // pooling, straight from malloc, whose per-thread caches serve
+        // it without taking the pool's lock. bytes must be passed back
+        // to releaseScratch() unchanged.
+        static void *acquireScratch(size_t bytes);
+        static void releaseScratch(void *ptr,
+                                   size_t bytes);
+
+    private:
+        // Idle buffers oldest first, for trimming.
+        typedef std::list<std::pair<void *, size_t>> IdleList;
+
+    private:
+        FITSBufferPool(const FITSBufferPool &);
+        FITSBufferPool &operator=(const FITSBufferPool &);
+
+        void *allocate(size_t bytes);
+        size_t trimTo(size_t bytes);
+        void chargeBudget(int64_t bytes);
+
+    private:
+        mutable std::mutex _mutex;
+        // Per size class, where each idle buffer is in _idleOrder, also
+        // oldest first.
+        std::map<size_t, std::deque<IdleList::iterator>> _idle;
+        IdleList _idleOrder;
+        std::unordered_map<void *, size_t> _outstanding;
+        size_t _retainLimit;
+        bool _useHugePages;
+        Stats _stats;
+        FITSMemoryBudget *_budget;
+        int _budgetId;
+    };
+
+    // A pooled array that goes back to the pool when it goes out of
+    // scope, for scratch space.
+    template <typename T>
+    class FITSPooledArray
+    {
+    public:
+        explicit FITSPooledArray(size_t count)
+            : _data((T *)FITSBufferPool::acquireScratch(count * sizeof(T))),
+              _count(count)
+        {
+        }
+
+        ~FITSPooledArray()
+        {
+            FITSBufferPool::releaseScratch(_data, _count * sizeof(T));
+        }
+
+        T *data() { return _data; }
+        size_t size() const { return _count; }
+        T &operator[](size_t i) { return _data[i]; }
+
+    private:
+        FITSPooledArray(const FITSPooledArray &);
+        FITSPooledArray &operator=(const FITSPooledArray &);
+
+        T *_data;
+        size_t _count;
+    };
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <inttypes.h>
+#include <memory>
+#include <vector>
+#include <fitsio.h>
 
 namespace ELS
 {
@@ -19,6 +22,17 @@ namespace ELS
             BD_DOUBLE
         };
 
+        // How load() combines the pixels of a bin.
+        enum BinMode
+        {
+            BM_SUM,
+            BM_AVERAGE
+        };
+
+        // Cubes may have this many axes; all but the first two (or the
+        // colour axis) index planes.
+        static const int g_maxAxes = 9;
+
     public:
         class Info
         {
@@ -26,21 +40,127 @@ namespace ELS
             int bitDepthEnum;
             char imageType[100];
             int numAxis;
-            long axLengths[3];
+            long axLengths[g_maxAxes];
             int chanAx;
             int width;
             int height;
             int64_t numPixels;
             char sizeAndColor[200];
-            long fpixel[3];
+            // First pixel read, in file coordinates.
+            long fpixel[g_maxAxes];
             double *imageArray;
             double maxPixelVal;
             double minPixelVal;
+            char bayerPattern[FLEN_VALUE];
+            int bayerOffsetX;
+            int bayerOffsetY;
+            int decimation;
+            int binning;
+            // Pixels run from 0 to range - 1: set where that is more
+            // than the pixel type says, as for sum-binned images. 0 to
+            // go by the type.
+            int64_t range;
+            // Which HDU (1 is the primary) and which of its planes.
+            int hdu;
+            int plane;
+            int planeCount;
+            char extName[FLEN_VALUE];
+            // Where pixel (0, 0) lies in the full image, for a region.
+            int originX;
+            int originY;
+        };
+
+        // A rectangle of image pixels, 0-based.
+        struct Region
+        {
+            int x;
+            int y;
+            int width;
+            int height;
+        };
+
+        // An image HDU of a file, as found by listImages().
+        struct ImageHDU
+        {
+            int hdu;
+            char extName[FLEN_VALUE];
+            int width;
+            int height;
+            bool isColor;
+            int planeCount;
         };
 
     public:
+        // Reads the first plane of the first HDU holding an image.
         static FITSImage *load(const char *filename);
 
+        // Reads one plane of one HDU; hdu 0 means the first HDU holding
+        // an image. Only that plane is read. A binning above 1 bins it
+        // that many pixels square as it is read, per channel; bayered
+        // frames come out mono, and sums of integers widen (see
+        // FITSBinner).
+        static FITSImage *load(const char *filename,
+                               int hdu,
+                               int plane,
+                               int binning = 1,
+                               BinMode binMode = BM_AVERAGE);
+
+        // Reads just region (clipped to the image) of one plane, and of
+        // one channel of a colour image, or all of them if channel is
+        // -1. Only the rows, and for tile-compressed files the tiles,
+        // that region covers are read. The result keeps its place in
+        // the full image as its origin.
+        static FITSImage *loadRegion(const char *filename,
+                                     const Region &region,
+                                     int channel = -1,
+                                     int hdu = 0,
+                                     int plane = 0);
+
+        // Every image HDU in filename, from the headers alone.
+        static std::vector<ImageHDU> listImages(const char *filename);
+
+        // Reads every factor'th pixel in both directions, for previews.
+        // Bayered frames use the nearest odd factor at or below the one
+        // asked for, which keeps the colour filter pattern intact.
+        static FITSImage *loadDecimated(const char *filename,
+                                        int factor);
+
+        // Reads just the header of filename's first image into info.
+        static BitDepth probe(const char *filename,
+                              Info *info);
+
+        // Reads the image geometry and pixel type of the current HDU
+        // into info, set up for its first plane, and returns the
+        // matching bit depth. Throws on anything load() would refuse.
+        static BitDepth probe(fitsfile *fits,
+                              Info *info);
+
+        // Creates an image with an allocated but uninitialized raster,
+        // for processing stages to fill in. Colour images are planar.
+        static FITSImage *create(BitDepth bitDepth,
+                                 int width,
+                                 int height,
+                                 bool isColor);
+
+        // Creates an image described by info (copied), with an allocated
+        // but uninitialized raster. For restoring an image whose pixels
+        // were kept elsewhere.
+        static FITSImage *create(BitDepth bitDepth,
+                                 const Info &info);
+
+        // Creates an image described by info (copied) over pixels that
+        // live elsewhere, such as shared memory. owner keeps them alive
+        // for as long as the image exists. The pixels are read-only.
+        static FITSImage *wrap(BitDepth bitDepth,
+                               const Info &info,
+                               const void *pixels,
+                               const std::shared_ptr<const void> &owner);
+
+        // A new image holding a copy of region (clipped) of image, with
+        // its origin kept as loadRegion() does.
+        static FITSImage *crop(const FITSImage *image,
+                               const Region &region);
+
     public:
         ~FITSImage();
 
@@ -52,10 +172,41 @@ namespace ELS
         int getChanAx() const;
         bool isColor() const;
 
+        // The factor the image was decimated by when read, 1 if it
+        // holds every pixel.
+        int getDecimation() const;
+        // The factor load() binned the image by, 1 if it didn't.
+        int getBinning() const;
+
+        // The colour filter array of a one-shot-colour frame (BAYERPAT,
+        // XBAYROFF, YBAYROFF), empty for anything else.
+        bool isBayered() const;
+        const char *getBayerPattern() const;
+        int getBayerOffsetX() const;
+        int getBayerOffsetY() const;
+
+        const Info &getInfo() const;
+
+        // Where in the file the image came from.
+        int getHDU() const;
+        int getPlane() const;
+        int getPlaneCount() const;
+        int getOriginX() const;
+        int getOriginY() const;
+
         BitDepth getBitDepth() const;
+        // Size in bytes of the raster returned by getPixels().
+        int64_t getPixelBytes() const;
         const void *getPixels() const;
+        void *getPixels();
 
     private:
+        static void openImage(const char *filename,
+                              int hdu,
+                              fitsfile **fits);
+        static void selectPlane(Info *info,
+                                int plane);
+
         FITSImage(BitDepth bitDepth,
                   FITSRaster *raster,
                   Info *info);
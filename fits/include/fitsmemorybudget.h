@@ -0,0 +1,110 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ELS
+{
+
+    // Process-wide accounting of the big memory users: rasters, renders,
+    // caches and the buffer pool's idle memory. Each user registers as a
+    // consumer and charges what it holds. When a charge takes the total
+    // over budget, consumers that can give memory back are asked to,
+    // lowest priority first and least recently used first within a
+    // priority, until the total fits again. Thread-safe.
+    class FITSMemoryBudget
+    {
+    public:
+        enum Category
+        {
+            MC_RASTER,
+            MC_RENDER,
+            MC_CACHE,
+            MC_TILES,
+            MC_PREFETCH,
+            MC_POOL,
+            MC_COUNT
+        };
+
+        // Asked to free at least the given number of bytes; returns how
+        // many it freed (uncharging them itself). Called without any
+        // budget lock held, from whichever thread went over budget.
+        typedef std::function<size_t(size_t)> Evictor;
+
+        struct ConsumerInfo
+        {
+            int id;
+            std::string name;
+            Category category;
+            int priority;
+            bool evictable;
+            size_t usage;
+            uint64_t lastUse;
+        };
+
+    public:
+        static FITSMemoryBudget *global();
+
+        FITSMemoryBudget();
+
+        static const char *getCategoryName(Category category);
+
+        // Defaults to a quarter of physical memory, so the viewer sits
+        // comfortably beside capture software on a small laptop.
+        void setBudget(size_t bytes);
+        size_t getBudget() const;
+
+        // Consumers without an evictor are only counted. removeConsumer
+        // waits for any eviction in progress, so an evictor is never
+        // called after its consumer is removed; don't hold a lock the
+        // evictor takes while removing.
+        int addConsumer(const char *name,
+                        Category category,
+                        int priority = 0,
+                        Evictor evictor = Evictor());
+        void removeConsumer(int id);
+
+        // Adjusts a consumer's usage and marks it used. Growing may
+        // trigger eviction from other consumers.
+        void charge(int id,
+                    int64_t bytes);
+        void touch(int id);
+
+        size_t getUsage(Category category) const;
+        size_t getTotalUsage() const;
+        uint64_t getEvictedBytes() const;
+        std::vector<ConsumerInfo> getConsumers() const;
+
+        // Evicts until the total is within budget, or nothing more can
+        // be evicted. Returns true if within budget.
+        bool enforce();
+
+    private:
+        FITSMemoryBudget(const FITSMemoryBudget &);
+        FITSMemoryBudget &operator=(const FITSMemoryBudget &);
+
+        static size_t defaultBudget();
+
+    private:
+        struct Consumer
+        {
+            ConsumerInfo info;
+            Evictor evictor;
+            bool active;
+        };
+
+        mutable std::mutex _mutex;
+        std::vector<Consumer> _consumers;
+        size_t _budget;
+        size_t _total;
+        uint64_t _clock;
+        uint64_t _evicted;
+        // Held for a whole round of eviction.
+        std::mutex _evictMutex;
+    };
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <inttypes.h>
+#include <memory>
 #include <fitsio.h>
 
 #include "fitsimage.h"
@@ -15,15 +16,30 @@ namespace ELS
                    int64_t pixelCount);
         ~FITSRaster();
 
+        void *allocate();
+        // Uses pixels held elsewhere instead of allocating; owner keeps
+        // them alive until the raster lets go.
+        void attach(const void *pixels,
+                    const std::shared_ptr<const void> &owner);
         void readPix(fitsfile *fits,
                      long *fpixel);
+        void readSubset(fitsfile *fits,
+                        long *fpixel,
+                        long *lpixel,
+                        long *inc);
 
         const void *getPixels() const;
+        void *getPixels();
+
+    private:
+        int getFITSIOType() const;
+        void release();
 
     private:
         FITSImage::BitDepth _bitDepth;
         int64_t _pixelCount;
         void *_pixels;
+        std::shared_ptr<const void> _owner;
     };
 
 }
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Decoded rasters and rendered images shared between viewer
+    // processes through POSIX shared memory. Each entry is its own
+    // segment, written once by the process that publishes it and then
+    // mapped read-only by everyone, so a second window on a file costs
+    // no extra memory. A small index segment of slots, updated only with
+    // atomic operations, maps keys to entries and records which of the
+    // attached processes hold each one; entries nobody holds are
+    // dropped, oldest first, to stay under capacity. Holds of a process
+    // that died are dropped when found, and the last process to detach
+    // removes every segment.
+    //
+    // What the cache holds is charged to the global memory budget,
+    // which can have entries nobody holds dropped early.
+    //
+    // Keys are any string identifying the content, e.g. path, size and
+    // modification time plus whatever processing was applied. Thread-
+    // safe. If shared memory isn't available every lookup misses.
+    class FITSSharedCache
+    {
+    public:
+        // A mapped entry. The data stays valid, and the entry in the
+        // cache, for as long as the block exists.
+        class Block
+        {
+        public:
+            ~Block();
+
+            const void *getMeta() const;
+            size_t getMetaSize() const;
+            const void *getData() const;
+            size_t getDataSize() const;
+
+        private:
+            friend class FITSSharedCache;
+            Block();
+
+            void *_mapping;
+            size_t _mappingSize;
+            const void *_meta;
+            size_t _metaSize;
+            const void *_data;
+            size_t _dataSize;
+            FITSSharedCache *_cache;
+            int _slot;
+        };
+
+    public:
+        // Per user, shared by every process of that user.
+        static FITSSharedCache *global();
+
+        explicit FITSSharedCache(const char *name);
+        ~FITSSharedCache();
+
+        bool isOpen() const;
+
+        // Defaults to an eighth of physical memory.
+        void setCapacity(size_t bytes);
+        size_t getCapacity() const;
+        size_t getUsage() const;
+
+        // Null if key isn't cached (or is still being written).
+        std::shared_ptr<const Block> attach(const std::string &key);
+
+        // Copies meta and data into a new entry and returns it mapped.
+        // Null if key is already cached or being written elsewhere, or
+        // there is no room.
+        std::shared_ptr<const Block> publish(const std::string &key,
+                                             const void *meta,
+                                             size_t metaSize,
+                                             const void *data,
+                                             size_t dataSize);
+
+        // The above for FITSImages. attachImage returns an image over
+        // the shared pixels, or null. publishImage returns image moved
+        // into shared memory (deleting the original), or image itself if
+        // it couldn't be published.
+        FITSImage *attachImage(const std::string &key);
+        FITSImage *publishImage(const std::string &key,
+                                FITSImage *image);
+
+    private:
+        struct Index;
+        struct Slot;
+
+        std::string segmentName(int slot,
+                                uint32_t generation) const;
+        Block *map(const std::string &key,
+                   int slot,
+                   bool writable,
+                   size_t size);
+        bool attachProcess();
+        void detachProcess();
+        bool isAlive(int process) const;
+        uint64_t getLiveHolders(int slot);
+        void hold(int slot);
+        void release(int slot);
+        size_t dropOldest();
+        bool makeRoom(size_t bytes);
+        size_t evict(size_t bytes);
+        void chargeBudget();
+        int claimSlot(uint64_t hash);
+
+    private:
+        std::string _name;
+        int _fd;
+        Index *_index;
+        size_t _indexSize;
+        size_t _capacity;
+        // Our entry in the index's process table.
+        int _process;
+        // How many blocks of each slot this process has mapped.
+        std::mutex _mutex;
+        std::vector<int> _holds;
+        int _budgetId;
+        std::atomic<int64_t> _charged;
+    };
+
+}
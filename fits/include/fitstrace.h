@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <inttypes.h>
+
+namespace ELS
+{
+
+    // Scoped timing spans for finding out where the time goes between
+    // opening a file and seeing it. Each thread records into its own
+    // fixed-size ring buffer without locking; when disabled a span costs
+    // one relaxed atomic load. Define ELS_NO_TRACE to compile the spans
+    // out altogether.
+    class FITSTrace
+    {
+    public:
+        static void setEnabled(bool enabled);
+        static inline bool isEnabled()
+        {
+            return g_enabled.load(std::memory_order_relaxed);
+        }
+
+        // Monotonic nanoseconds; only differences are meaningful.
+        static int64_t now();
+
+        // name must outlive the trace, so a string literal.
+        static void record(const char *name,
+                           int64_t start,
+                           int64_t end);
+
+        // Writes every thread's recorded spans as Chrome trace-event
+        // JSON (chrome://tracing, Perfetto). Spans recorded while this
+        // runs may be missed but are never torn.
+        static bool writeChromeTrace(const char *filename);
+
+        // Forgets all recorded spans.
+        static void clear();
+
+    private:
+        static std::atomic<bool> g_enabled;
+    };
+
+    class FITSTraceScope
+    {
+    public:
+        explicit FITSTraceScope(const char *name)
+            : _name(FITSTrace::isEnabled() ? name : 0),
+              _start(_name != 0 ? FITSTrace::now() : 0)
+        {
+        }
+
+        ~FITSTraceScope()
+        {
+            if (_name != 0)
+            {
+                FITSTrace::record(_name, _start, FITSTrace::now());
+            }
+        }
+
+    private:
+        FITSTraceScope(const FITSTraceScope &);
+        FITSTraceScope &operator=(const FITSTraceScope &);
+
+        const char *_name;
+        int64_t _start;
+    };
+
+}
+
+#define ELS_TRACE_CONCAT2(a, b) a##b
+#define ELS_TRACE_CONCAT(a, b) ELS_TRACE_CONCAT2(a, b)
+
+#ifdef ELS_NO_TRACE
+#define ELS_TRACE_SCOPE(name)
+#else
+#define ELS_TRACE_SCOPE(name) ELS::FITSTraceScope ELS_TRACE_CONCAT(_elsTraceScope, __LINE__)(name)
+#endif
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "fitstantrum.h"
+#include "fitsbandreader.h"
+
+namespace ELS
+{
+
+    FITSBandReader::FITSBandReader(const char *filename)
+        : _fits(0),
+          _info()
+    {
+        strncpy(_filename, filename, sizeof(_filename) - 1);
+        _filename[sizeof(_filename) - 1] = 0;
+
+        int status = 0;
+        fits_open_file(&_fits, filename, READONLY, &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+
+        try
+        {
+            FITSImage::probe(_fits, &_info);
+        }
+        catch (FITSException *e)
+        {
+            fits_close_file(_fits, &status);
+            _fits = 0;
+            throw e;
+        }
+    }
+
+    FITSBandReader::~FITSBandReader()
+    {
+        if (_fits != 0)
+        {
+            int status = 0;
+            fits_close_file(_fits, &status);
+        }
+    }
+
+    const char *FITSBandReader::getFilename() const
+    {
+        return _filename;
+    }
+
+    int FITSBandReader::getWidth() const
+    {
+        return _info.width;
+    }
+
+    int FITSBandReader::getHeight() const
+    {
+        return _info.height;
+    }
+
+    int FITSBandReader::getChannels() const
+    {
+        return _info.chanAx == 0 ? 1 : 3;
+    }
+
+    void FITSBandReader::readBand(int channel,
+                                  int firstRow,
+                                  int numRows,
+                                  float *pixels)
+    {
+        long fpixel[FITSImage::g_maxAxes];
+        long lpixel[FITSImage::g_maxAxes];
+        long inc[FITSImage::g_maxAxes];
+        for (int i = 0; i < FITSImage::g_maxAxes; i++)
+        {
+            fpixel[i] = lpixel[i] = _info.fpixel[i];
+            inc[i] = 1;
+        }
+
+        // Pick the row band out of the requested channel plane. For
+        // RGB-on-axis-1 files this also de-interleaves the channel.
+        switch (_info.chanAx)
+        {
+        case 0:
+            // First plane of a cube
+            fpixel[0] = 1;
+            fpixel[1] = firstRow + 1;
+            lpixel[0] = _info.width;
+            lpixel[1] = firstRow + numRows;
+            break;
+        case 1:
+            fpixel[0] = channel + 1;
+            fpixel[1] = 1;
+            fpixel[2] = firstRow + 1;
+            lpixel[0] = channel + 1;
+            lpixel[1] = _info.width;
+            lpixel[2] = firstRow + numRows;
+            break;
+        default:
+            fpixel[0] = 1;
+            fpixel[1] = firstRow + 1;
+            fpixel[2] = channel + 1;
+            lpixel[0] = _info.width;
+            lpixel[1] = firstRow + numRows;
+            lpixel[2] = channel + 1;
+            break;
+        }
+
+        int status = 0;
+        fits_read_subset(_fits,
+                         TFLOAT,
+                         fpixel,
+                         lpixel,
+                         inc,
+                         NULL,
+                         pixels,
+                         NULL,
+                         &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+    }
+
+}
@@ -0,0 +1,129 @@
+#include "fitstantrum.h"
+#include "fitsbandwriter.h"
+
+namespace ELS
+{
+
+    FITSBandWriter::FITSBandWriter(const char *filename,
+                                   int width,
+                                   int height,
+                                   int channels,
+                                   FITSImage::BitDepth bitDepth /* = FITSImage::BD_FLOAT */)
+        : _fits(0),
+          _width(width),
+          _height(height),
+          _channels(channels)
+    {
+        int status = 0;
+        fits_create_file(&_fits, filename, &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+
+        // Integer images are written unsigned (BZERO offset), the way
+        // camera drivers store them.
+        int imgType = FLOAT_IMG;
+        switch (bitDepth)
+        {
+        case FITSImage::BD_INT_8:
+            imgType = BYTE_IMG;
+            break;
+        case FITSImage::BD_INT_16:
+            imgType = USHORT_IMG;
+            break;
+        case FITSImage::BD_INT_32:
+            imgType = ULONG_IMG;
+            break;
+        case FITSImage::BD_FLOAT:
+            imgType = FLOAT_IMG;
+            break;
+        case FITSImage::BD_DOUBLE:
+            imgType = DOUBLE_IMG;
+            break;
+        }
+
+        long naxes[3] = {width, height, channels};
+        fits_create_img(_fits, imgType, channels == 1 ? 2 : 3, naxes, &status);
+        if (status)
+        {
+            fits_close_file(_fits, &status);
+            _fits = 0;
+            throw new FITSTantrum(status);
+        }
+    }
+
+    FITSBandWriter::~FITSBandWriter()
+    {
+        if (_fits != 0)
+        {
+            int status = 0;
+            fits_close_file(_fits, &status);
+        }
+    }
+
+    void FITSBandWriter::writeKey(const char *keyword,
+                                  long value,
+                                  const char *comment)
+    {
+        int status = 0;
+        fits_update_key(_fits, TLONG, keyword, &value, comment, &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+    }
+
+    void FITSBandWriter::writeHistory(const char *history)
+    {
+        int status = 0;
+        fits_write_history(_fits, history, &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+    }
+
+    void FITSBandWriter::writeBand(int channel,
+                                   int firstRow,
+                                   int numRows,
+                                   const float *pixels)
+    {
+        if ((firstRow < 0) || (firstRow + numRows > _height) ||
+            (channel < 0) || (channel >= _channels))
+        {
+            throw new FITSException("Band is outside the image");
+        }
+
+        // Planes are written whole rows at a time, so a band is one
+        // contiguous run of pixels in the output.
+        long fpixel[3] = {1, firstRow + 1, channel + 1};
+
+        int status = 0;
+        fits_write_pix(_fits,
+                       TFLOAT,
+                       fpixel,
+                       (LONGLONG)_width * numRows,
+                       (void *)pixels,
+                       &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+    }
+
+    void FITSBandWriter::close()
+    {
+        if (_fits != 0)
+        {
+            int status = 0;
+            fits_close_file(_fits, &status);
+            _fits = 0;
+            if (status)
+            {
+                throw new FITSTantrum(status);
+            }
+        }
+    }
+
+}
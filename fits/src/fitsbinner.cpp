@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fitsbinner.h"
+#include "fitsexception.h"
+#include "fitstantrum.h"
+#include "fitstrace.h"
+
+namespace
+{
+
+    // Binned rows produced per read.
+    constexpr int g_bandRows = 16;
+
+    // Types sums are kept and returned in, by pixel type.
+    template <typename T>
+    struct Binned;
+
+    template <>
+    struct Binned<uint8_t>
+    {
+        typedef uint32_t Sum;
+        typedef uint16_t SumOut;
+    };
+
+    template <>
+    struct Binned<uint16_t>
+    {
+        typedef uint32_t Sum;
+        typedef uint32_t SumOut;
+    };
+
+    template <>
+    struct Binned<uint32_t>
+    {
+        typedef uint64_t Sum;
+        typedef double SumOut;
+    };
+
+    template <>
+    struct Binned<float>
+    {
+        typedef float Sum;
+        typedef float SumOut;
+    };
+
+    template <>
+    struct Binned<double>
+    {
+        typedef double Sum;
+        typedef double SumOut;
+    };
+
+    // Adds a row of samples into sums, column by column.
+    template <typename T, typename S>
+    void addRow(const T *row, S *sums, int64_t count)
+    {
+        for (int64_t i = 0; i < count; i++)
+        {
+            sums[i] += row[i];
+        }
+    }
+
+#if defined(__SSE2__)
+    void addRow(const uint8_t *row, uint32_t *sums, int64_t count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int64_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            const __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+            const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            __m128i *out = (__m128i *)(sums + i);
+            _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(low, zero)));
+            _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(low, zero)));
+            _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2), _mm_unpacklo_epi16(high, zero)));
+            _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3), _mm_unpackhi_epi16(high, zero)));
+        }
+        for (; i < count; i++)
+        {
+            sums[i] += row[i];
+        }
+    }
+
+    void addRow(const uint16_t *row, uint32_t *sums, int64_t count)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int64_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i words = _mm_loadu_si128((const __m128i *)(row + i));
+            __m128i *out = (__m128i *)(sums + i);
+            _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_unpacklo_epi16(words, zero)));
+            _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_unpackhi_epi16(words, zero)));
+        }
+        for (; i < count; i++)
+        {
+            sums[i] += row[i];
+        }
+    }
+
+    void addRow(const float *row, float *sums, int64_t count)
+    {
+        int64_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm_storeu_ps(sums + i, _mm_add_ps(_mm_loadu_ps(sums + i), _mm_loadu_ps(row + i)));
+        }
+        for (; i < count; i++)
+        {
+            sums[i] += row[i];
+        }
+    }
+#endif
+
+    // Sums factor adjacent pixels of the column sums, for each sample,
+    // into a binned row, averaged if asked to (rounding integers).
+    template <typename S, typename O>
+    void emitRow(const S *sums, O *output, int outWidth, int samplesPerPixel,
+                 int factor, bool average)
+    {
+        const S count = factor * factor;
+        for (int x = 0; x < outWidth; x++)
+        {
+            const S *block = sums + (int64_t)x * factor * samplesPerPixel;
+            for (int sample = 0; sample < samplesPerPixel; sample++)
+            {
+                S total = 0;
+                for (int i = 0; i < factor; i++)
+                {
+                    total += block[i * samplesPerPixel + sample];
+                }
+                if (average)
+                {
+                    total = std::is_floating_point<S>::value ? total / count : (total + count / 2) / count;
+                }
+                output[x * samplesPerPixel + sample] = total;
+            }
+        }
+    }
+
+    template <typename T, typename O>
+    void binPlanes(fitsfile *fits, int fitsIOType, const ELS::FITSImage::Info &info,
+                   int factor, bool average, O *output)
+    {
+        typedef typename Binned<T>::Sum S;
+
+        // Colour is planes one after the other (axis 3), or samples of
+        // each pixel (axis 1).
+        const int planes = info.chanAx == 3 ? 3 : 1;
+        const int samplesPerPixel = info.chanAx == 1 ? 3 : 1;
+        const int yAx = info.chanAx == 1 ? 2 : 1;
+        const int outWidth = info.width / factor;
+        const int outHeight = info.height / factor;
+        const int64_t rowSamples = (int64_t)info.width * samplesPerPixel;
+        const int64_t outRowSamples = (int64_t)outWidth * samplesPerPixel;
+
+        std::vector<T> band(rowSamples * factor * g_bandRows);
+        std::vector<S> sums(rowSamples);
+        for (int plane = 0; plane < planes; plane++)
+        {
+            for (int first = 0; first < outHeight; first += g_bandRows)
+            {
+                const int rows = std::min(g_bandRows, outHeight - first);
+
+                // Whole rows of a plane are contiguous in the file.
+                long fpixel[ELS::FITSImage::g_maxAxes];
+                memcpy(fpixel, info.fpixel, sizeof(fpixel));
+                fpixel[yAx] = (long)first * factor + 1;
+                if (info.chanAx == 3)
+                {
+                    fpixel[2] = plane + 1;
+                }
+
+                int status = 0;
+                fits_read_pix(fits,
+                              fitsIOType,
+                              fpixel,
+                              rowSamples * factor * rows,
+                              NULL,
+                              band.data(),
+                              NULL,
+                              &status);
+                if (status)
+                {
+                    throw new ELS::FITSTantrum(status);
+                }
+
+                for (int row = 0; row < rows; row++)
+                {
+                    std::fill(sums.begin(), sums.end(), 0);
+                    for (int i = 0; i < factor; i++)
+                    {
+                        addRow(band.data() + (row * factor + i) * rowSamples, sums.data(), rowSamples);
+                    }
+
+                    O *out = output + ((int64_t)plane * outHeight + first + row) * outRowSamples;
+                    emitRow(sums.data(), out, outWidth, samplesPerPixel, factor, average);
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    void binImage(fitsfile *fits, int fitsIOType, const ELS::FITSImage::Info &info,
+                  int factor, ELS::FITSImage::BinMode mode, void *pixels)
+    {
+        if (mode == ELS::FITSImage::BM_AVERAGE)
+        {
+            binPlanes<T, T>(fits, fitsIOType, info, factor, true, (T *)pixels);
+        }
+        else
+        {
+            typedef typename Binned<T>::SumOut O;
+            binPlanes<T, O>(fits, fitsIOType, info, factor, false, (O *)pixels);
+        }
+    }
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    FITSImage::BitDepth FITSBinner::getBinnedDepth(FITSImage::BitDepth bitDepth,
+                                                   FITSImage::BinMode mode)
+    {
+        if (mode == FITSImage::BM_AVERAGE)
+        {
+            return bitDepth;
+        }
+
+        switch (bitDepth)
+        {
+        case FITSImage::BD_INT_8:
+            return FITSImage::BD_INT_16;
+        case FITSImage::BD_INT_16:
+            return FITSImage::BD_INT_32;
+        case FITSImage::BD_INT_32:
+            return FITSImage::BD_DOUBLE;
+        default:
+            return bitDepth;
+        }
+    }
+
+    /* static */
+    void FITSBinner::read(fitsfile *fits,
+                          const FITSImage::Info &info,
+                          FITSImage::BitDepth bitDepth,
+                          int factor,
+                          FITSImage::BinMode mode,
+                          void *pixels)
+    {
+        ELS_TRACE_SCOPE("FITSBinner::read");
+
+        switch (bitDepth)
+        {
+        case FITSImage::BD_INT_8:
+            binImage<uint8_t>(fits, TBYTE, info, factor, mode, pixels);
+            break;
+        case FITSImage::BD_INT_16:
+            binImage<uint16_t>(fits, TUSHORT, info, factor, mode, pixels);
+            break;
+        case FITSImage::BD_INT_32:
+            binImage<uint32_t>(fits, TUINT, info, factor, mode, pixels);
+            break;
+        case FITSImage::BD_FLOAT:
+            binImage<float>(fits, TFLOAT, info, factor, mode, pixels);
+            break;
+        case FITSImage::BD_DOUBLE:
+            binImage<double>(fits, TDOUBLE, info, factor, mode, pixels);
+            break;
+        default:
+            throw new FITSException("Unknown bit depth");
+        }
+    }
+
+}
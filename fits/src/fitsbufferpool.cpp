@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <iterator>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "fitsexception.h"
+#include "fitsmemorybudget.h"
+#include "fitsbufferpool.h"
+
+namespace
+{
+
+    const size_t g_hugePage = 2 * 1024 * 1024;
+    const size_t g_cacheLine = 64;
+
+    // Buffers below this are cheap to malloc and not worth pooling
+    // separately; they still go through the pool so release() can't
+    // tell the difference.
+    const size_t g_minClass = 4096;
+
+    // Scratch below this bypasses the pool altogether (see
+    // acquireScratch()).
+    const size_t g_minPooledScratch = 256 * 1024;
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    FITSBufferPool *FITSBufferPool::global()
+    {
+        // The budget must be constructed first so it outlives the pool.
+        static FITSMemoryBudget *budget = FITSMemoryBudget::global();
+        static FITSBufferPool pool(budget);
+        return &pool;
+    }
+
+    FITSBufferPool::FITSBufferPool(FITSMemoryBudget *budget /* = 0 */)
+        : _retainLimit((size_t)2 * 1024 * 1024 * 1024),
+          _useHugePages(true),
+          _budget(budget),
+          _budgetId(-1)
+    {
+        _stats.hits = 0;
+        _stats.misses = 0;
+        _stats.outstandingBytes = 0;
+        _stats.retainedBytes = 0;
+
+        if (_budget != 0)
+        {
+            // Idle buffers are the cheapest memory to give back.
+            _budgetId = _budget->addConsumer("Buffer pool (idle)",
+                                             FITSMemoryBudget::MC_POOL,
+                                             0,
+                                             [this](size_t bytes)
+                                             { return trimBy(bytes); });
+        }
+    }
+
+    FITSBufferPool::~FITSBufferPool()
+    {
+        if (_budget != 0)
+        {
+            _budget->removeConsumer(_budgetId);
+            _budget = 0;
+        }
+
+        trim();
+    }
+
+    /* static */
+    size_t FITSBufferPool::sizeClass(size_t bytes)
+    {
+        if (bytes <= g_minClass)
+        {
+            return g_minClass;
+        }
+
+        // Keep the top four significant bits and round the rest up.
+        size_t top = bytes;
+        int shift = 0;
+        while (top >= 16)
+        {
+            top >>= 1;
+            shift++;
+        }
+        size_t rounded = top << shift;
+        if (rounded < bytes)
+        {
+            rounded = (top + 1) << shift;
+        }
+
+        return (rounded + g_cacheLine - 1) & ~(g_cacheLine - 1);
+    }
+
+    /* static */
+    void *FITSBufferPool::acquireScratch(size_t bytes)
+    {
+        if (bytes >= g_minPooledScratch)
+        {
+            return global()->acquire(bytes);
+        }
+
+        void *ptr = malloc(std::max(bytes, (size_t)1));
+        if (ptr == 0)
+        {
+            throw new FITSException("Out of memory for scratch buffer");
+        }
+        return ptr;
+    }
+
+    /* static */
+    void FITSBufferPool::releaseScratch(void *ptr,
+                                        size_t bytes)
+    {
+        if (bytes >= g_minPooledScratch)
+        {
+            global()->release(ptr);
+        }
+        else
+        {
+            free(ptr);
+        }
+    }
+
+    void *FITSBufferPool::acquire(size_t bytes)
+    {
+        const size_t size = sizeClass(bytes);
+
+        void *ptr;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::map<size_t, std::deque<IdleList::iterator>>::iterator it = _idle.find(size);
+            if ((it != _idle.end()) && !it->second.empty())
+            {
+                // The most recently released, still warm in cache.
+                ptr = it->second.back()->first;
+                _idleOrder.erase(it->second.back());
+                it->second.pop_back();
+
+                _outstanding[ptr] = size;
+                _stats.hits++;
+                _stats.outstandingBytes += size;
+                _stats.retainedBytes -= size;
+            }
+            else
+            {
+                ptr = 0;
+            }
+        }
+
+        if (ptr != 0)
+        {
+            chargeBudget(-(int64_t)size);
+            return ptr;
+        }
+
+        // Allocate outside the lock; large allocations can take a while
+        // to be handed out.
+        ptr = allocate(size);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _outstanding[ptr] = size;
+        _stats.misses++;
+        _stats.outstandingBytes += size;
+        return ptr;
+    }
+
+    void FITSBufferPool::release(void *ptr)
+    {
+        if (ptr == 0)
+        {
+            return;
+        }
+
+        int64_t retained = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::unordered_map<void *, size_t>::iterator it = _outstanding.find(ptr);
+            if (it == _outstanding.end())
+            {
+                return;
+            }
+
+            const size_t size = it->second;
+            _outstanding.erase(it);
+            _stats.outstandingBytes -= size;
+
+            if (size > _retainLimit)
+            {
+                free(ptr);
+                return;
+            }
+
+            _idleOrder.push_back(std::make_pair(ptr, size));
+            _idle[size].push_back(std::prev(_idleOrder.end()));
+            _stats.retainedBytes += size;
+
+            retained = (int64_t)size - (int64_t)trimTo(_retainLimit);
+        }
+
+        chargeBudget(retained);
+    }
+
+    size_t FITSBufferPool::sizeOf(void *ptr) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        std::unordered_map<void *, size_t>::const_iterator it = _outstanding.find(ptr);
+        return it == _outstanding.end() ? 0 : it->second;
+    }
+
+    void FITSBufferPool::setRetainLimit(size_t bytes)
+    {
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _retainLimit = bytes;
+            freed = trimTo(_retainLimit);
+        }
+
+        chargeBudget(-(int64_t)freed);
+    }
+
+    size_t FITSBufferPool::getRetainLimit() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _retainLimit;
+    }
+
+    void FITSBufferPool::setUseHugePages(bool useHugePages)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _useHugePages = useHugePages;
+    }
+
+    bool FITSBufferPool::getUseHugePages() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _useHugePages;
+    }
+
+    void FITSBufferPool::trim()
+    {
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            freed = trimTo(0);
+        }
+
+        chargeBudget(-(int64_t)freed);
+    }
+
+    size_t FITSBufferPool::trimBy(size_t bytes)
+    {
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            freed = trimTo(_stats.retainedBytes > bytes ? _stats.retainedBytes - bytes : 0);
+        }
+
+        chargeBudget(-(int64_t)freed);
+        return freed;
+    }
+
+    FITSBufferPool::Stats FITSBufferPool::getStats() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _stats;
+    }
+
+    void *FITSBufferPool::allocate(size_t bytes)
+    {
+        bool useHugePages;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            useHugePages = _useHugePages;
+        }
+
+        const size_t alignment = bytes >= g_hugePage ? g_hugePage : g_cacheLine;
+
+        void *ptr = 0;
+        if (posix_memalign(&ptr, alignment, bytes) != 0)
+        {
+            throw new FITSException("Out of memory for pixel buffer");
+        }
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        // Must happen before the pages are first touched. Only a hint:
+        // it fails quietly when transparent huge pages are off.
+        if (useHugePages && (bytes >= g_hugePage))
+        {
+            madvise(ptr, bytes, MADV_HUGEPAGE);
+        }
+#else
+        (void)useHugePages;
+#endif
+
+        return ptr;
+    }
+
+    // Caller holds the lock. Returns the bytes freed.
+    size_t FITSBufferPool::trimTo(size_t bytes)
+    {
+        size_t freed = 0;
+        while ((_stats.retainedBytes > bytes) && !_idleOrder.empty())
+        {
+            void *ptr = _idleOrder.front().first;
+            const size_t size = _idleOrder.front().second;
+
+            // The oldest idle buffer overall is the oldest of its class.
+            _idle[size].pop_front();
+            _idleOrder.pop_front();
+            _stats.retainedBytes -= size;
+            freed += size;
+            free(ptr);
+        }
+
+        return freed;
+    }
+
+    // Must be called without the lock: charging can trigger eviction,
+    // which may come back here through trimBy().
+    void FITSBufferPool::chargeBudget(int64_t bytes)
+    {
+        if ((_budget != 0) && (bytes != 0))
+        {
+            _budget->charge(_budgetId, bytes);
+        }
+    }
+
+}
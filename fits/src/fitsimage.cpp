@@ -1,101 +1,610 @@
+#include <algorithm>
+#include <string.h>
 #include <fitsio.h>
 
+#include "fitsbinner.h"
 #include "fitstantrum.h"
+#include "fitstrace.h"
 #include "fitsraster.h"
 #include "fitsimage.h"
 
+namespace
+{
+
+    // What sums of factor x factor pixels of fullDepth can reach, on the
+    // terms the stretch judges unbinned pixels by: the type's range for
+    // integers; for floating point, 1 if the data look normalized, else
+    // 64K.
+    int64_t sumRange(ELS::FITSImage::BitDepth fullDepth,
+                     ELS::FITSImage::BitDepth bitDepth,
+                     const void *pixels,
+                     int64_t count,
+                     int factor)
+    {
+        const int64_t bin = (int64_t)factor * factor;
+        switch (fullDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            return bin * 256;
+        case ELS::FITSImage::BD_INT_16:
+            return bin * 65536;
+        case ELS::FITSImage::BD_INT_32:
+            return bin * 4294967296LL;
+        default:
+            break;
+        }
+
+        double largest = 0.0;
+        const int64_t step = std::max(count / 1000, (int64_t)1);
+        for (int64_t i = 0; i < count; i += step)
+        {
+            largest = std::max(largest, bitDepth == ELS::FITSImage::BD_FLOAT ? (double)((const float *)pixels)[i]
+                                                                             : ((const double *)pixels)[i]);
+        }
+
+        return largest <= 1.01 * bin ? bin : bin * 65536;
+    }
+
+    const char *describeBitDepth(ELS::FITSImage::BitDepth bitDepth)
+    {
+        switch (bitDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            return "8-bit byte pixels";
+        case ELS::FITSImage::BD_INT_16:
+            return "16 bit integer pixels";
+        case ELS::FITSImage::BD_INT_32:
+            return "32-bit integer pixels";
+        case ELS::FITSImage::BD_FLOAT:
+            return "32-bit floating point pixels";
+        case ELS::FITSImage::BD_DOUBLE:
+            return "64-bit floating point pixels";
+        }
+
+        return "unknown pixels";
+    }
+
+    // Reads an optional string keyword; leaves value untouched if the
+    // header doesn't have it.
+    void readOptionalKey(fitsfile *fits,
+                         const char *keyword,
+                         char *value)
+    {
+        int status = 0;
+        char tmp[FLEN_VALUE];
+        fits_read_key(fits, TSTRING, keyword, tmp, NULL, &status);
+        if (status == 0)
+        {
+            strcpy(value, tmp);
+        }
+    }
+
+    void readOptionalKey(fitsfile *fits,
+                         const char *keyword,
+                         int *value)
+    {
+        int status = 0;
+        int tmp;
+        fits_read_key(fits, TINT, keyword, &tmp, NULL, &status);
+        if (status == 0)
+        {
+            *value = tmp;
+        }
+    }
+
+}
+
 namespace ELS
 {
 
     /* static */
     FITSImage *FITSImage::load(const char *filename)
     {
+        return load(filename, 0, 0);
+    }
+
+    /* static */
+    FITSImage *FITSImage::load(const char *filename,
+                               int hdu,
+                               int plane,
+                               int binning,
+                               BinMode binMode)
+    {
+        ELS_TRACE_SCOPE("FITSImage::load");
+
         int status = 0;
         fitsfile *tmpFits;
         Info *tmpInfo = new Info();
 
+        try
+        {
+            openImage(filename, hdu, &tmpFits);
+        }
+        catch (FITSException *e)
+        {
+            delete tmpInfo;
+            throw e;
+        }
+
+        FITSRaster *raster = 0;
+        FITSImage::BitDepth bitDepth;
+        try
+        {
+            bitDepth = probe(tmpFits, tmpInfo);
+            selectPlane(tmpInfo, plane);
+
+            if (binning > 1)
+            {
+                const Info full = *tmpInfo;
+                const FITSImage::BitDepth fullDepth = bitDepth;
+
+                tmpInfo->width = full.width / binning;
+                tmpInfo->height = full.height / binning;
+                if ((tmpInfo->width == 0) || (tmpInfo->height == 0))
+                {
+                    throw new FITSException("Image is smaller than one bin");
+                }
+                const int xAx = tmpInfo->chanAx == 1 ? 1 : 0;
+                tmpInfo->axLengths[xAx] = tmpInfo->width;
+                tmpInfo->axLengths[xAx + 1] = tmpInfo->height;
+                tmpInfo->numPixels = (int64_t)tmpInfo->width * tmpInfo->height * (tmpInfo->chanAx != 0 ? 3 : 1);
+                tmpInfo->binning = binning;
+
+                // A bin mixes the colours of the filter array
+                tmpInfo->bayerPattern[0] = 0;
+                tmpInfo->bayerOffsetX = 0;
+                tmpInfo->bayerOffsetY = 0;
+
+                bitDepth = FITSBinner::getBinnedDepth(bitDepth, binMode);
+                strcpy(tmpInfo->imageType, describeBitDepth(bitDepth));
+                sprintf(tmpInfo->sizeAndColor + strlen(tmpInfo->sizeAndColor),
+                        "; binned %dx%d (%s) to %dx%d", binning, binning,
+                        binMode == BM_SUM ? "sum" : "average", tmpInfo->width, tmpInfo->height);
+
+                raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+                void *pixels = raster->allocate();
+                FITSBinner::read(tmpFits, full, fullDepth, binning, binMode, pixels);
+                if (binMode == BM_SUM)
+                {
+                    tmpInfo->range = sumRange(fullDepth, bitDepth, pixels, tmpInfo->numPixels, binning);
+                }
+            }
+            else
+            {
+                // Create a raster for the data and read it. A plane of a
+                // cube is contiguous in the file, so this reads only it.
+                raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+                raster->readPix(tmpFits, tmpInfo->fpixel);
+            }
+        }
+        catch (FITSException *e)
+        {
+            delete raster;
+            delete tmpInfo;
+            fits_close_file(tmpFits, &status);
+            throw e;
+        }
+
+        fits_close_file(tmpFits, &status);
+
+        return new FITSImage(bitDepth, raster, tmpInfo);
+    }
+
+    /* static */
+    FITSImage *FITSImage::loadRegion(const char *filename,
+                                     const Region &region,
+                                     int channel,
+                                     int hdu,
+                                     int plane)
+    {
+        ELS_TRACE_SCOPE("FITSImage::loadRegion");
+
+        int status = 0;
+        fitsfile *tmpFits;
+        Info *tmpInfo = new Info();
+
+        try
+        {
+            openImage(filename, hdu, &tmpFits);
+        }
+        catch (FITSException *e)
+        {
+            delete tmpInfo;
+            throw e;
+        }
+
+        FITSRaster *raster = 0;
+        FITSImage::BitDepth bitDepth;
+        try
+        {
+            bitDepth = probe(tmpFits, tmpInfo);
+            selectPlane(tmpInfo, plane);
+
+            const int x0 = std::max(region.x, 0);
+            const int y0 = std::max(region.y, 0);
+            const int x1 = std::min(region.x + region.width, tmpInfo->width);
+            const int y1 = std::min(region.y + region.height, tmpInfo->height);
+            if ((x1 <= x0) || (y1 <= y0))
+            {
+                throw new FITSException("Region is outside the image");
+            }
+            if ((channel < -1) || (channel >= (tmpInfo->chanAx != 0 ? 3 : 1)))
+            {
+                throw new FITSException("No such channel");
+            }
+
+            long fpixel[g_maxAxes];
+            long lpixel[g_maxAxes];
+            long inc[g_maxAxes];
+            for (int i = 0; i < g_maxAxes; i++)
+            {
+                fpixel[i] = lpixel[i] = tmpInfo->fpixel[i];
+                inc[i] = 1;
+            }
+
+            // Axes of x, y and colour
+            int xAx = 0;
+            int yAx = 1;
+            int cAx = -1;
+            if (tmpInfo->chanAx == 1)
+            {
+                xAx = 1;
+                yAx = 2;
+                cAx = 0;
+            }
+            else if (tmpInfo->chanAx == 3)
+            {
+                cAx = 2;
+            }
+
+            fpixel[xAx] = x0 + 1;
+            lpixel[xAx] = x1;
+            fpixel[yAx] = y0 + 1;
+            lpixel[yAx] = y1;
+            if (cAx != -1)
+            {
+                fpixel[cAx] = channel == -1 ? 1 : channel + 1;
+                lpixel[cAx] = channel == -1 ? 3 : channel + 1;
+            }
+
+            tmpInfo->width = x1 - x0;
+            tmpInfo->height = y1 - y0;
+            tmpInfo->originX = x0;
+            tmpInfo->originY = y0;
+            tmpInfo->numPixels = (int64_t)tmpInfo->width * tmpInfo->height;
+            if ((tmpInfo->chanAx != 0) && (channel == -1))
+            {
+                tmpInfo->numPixels *= 3;
+                tmpInfo->axLengths[xAx] = tmpInfo->width;
+                tmpInfo->axLengths[yAx] = tmpInfo->height;
+            }
+            else
+            {
+                // One channel, or one plane of a cube, is a mono image
+                tmpInfo->chanAx = 0;
+                tmpInfo->numAxis = 2;
+                tmpInfo->axLengths[0] = tmpInfo->width;
+                tmpInfo->axLengths[1] = tmpInfo->height;
+            }
+
+            // Keep the colour filter array in step with the crop
+            tmpInfo->bayerOffsetX = (tmpInfo->bayerOffsetX + x0) & 1;
+            tmpInfo->bayerOffsetY = (tmpInfo->bayerOffsetY + y0) & 1;
+
+            sprintf(tmpInfo->sizeAndColor + strlen(tmpInfo->sizeAndColor),
+                    "; region %dx%d at %d,%d", tmpInfo->width, tmpInfo->height, x0, y0);
+            if ((channel != -1) && (cAx != -1))
+            {
+                sprintf(tmpInfo->sizeAndColor + strlen(tmpInfo->sizeAndColor),
+                        ", channel %d", channel + 1);
+            }
+
+            raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+            raster->readSubset(tmpFits, fpixel, lpixel, inc);
+
+            memcpy(tmpInfo->fpixel, fpixel, sizeof(fpixel));
+        }
+        catch (FITSException *e)
+        {
+            delete raster;
+            delete tmpInfo;
+            fits_close_file(tmpFits, &status);
+            throw e;
+        }
+
+        fits_close_file(tmpFits, &status);
+
+        return new FITSImage(bitDepth, raster, tmpInfo);
+    }
+
+    /* static */
+    std::vector<FITSImage::ImageHDU> FITSImage::listImages(const char *filename)
+    {
+        ELS_TRACE_SCOPE("FITSImage::listImages");
+
+        int status = 0;
+        fitsfile *tmpFits;
+
         fits_open_file(&tmpFits, filename, READONLY, &status);
         if (status)
         {
             throw new FITSTantrum(status);
         }
 
+        int hduCount = 0;
+        fits_get_num_hdus(tmpFits, &hduCount, &status);
+        if (status)
+        {
+            fits_close_file(tmpFits, &status);
+            throw new FITSTantrum(status);
+        }
+
+        std::vector<ImageHDU> images;
+        for (int hdu = 1; hdu <= hduCount; hdu++)
+        {
+            int hduType = 0;
+            int numAxis = 0;
+            fits_movabs_hdu(tmpFits, hdu, &hduType, &status);
+            if (status == 0)
+            {
+                fits_get_img_dim(tmpFits, &numAxis, &status);
+            }
+            if (status)
+            {
+                status = 0;
+                continue;
+            }
+
+            // Tile-compressed images report themselves as images.
+            if ((hduType != IMAGE_HDU) || (numAxis < 2))
+            {
+                continue;
+            }
+
+            // Skip anything load() would refuse
+            Info tmpInfo;
+            try
+            {
+                probe(tmpFits, &tmpInfo);
+            }
+            catch (FITSException *e)
+            {
+                delete e;
+                continue;
+            }
+
+            ImageHDU image;
+            image.hdu = hdu;
+            strcpy(image.extName, tmpInfo.extName);
+            image.width = tmpInfo.width;
+            image.height = tmpInfo.height;
+            image.isColor = tmpInfo.chanAx != 0;
+            image.planeCount = tmpInfo.planeCount;
+            images.push_back(image);
+        }
+
+        fits_close_file(tmpFits, &status);
+
+        return images;
+    }
+
+    /* static */
+    FITSImage *FITSImage::loadDecimated(const char *filename,
+                                        int factor)
+    {
+        ELS_TRACE_SCOPE("FITSImage::loadDecimated");
+
+        int status = 0;
+        fitsfile *tmpFits;
+        Info *tmpInfo = new Info();
+
+        try
+        {
+            openImage(filename, 0, &tmpFits);
+        }
+        catch (FITSException *e)
+        {
+            delete tmpInfo;
+            throw e;
+        }
+
+        FITSRaster *raster = 0;
+        FITSImage::BitDepth bitDepth;
+        try
+        {
+            bitDepth = probe(tmpFits, tmpInfo);
+
+            if (factor < 1)
+            {
+                factor = 1;
+            }
+            if ((tmpInfo->bayerPattern[0] != 0) && ((factor & 1) == 0))
+            {
+                factor--;
+            }
+
+            long lpixel[g_maxAxes];
+            long inc[g_maxAxes];
+            for (int i = 0; i < tmpInfo->numAxis; i++)
+            {
+                lpixel[i] = tmpInfo->axLengths[i];
+                inc[i] = factor;
+            }
+            if (tmpInfo->chanAx == 1)
+            {
+                inc[0] = 1;
+            }
+            else if (tmpInfo->chanAx == 3)
+            {
+                inc[2] = 1;
+            }
+            else
+            {
+                // Just the first plane of a cube
+                for (int i = 2; i < tmpInfo->numAxis; i++)
+                {
+                    lpixel[i] = tmpInfo->fpixel[i];
+                    inc[i] = 1;
+                }
+            }
+
+            tmpInfo->decimation = factor;
+            tmpInfo->width = (tmpInfo->width + factor - 1) / factor;
+            tmpInfo->height = (tmpInfo->height + factor - 1) / factor;
+            tmpInfo->numPixels = (int64_t)tmpInfo->width * tmpInfo->height;
+            if (tmpInfo->chanAx != 0)
+            {
+                tmpInfo->numPixels *= 3;
+            }
+            if (factor > 1)
+            {
+                sprintf(tmpInfo->sizeAndColor + strlen(tmpInfo->sizeAndColor),
+                        "; decimated 1:%d to %dx%d", factor, tmpInfo->width, tmpInfo->height);
+            }
+
+            raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+            raster->readSubset(tmpFits, tmpInfo->fpixel, lpixel, inc);
+        }
+        catch (FITSException *e)
+        {
+            delete raster;
+            delete tmpInfo;
+            fits_close_file(tmpFits, &status);
+            throw e;
+        }
+
+        fits_close_file(tmpFits, &status);
+
+        return new FITSImage(bitDepth, raster, tmpInfo);
+    }
+
+    /* static */
+    FITSImage::BitDepth FITSImage::probe(const char *filename,
+                                         Info *info)
+    {
+        int status = 0;
+        fitsfile *tmpFits;
+
+        openImage(filename, 0, &tmpFits);
+
+        FITSImage::BitDepth bitDepth;
+        try
+        {
+            bitDepth = probe(tmpFits, info);
+        }
+        catch (FITSException *e)
+        {
+            fits_close_file(tmpFits, &status);
+            throw e;
+        }
+
+        fits_close_file(tmpFits, &status);
+
+        return bitDepth;
+    }
+
+    /* static */
+    FITSImage::BitDepth FITSImage::probe(fitsfile *fits,
+                                         Info *info)
+    {
+        ELS_TRACE_SCOPE("FITSImage::probe");
+
+        int status = 0;
+
         /* Get the axis count for the image */
-        fits_get_img_dim(tmpFits, &tmpInfo->numAxis, &status);
+        fits_get_img_dim(fits, &info->numAxis, &status);
         if (status)
         {
             throw new FITSTantrum(status);
         }
 
         /* Find the x/y-axis dimensions and the color dimension if it exists. */
-        if (tmpInfo->numAxis < 2)
+        if (info->numAxis < 2)
         {
             throw new FITSException("Too few axes to be a real image!");
         }
-        else if (tmpInfo->numAxis > 3)
+        else if (info->numAxis > g_maxAxes)
         {
             throw new FITSException("Too many axes to be a real image!");
         }
 
         /* Get the size of each axis */
-        fits_get_img_size(tmpFits, 3, tmpInfo->axLengths, &status);
+        fits_get_img_size(fits, g_maxAxes, info->axLengths, &status);
         if (status)
         {
             throw new FITSTantrum(status);
         }
 
-        /* Find the color axis if it exists.. */
-        if (tmpInfo->numAxis == 2)
+        /* Find the color axis if it exists. Anything else past the
+           first two axes is a stack of mono planes. */
+        info->chanAx = 0;
+        info->width = info->axLengths[1 - 1];
+        info->height = info->axLengths[2 - 1];
+        info->planeCount = 1;
+        if (info->numAxis == 3)
         {
-            tmpInfo->chanAx = 0;
-            tmpInfo->width = tmpInfo->axLengths[1 - 1];
-            tmpInfo->height = tmpInfo->axLengths[2 - 1];
-        }
-        else
-        { // (numAxis == 3)
-            if (tmpInfo->axLengths[3 - 1] == 3)
+            if (info->axLengths[3 - 1] == 3)
             {
-                tmpInfo->chanAx = 3;
-                tmpInfo->width = tmpInfo->axLengths[1 - 1];
-                tmpInfo->height = tmpInfo->axLengths[2 - 1];
+                info->chanAx = 3;
             }
-            else if (tmpInfo->axLengths[1 - 1] == 3)
+            else if (info->axLengths[1 - 1] == 3)
             {
-                tmpInfo->chanAx = 1;
-                tmpInfo->width = tmpInfo->axLengths[2 - 1];
-                tmpInfo->height = tmpInfo->axLengths[3 - 1];
+                info->chanAx = 1;
+                info->width = info->axLengths[2 - 1];
+                info->height = info->axLengths[3 - 1];
             }
-            else
+        }
+        if (info->chanAx == 0)
+        {
+            for (int i = 3; i <= info->numAxis; i++)
             {
-                throw new FITSException("Found 3 axis, but can't figure out RGB dimension!");
+                info->planeCount *= info->axLengths[i - 1];
             }
         }
+        if ((info->width < 1) || (info->height < 1) || (info->planeCount < 1))
+        {
+            throw new FITSException("Image has no pixels");
+        }
 
-        /* Compute the number of pixels */
-        tmpInfo->numPixels = tmpInfo->width * tmpInfo->height;
-        if (tmpInfo->chanAx != 0)
+        /* Compute the number of pixels (in one plane) */
+        info->numPixels = (int64_t)info->width * info->height;
+        if (info->chanAx != 0)
         {
-            tmpInfo->numPixels *= 3;
+            info->numPixels *= 3;
         }
 
         /* Report on image size and color axis location */
-        if (tmpInfo->chanAx)
+        if (info->chanAx)
+        {
+            sprintf(info->sizeAndColor, "%dx%d Color FITS image; RGB is ax %d", info->width, info->height, info->chanAx);
+        }
+        else if (info->planeCount > 1)
         {
-            sprintf(tmpInfo->sizeAndColor, "%dx%d Color FITS image; RGB is ax %d", tmpInfo->width, tmpInfo->height, tmpInfo->chanAx);
+            sprintf(info->sizeAndColor, "%dx%dx%d FITS cube", info->width, info->height, info->planeCount);
         }
         else
         {
-            sprintf(tmpInfo->sizeAndColor, "%dx%d FITS image", tmpInfo->width, tmpInfo->height);
+            sprintf(info->sizeAndColor, "%dx%d FITS image", info->width, info->height);
         }
 
-        /* Set up fpixel for a full image read. */
-        for (int i = 1; i <= tmpInfo->numAxis; i++)
+        /* Set up fpixel to read the first plane. */
+        for (int i = 1; i <= info->numAxis; i++)
         {
-            tmpInfo->fpixel[i - 1] = 1;
+            info->fpixel[i - 1] = 1;
         }
+        info->plane = 0;
+        info->decimation = 1;
+        info->binning = 1;
+        info->range = 0;
+        info->originX = 0;
+        info->originY = 0;
+
+        fits_get_hdu_num(fits, &info->hdu);
+        info->extName[0] = 0;
+        readOptionalKey(fits, "EXTNAME", info->extName);
 
         int fitsIOBitDepth;
-        fits_get_img_type(tmpFits, &fitsIOBitDepth, &status);
+        fits_get_img_type(fits, &fitsIOBitDepth, &status);
         if (status)
         {
             throw new FITSTantrum(status);
@@ -106,48 +615,260 @@ namespace ELS
         {
         case BYTE_IMG:
             bitDepth = FITSImage::BD_INT_8;
-            sprintf(tmpInfo->imageType, "8-bit byte pixels");
             break;
         case SHORT_IMG:
             bitDepth = FITSImage::BD_INT_16;
-            sprintf(tmpInfo->imageType, "16 bit integer pixels");
             break;
         case LONG_IMG:
             bitDepth = FITSImage::BD_INT_32;
-            sprintf(tmpInfo->imageType, "32-bit integer pixels");
             break;
         case FLOAT_IMG:
             bitDepth = FITSImage::BD_FLOAT;
-            sprintf(tmpInfo->imageType, "32-bit floating point pixels");
             break;
         case DOUBLE_IMG:
             bitDepth = FITSImage::BD_DOUBLE;
-            sprintf(tmpInfo->imageType, "64-bit floating point pixels");
             break;
         default:
             throw new FITSException("Unknown bit depth");
         }
+        strcpy(info->imageType, describeBitDepth(bitDepth));
+
+        /* One-shot-colour cameras record their colour filter array in
+           the header of an otherwise mono image. */
+        info->bayerPattern[0] = 0;
+        info->bayerOffsetX = 0;
+        info->bayerOffsetY = 0;
+        if (info->chanAx == 0)
+        {
+            readOptionalKey(fits, "BAYERPAT", info->bayerPattern);
+            readOptionalKey(fits, "XBAYROFF", &info->bayerOffsetX);
+            readOptionalKey(fits, "YBAYROFF", &info->bayerOffsetY);
+        }
+
+        return bitDepth;
+    }
+
+    /* static */
+    void FITSImage::openImage(const char *filename,
+                              int hdu,
+                              fitsfile **fits)
+    {
+        int status = 0;
+
+        fits_open_file(fits, filename, READONLY, &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+
+        int hduType = 0;
+        if (hdu > 0)
+        {
+            fits_movabs_hdu(*fits, hdu, &hduType, &status);
+            if ((status == 0) && (hduType != IMAGE_HDU))
+            {
+                fits_close_file(*fits, &status);
+                throw new FITSException("HDU is not an image");
+            }
+        }
+        else
+        {
+            // Multi-extension files often have an empty primary HDU, so
+            // skip ahead to the first HDU with pixels
+            while (status == 0)
+            {
+                int numAxis = 0;
+                fits_get_hdu_type(*fits, &hduType, &status);
+                if ((status == 0) && (hduType == IMAGE_HDU))
+                {
+                    fits_get_img_dim(*fits, &numAxis, &status);
+                }
+                if ((status == 0) && (hduType == IMAGE_HDU) && (numAxis >= 2))
+                {
+                    break;
+                }
+                if (status == 0)
+                {
+                    fits_movrel_hdu(*fits, 1, &hduType, &status);
+                }
+            }
+        }
+
+        if (status)
+        {
+            int tmpStatus = 0;
+            fits_close_file(*fits, &tmpStatus);
+            if (status == END_OF_FILE)
+            {
+                throw new FITSException("No image found in file");
+            }
+            throw new FITSTantrum(status);
+        }
+    }
+
+    /* static */
+    void FITSImage::selectPlane(Info *info,
+                                int plane)
+    {
+        if ((plane < 0) || (plane >= info->planeCount))
+        {
+            throw new FITSException("No such plane");
+        }
+
+        info->plane = plane;
+        if (info->chanAx != 0)
+        {
+            return;
+        }
+
+        int remaining = plane;
+        for (int i = 2; i < info->numAxis; i++)
+        {
+            info->fpixel[i] = 1 + remaining % info->axLengths[i];
+            remaining /= info->axLengths[i];
+        }
+
+        if (info->planeCount > 1)
+        {
+            sprintf(info->sizeAndColor + strlen(info->sizeAndColor),
+                    "; plane %d", plane + 1);
+        }
+    }
+
+    /* static */
+    FITSImage *FITSImage::create(BitDepth bitDepth,
+                                 int width,
+                                 int height,
+                                 bool isColor)
+    {
+        Info *tmpInfo = new Info();
+
+        tmpInfo->numAxis = isColor ? 3 : 2;
+        tmpInfo->axLengths[0] = width;
+        tmpInfo->axLengths[1] = height;
+        tmpInfo->axLengths[2] = isColor ? 3 : 1;
+        tmpInfo->chanAx = isColor ? 3 : 0;
+        tmpInfo->width = width;
+        tmpInfo->height = height;
+        tmpInfo->numPixels = (int64_t)width * height * (isColor ? 3 : 1);
+        tmpInfo->fpixel[0] = 1;
+        tmpInfo->fpixel[1] = 1;
+        tmpInfo->fpixel[2] = 1;
+        tmpInfo->hdu = 1;
+        tmpInfo->plane = 0;
+        tmpInfo->planeCount = 1;
+        tmpInfo->extName[0] = 0;
+        tmpInfo->originX = 0;
+        tmpInfo->originY = 0;
+        tmpInfo->bayerPattern[0] = 0;
+        tmpInfo->bayerOffsetX = 0;
+        tmpInfo->bayerOffsetY = 0;
+        tmpInfo->decimation = 1;
+        tmpInfo->binning = 1;
+        tmpInfo->range = 0;
+        strcpy(tmpInfo->imageType, describeBitDepth(bitDepth));
+        if (isColor)
+        {
+            sprintf(tmpInfo->sizeAndColor, "%dx%d Color image", width, height);
+        }
+        else
+        {
+            sprintf(tmpInfo->sizeAndColor, "%dx%d image", width, height);
+        }
+
+        FITSRaster *raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+        raster->allocate();
+
+        return new FITSImage(bitDepth, raster, tmpInfo);
+    }
+
+    /* static */
+    FITSImage *FITSImage::create(BitDepth bitDepth,
+                                 const Info &info)
+    {
+        Info *tmpInfo = new Info(info);
 
-        // Create a raster for the data and read it
         FITSRaster *raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
-        raster->readPix(tmpFits, tmpInfo->fpixel);
+        try
+        {
+            raster->allocate();
+        }
+        catch (FITSException *e)
+        {
+            delete raster;
+            delete tmpInfo;
+            throw e;
+        }
+
+        return new FITSImage(bitDepth, raster, tmpInfo);
+    }
 
-        //    /* Compute maximum pixel value */
-        //    tmpInfo->maxPixelVal =  tmpInfo->imageArray[0];
-        //    tmpInfo->minPixelVal =  tmpInfo->imageArray[0];
-        //    for (int i = 1; i < tmpInfo->numPixels; i++) {
-        //        if (tmpInfo->imageArray[i] > tmpInfo->maxPixelVal) {
-        //            tmpInfo->maxPixelVal = tmpInfo->imageArray[i];
-        //        }
+    /* static */
+    FITSImage *FITSImage::wrap(BitDepth bitDepth,
+                               const Info &info,
+                               const void *pixels,
+                               const std::shared_ptr<const void> &owner)
+    {
+        Info *tmpInfo = new Info(info);
+        tmpInfo->imageArray = 0;
 
-        //        if (tmpInfo->imageArray[i] < tmpInfo->minPixelVal) {
-        //            tmpInfo->minPixelVal = tmpInfo->imageArray[i];
-        //        }
-        //    }
+        FITSRaster *raster = new FITSRaster(bitDepth, tmpInfo->numPixels);
+        raster->attach(pixels, owner);
 
         return new FITSImage(bitDepth, raster, tmpInfo);
     }
 
+    /* static */
+    FITSImage *FITSImage::crop(const FITSImage *image,
+                               const Region &region)
+    {
+        ELS_TRACE_SCOPE("FITSImage::crop");
+
+        const Info &source = image->getInfo();
+        const int x0 = std::max(region.x, 0);
+        const int y0 = std::max(region.y, 0);
+        const int x1 = std::min(region.x + region.width, source.width);
+        const int y1 = std::min(region.y + region.height, source.height);
+        if ((x1 <= x0) || (y1 <= y0))
+        {
+            throw new FITSException("Region is outside the image");
+        }
+
+        Info info(source);
+        info.width = x1 - x0;
+        info.height = y1 - y0;
+        info.originX = source.originX + x0;
+        info.originY = source.originY + y0;
+        info.numPixels = (int64_t)info.width * info.height * (info.chanAx != 0 ? 3 : 1);
+        info.axLengths[info.chanAx == 1 ? 1 : 0] = info.width;
+        info.axLengths[info.chanAx == 1 ? 2 : 1] = info.height;
+        info.bayerOffsetX = (info.bayerOffsetX + x0) & 1;
+        info.bayerOffsetY = (info.bayerOffsetY + y0) & 1;
+        sprintf(info.sizeAndColor, "%dx%d region at %d,%d", info.width, info.height, info.originX, info.originY);
+
+        FITSImage *result = create(image->getBitDepth(), info);
+
+        // Bytes per sample; colour on axis 1 is interleaved, so a pixel
+        // is three of them.
+        const size_t sample = image->getPixelBytes() / source.numPixels;
+        const size_t pixel = info.chanAx == 1 ? sample * 3 : sample;
+        const int planes = info.chanAx == 3 ? 3 : 1;
+
+        const unsigned char *from = (const unsigned char *)image->getPixels();
+        unsigned char *to = (unsigned char *)result->getPixels();
+        for (int c = 0; c < planes; c++)
+        {
+            for (int y = y0; y < y1; y++)
+            {
+                memcpy(to, from + (((int64_t)c * source.height + y) * source.width + x0) * pixel,
+                       info.width * pixel);
+                to += info.width * pixel;
+            }
+        }
+
+        return result;
+    }
+
     FITSImage::FITSImage(BitDepth bitDepth,
                          FITSRaster *raster,
                          Info *info)
@@ -161,6 +882,8 @@ namespace ELS
         {
             delete _raster;
         }
+
+        delete _info;
     }
 
     const char *FITSImage::getImageType() const
@@ -193,14 +916,97 @@ namespace ELS
         return _info->chanAx != 0;
     }
 
+    const FITSImage::Info &FITSImage::getInfo() const
+    {
+        return *_info;
+    }
+
+    int FITSImage::getHDU() const
+    {
+        return _info->hdu;
+    }
+
+    int FITSImage::getPlane() const
+    {
+        return _info->plane;
+    }
+
+    int FITSImage::getPlaneCount() const
+    {
+        return _info->planeCount;
+    }
+
+    int FITSImage::getOriginX() const
+    {
+        return _info->originX;
+    }
+
+    int FITSImage::getOriginY() const
+    {
+        return _info->originY;
+    }
+
     FITSImage::BitDepth FITSImage::getBitDepth() const
     {
         return _bitDepth;
     }
 
+    int64_t FITSImage::getPixelBytes() const
+    {
+        switch (_bitDepth)
+        {
+        case BD_INT_8:
+            return _info->numPixels;
+        case BD_INT_16:
+            return _info->numPixels * 2;
+        case BD_INT_32:
+        case BD_FLOAT:
+            return _info->numPixels * 4;
+        case BD_DOUBLE:
+            return _info->numPixels * 8;
+        }
+
+        return 0;
+    }
+
+    int FITSImage::getDecimation() const
+    {
+        return _info->decimation;
+    }
+
+    int FITSImage::getBinning() const
+    {
+        return _info->binning;
+    }
+
+    bool FITSImage::isBayered() const
+    {
+        return _info->bayerPattern[0] != 0;
+    }
+
+    const char *FITSImage::getBayerPattern() const
+    {
+        return _info->bayerPattern;
+    }
+
+    int FITSImage::getBayerOffsetX() const
+    {
+        return _info->bayerOffsetX;
+    }
+
+    int FITSImage::getBayerOffsetY() const
+    {
+        return _info->bayerOffsetY;
+    }
+
     const void *FITSImage::getPixels() const
     {
         return _raster->getPixels();
     }
 
+    void *FITSImage::getPixels()
+    {
+        return _raster->getPixels();
+    }
+
 }
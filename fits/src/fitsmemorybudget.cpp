@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <unistd.h>
+
+#include "fitsmemorybudget.h"
+
+namespace ELS
+{
+
+    /* static */
+    FITSMemoryBudget *FITSMemoryBudget::global()
+    {
+        static FITSMemoryBudget budget;
+        return &budget;
+    }
+
+    FITSMemoryBudget::FITSMemoryBudget()
+        : _budget(defaultBudget()),
+          _total(0),
+          _clock(0),
+          _evicted(0)
+    {
+    }
+
+    /* static */
+    const char *FITSMemoryBudget::getCategoryName(Category category)
+    {
+        switch (category)
+        {
+        case MC_RASTER:
+            return "Rasters";
+        case MC_RENDER:
+            return "Renders";
+        case MC_CACHE:
+            return "Frame cache";
+        case MC_TILES:
+            return "Tiles";
+        case MC_PREFETCH:
+            return "Prefetch";
+        case MC_POOL:
+            return "Idle pool";
+        case MC_COUNT:
+            break;
+        }
+
+        return "Unknown";
+    }
+
+    /* static */
+    size_t FITSMemoryBudget::defaultBudget()
+    {
+        const long pages = sysconf(_SC_PHYS_PAGES);
+        const long pageSize = sysconf(_SC_PAGE_SIZE);
+        if ((pages <= 0) || (pageSize <= 0))
+        {
+            return (size_t)2 * 1024 * 1024 * 1024;
+        }
+
+        return (size_t)pages * pageSize / 4;
+    }
+
+    void FITSMemoryBudget::setBudget(size_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _budget = bytes;
+        }
+
+        enforce();
+    }
+
+    size_t FITSMemoryBudget::getBudget() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _budget;
+    }
+
+    int FITSMemoryBudget::addConsumer(const char *name,
+                                      Category category,
+                                      int priority /* = 0 */,
+                                      Evictor evictor /* = Evictor() */)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        Consumer consumer;
+        consumer.info.id = _consumers.size();
+        consumer.info.name = name;
+        consumer.info.category = category;
+        consumer.info.priority = priority;
+        consumer.info.evictable = (bool)evictor;
+        consumer.info.usage = 0;
+        consumer.info.lastUse = ++_clock;
+        consumer.evictor = evictor;
+        consumer.active = true;
+        _consumers.push_back(consumer);
+
+        return consumer.info.id;
+    }
+
+    void FITSMemoryBudget::removeConsumer(int id)
+    {
+        std::lock_guard<std::mutex> evictLock(_evictMutex);
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        Consumer &consumer = _consumers[id];
+        _total -= consumer.info.usage;
+        consumer.info.usage = 0;
+        consumer.evictor = Evictor();
+        consumer.info.evictable = false;
+        consumer.active = false;
+    }
+
+    void FITSMemoryBudget::charge(int id,
+                                  int64_t bytes)
+    {
+        bool over;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            ConsumerInfo &info = _consumers[id].info;
+            if ((bytes < 0) && ((size_t)-bytes > info.usage))
+            {
+                bytes = -(int64_t)info.usage;
+            }
+            info.usage += bytes;
+            info.lastUse = ++_clock;
+            _total += bytes;
+
+            over = (bytes > 0) && (_total > _budget);
+        }
+
+        if (over)
+        {
+            enforce();
+        }
+    }
+
+    void FITSMemoryBudget::touch(int id)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _consumers[id].info.lastUse = ++_clock;
+    }
+
+    size_t FITSMemoryBudget::getUsage(Category category) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        size_t usage = 0;
+        for (const Consumer &consumer : _consumers)
+        {
+            if (consumer.active && (consumer.info.category == category))
+            {
+                usage += consumer.info.usage;
+            }
+        }
+
+        return usage;
+    }
+
+    size_t FITSMemoryBudget::getTotalUsage() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _total;
+    }
+
+    uint64_t FITSMemoryBudget::getEvictedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _evicted;
+    }
+
+    std::vector<FITSMemoryBudget::ConsumerInfo> FITSMemoryBudget::getConsumers() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        std::vector<ConsumerInfo> consumers;
+        for (const Consumer &consumer : _consumers)
+        {
+            if (consumer.active)
+            {
+                consumers.push_back(consumer.info);
+            }
+        }
+
+        return consumers;
+    }
+
+    bool FITSMemoryBudget::enforce()
+    {
+        // One thread evicts at a time; others carry on, the one already
+        // evicting will see their charges too.
+        std::unique_lock<std::mutex> evictLock(_evictMutex, std::try_to_lock);
+        if (!evictLock.owns_lock())
+        {
+            return false;
+        }
+
+        // Evictors uncharge through charge(), so they must run without
+        // the lock. Take a snapshot of who to ask, in order.
+        std::vector<std::pair<int, Evictor>> order;
+        size_t excess = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_total > _budget)
+            {
+                excess = _total - _budget;
+
+                std::vector<const Consumer *> candidates;
+                for (const Consumer &consumer : _consumers)
+                {
+                    if (consumer.active && consumer.info.evictable && (consumer.info.usage > 0))
+                    {
+                        candidates.push_back(&consumer);
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end(),
+                          [](const Consumer *a, const Consumer *b)
+                          {
+                              if (a->info.priority != b->info.priority)
+                              {
+                                  return a->info.priority < b->info.priority;
+                              }
+                              return a->info.lastUse < b->info.lastUse;
+                          });
+                for (const Consumer *consumer : candidates)
+                {
+                    order.push_back(std::make_pair(consumer->info.id, consumer->evictor));
+                }
+            }
+        }
+
+        for (size_t i = 0; (i < order.size()) && (excess > 0); i++)
+        {
+            const size_t freed = order[i].second(excess);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _evicted += freed;
+            excess = _total > _budget ? _total - _budget : 0;
+        }
+
+        bool within;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            within = _total <= _budget;
+        }
+
+        return within;
+    }
+
+}
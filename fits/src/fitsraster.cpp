@@ -1,73 +1,105 @@
+#include "fitsbufferpool.h"
+#include "fitsmemorybudget.h"
 #include "fitstantrum.h"
+#include "fitstrace.h"
 #include "fitsraster.h"
 
+namespace
+{
+
+    // Rasters in use can't be given back, only counted.
+    int rasterConsumer()
+    {
+        static int id = ELS::FITSMemoryBudget::global()->addConsumer("FITS rasters",
+                                                                     ELS::FITSMemoryBudget::MC_RASTER);
+        return id;
+    }
+
+}
+
 namespace ELS
 {
 
     FITSRaster::FITSRaster(FITSImage::BitDepth bitDepth,
                            int64_t pixelCount)
-        : _bitDepth(bitDepth), _pixelCount(pixelCount), _pixels(0)
+        : _bitDepth(bitDepth), _pixelCount(pixelCount), _pixels(0), _owner()
     {
     }
 
     FITSRaster::~FITSRaster()
     {
-        if (_pixels != 0)
-        {
-            switch (_bitDepth)
-            {
-            case FITSImage::BD_INT_8:
-                delete[](uint8_t *) _pixels;
-                break;
-            case FITSImage::BD_INT_16:
-                delete[](uint16_t *) _pixels;
-                break;
-            case FITSImage::BD_INT_32:
-                delete[](uint32_t *) _pixels;
-                break;
-            case FITSImage::BD_FLOAT:
-                delete[](float *) _pixels;
-                break;
-            case FITSImage::BD_DOUBLE:
-                delete[](double *) _pixels;
-                break;
-            default:
-                break;
-            }
-        }
+        release();
     }
 
-    void FITSRaster::readPix(fitsfile *fits,
-                             long *fpixel)
+    void *FITSRaster::allocate()
     {
-        // Allocate space for the pixels
-        int fitsIOType = 0;
+        size_t pixelSize;
         switch (_bitDepth)
         {
         case FITSImage::BD_INT_8:
-            fitsIOType = TBYTE;
-            _pixels = new uint8_t[_pixelCount];
+            pixelSize = sizeof(uint8_t);
             break;
         case FITSImage::BD_INT_16:
-            fitsIOType = TUSHORT;
-            _pixels = new uint16_t[_pixelCount];
+            pixelSize = sizeof(uint16_t);
             break;
         case FITSImage::BD_INT_32:
-            fitsIOType = TUINT;
-            _pixels = new uint32_t[_pixelCount];
+            pixelSize = sizeof(uint32_t);
             break;
         case FITSImage::BD_FLOAT:
-            fitsIOType = TFLOAT;
-            _pixels = new float[_pixelCount];
+            pixelSize = sizeof(float);
             break;
         case FITSImage::BD_DOUBLE:
-            fitsIOType = TDOUBLE;
-            _pixels = new double[_pixelCount];
+            pixelSize = sizeof(double);
             break;
         default:
             throw new FITSException("Unknown bit depth");
         }
 
+        // Pooled, so the next frame of the same size and type reuses
+        // this one's memory instead of faulting in fresh pages.
+        release();
+        _pixels = FITSBufferPool::global()->acquire(_pixelCount * pixelSize);
+        FITSMemoryBudget::global()->charge(rasterConsumer(),
+                                           FITSBufferPool::global()->sizeOf(_pixels));
+
+        return _pixels;
+    }
+
+    void FITSRaster::attach(const void *pixels,
+                            const std::shared_ptr<const void> &owner)
+    {
+        release();
+        _pixels = const_cast<void *>(pixels);
+        _owner = owner;
+    }
+
+    void FITSRaster::release()
+    {
+        if (_owner)
+        {
+            // Not ours, so neither pooled nor charged.
+            _owner.reset();
+            _pixels = 0;
+        }
+        else if (_pixels != 0)
+        {
+            FITSMemoryBudget::global()->charge(rasterConsumer(),
+                                               -(int64_t)FITSBufferPool::global()->sizeOf(_pixels));
+            FITSBufferPool::global()->release(_pixels);
+            _pixels = 0;
+        }
+    }
+
+    void FITSRaster::readPix(fitsfile *fits,
+                             long *fpixel)
+    {
+        ELS_TRACE_SCOPE("FITSRaster::readPix");
+
+        int fitsIOType = getFITSIOType();
+
+        // Allocate space for the pixels
+        allocate();
+
         // Read in the data in one big gulp
         int status = 0;
         fits_read_pix(fits,
@@ -84,9 +116,62 @@ namespace ELS
         }
     }
 
+    void FITSRaster::readSubset(fitsfile *fits,
+                                long *fpixel,
+                                long *lpixel,
+                                long *inc)
+    {
+        ELS_TRACE_SCOPE("FITSRaster::readSubset");
+
+        int fitsIOType = getFITSIOType();
+
+        allocate();
+
+        // The raster must already be sized for the subset
+        int status = 0;
+        fits_read_subset(fits,
+                         fitsIOType,
+                         fpixel,
+                         lpixel,
+                         inc,
+                         NULL,
+                         _pixels,
+                         NULL,
+                         &status);
+        if (status)
+        {
+            throw new FITSTantrum(status);
+        }
+    }
+
     const void *FITSRaster::getPixels() const
     {
         return _pixels;
     }
 
+    void *FITSRaster::getPixels()
+    {
+        return _pixels;
+    }
+
+    /* private */
+    int FITSRaster::getFITSIOType() const
+    {
+        switch (_bitDepth)
+        {
+        case FITSImage::BD_INT_8:
+            return TBYTE;
+        case FITSImage::BD_INT_16:
+            return TUSHORT;
+        case FITSImage::BD_INT_32:
+            return TUINT;
+        case FITSImage::BD_FLOAT:
+            return TFLOAT;
+        case FITSImage::BD_DOUBLE:
+            return TDOUBLE;
+        default:
+            throw new FITSException("Unknown bit depth");
+        }
+    }
+
 }
@@ -0,0 +1,817 @@
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+
+#include "fitsmemorybudget.h"
+#include "fitssharedcache.h"
+#include "fitstrace.h"
+
+namespace
+{
+
+    const char g_indexMagic[8] = {'Q', 'T', 'F', 'S', 'H', 'M', 'I', '2'};
+    const char g_entryMagic[8] = {'Q', 'T', 'F', 'S', 'H', 'M', 'E', '1'};
+
+    const int g_slots = 1024;
+
+    // Processes attached at once; one bit each in a slot's holders.
+    const int g_maxProcesses = 64;
+
+    // How far from a key's home slot it may be stored.
+    const int g_maxProbe = 16;
+
+    // A slot left mid-write this long belonged to a process that died.
+    const int64_t g_staleWriteMs = 60 * 1000;
+
+    const size_t g_maxKey = 1024;
+
+    enum SlotState
+    {
+        SS_EMPTY,
+        SS_WRITING,
+        SS_READY
+    };
+
+    // At the start of every entry segment. The full key lets a reader
+    // check it mapped what it asked for; data starts on a page boundary.
+    struct EntryHeader
+    {
+        char magic[8];
+        uint64_t keyLength;
+        char key[g_maxKey];
+        uint64_t metaSize;
+        uint64_t dataSize;
+        uint64_t dataOffset;
+    };
+
+    struct ImageMeta
+    {
+        int32_t bitDepth;
+        ELS::FITSImage::Info info;
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                  "the shared index needs address-free atomics");
+
+    uint64_t hashKey(const std::string &key)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < key.size(); i++)
+        {
+            hash ^= (unsigned char)key[i];
+            hash *= 1099511628211ull;
+        }
+
+        // 0 marks an unused slot.
+        return hash == 0 ? 1 : hash;
+    }
+
+    int64_t nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    size_t physicalMemory()
+    {
+        const long pages = sysconf(_SC_PHYS_PAGES);
+        const long pageSize = sysconf(_SC_PAGE_SIZE);
+        if ((pages <= 0) || (pageSize <= 0))
+        {
+            return (size_t)8 << 30;
+        }
+
+        return (size_t)pages * pageSize;
+    }
+
+    bool keyMatches(const EntryHeader *header,
+                    const std::string &key)
+    {
+        const size_t stored = key.size() < g_maxKey ? key.size() : g_maxKey;
+        return (memcmp(header->magic, g_entryMagic, sizeof(g_entryMagic)) == 0) &&
+               (header->keyLength == key.size()) &&
+               (memcmp(header->key, key.data(), stored) == 0);
+    }
+
+}
+
+namespace ELS
+{
+
+    // Lives in shared memory, so only plain data and lock-free atomics;
+    // a freshly created (zero-filled) segment is an empty index.
+    struct FITSSharedCache::Slot
+    {
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> generation;
+        // Bit n set: process n of the index has the entry mapped.
+        std::atomic<uint64_t> holders;
+        std::atomic<uint64_t> hash;
+        std::atomic<uint64_t> bytes;
+        std::atomic<int64_t> lastUse;
+    };
+
+    struct FITSSharedCache::Index
+    {
+        char magic[8];
+        std::atomic<uint64_t> usage;
+        // 0 for a free entry. Claimed and given up only under the
+        // index's file lock.
+        std::atomic<int32_t> processes[g_maxProcesses];
+        Slot slots[g_slots];
+    };
+
+    /* static */
+    FITSSharedCache *FITSSharedCache::global()
+    {
+        // The budget must be constructed first so it outlives the cache.
+        static FITSMemoryBudget *budget = FITSMemoryBudget::global();
+        static FITSSharedCache cache(("/qtfits-" + std::to_string(getuid())).c_str());
+        (void)budget;
+        return &cache;
+    }
+
+    FITSSharedCache::FITSSharedCache(const char *name)
+        : _name(name),
+          _fd(-1),
+          _index(0),
+          _indexSize(sizeof(Index)),
+          _capacity(physicalMemory() / 8),
+          _process(-1),
+          _mutex(),
+          _holds(g_slots, 0),
+          _budgetId(-1),
+          _charged(0)
+    {
+        // Attaching and detaching happen under a lock on the index. The
+        // last process to detach unlinks it, so if that happened while
+        // we waited for the lock, open the new one instead.
+        int fd = -1;
+        for (int attempt = 0; (attempt < 4) && (fd < 0); attempt++)
+        {
+            fd = shm_open(_name.c_str(), O_CREAT | O_RDWR, 0600);
+            if (fd < 0)
+            {
+                return;
+            }
+
+            struct stat st;
+            if ((flock(fd, LOCK_EX) != 0) || (fstat(fd, &st) != 0) || (st.st_nlink == 0))
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0)
+        {
+            return;
+        }
+
+        // Growing a new segment zero-fills it; every process does this
+        // and it is harmless once the segment has its size.
+        struct stat st;
+        if ((fstat(fd, &st) != 0) ||
+            (((size_t)st.st_size != _indexSize) && (ftruncate(fd, _indexSize) != 0)))
+        {
+            close(fd);
+            return;
+        }
+
+        void *mapping = mmap(0, _indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            return;
+        }
+
+        Index *index = (Index *)mapping;
+        static const char zeros[sizeof(g_indexMagic)] = {0};
+        if (memcmp(index->magic, zeros, sizeof(zeros)) == 0)
+        {
+            memcpy(index->magic, g_indexMagic, sizeof(g_indexMagic));
+        }
+        else if (memcmp(index->magic, g_indexMagic, sizeof(g_indexMagic)) != 0)
+        {
+            // Left by an incompatible build; leave it alone.
+            munmap(mapping, _indexSize);
+            close(fd);
+            return;
+        }
+
+        _index = index;
+        if (!attachProcess())
+        {
+            // Too many viewers open already.
+            munmap(mapping, _indexSize);
+            close(fd);
+            _index = 0;
+            return;
+        }
+        flock(fd, LOCK_UN);
+        _fd = fd;
+
+        // Cheaper to lose than tiles or prefetched frames, like the
+        // frame cache; only entries nobody holds can go.
+        _budgetId = FITSMemoryBudget::global()->addConsumer("Shared cache",
+                                                            FITSMemoryBudget::MC_CACHE,
+                                                            10,
+                                                            [this](size_t bytes)
+                                                            { return evict(bytes); });
+        chargeBudget();
+    }
+
+    FITSSharedCache::~FITSSharedCache()
+    {
+        if (_index == 0)
+        {
+            return;
+        }
+
+        FITSMemoryBudget::global()->removeConsumer(_budgetId);
+
+        flock(_fd, LOCK_EX);
+        detachProcess();
+        munmap(_index, _indexSize);
+        _index = 0;
+        close(_fd);
+    }
+
+    bool FITSSharedCache::isOpen() const
+    {
+        return _index != 0;
+    }
+
+    void FITSSharedCache::setCapacity(size_t bytes)
+    {
+        _capacity = bytes;
+    }
+
+    size_t FITSSharedCache::getCapacity() const
+    {
+        return _capacity;
+    }
+
+    size_t FITSSharedCache::getUsage() const
+    {
+        return _index != 0 ? _index->usage.load() : 0;
+    }
+
+    std::shared_ptr<const FITSSharedCache::Block> FITSSharedCache::attach(const std::string &key)
+    {
+        if (_index == 0)
+        {
+            return std::shared_ptr<const Block>();
+        }
+
+        ELS_TRACE_SCOPE("FITSSharedCache::attach");
+
+        const uint64_t hash = hashKey(key);
+        for (int probe = 0; probe < g_maxProbe; probe++)
+        {
+            const int i = (int)((hash + probe) % g_slots);
+            Slot &slot = _index->slots[i];
+            if ((slot.state.load() != SS_READY) || (slot.hash.load() != hash))
+            {
+                continue;
+            }
+
+            // Hold it, then make sure the slot wasn't evicted or reused
+            // before the hold counted.
+            hold(i);
+            if ((slot.state.load() != SS_READY) || (slot.hash.load() != hash))
+            {
+                release(i);
+                continue;
+            }
+
+            Block *block = map(key, i, false, 0);
+            if (block == 0)
+            {
+                release(i);
+                return std::shared_ptr<const Block>();
+            }
+            slot.lastUse.store(nowMs());
+            chargeBudget();
+
+            return std::shared_ptr<const Block>(block);
+        }
+
+        return std::shared_ptr<const Block>();
+    }
+
+    std::shared_ptr<const FITSSharedCache::Block> FITSSharedCache::publish(const std::string &key,
+                                                                           const void *meta,
+                                                                           size_t metaSize,
+                                                                           const void *data,
+                                                                           size_t dataSize)
+    {
+        if (_index == 0)
+        {
+            return std::shared_ptr<const Block>();
+        }
+
+        ELS_TRACE_SCOPE("FITSSharedCache::publish");
+
+        const size_t pageSize = sysconf(_SC_PAGE_SIZE);
+        const size_t dataOffset = (sizeof(EntryHeader) + metaSize + pageSize - 1) / pageSize * pageSize;
+        const size_t size = dataOffset + dataSize;
+        const bool room = (size <= _capacity) && makeRoom(size);
+        chargeBudget();
+        if (!room)
+        {
+            return std::shared_ptr<const Block>();
+        }
+
+        const uint64_t hash = hashKey(key);
+        const int i = claimSlot(hash);
+        if (i < 0)
+        {
+            return std::shared_ptr<const Block>();
+        }
+        Slot &slot = _index->slots[i];
+
+        hold(i);
+        Block *block = map(key, i, true, size);
+        if (block == 0)
+        {
+            release(i);
+            slot.hash.store(0);
+            slot.state.store(SS_EMPTY);
+            return std::shared_ptr<const Block>();
+        }
+        block->_meta = (const char *)block->_mapping + sizeof(EntryHeader);
+        block->_metaSize = metaSize;
+        block->_data = (const char *)block->_mapping + dataOffset;
+        block->_dataSize = dataSize;
+
+        EntryHeader *header = (EntryHeader *)block->_mapping;
+        memcpy(header->magic, g_entryMagic, sizeof(g_entryMagic));
+        header->keyLength = key.size();
+        memcpy(header->key, key.data(), key.size() < g_maxKey ? key.size() : g_maxKey);
+        header->metaSize = metaSize;
+        header->dataSize = dataSize;
+        header->dataOffset = dataOffset;
+        memcpy((char *)block->_mapping + sizeof(EntryHeader), meta, metaSize);
+        memcpy((char *)block->_mapping + dataOffset, data, dataSize);
+
+        // From here on it is read-only for the publisher too.
+        mprotect(block->_mapping, block->_mappingSize, PROT_READ);
+
+        slot.bytes.store(size);
+        slot.lastUse.store(nowMs());
+        _index->usage.fetch_add(size);
+        slot.state.store(SS_READY);
+        chargeBudget();
+
+        return std::shared_ptr<const Block>(block);
+    }
+
+    FITSImage *FITSSharedCache::attachImage(const std::string &key)
+    {
+        std::shared_ptr<const Block> block = attach(key);
+        if (!block || (block->getMetaSize() != sizeof(ImageMeta)))
+        {
+            return 0;
+        }
+
+        const ImageMeta *meta = (const ImageMeta *)block->getMeta();
+        FITSImage *image = FITSImage::wrap((FITSImage::BitDepth)meta->bitDepth,
+                                           meta->info,
+                                           block->getData(),
+                                           block);
+        if ((size_t)image->getPixelBytes() > block->getDataSize())
+        {
+            delete image;
+            return 0;
+        }
+
+        return image;
+    }
+
+    FITSImage *FITSSharedCache::publishImage(const std::string &key,
+                                             FITSImage *image)
+    {
+        ImageMeta meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.bitDepth = image->getBitDepth();
+        meta.info = image->getInfo();
+        meta.info.imageArray = 0;
+
+        std::shared_ptr<const Block> block = publish(key,
+                                                     &meta,
+                                                     sizeof(meta),
+                                                     image->getPixels(),
+                                                     image->getPixelBytes());
+        if (!block)
+        {
+            // Another process may have got there first.
+            FITSImage *shared = attachImage(key);
+            if (shared == 0)
+            {
+                return image;
+            }
+
+            delete image;
+            return shared;
+        }
+
+        FITSImage *shared = FITSImage::wrap(image->getBitDepth(),
+                                            meta.info,
+                                            block->getData(),
+                                            block);
+        delete image;
+
+        return shared;
+    }
+
+    /* private */
+    std::string FITSSharedCache::segmentName(int slot,
+                                             uint32_t generation) const
+    {
+        return _name + "-" + std::to_string(slot) + "-" + std::to_string(generation);
+    }
+
+    // Maps slot's segment: a new one of size bytes to write, or the
+    // existing one read-only after checking it holds key.
+    FITSSharedCache::Block *FITSSharedCache::map(const std::string &key,
+                                                 int slot,
+                                                 bool writable,
+                                                 size_t size)
+    {
+        const std::string name = segmentName(slot, _index->slots[slot].generation.load());
+
+        int fd = writable ? shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600)
+                          : shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return 0;
+        }
+
+        struct stat st;
+        if (writable ? (ftruncate(fd, size) != 0)
+                     : ((fstat(fd, &st) != 0) || ((size = st.st_size) < sizeof(EntryHeader))))
+        {
+            close(fd);
+            if (writable)
+            {
+                shm_unlink(name.c_str());
+            }
+            return 0;
+        }
+
+        void *mapping = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            if (writable)
+            {
+                shm_unlink(name.c_str());
+            }
+            return 0;
+        }
+
+        const EntryHeader *header = (const EntryHeader *)mapping;
+        if (!writable &&
+            (!keyMatches(header, key) ||
+             (header->dataOffset + header->dataSize > size) ||
+             (sizeof(EntryHeader) + header->metaSize > header->dataOffset)))
+        {
+            munmap(mapping, size);
+            return 0;
+        }
+
+        Block *block = new Block();
+        block->_mapping = mapping;
+        block->_mappingSize = size;
+        block->_cache = this;
+        block->_slot = slot;
+        if (!writable)
+        {
+            block->_meta = (const char *)mapping + sizeof(EntryHeader);
+            block->_metaSize = header->metaSize;
+            block->_data = (const char *)mapping + header->dataOffset;
+            block->_dataSize = header->dataSize;
+        }
+
+        return block;
+    }
+
+    // Takes a free entry in the process table, dropping whatever the
+    // dead process that had it still held. Caller holds the index lock.
+    bool FITSSharedCache::attachProcess()
+    {
+        for (int p = 0; p < g_maxProcesses; p++)
+        {
+            if (isAlive(p))
+            {
+                continue;
+            }
+
+            _index->processes[p].store(getpid());
+            for (int i = 0; i < g_slots; i++)
+            {
+                _index->slots[i].holders.fetch_and(~(1ull << p));
+            }
+            _process = p;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // Lets go of everything and, if no other process is attached, removes
+    // the entries and the index. Caller holds the index lock.
+    void FITSSharedCache::detachProcess()
+    {
+        for (int i = 0; i < g_slots; i++)
+        {
+            _index->slots[i].holders.fetch_and(~(1ull << _process));
+        }
+        _index->processes[_process].store(0);
+
+        for (int p = 0; p < g_maxProcesses; p++)
+        {
+            if (isAlive(p))
+            {
+                return;
+            }
+        }
+
+        for (int i = 0; i < g_slots; i++)
+        {
+            Slot &slot = _index->slots[i];
+            if (slot.state.load() != SS_EMPTY)
+            {
+                shm_unlink(segmentName(i, slot.generation.load()).c_str());
+            }
+        }
+        shm_unlink(_name.c_str());
+    }
+
+    bool FITSSharedCache::isAlive(int process) const
+    {
+        const pid_t pid = _index->processes[process].load();
+        return (pid != 0) && ((kill(pid, 0) == 0) || (errno == EPERM));
+    }
+
+    // The processes holding slot, after dropping the holds of any that
+    // died without letting go.
+    uint64_t FITSSharedCache::getLiveHolders(int slot)
+    {
+        Slot &s = _index->slots[slot];
+        uint64_t holders = s.holders.load();
+        for (int p = 0; (p < g_maxProcesses) && (holders != 0); p++)
+        {
+            const uint64_t bit = 1ull << p;
+            if (((holders & bit) != 0) && (p != _process) && !isAlive(p))
+            {
+                s.holders.fetch_and(~bit);
+                holders &= ~bit;
+            }
+        }
+
+        return holders;
+    }
+
+    // Blocks of a slot held in this process count as one hold.
+    void FITSSharedCache::hold(int slot)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_holds[slot]++ == 0)
+        {
+            _index->slots[slot].holders.fetch_or(1ull << _process);
+        }
+    }
+
+    void FITSSharedCache::release(int slot)
+    {
+        if (_index == 0)
+        {
+            // Outlived the cache; the hold went when we detached.
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_holds[slot] == 0)
+        {
+            _index->slots[slot].holders.fetch_and(~(1ull << _process));
+        }
+    }
+
+    // Drops the least recently used entry nobody holds. Returns its size,
+    // or 0 if there was none.
+    size_t FITSSharedCache::dropOldest()
+    {
+        for (;;)
+        {
+            int victim = -1;
+            int64_t oldest = INT64_MAX;
+            for (int i = 0; i < g_slots; i++)
+            {
+                Slot &slot = _index->slots[i];
+                if ((slot.state.load() == SS_READY) && (slot.lastUse.load() < oldest) &&
+                    (getLiveHolders(i) == 0))
+                {
+                    oldest = slot.lastUse.load();
+                    victim = i;
+                }
+            }
+            if (victim < 0)
+            {
+                return 0;
+            }
+
+            Slot &slot = _index->slots[victim];
+            uint32_t expected = SS_READY;
+            if (!slot.state.compare_exchange_strong(expected, SS_WRITING))
+            {
+                continue;
+            }
+            if (slot.holders.load() != 0)
+            {
+                // Attached while we looked.
+                slot.state.store(SS_READY);
+                continue;
+            }
+
+            const size_t bytes = slot.bytes.load();
+            shm_unlink(segmentName(victim, slot.generation.load()).c_str());
+            _index->usage.fetch_sub(bytes);
+            slot.bytes.store(0);
+            slot.hash.store(0);
+            slot.state.store(SS_EMPTY);
+
+            return bytes;
+        }
+    }
+
+    // Drops unreferenced entries, least recently used first, until bytes
+    // more would fit.
+    bool FITSSharedCache::makeRoom(size_t bytes)
+    {
+        while (_index->usage.load() + bytes > _capacity)
+        {
+            if (dropOldest() == 0)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // For the memory budget.
+    size_t FITSSharedCache::evict(size_t bytes)
+    {
+        size_t freed = 0;
+        while (freed < bytes)
+        {
+            const size_t dropped = dropOldest();
+            if (dropped == 0)
+            {
+                break;
+            }
+            freed += dropped;
+        }
+
+        chargeBudget();
+        return freed;
+    }
+
+    // Brings the charge in line with what the cache holds, which other
+    // processes change too. Must be called without holding _mutex, as
+    // charging can evict from here.
+    void FITSSharedCache::chargeBudget()
+    {
+        if (_budgetId < 0)
+        {
+            return;
+        }
+
+        const int64_t usage = (int64_t)_index->usage.load();
+        const int64_t change = usage - _charged.exchange(usage);
+        if (change != 0)
+        {
+            FITSMemoryBudget::global()->charge(_budgetId, change);
+        }
+    }
+
+    // Takes an empty slot near hash's home for writing, or -1 if hash is
+    // already there or the neighbourhood is full of entries in use.
+    int FITSSharedCache::claimSlot(uint64_t hash)
+    {
+        for (int probe = 0; probe < g_maxProbe; probe++)
+        {
+            if (_index->slots[(hash + probe) % g_slots].hash.load() == hash)
+            {
+                return -1;
+            }
+        }
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int probe = 0; probe < g_maxProbe; probe++)
+            {
+                const int i = (int)((hash + probe) % g_slots);
+                Slot &slot = _index->slots[i];
+
+                uint32_t expected = SS_EMPTY;
+                if (pass == 0)
+                {
+                    if (!slot.state.compare_exchange_strong(expected, SS_WRITING))
+                    {
+                        continue;
+                    }
+                }
+                else
+                {
+                    // Second pass: reclaim an unreferenced entry, or one
+                    // whose writer died.
+                    const uint32_t state = slot.state.load();
+                    int64_t lastUse = slot.lastUse.load();
+                    if ((state == SS_READY) && (getLiveHolders(i) == 0))
+                    {
+                        expected = SS_READY;
+                        if (!slot.state.compare_exchange_strong(expected, SS_WRITING))
+                        {
+                            continue;
+                        }
+                        if (slot.holders.load() != 0)
+                        {
+                            slot.state.store(SS_READY);
+                            continue;
+                        }
+                    }
+                    else if ((state != SS_WRITING) || (nowMs() - lastUse < g_staleWriteMs) ||
+                             !slot.lastUse.compare_exchange_strong(lastUse, nowMs()))
+                    {
+                        continue;
+                    }
+
+                    shm_unlink(segmentName(i, slot.generation.load()).c_str());
+                    _index->usage.fetch_sub(slot.bytes.load());
+                    slot.bytes.store(0);
+                }
+
+                slot.generation.fetch_add(1);
+                slot.hash.store(hash);
+                slot.lastUse.store(nowMs());
+
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    FITSSharedCache::Block::Block()
+        : _mapping(0),
+          _mappingSize(0),
+          _meta(0),
+          _metaSize(0),
+          _data(0),
+          _dataSize(0),
+          _cache(0),
+          _slot(-1)
+    {
+    }
+
+    FITSSharedCache::Block::~Block()
+    {
+        munmap(_mapping, _mappingSize);
+        if (_cache != 0)
+        {
+            _cache->release(_slot);
+        }
+    }
+
+    const void *FITSSharedCache::Block::getMeta() const
+    {
+        return _meta;
+    }
+
+    size_t FITSSharedCache::Block::getMetaSize() const
+    {
+        return _metaSize;
+    }
+
+    const void *FITSSharedCache::Block::getData() const
+    {
+        return _data;
+    }
+
+    size_t FITSSharedCache::Block::getDataSize() const
+    {
+        return _dataSize;
+    }
+
+}
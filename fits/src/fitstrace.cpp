@@ -0,0 +1,176 @@
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include "fitstrace.h"
+
+namespace
+{
+
+    struct Span
+    {
+        // Even when the slot is stable, odd while it is being written.
+        std::atomic<uint64_t> sequence;
+        const char *name;
+        int64_t start;
+        int64_t end;
+    };
+
+    // One per thread that has ever recorded a span. Buffers are never
+    // freed: threads come from pools and are few, and a dump may be
+    // reading a buffer whose thread has gone.
+    struct ThreadBuffer
+    {
+        static const uint64_t g_capacity = 16384;
+
+        int threadId;
+        std::atomic<uint64_t> head;
+        Span spans[g_capacity];
+        ThreadBuffer *next;
+    };
+
+    std::atomic<ThreadBuffer *> g_buffers(0);
+    std::atomic<int> g_nextThreadId(1);
+
+    // Buffers that were cleared keep their memory; spans before the
+    // clear point are simply ignored.
+    std::atomic<int64_t> g_clearedAt(0);
+
+    ThreadBuffer *threadBuffer()
+    {
+        static thread_local ThreadBuffer *buffer = 0;
+        if (buffer == 0)
+        {
+            buffer = new ThreadBuffer();
+            buffer->threadId = g_nextThreadId++;
+            buffer->head = 0;
+            for (uint64_t i = 0; i < ThreadBuffer::g_capacity; i++)
+            {
+                buffer->spans[i].sequence = 0;
+            }
+
+            ThreadBuffer *head = g_buffers.load();
+            do
+            {
+                buffer->next = head;
+            } while (!g_buffers.compare_exchange_weak(head, buffer));
+        }
+
+        return buffer;
+    }
+
+    void writeEscaped(FILE *file,
+                      const char *text)
+    {
+        for (const char *c = text; *c != 0; c++)
+        {
+            if ((*c == '"') || (*c == '\\'))
+            {
+                fputc('\\', file);
+            }
+            fputc(*c, file);
+        }
+    }
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    std::atomic<bool> FITSTrace::g_enabled(false);
+
+    /* static */
+    void FITSTrace::setEnabled(bool enabled)
+    {
+        g_enabled = enabled;
+    }
+
+    /* static */
+    int64_t FITSTrace::now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /* static */
+    void FITSTrace::record(const char *name,
+                           int64_t start,
+                           int64_t end)
+    {
+        ThreadBuffer *buffer = threadBuffer();
+
+        // Only this thread writes here, so a plain load is enough.
+        const uint64_t index = buffer->head.load(std::memory_order_relaxed);
+        Span &span = buffer->spans[index % ThreadBuffer::g_capacity];
+
+        const uint64_t sequence = span.sequence.load(std::memory_order_relaxed);
+        span.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        span.name = name;
+        span.start = start;
+        span.end = end;
+        span.sequence.store(sequence + 2, std::memory_order_release);
+
+        buffer->head.store(index + 1, std::memory_order_release);
+    }
+
+    /* static */
+    bool FITSTrace::writeChromeTrace(const char *filename)
+    {
+        FILE *file = fopen(filename, "w");
+        if (file == 0)
+        {
+            return false;
+        }
+
+        const int64_t clearedAt = g_clearedAt.load();
+        const char *separator = "";
+
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        for (ThreadBuffer *buffer = g_buffers.load(); buffer != 0; buffer = buffer->next)
+        {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                          "\"args\":{\"name\":\"thread %d\"}}",
+                    separator, buffer->threadId, buffer->threadId);
+            separator = ",";
+
+            const uint64_t head = buffer->head.load(std::memory_order_acquire);
+            const uint64_t count = head < ThreadBuffer::g_capacity ? head : ThreadBuffer::g_capacity;
+            for (uint64_t i = head - count; i < head; i++)
+            {
+                Span &slot = buffer->spans[i % ThreadBuffer::g_capacity];
+
+                // Seqlock read: retry-free, a slot that changed under us
+                // is skipped.
+                const uint64_t before = slot.sequence.load(std::memory_order_acquire);
+                const char *name = slot.name;
+                const int64_t start = slot.start;
+                const int64_t end = slot.end;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                const uint64_t after = slot.sequence.load(std::memory_order_relaxed);
+                if ((before != after) || ((before & 1) != 0) || (name == 0) || (start < clearedAt))
+                {
+                    continue;
+                }
+
+                fprintf(file, ",\n{\"name\":\"");
+                writeEscaped(file, name);
+                fprintf(file, "\",\"cat\":\"qtfits\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                              "\"ts\":%.3f,\"dur\":%.3f}",
+                        buffer->threadId, start / 1000.0, (end - start) / 1000.0);
+            }
+        }
+        fprintf(file, "\n]}\n");
+
+        return fclose(file) == 0;
+    }
+
+    /* static */
+    void FITSTrace::clear()
+    {
+        g_clearedAt = now();
+    }
+
+}
@@ -0,0 +1,146 @@
+#ifndef COMPAREWIDGET_H
+#define COMPAREWIDGET_H
+
+#include <QWidget>
+#include <QFutureWatcher>
+#include <QImage>
+#include <QPoint>
+#include <QPointF>
+#include <QRectF>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+#include <vector>
+
+#include "fitsimage.h"
+
+// Shows several frames at the same zoom, pan and stretch, either
+// blinking between them or two side by side, for spotting satellites,
+// cloud and focus drift. Every frame is rendered once for the current
+// scale, all with the first frame's stretch, so a blink only changes
+// which render is drawn.
+class CompareWidget : public QWidget
+{
+    Q_OBJECT
+
+public:
+    enum CompareMode
+    {
+        CM_BLINK,
+        CM_SIDE_BY_SIDE
+    };
+
+public:
+    explicit CompareWidget(QWidget *parent = nullptr);
+    virtual ~CompareWidget();
+
+    QSize sizeHint() const override;
+    QSize minimumSizeHint() const override;
+
+    int getFrameCount() const;
+    int getCurrent() const;
+    CompareMode getMode() const;
+    int getBlinkRate() const;
+    bool isBlinking() const;
+
+public slots:
+    // Loads files in the background, replacing the frames held.
+    void setFiles(const QStringList &files);
+    void clear();
+    void setMode(CompareMode mode);
+    // Frames per second.
+    void setBlinkRate(int hz);
+    void setBlinking(bool blinking);
+    void setStretched(bool isStretched);
+    // In side-by-side mode the first frame is always on the left and
+    // the current one on the right.
+    void setCurrent(int index);
+    void step(int delta);
+
+signals:
+    void framesLoaded(int count);
+    void currentChanged(int index,
+                        const QString &filename);
+    void loadFailed(const QString &filename,
+                    const QString &errText);
+
+protected:
+    struct LoadResult
+    {
+        std::vector<ELS::FITSImage *> frames;
+        QStringList files;
+        QStringList failed;
+        QStringList errors;
+    };
+
+    struct RenderResult
+    {
+        int generation;
+        int sampling;
+        bool stretched;
+        std::vector<QImage *> renders;
+    };
+
+    static LoadResult loadFiles(const QStringList &files);
+    void startLoad(const QStringList &files);
+    void loadFinished();
+
+    static RenderResult renderFrames(const std::vector<const ELS::FITSImage *> &frames,
+                                     int generation,
+                                     bool stretched,
+                                     int sampling);
+    void requestRender();
+    void renderFinished();
+
+    void waitForRender();
+    void deleteFrames();
+    static void deleteRenders(std::vector<QImage *> &renders);
+
+    virtual void paintEvent(QPaintEvent *event) override;
+    virtual void resizeEvent(QResizeEvent *event) override;
+    virtual void wheelEvent(QWheelEvent *event) override;
+    virtual void mousePressEvent(QMouseEvent *event) override;
+    virtual void mouseMoveEvent(QMouseEvent *event) override;
+    virtual void keyPressEvent(QKeyEvent *event) override;
+
+    void paintFrame(QPainter &painter,
+                    const QRect &pane,
+                    int index) const;
+
+    QSize paneSize() const;
+    // Screen pixels per image pixel.
+    float getScale() const;
+    float getFitScale() const;
+    int wantedSampling() const;
+    // The part of the image, in image pixels, a pane of size shows.
+    QRectF viewRect(const QSize &size) const;
+
+private:
+    std::vector<ELS::FITSImage *> _frames;
+    QStringList _files;
+    int _generation;
+    std::vector<QImage *> _renders;
+    int _renderSampling;
+    bool _renderStretched;
+    bool _showStretched;
+    CompareMode _mode;
+    int _current;
+    float _zoom;
+    QPointF _center;
+    QPoint _dragStart;
+    QPointF _dragCenter;
+    QTimer _blinkTimer;
+    int _blinkRate;
+    QFutureWatcher<LoadResult> _loadWatcher;
+    bool _loadPending;
+    bool _haveQueued;
+    QStringList _queuedFiles;
+    QFutureWatcher<RenderResult> _renderWatcher;
+    bool _renderPending;
+    bool _renderAgain;
+
+private:
+    static const float g_maxZoom;
+};
+
+#endif // COMPAREWIDGET_H
@@ -0,0 +1,85 @@
+#ifndef FITSRENDER_H
+#define FITSRENDER_H
+
+#include <QImage>
+
+#include "backgroundmodel.h"
+#include "fitsimage.h"
+#include "fitssharedcache.h"
+#include "stretch.h"
+
+// Turns a FITSImage into something displayable. Needs QImage but no
+// widgets, so it serves the viewer and the headless tools alike.
+class FITSRender
+{
+public:
+    // The cfitsio datatype code the stretch expects for bitDepth.
+    static int getFITSIODataType(ELS::FITSImage::BitDepth bitDepth);
+
+    // A Grayscale8 (mono) or ARGB32 (colour) image whose pixels come
+    // from the buffer pool and go back to it when the image is deleted.
+    static QImage *createImage(int width,
+                               int height,
+                               bool isColor);
+
+    // Renders image into a new Grayscale8 (mono) or ARGB32 (colour)
+    // QImage. When stretched is set the auto-stretch parameters are
+    // computed, otherwise the data is shown linearly. The parameters
+    // used are returned through params if it is not null. Sampling
+    // renders every sampling'th pixel, as Stretch::run does. A
+    // background model fitted to image, if given, is taken out as the
+    // pixels are stretched (see Stretch::setBackground()).
+    static QImage *render(const ELS::FITSImage *image,
+                          bool stretched,
+                          StretchParams *params = 0,
+                          int sampling = 1,
+                          const ELS::BackgroundModel *background = 0);
+
+    // As above, stretched with params already known (from a previous
+    // render or a cache) rather than computed again.
+    static QImage *render(const ELS::FITSImage *image,
+                          const StretchParams &params,
+                          int sampling = 1,
+                          const ELS::BackgroundModel *background = 0);
+
+    // Just region of image (clipped to it), stretched with params as a
+    // render of the whole image would be. Touches only the region's
+    // pixels, plus a small sample of the image's.
+    static QImage *renderRegion(const ELS::FITSImage *image,
+                                const ELS::FITSImage::Region &region,
+                                const StretchParams &params,
+                                const ELS::BackgroundModel *background = 0);
+
+    // Just the auto-stretch parameters for image, without rendering it,
+    // so that parts of it can be rendered alike.
+    static StretchParams computeParams(const ELS::FITSImage *image,
+                                       const ELS::BackgroundModel *background = 0);
+
+    // Parameters showing low..high, in the image's own units, linearly
+    // across the full output range; for signed data such as the result
+    // of ELS::FrameMath, where the auto-stretch makes no sense.
+    static StretchParams linearParams(const ELS::FITSImage *image,
+                                      float low,
+                                      float high);
+
+    // A rendered image kept in shared memory under key, mapped read-only,
+    // or null if there is none.
+    static QImage *attachShared(ELS::FITSSharedCache *cache,
+                                const std::string &key);
+
+    // Moves image into shared memory under key, deleting it, and
+    // returns the shared copy; returns image itself if that fails.
+    static QImage *publishShared(ELS::FITSSharedCache *cache,
+                                 const std::string &key,
+                                 QImage *image);
+
+private:
+    static QImage *renderImage(const ELS::FITSImage *image,
+                               bool stretched,
+                               const StretchParams *knownParams,
+                               StretchParams *params,
+                               int sampling,
+                               const ELS::BackgroundModel *background);
+};
+
+#endif // FITSRENDER_H
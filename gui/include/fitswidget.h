@@ -3,10 +3,31 @@
 
 #include <QWidget>
 #include <QWheelEvent>
+#include <QMouseEvent>
 #include <QString>
+#include <QFutureWatcher>
+#include <QList>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <inttypes.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <fitsio.h>
 
 #include "fitsimage.h"
+#include "backgroundmodel.h"
+#include "debayer.h"
+#include "executor.h"
+#include "starfinder.h"
+#include "framecache.h"
+#include "framemath.h"
+#include "regionstatistics.h"
+#include "previewcache.h"
+#include "fitssharedcache.h"
 
 class FITSWidget : public QWidget
 {
@@ -31,8 +52,48 @@ public:
         double minPixelVal;
     };
 
+    // Centre-and-corners inspection: patches of the image at 1:1 laid
+    // out 3x3, or just the corners and centre.
+    enum MosaicMode
+    {
+        MM_OFF,
+        MM_NINE,
+        MM_FIVE
+    };
+
+    // What is under the cursor, in the image's native units. Box
+    // statistics are over the aperture centred there, once the tables
+    // for them are built (in the background after each load).
+    struct Readout
+    {
+        int x;
+        int y;
+        int channels;
+        double value[3];
+        bool haveBox;
+        ELS::RegionStatistics::Box box[3];
+    };
+
+    // What is shown against the reference frame, if one is set.
+    enum DiffView
+    {
+        DV_OFF,
+        DV_DIFFERENCE,
+        DV_RATIO
+    };
+
+    // How the sky background gradient is taken out of the image shown
+    // (see ELS::BackgroundModel).
+    enum BackgroundMode
+    {
+        BG_OFF,
+        BG_SUBTRACT,
+        BG_DIVIDE
+    };
+
 public:
     explicit FITSWidget(QWidget *parent = nullptr);
+    virtual ~FITSWidget();
 
     QSize sizeHint() const override;
     QSize minimumSizeHint() const override;
@@ -42,24 +103,229 @@ public:
     const char *getFilename() const;
     bool getStretched() const;
     float getZoom() const;
+    bool isDebayered() const;
+    ELS::Debayer::Mode getDebayerMode() const;
+    int getBinning() const;
+    ELS::FITSImage::BinMode getBinMode() const;
+    bool getCosmeticCorrection() const;
+    BackgroundMode getBackgroundMode() const;
+    bool getShowStars() const;
+    const ELS::StarAnalysis &getStarAnalysis() const;
+
+    // Planes of the file shown, counted through every image HDU and
+    // every plane of each cube in turn.
+    int getPlaneCount() const;
+    int getPlane() const;
+
+    MosaicMode getMosaicMode() const;
+    int getMosaicPatchSize() const;
+
+    int getAperture() const;
+    int getLoupe() const;
+
+    DiffView getDiffView() const;
+    const char *getReferenceFilename() const;
+    bool hasReference() const;
+
+    // Frames switched away from are kept compressed in cache, and read
+    // back from it instead of the disk. Null (the default) disables
+    // this; the cache must outlive the widget.
+    void setFrameCache(ELS::FrameCache *cache);
+
+    // Files are loaded in the background. With a preview cache set, a
+    // cached preview is shown meanwhile, and previews are added for
+    // files that had none. Null (the default) disables this.
+    void setPreviewCache(PreviewCache *cache);
+
+    // Rasters and renders are shared with other viewer processes through
+    // cache, and taken from it when another process already has them.
+    // Null (the default) disables this.
+    void setSharedCache(ELS::FITSSharedCache *cache);
 
 public slots:
     void setFile(const char *filename);
+    // Only the plane is read, in the background. With a frame cache
+    // set, the planes either side are read ahead into it.
+    void setPlane(int plane);
+    // Frames are binned factor pixels square as they are read (1, the
+    // default, for none); the frame shown, and the reference, are read
+    // again. Bayered frames come out mono.
+    void setBinning(int factor,
+                    ELS::FITSImage::BinMode mode = ELS::FITSImage::BM_AVERAGE);
     void setStretched(bool isStretched);
     void setZoom(float zoom);
+    void setDebayerMode(ELS::Debayer::Mode mode);
+    // Hot and cold pixels are replaced by their neighbourhood median
+    // (see ELS::CosmeticCorrection), before debayering.
+    void setCosmeticCorrection(bool isCorrected);
+    // The background is modelled in the background for each frame, and
+    // taken out as it is stretched once ready; the pixels are left as
+    // read.
+    void setBackgroundMode(BackgroundMode mode);
+    void setShowStars(bool showStars);
+    void setMosaicMode(MosaicMode mode);
+    // Patch width and height in image pixels; default 256.
+    void setMosaicPatchSize(int size);
+    // Side of the square the cursor statistics cover; default 15.
+    void setAperture(int size);
+    // Magnification of the loupe that follows the cursor, 4 to 16, or
+    // 0 (the default) for none. It is rendered from the raw pixels
+    // under it alone, never from the whole image.
+    void setLoupe(int magnification);
+    // The frame the diff view compares against, read in the background
+    // and debayered like the frame shown. It must match it in size.
+    void setReference(const char *filename);
+    void clearReference();
+    // The image shown minus (or divided by) the reference. Only the
+    // tiles on screen are computed, and only again once they change.
+    void setDiffView(DiffView view);
+    // The reference pixel compared with image pixel (x, y) is
+    // (x + dx, y + dy).
+    void setReferenceOffset(int dx,
+                            int dy);
 
 signals:
     void fileChanged(const char *filename);
+    void planeChanged(int plane);
     void fileFailed(const char *filename,
                     const char *errText);
+    void referenceChanged(const char *filename);
     void zoomChanged(float zoom);
     void actualZoomChanged(float zoom);
+    void starsAnalyzed(const ELS::StarAnalysis &analysis);
+    void cursorReadout(const FITSWidget::Readout &readout);
+    void cursorLeft();
+    // Time from setFile to the image, or a preview of it, being drawn.
+    void firstPixelShown(float ms);
 
 protected:
+    struct LoadResult
+    {
+        ELS::FITSImage *fits;
+        ELS::FITSImage *cfa;
+        // The frame as read, when fits (or cfa) is it corrected.
+        ELS::FITSImage *uncorrected;
+        ELS::Debayer::Mode debayerMode;
+        // Background noise, in native units, when known; 0 if not.
+        float noise;
+        bool haveParams;
+        StretchParams params;
+        bool listed;
+        std::vector<ELS::FITSImage::ImageHDU> images;
+        std::string errText;
+    };
+
+    struct ReferenceResult
+    {
+        std::string filename;
+        ELS::FITSImage *fits;
+        ELS::FITSImage *cfa;
+        ELS::Debayer::Mode debayerMode;
+        int binning;
+        ELS::FITSImage::BinMode binMode;
+        std::string errText;
+    };
+
+    // Tiles of the diff view computed off the GUI thread, and its range
+    // if that was wanted.
+    struct DiffResult
+    {
+        int generation;
+        std::vector<ELS::FITSImage::Region> regions;
+        bool haveRange;
+        float low;
+        float high;
+        bool failed;
+        std::string errText;
+    };
+
+    static LoadResult loadFile(const std::string &filename,
+                               const std::string &frameKey,
+                               int hdu,
+                               int plane,
+                               int binning,
+                               ELS::FITSImage::BinMode binMode,
+                               bool listImages,
+                               const ELS::Executor::Job &prefetch,
+                               ELS::FrameCache *frameCache,
+                               ELS::FITSSharedCache *sharedCache,
+                               ELS::Debayer::Mode debayerMode,
+                               bool cosmetic,
+                               PreviewCache *previewCache,
+                               const PreviewCache::Entry &preview);
+    void loadFinished();
+    // Without a cached preview, one is read decimated alongside the
+    // full load, to have something on screen sooner.
+    static PreviewCache::Entry quickPreview(const std::string &filename,
+                                            ELS::Debayer::Mode debayerMode);
+    void quickPreviewFinished();
+    void abandonLoad();
+    void loadPlane(int plane,
+                   int hdu,
+                   int hduPlane);
+    void prefetchAround(int plane);
+    bool findPlane(int index,
+                   int *hdu,
+                   int *plane) const;
+    void discardLoad(QFutureWatcher<LoadResult> *watcher);
+    ELS::FITSImage *getRawImage() const;
+    const ELS::BackgroundModel *getBackgroundModel();
+    void startBackgroundFit();
+    void cancelBackgroundFit();
+    void backgroundFitFinished();
+
+    static ReferenceResult loadReference(const std::string &filename,
+                                         ELS::Debayer::Mode debayerMode,
+                                         int binning,
+                                         ELS::FITSImage::BinMode binMode);
+    void referenceFinished();
+    void abandonReference();
+    void discardReference(QFutureWatcher<ReferenceResult> *watcher);
+    void deleteReference();
+    bool isDiffShown() const;
+    void invalidateDiff();
+    void startDifference(const QRect &source);
+    void differenceFinished();
+    void waitForDifference();
+
     virtual void wheelEvent(QWheelEvent *event) override;
     virtual void paintEvent(QPaintEvent *event) override;
+    virtual void mouseMoveEvent(QMouseEvent *event) override;
+    virtual void leaveEvent(QEvent *event) override;
+
+    QImage *convertImage();
+    QImage *buildMosaic();
+    void paintMosaic(QPainter &painter);
+    void discardRenders();
+
+    void startRegionStatistics();
+    void cancelRegionStatistics();
+    void emitReadout();
+    QRect loupeFrame() const;
+    void paintLoupe(QPainter &painter);
+
+    // A star analysis under way, shared with its job. Disposing of its
+    // image, should the widget be done with it first, waits for the
+    // job to end.
+    struct StarJob
+    {
+        ELS::CancelToken token;
+        const ELS::FITSImage *image;
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool running;
+        std::function<void()> dispose;
+    };
 
-    QImage *convertImage() const;
+    void startStarAnalysis();
+    void cancelStarAnalysis();
+    void starAnalysisFinished();
+    void retireImage(ELS::FITSImage *image,
+                     const std::function<void()> &dispose);
+    void deleteImage(ELS::FITSImage *image);
+    void paintStars(QPainter &painter,
+                    const QRect &target,
+                    const QRect &source) const;
 
 protected:
     enum ZoomAdjustStrategy
@@ -76,15 +342,88 @@ protected:
 
 private:
     QSizePolicy _sizePolicy;
-    const char *_filename;
+    std::string _filename;
     ELS::FITSImage *_fits;
+    ELS::FITSImage *_cfaFits;
+    ELS::Debayer::Mode _debayerMode;
+    int _binning;
+    ELS::FITSImage::BinMode _binMode;
+    bool _cosmetic;
+    ELS::FITSImage *_uncorrected;
+    float _noise;
+    BackgroundMode _backgroundMode;
+    ELS::BackgroundModel _background;
+    bool _backgroundFitted;
+    QFutureWatcher<void> _backgroundWatcher;
+    ELS::CancelToken _backgroundCancel;
     QImage *_cacheImage;
     bool _showStretched;
     float _zoom;
     float _actualZoom;
+    bool _showStars;
+    bool _starsStarted;
+    ELS::StarAnalysis _stars;
+    QFutureWatcher<ELS::StarAnalysis> _starWatcher;
+    std::shared_ptr<StarJob> _starJob;
+    int64_t _openStarted;
+    ELS::FrameCache *_frameCache;
+    std::string _frameKey;
+    PreviewCache *_previewCache;
+    ELS::FITSSharedCache *_sharedCache;
+    PreviewCache::Entry _preview;
+    bool _haveParams;
+    StretchParams _params;
+    std::string _pendingFile;
+    std::string _pendingKey;
+    bool _loadPending;
+    QFutureWatcher<LoadResult> _loadWatcher;
+    QList<QFutureWatcher<LoadResult> *> _staleLoads;
+    QFutureWatcher<PreviewCache::Entry> _quickWatcher;
+    std::string _quickFile;
+    std::vector<ELS::FITSImage::ImageHDU> _images;
+    int _plane;
+    int _pendingPlane;
+    std::map<std::string, ELS::Executor::Job> _prefetch;
+    MosaicMode _mosaicMode;
+    int _mosaicPatch;
+    QImage *_mosaicImage;
+    DiffView _diffView;
+    std::string _referenceFile;
+    ELS::FITSImage *_reference;
+    ELS::FITSImage *_referenceCfa;
+    QFutureWatcher<ReferenceResult> _referenceWatcher;
+    QList<QFutureWatcher<ReferenceResult> *> _staleReferences;
+    bool _referencePending;
+    int _referenceDx;
+    int _referenceDy;
+    ELS::FITSImage *_diffFits;
+    bool _diffFailed;
+    std::vector<bool> _diffDirty;
+    bool _haveDiffRange;
+    float _diffLow;
+    float _diffHigh;
+    QFutureWatcher<DiffResult> _diffWatcher;
+    // Bumped whenever computed tiles go out of date.
+    int _diffGeneration;
+    ELS::RegionStatistics _regionStats;
+    ELS::Executor::Job _regionJob;
+    int _aperture;
+    QRect _lastTarget;
+    QRect _lastSource;
+    // Image pixel under the cursor, x -1 if none.
+    QPoint _cursor;
+    QPoint _mousePos;
+    int _loupe;
+    QImage *_loupeImage;
+    QPoint _loupeCenter;
+    QRect _loupeSource;
 
 private:
     static const float g_validZooms[];
+    // Width and height of the diff view's tiles, in image pixels.
+    static const int g_diffTile;
+    // Screen pixels the loupe spans, roughly.
+    static const int g_loupeSize;
 };
 
 #endif // FITSWIDGET_H
@@ -6,8 +6,19 @@
 #include <QHBoxLayout>
 #include <QLabel>
 #include <QPushButton>
+#include <QComboBox>
+#include <QSlider>
+#include <QSpinBox>
+#include <QStackedWidget>
+#include <QDockWidget>
+#include <QAction>
+#include <QListWidget>
+#include <QStringList>
 
 #include "fitswidget.h"
+#include "comparewidget.h"
+#include "memorypanel.h"
+#include "framecache.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui
@@ -24,31 +35,87 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // When the process started (FITSTrace::now()), to report the time
+    // from launch to the first frame on screen.
+    void setLaunchStarted(int64_t started);
+
+public slots:
+    // Adds files to the browse list and shows the first of them.
+    void openFiles(const QStringList &files);
+
 signals:
     void toggleStretched(bool showStretched);
 
 private:
     void fitsFileChanged(const char *filename);
+    void fitsPlaneChanged(int plane);
     void fitsFileFailed(const char *filename,
                         const char *errText);
     void fitsZoomChanged(float zoom);
+    void fitsFirstPixelShown(float ms);
+    void fitsReferenceChanged(const char *filename);
+    void fitsCursorReadout(const FITSWidget::Readout &readout);
+    void fitsCursorLeft();
 
     void stretchToggled(bool isChecked);
+    void debayerModeChanged(int index);
+    void starsToggled(bool isChecked);
 
     void zoomFitClicked(bool isChecked);
     void zoom100Clicked(bool isChecked);
+    void mosaicModeChanged(int index);
+    void mosaicPatchChanged(int index);
+    void binningChanged(int index);
+    void backgroundChanged(int index);
+    void referenceClicked(bool isChecked);
+    void diffViewChanged(int index);
+    void loupeChanged(int index);
+    void compareToggled(bool isChecked);
+    void compareModeChanged(int index);
+    void compareCurrentChanged(int index,
+                               const QString &filename);
+    void memoryPanelToggled(bool isChecked);
+    void fileListRowChanged(int row);
+    void finishStartup();
 
 private:
+    ELS::FrameCache frameCache;
     QWidget mainPane;
     QVBoxLayout layout;
+    QStackedWidget viewStack;
     FITSWidget fitsWidget;
+    CompareWidget compareWidget;
     QIcon onIcon;
     QIcon offIcon;
     QHBoxLayout bottomLayout;
     QPushButton stretchBtn;
     bool showingStretched;
+    QComboBox debayerCombo;
+    QComboBox binCombo;
+    QComboBox binModeCombo;
+    QPushButton starsBtn;
+    QPushButton cosmeticBtn;
+    QComboBox backgroundCombo;
+    QSlider planeSlider;
+    QLabel planeLabel;
     QLabel currentZoom;
     QPushButton zoomFitBtn;
     QPushButton zoom100Btn;
+    QComboBox mosaicCombo;
+    QComboBox patchCombo;
+    QPushButton referenceBtn;
+    QComboBox diffCombo;
+    QSpinBox apertureSpin;
+    QComboBox loupeCombo;
+    QLabel readoutLabel;
+    QPushButton compareBtn;
+    QComboBox compareModeCombo;
+    QSpinBox blinkRateSpin;
+    QDockWidget filesDock;
+    QListWidget fileList;
+    QDockWidget memoryDock;
+    MemoryPanel memoryPanel;
+    QAction memoryAction;
+    int64_t launchStarted;
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,43 @@
+#ifndef MEMORYPANEL_H
+#define MEMORYPANEL_H
+
+#include <QWidget>
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <QLabel>
+#include <QProgressBar>
+#include <QSpinBox>
+#include <QTableWidget>
+#include <QTimer>
+
+// Debug view of the memory budget: usage per consumer and category,
+// buffer pool hit rate, and the budget itself, which can be changed
+// here. Refreshes itself while visible.
+class MemoryPanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit MemoryPanel(QWidget *parent = nullptr);
+
+protected:
+    virtual void showEvent(QShowEvent *event) override;
+    virtual void hideEvent(QHideEvent *event) override;
+
+private:
+    void refresh();
+    void budgetChanged(int budgetMB);
+
+private:
+    QVBoxLayout layout;
+    QLabel totalLabel;
+    QProgressBar usageBar;
+    QTableWidget consumerTable;
+    QLabel poolLabel;
+    QHBoxLayout budgetLayout;
+    QLabel budgetLabel;
+    QSpinBox budgetSpin;
+    QTimer refreshTimer;
+};
+
+#endif // MEMORYPANEL_H
@@ -0,0 +1,77 @@
+#ifndef PREVIEWCACHE_H
+#define PREVIEWCACHE_H
+
+#include <inttypes.h>
+#include <QImage>
+#include <QString>
+
+#include "stretch.h"
+
+// Persistent cache of what it takes to show a file quickly: a small
+// stretched preview, the channel statistics and the auto-stretch
+// parameters. Entries are keyed by path and validated against the
+// file's size, modification time and a hash of its header, so a file
+// that changed is simply a miss.
+//
+// Lookups go through a fixed-size, open-addressed index file, so they
+// cost one record read whatever the cache holds. Previews live beside
+// it as PNGs named after their key. The index keeps their total size,
+// and past the capacity the least recently used are dropped. Safe to
+// share between processes.
+class PreviewCache
+{
+public:
+    struct Entry
+    {
+        QImage preview;
+        int width;
+        int height;
+        float background;
+        float noise;
+        float minimum;
+        float maximum;
+        StretchParams params;
+    };
+
+public:
+    // The user's cache directory (XDG_CACHE_HOME on Linux), holding
+    // QTFITS_PREVIEW_CACHE_MB if that is set.
+    static PreviewCache *global();
+
+    explicit PreviewCache(const QString &directory);
+
+    // Longest side of the stored previews.
+    static int getPreviewSize();
+
+    // Most bytes of previews kept on disk; 256 MB by default.
+    void setCapacity(qint64 bytes);
+    qint64 getCapacity() const;
+
+    bool lookup(const QString &filename,
+                Entry *entry) const;
+    void store(const QString &filename,
+               const Entry &entry);
+
+private:
+    struct Identity
+    {
+        uint64_t key;
+        int64_t size;
+        int64_t mtime;
+        uint64_t headerHash;
+    };
+
+    static bool identify(const QString &filename,
+                         Identity *identity);
+    QString previewPath(uint64_t key) const;
+    bool openIndex(class QFile *index) const;
+    void trim(class QFile *index,
+              int64_t *totalBytes) const;
+    void prune(class QFile *index) const;
+
+private:
+    QString _directory;
+    qint64 _capacity;
+};
+
+#endif // PREVIEWCACHE_H
@@ -0,0 +1,39 @@
+#ifndef SINGLEINSTANCE_H
+#define SINGLEINSTANCE_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QStringList>
+
+// Lets a new invocation of the viewer hand its files to one that is
+// already running, over a per-user local socket, instead of starting
+// another.
+class SingleInstance : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Sends files to the running viewer. False if there is none. Needs
+    // only a QCoreApplication, so it can run before the GUI starts up.
+    static bool forward(const QStringList &files);
+
+    explicit SingleInstance(QObject *parent = nullptr);
+
+    // Starts taking files from later invocations. False if it can't,
+    // including when another viewer is already listening.
+    bool listen();
+
+signals:
+    // Possibly empty: the viewer was started again without files.
+    void filesReceived(const QStringList &files);
+
+private:
+    static QString serverName();
+
+    void newConnection();
+
+private:
+    QLocalServer _server;
+};
+
+#endif // SINGLEINSTANCE_H
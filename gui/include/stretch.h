@@ -11,6 +11,8 @@
 #include <memory>
 #include <QImage>
 
+#include "backgroundmodel.h"
+
 struct StretchParams1Channel
 {
   // Stretch algorithm parameters
@@ -83,6 +85,27 @@ class Stretch
          */
         void run(uint8_t const *input, QImage *output_image, int sampling=1);
 
+        /**
+         * @brief getInputRange Returns the input range the image is stretched over.
+         * Parameters are fractions of this less one (or of 1 if it is 1).
+         * @param input the raw data buffer, which decides it for float and double types.
+         */
+        int64_t getInputRange(const uint8_t *input);
+
+        /**
+         * @brief setInputRange Fixes the input range rather than deciding it from the data,
+         * for rendering part of an image the same as the whole (see getInputRange()).
+         */
+        void setInputRange(int64_t range);
+
+        /**
+         * @brief setBackground Corrects each pixel by model, subtracting or dividing it
+         * out as the pixel is stretched, and computes parameters on the corrected data.
+         * @param model a model fitted to the whole image, or null for none; not copied.
+         * @param originX, originY where the buffer starts in the image the model was fitted to.
+         */
+        void setBackground(const ELS::BackgroundModel *model, int originX = 0, int originY = 0);
+
  private:
         // Adjusts input_range for float and double types.
         void recalculateInputRange(const uint8_t *input);
@@ -91,8 +114,12 @@ class Stretch
         int image_width;
         int image_height;
         int image_channels;
-        int input_range;
+        int64_t input_range;
+        bool input_range_fixed;
         int dataType;
+        const ELS::BackgroundModel *background;
+        int background_x;
+        int background_y;
   
         // Parameters.
         StretchParams params;
@@ -0,0 +1,17 @@
+# Rendering of FITS data into QImages, shared by the viewer and the
+# command-line tools. Needs QtGui but nothing from QtWidgets.
+
+QT += gui concurrent
+
+INCLUDEPATH += \
+    $$PWD/include
+
+SOURCES += \
+    $$PWD/src/fitsrender.cpp \
+    $$PWD/src/previewcache.cpp \
+    $$PWD/src/stretch.cpp
+
+HEADERS += \
+    $$PWD/include/fitsrender.h \
+    $$PWD/include/previewcache.h \
+    $$PWD/include/stretch.h
@@ -0,0 +1,635 @@
+#include <QFileInfo>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QPainter>
+#include <QWheelEvent>
+#include <algorithm>
+#include <math.h>
+
+#include "comparewidget.h"
+#include "debayer.h"
+#include "executor.h"
+#include "fitsexception.h"
+#include "fitsrender.h"
+#include "fitstrace.h"
+
+/* static */
+const float CompareWidget::g_maxZoom = 4.0f;
+
+CompareWidget::CompareWidget(QWidget *parent)
+    : QWidget(parent),
+      _frames(),
+      _files(),
+      _generation(0),
+      _renders(),
+      _renderSampling(1),
+      _renderStretched(false),
+      _showStretched(false),
+      _mode(CM_BLINK),
+      _current(0),
+      _zoom(-1.0),
+      _center(),
+      _dragStart(),
+      _dragCenter(),
+      _blinkTimer(),
+      _blinkRate(4),
+      _loadWatcher(),
+      _loadPending(false),
+      _haveQueued(false),
+      _queuedFiles(),
+      _renderWatcher(),
+      _renderPending(false),
+      _renderAgain(false)
+{
+    setBackgroundRole(QPalette::Dark);
+    setAutoFillBackground(true);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+    setFocusPolicy(Qt::StrongFocus);
+
+    _blinkTimer.setInterval(1000 / _blinkRate);
+
+    QObject::connect(&_blinkTimer, &QTimer::timeout,
+                     this, [this]()
+                     { step(1); });
+    QObject::connect(&_loadWatcher, &QFutureWatcher<LoadResult>::finished,
+                     this, &CompareWidget::loadFinished);
+    QObject::connect(&_renderWatcher, &QFutureWatcher<RenderResult>::finished,
+                     this, &CompareWidget::renderFinished);
+}
+
+CompareWidget::~CompareWidget()
+{
+    // Work still running owns what it returns.
+    if (_loadPending)
+    {
+        _loadWatcher.waitForFinished();
+        LoadResult result = _loadWatcher.result();
+        for (ELS::FITSImage *frame : result.frames)
+        {
+            delete frame;
+        }
+    }
+    if (_renderPending)
+    {
+        _renderWatcher.waitForFinished();
+        RenderResult result = _renderWatcher.result();
+        deleteRenders(result.renders);
+    }
+
+    deleteRenders(_renders);
+    deleteFrames();
+}
+
+QSize CompareWidget::sizeHint() const
+{
+    return QSize(800, 600);
+}
+
+QSize CompareWidget::minimumSizeHint() const
+{
+    return QSize(100, 100);
+}
+
+int CompareWidget::getFrameCount() const
+{
+    return (int)_frames.size();
+}
+
+int CompareWidget::getCurrent() const
+{
+    return _current;
+}
+
+CompareWidget::CompareMode CompareWidget::getMode() const
+{
+    return _mode;
+}
+
+int CompareWidget::getBlinkRate() const
+{
+    return _blinkRate;
+}
+
+bool CompareWidget::isBlinking() const
+{
+    return _blinkTimer.isActive();
+}
+
+void CompareWidget::setFiles(const QStringList &files)
+{
+    // One load at a time; the latest request wins.
+    if (_loadPending)
+    {
+        _haveQueued = true;
+        _queuedFiles = files;
+        return;
+    }
+
+    startLoad(files);
+}
+
+void CompareWidget::clear()
+{
+    // A load still running is thrown away when it finishes.
+    _haveQueued = _loadPending;
+    _queuedFiles.clear();
+
+    waitForRender();
+    deleteRenders(_renders);
+    deleteFrames();
+    _files.clear();
+    _current = 0;
+    _generation++;
+
+    update();
+}
+
+void CompareWidget::setMode(CompareMode mode)
+{
+    if (_mode != mode)
+    {
+        _mode = mode;
+
+        // Panes are a different size, so may want another sampling.
+        requestRender();
+        update();
+    }
+}
+
+void CompareWidget::setBlinkRate(int hz)
+{
+    if ((hz > 0) && (_blinkRate != hz))
+    {
+        _blinkRate = hz;
+        _blinkTimer.setInterval(1000 / _blinkRate);
+    }
+}
+
+void CompareWidget::setBlinking(bool blinking)
+{
+    if (blinking)
+    {
+        _blinkTimer.start();
+    }
+    else
+    {
+        _blinkTimer.stop();
+    }
+}
+
+void CompareWidget::setStretched(bool isStretched)
+{
+    if (_showStretched != isStretched)
+    {
+        _showStretched = isStretched;
+
+        requestRender();
+    }
+}
+
+void CompareWidget::setCurrent(int index)
+{
+    if (_frames.empty())
+    {
+        return;
+    }
+
+    const int count = (int)_frames.size();
+    index = ((index % count) + count) % count;
+    if (_current != index)
+    {
+        _current = index;
+        update();
+
+        emit currentChanged(_current, _files[_current]);
+    }
+}
+
+void CompareWidget::step(int delta)
+{
+    // Side by side, the first frame is already on the left.
+    if ((_mode == CM_SIDE_BY_SIDE) && (_frames.size() > 1))
+    {
+        int index = _current + delta;
+        const int count = (int)_frames.size();
+        if (index <= 0)
+        {
+            index = delta > 0 ? 1 : count - 1;
+        }
+        if (index >= count)
+        {
+            index = 1;
+        }
+        setCurrent(index);
+        return;
+    }
+
+    setCurrent(_current + delta);
+}
+
+/* static */
+CompareWidget::LoadResult CompareWidget::loadFiles(const QStringList &files)
+{
+    ELS_TRACE_SCOPE("CompareWidget::loadFiles");
+
+    LoadResult result;
+    for (const QString &file : files)
+    {
+        ELS::FITSImage *image = 0;
+        try
+        {
+            image = ELS::FITSImage::load(file.toLocal8Bit().constData());
+
+            // Compared as they would be viewed.
+            if (image->isBayered())
+            {
+                ELS::FITSImage *debayered = ELS::Debayer::run(image, ELS::Debayer::DM_BILINEAR);
+                delete image;
+                image = debayered;
+            }
+
+            result.frames.push_back(image);
+            result.files.append(file);
+        }
+        catch (ELS::FITSException *e)
+        {
+            delete image;
+            result.failed.append(file);
+            result.errors.append(e->getErrText());
+            delete e;
+        }
+    }
+
+    return result;
+}
+
+void CompareWidget::startLoad(const QStringList &files)
+{
+    _loadPending = true;
+    _loadWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                        { return loadFiles(files); }));
+}
+
+void CompareWidget::loadFinished()
+{
+    _loadPending = false;
+
+    LoadResult result = _loadWatcher.result();
+
+    // Asked for something else meanwhile.
+    if (_haveQueued)
+    {
+        for (ELS::FITSImage *frame : result.frames)
+        {
+            delete frame;
+        }
+
+        _haveQueued = false;
+        if (!_queuedFiles.isEmpty())
+        {
+            startLoad(_queuedFiles);
+            _queuedFiles.clear();
+        }
+        return;
+    }
+
+    for (int i = 0; i < result.failed.size(); i++)
+    {
+        emit loadFailed(result.failed[i], result.errors[i]);
+    }
+
+    waitForRender();
+    deleteRenders(_renders);
+    deleteFrames();
+
+    _frames = result.frames;
+    _files = result.files;
+    _generation++;
+    _current = 0;
+    _zoom = -1.0;
+
+    requestRender();
+    update();
+
+    emit framesLoaded((int)_frames.size());
+    if (!_frames.empty())
+    {
+        emit currentChanged(_current, _files[_current]);
+    }
+}
+
+/* static */
+CompareWidget::RenderResult CompareWidget::renderFrames(const std::vector<const ELS::FITSImage *> &frames,
+                                                        int generation,
+                                                        bool stretched,
+                                                        int sampling)
+{
+    ELS_TRACE_SCOPE("CompareWidget::renderFrames");
+
+    RenderResult result;
+    result.generation = generation;
+    result.sampling = sampling;
+    result.stretched = stretched;
+
+    // One stretch for all, so differences are in the data, not in how
+    // each frame happened to be stretched.
+    StretchParams params;
+    if (stretched && !frames.empty())
+    {
+        params = FITSRender::computeParams(frames[0]);
+    }
+
+    for (const ELS::FITSImage *frame : frames)
+    {
+        result.renders.push_back(stretched ? FITSRender::render(frame, params, sampling)
+                                           : FITSRender::render(frame, false, 0, sampling));
+    }
+
+    return result;
+}
+
+// Renders the frames again if the scale or stretch changed. Renders
+// already held are shown, scaled, until the new ones arrive.
+void CompareWidget::requestRender()
+{
+    if (_frames.empty())
+    {
+        return;
+    }
+
+    const int sampling = wantedSampling();
+    if (!_renders.empty() && (_renderSampling == sampling) && (_renderStretched == _showStretched))
+    {
+        return;
+    }
+
+    if (_renderPending)
+    {
+        _renderAgain = true;
+        return;
+    }
+
+    std::vector<const ELS::FITSImage *> frames(_frames.begin(), _frames.end());
+    const int generation = _generation;
+    const bool stretched = _showStretched;
+    _renderPending = true;
+    _renderAgain = false;
+    _renderWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_INTERACTIVE, [=]()
+                                                          { return renderFrames(frames, generation, stretched, sampling); }));
+}
+
+void CompareWidget::renderFinished()
+{
+    if (!_renderPending)
+    {
+        return;
+    }
+    _renderPending = false;
+
+    RenderResult result = _renderWatcher.result();
+    if (result.generation != _generation)
+    {
+        deleteRenders(result.renders);
+    }
+    else
+    {
+        deleteRenders(_renders);
+        _renders = result.renders;
+        _renderSampling = result.sampling;
+        _renderStretched = result.stretched;
+        update();
+    }
+
+    if (_renderAgain)
+    {
+        requestRender();
+    }
+}
+
+// The render reads the frames, so must be done before they go.
+void CompareWidget::waitForRender()
+{
+    if (_renderPending)
+    {
+        _renderWatcher.waitForFinished();
+        _renderPending = false;
+        _renderAgain = false;
+
+        RenderResult result = _renderWatcher.result();
+        deleteRenders(result.renders);
+    }
+}
+
+void CompareWidget::deleteFrames()
+{
+    for (ELS::FITSImage *frame : _frames)
+    {
+        delete frame;
+    }
+    _frames.clear();
+}
+
+/* static */
+void CompareWidget::deleteRenders(std::vector<QImage *> &renders)
+{
+    for (QImage *render : renders)
+    {
+        delete render;
+    }
+    renders.clear();
+}
+
+QSize CompareWidget::paneSize() const
+{
+    if (_mode == CM_SIDE_BY_SIDE)
+    {
+        return QSize(std::max(1, width() / 2 - 1), height());
+    }
+
+    return size();
+}
+
+float CompareWidget::getFitScale() const
+{
+    if (_frames.empty())
+    {
+        return 1.0f;
+    }
+
+    const QSize pane = paneSize();
+    return std::min((float)pane.width() / _frames[0]->getWidth(),
+                    (float)pane.height() / _frames[0]->getHeight());
+}
+
+float CompareWidget::getScale() const
+{
+    return _zoom == -1.0 ? getFitScale() : _zoom;
+}
+
+// Every n'th pixel is enough when zoomed out by n or more.
+int CompareWidget::wantedSampling() const
+{
+    return std::max(1, (int)floorf(1.0f / getScale()));
+}
+
+QRectF CompareWidget::viewRect(const QSize &size) const
+{
+    const float scale = getScale();
+    const float w = size.width() / scale;
+    const float h = size.height() / scale;
+
+    QPointF center = _center;
+    if ((_zoom == -1.0) && !_frames.empty())
+    {
+        center = QPointF(_frames[0]->getWidth() / 2.0, _frames[0]->getHeight() / 2.0);
+    }
+
+    return QRectF(center.x() - w / 2, center.y() - h / 2, w, h);
+}
+
+void CompareWidget::paintEvent(QPaintEvent * /* event */)
+{
+    ELS_TRACE_SCOPE("CompareWidget::paintEvent");
+
+    QPainter painter(this);
+    painter.setPen(palette().color(QPalette::BrightText));
+
+    if (_renders.empty())
+    {
+        if (_loadPending || _renderPending)
+        {
+            painter.drawText(rect(), Qt::AlignCenter, "Loading...");
+        }
+        return;
+    }
+
+    if ((_mode == CM_SIDE_BY_SIDE) && (_renders.size() > 1))
+    {
+        const QSize pane = paneSize();
+        paintFrame(painter, QRect(QPoint(0, 0), pane), 0);
+        paintFrame(painter, QRect(QPoint(width() - pane.width(), 0), pane),
+                   _current == 0 ? 1 : _current);
+    }
+    else
+    {
+        paintFrame(painter, rect(), _current);
+    }
+}
+
+// Draws frame index into pane at the shared scale and position.
+void CompareWidget::paintFrame(QPainter &painter,
+                               const QRect &pane,
+                               int index) const
+{
+    if (index >= (int)_renders.size())
+    {
+        return;
+    }
+
+    const float scale = getScale();
+    const QRectF view = viewRect(pane.size());
+    const QRectF source = view.intersected(QRectF(0, 0,
+                                                  _frames[index]->getWidth(),
+                                                  _frames[index]->getHeight()));
+    if (source.isEmpty())
+    {
+        return;
+    }
+
+    const QRectF target(pane.left() + (source.left() - view.left()) * scale,
+                        pane.top() + (source.top() - view.top()) * scale,
+                        source.width() * scale,
+                        source.height() * scale);
+    const QRectF rendered(source.left() / _renderSampling,
+                          source.top() / _renderSampling,
+                          source.width() / _renderSampling,
+                          source.height() / _renderSampling);
+
+    painter.save();
+    painter.setClipRect(pane);
+    painter.drawImage(target, *_renders[index], rendered);
+    painter.drawText(pane.adjusted(8, 8, -8, -8), Qt::AlignLeft | Qt::AlignTop,
+                     QString("%1/%2  %3").arg(index + 1).arg(_renders.size()).arg(QFileInfo(_files[index]).fileName()));
+    painter.restore();
+}
+
+void CompareWidget::resizeEvent(QResizeEvent *event)
+{
+    QWidget::resizeEvent(event);
+
+    requestRender();
+}
+
+void CompareWidget::wheelEvent(QWheelEvent *event)
+{
+    if (_frames.empty())
+    {
+        return;
+    }
+
+    const QPoint numSteps = event->angleDelta() / 120;
+    if (numSteps.y() == 0)
+    {
+        return;
+    }
+
+    if (_zoom == -1.0)
+    {
+        _center = viewRect(paneSize()).center();
+    }
+
+    const float fit = getFitScale();
+    const float zoom = getScale() * (numSteps.y() > 0 ? 1.25f : 0.8f);
+    _zoom = zoom <= fit ? -1.0f : std::min(zoom, g_maxZoom);
+
+    requestRender();
+    update();
+}
+
+void CompareWidget::mousePressEvent(QMouseEvent *event)
+{
+    if (_zoom == -1.0)
+    {
+        _center = viewRect(paneSize()).center();
+    }
+
+    _dragStart = event->pos();
+    _dragCenter = _center;
+}
+
+void CompareWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if (((event->buttons() & Qt::LeftButton) == 0) || _frames.empty())
+    {
+        return;
+    }
+
+    // Panning needs a fixed scale.
+    if (_zoom == -1.0)
+    {
+        _zoom = getFitScale();
+    }
+
+    const QPoint delta = event->pos() - _dragStart;
+    _center = _dragCenter - QPointF(delta) / getScale();
+    update();
+}
+
+void CompareWidget::keyPressEvent(QKeyEvent *event)
+{
+    switch (event->key())
+    {
+    case Qt::Key_Left:
+        step(-1);
+        break;
+    case Qt::Key_Right:
+        step(1);
+        break;
+    case Qt::Key_Space:
+        setBlinking(!isBlinking());
+        break;
+    default:
+        QWidget::keyPressEvent(event);
+        break;
+    }
+}
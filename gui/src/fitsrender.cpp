@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <fitsio.h>
+
+#include "fitsbufferpool.h"
+#include "fitsmemorybudget.h"
+#include "fitsrender.h"
+#include "fitstrace.h"
+
+/* static */
+int FITSRender::getFITSIODataType(ELS::FITSImage::BitDepth bitDepth)
+{
+    switch (bitDepth)
+    {
+    case ELS::FITSImage::BD_INT_8:
+        return TBYTE;
+    case ELS::FITSImage::BD_INT_16:
+        return TUSHORT;
+    case ELS::FITSImage::BD_INT_32:
+        return TUINT;
+    case ELS::FITSImage::BD_FLOAT:
+        return TFLOAT;
+    case ELS::FITSImage::BD_DOUBLE:
+        return TDOUBLE;
+    }
+
+    return 0;
+}
+
+namespace
+{
+
+    int renderConsumer()
+    {
+        static int id = ELS::FITSMemoryBudget::global()->addConsumer("Rendered images",
+                                                                     ELS::FITSMemoryBudget::MC_RENDER);
+        return id;
+    }
+
+    // Sum-binned images can hold more than their type says; see
+    // FITSImage::Info::range.
+    void setInputRange(Stretch *stretch,
+                       const ELS::FITSImage *image)
+    {
+        if (image->getInfo().range > 0)
+        {
+            stretch->setInputRange(image->getInfo().range);
+        }
+    }
+
+    void releasePooledImage(void *pixels)
+    {
+        ELS::FITSMemoryBudget::global()->charge(renderConsumer(),
+                                                -(int64_t)ELS::FITSBufferPool::global()->sizeOf(pixels));
+        ELS::FITSBufferPool::global()->release(pixels);
+    }
+
+    struct SharedImageMeta
+    {
+        int32_t width;
+        int32_t height;
+        int32_t bytesPerLine;
+        int32_t format;
+    };
+
+    void releaseSharedImage(void *block)
+    {
+        delete (std::shared_ptr<const ELS::FITSSharedCache::Block> *)block;
+    }
+
+    QImage *wrapShared(const std::shared_ptr<const ELS::FITSSharedCache::Block> &block)
+    {
+        if (block->getMetaSize() != sizeof(SharedImageMeta))
+        {
+            return 0;
+        }
+
+        const SharedImageMeta *meta = (const SharedImageMeta *)block->getMeta();
+        if ((size_t)meta->bytesPerLine * meta->height > block->getDataSize())
+        {
+            return 0;
+        }
+
+        // Read-only: the const constructor never writes to the pixels.
+        return new QImage((const uchar *)block->getData(),
+                          meta->width,
+                          meta->height,
+                          meta->bytesPerLine,
+                          (QImage::Format)meta->format,
+                          releaseSharedImage,
+                          new std::shared_ptr<const ELS::FITSSharedCache::Block>(block));
+    }
+
+}
+
+/* static */
+QImage *FITSRender::createImage(int width,
+                                int height,
+                                bool isColor)
+{
+    // Scan lines must be 32-bit aligned.
+    const int bytesPerLine = isColor ? width * 4 : (width + 3) & ~3;
+    uchar *pixels = (uchar *)ELS::FITSBufferPool::global()->acquire((size_t)bytesPerLine * height);
+    ELS::FITSMemoryBudget::global()->charge(renderConsumer(),
+                                            ELS::FITSBufferPool::global()->sizeOf(pixels));
+
+    return new QImage(pixels,
+                      width,
+                      height,
+                      bytesPerLine,
+                      isColor ? QImage::Format_ARGB32 : QImage::Format_Grayscale8,
+                      releasePooledImage,
+                      pixels);
+}
+
+/* static */
+QImage *FITSRender::render(const ELS::FITSImage *image,
+                           bool stretched,
+                           StretchParams *params /* = 0 */,
+                           int sampling /* = 1 */,
+                           const ELS::BackgroundModel *background /* = 0 */)
+{
+    ELS_TRACE_SCOPE("FITSRender::render");
+
+    return renderImage(image, stretched, 0, params, sampling, background);
+}
+
+/* static */
+QImage *FITSRender::render(const ELS::FITSImage *image,
+                           const StretchParams &params,
+                           int sampling /* = 1 */,
+                           const ELS::BackgroundModel *background /* = 0 */)
+{
+    ELS_TRACE_SCOPE("FITSRender::render");
+
+    return renderImage(image, true, &params, 0, sampling, background);
+}
+
+/* static */
+StretchParams FITSRender::computeParams(const ELS::FITSImage *image,
+                                        const ELS::BackgroundModel *background /* = 0 */)
+{
+    ELS_TRACE_SCOPE("FITSRender::computeParams");
+
+    Stretch cunningham(image->getWidth(),
+                       image->getHeight(),
+                       image->isColor() ? 3 : 1,
+                       getFITSIODataType(image->getBitDepth()));
+    setInputRange(&cunningham, image);
+    cunningham.setBackground(background);
+
+    return cunningham.computeParams((const uint8_t *)image->getPixels());
+}
+
+/* static */
+QImage *FITSRender::renderRegion(const ELS::FITSImage *image,
+                                 const ELS::FITSImage::Region &region,
+                                 const StretchParams &params,
+                                 const ELS::BackgroundModel *background /* = 0 */)
+{
+    ELS_TRACE_SCOPE("FITSRender::renderRegion");
+
+    // Float data is scaled by a range judged on the image; the region
+    // alone could be judged differently.
+    Stretch whole(image->getWidth(),
+                  image->getHeight(),
+                  image->isColor() ? 3 : 1,
+                  getFITSIODataType(image->getBitDepth()));
+    setInputRange(&whole, image);
+    const int64_t inputRange = whole.getInputRange((const uint8_t *)image->getPixels());
+
+    ELS::FITSImage *crop = ELS::FITSImage::crop(image, region);
+
+    QImage *qi = createImage(crop->getWidth(),
+                             crop->getHeight(),
+                             crop->isColor());
+
+    Stretch cunningham(crop->getWidth(),
+                       crop->getHeight(),
+                       crop->isColor() ? 3 : 1,
+                       getFITSIODataType(crop->getBitDepth()));
+    cunningham.setInputRange(inputRange);
+    cunningham.setBackground(background, std::max(region.x, 0), std::max(region.y, 0));
+    cunningham.setParams(params);
+    cunningham.run((const uint8_t *)crop->getPixels(), qi);
+
+    delete crop;
+
+    return qi;
+}
+
+/* static */
+StretchParams FITSRender::linearParams(const ELS::FITSImage *image,
+                                       float low,
+                                       float high)
+{
+    Stretch cunningham(image->getWidth(),
+                       image->getHeight(),
+                       image->isColor() ? 3 : 1,
+                       getFITSIODataType(image->getBitDepth()));
+    setInputRange(&cunningham, image);
+
+    // The stretch scales parameters by the largest input value.
+    const int64_t inputRange = cunningham.getInputRange((const uint8_t *)image->getPixels());
+    const float maxInput = inputRange > 1 ? inputRange - 1 : inputRange;
+
+    StretchParams1Channel channel;
+    channel.shadows = low / maxInput;
+    channel.highlights = high / maxInput;
+    channel.midtones = 0.5f;
+
+    StretchParams params;
+    params.grey_red = channel;
+    params.green = channel;
+    params.blue = channel;
+
+    return params;
+}
+
+/* static */
+QImage *FITSRender::renderImage(const ELS::FITSImage *image,
+                                bool stretched,
+                                const StretchParams *knownParams,
+                                StretchParams *params,
+                                int sampling,
+                                const ELS::BackgroundModel *background)
+{
+    int width = image->getWidth();
+    int height = image->getHeight();
+    bool isColor = image->isColor();
+
+    const void *pixels = image->getPixels();
+
+    QImage *qi = createImage((width + sampling - 1) / sampling,
+                             (height + sampling - 1) / sampling,
+                             isColor);
+
+    Stretch cunningham(width,
+                       height,
+                       isColor ? 3 : 1,
+                       getFITSIODataType(image->getBitDepth()));
+    setInputRange(&cunningham, image);
+    cunningham.setBackground(background);
+
+    if (knownParams != 0)
+    {
+        cunningham.setParams(*knownParams);
+    }
+    else if (stretched)
+    {
+        StretchParams sp = cunningham.computeParams((const uint8_t *)pixels);
+        cunningham.setParams(sp);
+    }
+
+    cunningham.run((uint8_t const *)pixels, qi, sampling);
+
+    if (params != 0)
+    {
+        *params = cunningham.getParams();
+    }
+
+    return qi;
+}
+
+/* static */
+QImage *FITSRender::attachShared(ELS::FITSSharedCache *cache,
+                                 const std::string &key)
+{
+    std::shared_ptr<const ELS::FITSSharedCache::Block> block = cache->attach(key);
+    if (!block)
+    {
+        return 0;
+    }
+
+    return wrapShared(block);
+}
+
+/* static */
+QImage *FITSRender::publishShared(ELS::FITSSharedCache *cache,
+                                  const std::string &key,
+                                  QImage *image)
+{
+    SharedImageMeta meta;
+    meta.width = image->width();
+    meta.height = image->height();
+    meta.bytesPerLine = image->bytesPerLine();
+    meta.format = image->format();
+
+    const QImage *constImage = image;
+    std::shared_ptr<const ELS::FITSSharedCache::Block> block = cache->publish(key,
+                                                                              &meta,
+                                                                              sizeof(meta),
+                                                                              constImage->constBits(),
+                                                                              (size_t)meta.bytesPerLine * meta.height);
+    if (!block)
+    {
+        block = cache->attach(key);
+    }
+
+    QImage *shared = block ? wrapShared(block) : 0;
+    if (shared == 0)
+    {
+        return image;
+    }
+
+    delete image;
+    return shared;
+}
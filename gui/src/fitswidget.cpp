@@ -1,8 +1,55 @@
+#include <algorithm>
+#include <string.h>
+#include <QFileInfo>
 #include <QPainter>
 
 #include "fitswidget.h"
+#include "cosmeticcorrection.h"
+#include "executor.h"
 #include "fitstantrum.h"
-#include "stretch.h"
+#include "fitsrender.h"
+#include "fitstrace.h"
+#include "imagestatistics.h"
+
+namespace
+{
+
+    // Identifies a file's content for the caches; a file that changed
+    // on disk must not come back from them.
+    std::string fileKey(const char *filename)
+    {
+        QFileInfo info(filename);
+        return QString("%1|%2|%3")
+            .arg(info.absoluteFilePath())
+            .arg(info.size())
+            .arg(info.lastModified().toMSecsSinceEpoch())
+            .toStdString();
+    }
+
+    // The key of one plane as read; the first, unbinned, keeps the
+    // plain file key.
+    std::string planeKey(const std::string &fileKey,
+                         int plane,
+                         int binning,
+                         ELS::FITSImage::BinMode binMode)
+    {
+        std::string key = fileKey;
+        if (plane != 0)
+        {
+            key += "|plane|" + std::to_string(plane);
+        }
+        if (binning > 1)
+        {
+            key += "|bin|" + std::to_string(binning) + (binMode == ELS::FITSImage::BM_SUM ? "|sum" : "|average");
+        }
+
+        return key;
+    }
+
+    // Planes read ahead either side of the one shown.
+    const int g_prefetchPlanes = 2;
+
+}
 
 /* static */
 const float FITSWidget::g_validZooms[] = {
@@ -21,20 +68,161 @@ const float FITSWidget::g_validZooms[] = {
     2.000,
     -1.0};
 
+/* static */
+const int FITSWidget::g_diffTile = 256;
+
+/* static */
+const int FITSWidget::g_loupeSize = 200;
+
 FITSWidget::FITSWidget(QWidget *parent)
     : QWidget(parent),
       _sizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding),
-      _filename(0),
+      _filename(),
       _fits(0),
+      _cfaFits(0),
+      _debayerMode(ELS::Debayer::DM_BILINEAR),
+      _binning(1),
+      _binMode(ELS::FITSImage::BM_AVERAGE),
+      _cosmetic(false),
+      _uncorrected(0),
+      _noise(0.0f),
+      _backgroundMode(BG_OFF),
+      _background(),
+      _backgroundFitted(false),
+      _backgroundWatcher(),
+      _backgroundCancel(),
       _cacheImage(0),
       _showStretched(false),
       _zoom(-1.0),
-      _actualZoom(-1.0)
+      _actualZoom(-1.0),
+      _showStars(false),
+      _starsStarted(false),
+      _stars(),
+      _starWatcher(),
+      _starJob(),
+      _openStarted(0),
+      _frameCache(0),
+      _frameKey(),
+      _previewCache(0),
+      _sharedCache(0),
+      _preview(),
+      _haveParams(false),
+      _params(),
+      _pendingFile(),
+      _pendingKey(),
+      _loadPending(false),
+      _loadWatcher(),
+      _staleLoads(),
+      _quickWatcher(),
+      _quickFile(),
+      _images(),
+      _plane(0),
+      _pendingPlane(0),
+      _prefetch(),
+      _mosaicMode(MM_OFF),
+      _mosaicPatch(256),
+      _mosaicImage(0),
+      _diffView(DV_OFF),
+      _referenceFile(),
+      _reference(0),
+      _referenceCfa(0),
+      _referenceWatcher(),
+      _staleReferences(),
+      _referencePending(false),
+      _referenceDx(0),
+      _referenceDy(0),
+      _diffFits(0),
+      _diffFailed(false),
+      _diffDirty(),
+      _haveDiffRange(false),
+      _diffLow(0.0f),
+      _diffHigh(0.0f),
+      _diffWatcher(),
+      _diffGeneration(0),
+      _regionStats(),
+      _regionJob(),
+      _aperture(15),
+      _lastTarget(),
+      _lastSource(),
+      _cursor(-1, -1),
+      _mousePos(),
+      _loupe(0),
+      _loupeImage(0),
+      _loupeCenter(),
+      _loupeSource()
 {
     setBackgroundRole(QPalette::Dark);
     setAutoFillBackground(true);
 
     setSizePolicy(_sizePolicy);
+    setMouseTracking(true);
+
+    QObject::connect(&_backgroundWatcher, &QFutureWatcher<void>::finished,
+                     this, &FITSWidget::backgroundFitFinished);
+    QObject::connect(&_starWatcher, &QFutureWatcher<ELS::StarAnalysis>::finished,
+                     this, &FITSWidget::starAnalysisFinished);
+    QObject::connect(&_loadWatcher, &QFutureWatcher<LoadResult>::finished,
+                     this, &FITSWidget::loadFinished);
+    QObject::connect(&_quickWatcher, &QFutureWatcher<PreviewCache::Entry>::finished,
+                     this, &FITSWidget::quickPreviewFinished);
+    QObject::connect(&_referenceWatcher, &QFutureWatcher<ReferenceResult>::finished,
+                     this, &FITSWidget::referenceFinished);
+    QObject::connect(&_diffWatcher, &QFutureWatcher<DiffResult>::finished,
+                     this, &FITSWidget::differenceFinished);
+}
+
+FITSWidget::~FITSWidget()
+{
+    cancelStarAnalysis();
+    cancelRegionStatistics();
+    cancelBackgroundFit();
+    waitForDifference();
+
+    // Cancelled, so not for long; what it reads goes with the widget.
+    if (_starJob != 0)
+    {
+        std::unique_lock<std::mutex> lock(_starJob->mutex);
+        _starJob->finished.wait(lock, [this]()
+                                { return !_starJob->running; });
+    }
+
+    // Reads ahead already running still use the frame cache.
+    for (auto &prefetch : _prefetch)
+    {
+        prefetch.second.cancel();
+    }
+    for (auto &prefetch : _prefetch)
+    {
+        prefetch.second.waitForFinished();
+    }
+
+    // Loads still running own what they return.
+    abandonLoad();
+    for (QFutureWatcher<LoadResult> *stale : _staleLoads)
+    {
+        stale->waitForFinished();
+        LoadResult result = stale->result();
+        delete result.fits;
+        delete result.cfa;
+        delete result.uncorrected;
+    }
+
+    abandonReference();
+    for (QFutureWatcher<ReferenceResult> *stale : _staleReferences)
+    {
+        stale->waitForFinished();
+        ReferenceResult result = stale->result();
+        delete result.fits;
+        delete result.cfa;
+    }
+    deleteReference();
+
+    deleteImage(_fits);
+    delete _cfaFits;
+    delete _uncorrected;
+    delete _cacheImage;
+    delete _mosaicImage;
+    delete _loupeImage;
 }
 
 QSize FITSWidget::sizeHint() const
@@ -54,7 +242,7 @@ const ELS::FITSImage *FITSWidget::getImage() const
 
 const char *FITSWidget::getFilename() const
 {
-    return _filename;
+    return _filename.empty() ? 0 : _filename.c_str();
 }
 
 bool FITSWidget::getStretched() const
@@ -62,64 +250,1465 @@ bool FITSWidget::getStretched() const
     return _showStretched;
 }
 
-float FITSWidget::getZoom() const
-{
-    return _zoom;
-}
+float FITSWidget::getZoom() const
+{
+    return _zoom;
+}
+
+bool FITSWidget::isDebayered() const
+{
+    return _cfaFits != 0;
+}
+
+ELS::Debayer::Mode FITSWidget::getDebayerMode() const
+{
+    return _debayerMode;
+}
+
+int FITSWidget::getBinning() const
+{
+    return _binning;
+}
+
+ELS::FITSImage::BinMode FITSWidget::getBinMode() const
+{
+    return _binMode;
+}
+
+bool FITSWidget::getCosmeticCorrection() const
+{
+    return _cosmetic;
+}
+
+FITSWidget::BackgroundMode FITSWidget::getBackgroundMode() const
+{
+    return _backgroundMode;
+}
+
+bool FITSWidget::getShowStars() const
+{
+    return _showStars;
+}
+
+const ELS::StarAnalysis &FITSWidget::getStarAnalysis() const
+{
+    return _stars;
+}
+
+int FITSWidget::getPlaneCount() const
+{
+    int count = 0;
+    for (const ELS::FITSImage::ImageHDU &image : _images)
+    {
+        count += image.planeCount;
+    }
+
+    return count;
+}
+
+int FITSWidget::getPlane() const
+{
+    return _plane;
+}
+
+FITSWidget::MosaicMode FITSWidget::getMosaicMode() const
+{
+    return _mosaicMode;
+}
+
+int FITSWidget::getMosaicPatchSize() const
+{
+    return _mosaicPatch;
+}
+
+int FITSWidget::getAperture() const
+{
+    return _aperture;
+}
+
+int FITSWidget::getLoupe() const
+{
+    return _loupe;
+}
+
+FITSWidget::DiffView FITSWidget::getDiffView() const
+{
+    return _diffView;
+}
+
+const char *FITSWidget::getReferenceFilename() const
+{
+    return _referenceFile.empty() ? 0 : _referenceFile.c_str();
+}
+
+bool FITSWidget::hasReference() const
+{
+    return _reference != 0;
+}
+
+void FITSWidget::setFrameCache(ELS::FrameCache *cache)
+{
+    _frameCache = cache;
+}
+
+void FITSWidget::setPreviewCache(PreviewCache *cache)
+{
+    _previewCache = cache;
+}
+
+void FITSWidget::setSharedCache(ELS::FITSSharedCache *cache)
+{
+    _sharedCache = cache;
+}
+
+void FITSWidget::setFile(const char *filename)
+{
+    if (_loadPending ? (_pendingFile == filename) : (_filename == filename))
+    {
+        return;
+    }
+
+    ELS_TRACE_SCOPE("FITSWidget::setFile");
+
+    abandonLoad();
+
+    // Back to the file already loaded, before the other one arrived.
+    if (_filename == filename)
+    {
+        update();
+        return;
+    }
+
+    _openStarted = ELS::FITSTrace::now();
+
+    _pendingFile = filename;
+    _pendingKey = planeKey(fileKey(filename), 0, _binning, _binMode);
+    _pendingPlane = 0;
+    _loadPending = true;
+
+    if (_previewCache != 0)
+    {
+        ELS_TRACE_SCOPE("PreviewCache::lookup");
+        _previewCache->lookup(QString::fromLocal8Bit(filename), &_preview);
+    }
+    update();
+
+    if (_preview.preview.isNull())
+    {
+        const std::string file = _pendingFile;
+        const ELS::Debayer::Mode mode = _debayerMode;
+        _quickFile = _pendingFile;
+        _quickWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                             { return quickPreview(file, mode); }));
+    }
+
+    const std::string file = _pendingFile;
+    const std::string key = _pendingKey;
+    const int binning = _binning;
+    const ELS::FITSImage::BinMode binMode = _binMode;
+    ELS::FrameCache *frameCache = _frameCache;
+    ELS::FITSSharedCache *sharedCache = _sharedCache;
+    const ELS::Debayer::Mode mode = _debayerMode;
+    const bool cosmetic = _cosmetic;
+    // Previews, and the stretch kept with them, are of the file as is.
+    PreviewCache *previewCache = (binning == 1) && !cosmetic ? _previewCache : 0;
+    const PreviewCache::Entry preview = binning == 1 ? _preview : PreviewCache::Entry();
+    _loadWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                        { return loadFile(file, key, 0, 0, binning, binMode, true, ELS::Executor::Job(),
+                                                                          frameCache, sharedCache, mode, cosmetic, previewCache, preview); }));
+}
+
+void FITSWidget::setPlane(int plane)
+{
+    // Planes are those of the file shown; ignore the scrubber while
+    // another file is on its way.
+    if (_filename.empty() || (_loadPending && (_pendingFile != _filename)))
+    {
+        return;
+    }
+    if (_loadPending ? (_pendingPlane == plane) : (_plane == plane))
+    {
+        return;
+    }
+
+    int hdu;
+    int hduPlane;
+    if (!findPlane(plane, &hdu, &hduPlane))
+    {
+        return;
+    }
+
+    ELS_TRACE_SCOPE("FITSWidget::setPlane");
+
+    abandonLoad();
+
+    if (_plane == plane)
+    {
+        update();
+        return;
+    }
+
+    loadPlane(plane, hdu, hduPlane);
+}
+
+void FITSWidget::setBinning(int factor,
+                            ELS::FITSImage::BinMode mode)
+{
+    factor = std::max(factor, 1);
+    if ((_binning == factor) && (_binMode == mode))
+    {
+        return;
+    }
+
+    ELS_TRACE_SCOPE("FITSWidget::setBinning");
+
+    _binning = factor;
+    _binMode = mode;
+
+    // Planes read ahead at the old binning are no use now.
+    for (auto &prefetch : _prefetch)
+    {
+        prefetch.second.cancel();
+    }
+    _prefetch.clear();
+
+    // The reference has to stay the same size as the frame.
+    if (_reference != 0)
+    {
+        const std::string reference = _referenceFile;
+        deleteReference();
+        invalidateDiff();
+        setReference(reference.c_str());
+    }
+
+    // Read again whatever is shown, or on its way.
+    const std::string file = _loadPending ? _pendingFile : _filename;
+    const int plane = _loadPending ? _pendingPlane : _plane;
+    if (file.empty())
+    {
+        return;
+    }
+
+    abandonLoad();
+    if (file != _filename)
+    {
+        setFile(file.c_str());
+        return;
+    }
+
+    int hdu;
+    int hduPlane;
+    if (findPlane(plane, &hdu, &hduPlane))
+    {
+        loadPlane(plane, hdu, hduPlane);
+    }
+}
+
+// Reads plane of the file shown, which is hduPlane of hdu, at the
+// current binning.
+void FITSWidget::loadPlane(int plane,
+                           int hdu,
+                           int hduPlane)
+{
+    _pendingFile = _filename;
+    _pendingKey = planeKey(fileKey(_filename.c_str()), plane, _binning, _binMode);
+    _pendingPlane = plane;
+    _loadPending = true;
+
+    // Already being read ahead: take that over rather than read it twice.
+    ELS::Executor::Job prefetch;
+    auto pending = _prefetch.find(_pendingKey);
+    if (pending != _prefetch.end())
+    {
+        prefetch = pending->second;
+    }
+
+    const std::string file = _pendingFile;
+    const std::string key = _pendingKey;
+    const int binning = _binning;
+    const ELS::FITSImage::BinMode binMode = _binMode;
+    ELS::FrameCache *frameCache = _frameCache;
+    ELS::FITSSharedCache *sharedCache = _sharedCache;
+    const ELS::Debayer::Mode mode = _debayerMode;
+    const bool cosmetic = _cosmetic;
+    _loadWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                        { return loadFile(file, key, hdu, hduPlane, binning, binMode, false, prefetch,
+                                                                          frameCache, sharedCache, mode, cosmetic, 0, PreviewCache::Entry()); }));
+}
+
+// Maps a plane counted through the whole file to its HDU and the plane
+// within that.
+bool FITSWidget::findPlane(int index,
+                           int *hdu,
+                           int *plane) const
+{
+    if (index < 0)
+    {
+        return false;
+    }
+
+    for (const ELS::FITSImage::ImageHDU &image : _images)
+    {
+        if (index < image.planeCount)
+        {
+            *hdu = image.hdu;
+            *plane = index;
+            return true;
+        }
+        index -= image.planeCount;
+    }
+
+    return false;
+}
+
+// Reads the planes around plane into the frame cache in the background,
+// and stops reading ahead anywhere else.
+void FITSWidget::prefetchAround(int plane)
+{
+    // Nearest first, and ahead before behind; scrubbing is usually
+    // forwards.
+    std::vector<std::pair<std::string, int>> wanted;
+    if ((_frameCache != 0) && (getPlaneCount() > 1))
+    {
+        const std::string baseKey = fileKey(_filename.c_str());
+        for (int distance = 1; distance <= g_prefetchPlanes; distance++)
+        {
+            wanted.push_back(std::make_pair(planeKey(baseKey, plane + distance, _binning, _binMode), plane + distance));
+            wanted.push_back(std::make_pair(planeKey(baseKey, plane - distance, _binning, _binMode), plane - distance));
+        }
+    }
+
+    for (auto it = _prefetch.begin(); it != _prefetch.end();)
+    {
+        bool keep = !it->second.isFinished();
+        if (keep)
+        {
+            keep = false;
+            for (const auto &want : wanted)
+            {
+                keep = keep || (want.first == it->first);
+            }
+        }
+
+        if (!keep)
+        {
+            it->second.cancel();
+            it = _prefetch.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (const auto &want : wanted)
+    {
+        int hdu;
+        int hduPlane;
+        const std::string key = want.first;
+        if (!findPlane(want.second, &hdu, &hduPlane) ||
+            (_prefetch.count(key) != 0) || _frameCache->contains(key))
+        {
+            continue;
+        }
+
+        const std::string file = _filename;
+        const int binning = _binning;
+        const ELS::FITSImage::BinMode binMode = _binMode;
+        ELS::FrameCache *frameCache = _frameCache;
+        _prefetch[key] = ELS::Executor::global()->submit(
+            ELS::Executor::EL_BACKGROUND,
+            [=](const ELS::CancelToken &token)
+            {
+                if (token.isCancelled())
+                {
+                    return;
+                }
+
+                ELS::FITSImage *image = 0;
+                try
+                {
+                    image = ELS::FITSImage::load(file.c_str(), hdu, hduPlane, binning, binMode);
+                }
+                catch (ELS::FITSException *e)
+                {
+                    // Reported if the plane is ever shown.
+                    delete e;
+                    return;
+                }
+
+                // Cancelled while reading: whoever wanted it read it.
+                if (!token.isCancelled())
+                {
+                    frameCache->insert(key, image);
+                }
+                delete image;
+            });
+    }
+}
+
+/* static */
+FITSWidget::LoadResult FITSWidget::loadFile(const std::string &filename,
+                                            const std::string &frameKey,
+                                            int hdu,
+                                            int plane,
+                                            int binning,
+                                            ELS::FITSImage::BinMode binMode,
+                                            bool listImages,
+                                            const ELS::Executor::Job &prefetch,
+                                            ELS::FrameCache *frameCache,
+                                            ELS::FITSSharedCache *sharedCache,
+                                            ELS::Debayer::Mode debayerMode,
+                                            bool cosmetic,
+                                            PreviewCache *previewCache,
+                                            const PreviewCache::Entry &preview)
+{
+    ELS_TRACE_SCOPE("FITSWidget::loadFile");
+
+    LoadResult result;
+    result.fits = 0;
+    result.cfa = 0;
+    result.uncorrected = 0;
+    result.debayerMode = debayerMode;
+    result.noise = preview.noise;
+    result.haveParams = false;
+    result.listed = false;
+
+    const std::string rasterKey = "raster|" + frameKey;
+    const std::string debayerKey = std::string("debayer|") + ELS::Debayer::getModeName(debayerMode) +
+                                   (cosmetic ? "|cosmetic|" : "|") + frameKey;
+
+    try
+    {
+        // Another viewer may have this file open already.
+        if (sharedCache != 0)
+        {
+            result.fits = sharedCache->attachImage(rasterKey);
+        }
+        const bool shared = result.fits != 0;
+        // A read ahead already under way runs at background priority;
+        // reading the plane here beats waiting for it.
+        if ((result.fits == 0) && prefetch.isValid())
+        {
+            prefetch.finishOrCancel();
+        }
+        if ((result.fits == 0) && (frameCache != 0))
+        {
+            result.fits = frameCache->restore(frameKey);
+        }
+        if (result.fits == 0)
+        {
+            result.fits = ELS::FITSImage::load(filename.c_str(), hdu, plane, binning, binMode);
+        }
+        if ((sharedCache != 0) && !shared)
+        {
+            result.fits = sharedCache->publishImage(rasterKey, result.fits);
+        }
+
+        // Before debayering, which would smear defects into their
+        // neighbours. The noise of a debayered frame is no guide to
+        // that of its mosaic.
+        if (cosmetic)
+        {
+            result.uncorrected = result.fits;
+            result.fits = ELS::CosmeticCorrection::run(result.uncorrected, ELS::CosmeticCorrection::g_defaultSigmas,
+                                                       result.uncorrected->isBayered() ? 0.0f : result.noise);
+        }
+
+        // One-shot-colour frames are shown debayered; the mosaic is
+        // kept so the mode can be changed without a reload.
+        if (result.fits->isBayered())
+        {
+            result.cfa = result.fits;
+            result.fits = 0;
+            if (sharedCache != 0)
+            {
+                result.fits = sharedCache->attachImage(debayerKey);
+            }
+            if (result.fits == 0)
+            {
+                result.fits = ELS::Debayer::run(result.cfa, debayerMode);
+                if (sharedCache != 0)
+                {
+                    result.fits = sharedCache->publishImage(debayerKey, result.fits);
+                }
+            }
+        }
+
+        // Those of the preview are skewed by the defects corrected.
+        if (!preview.preview.isNull() && !cosmetic)
+        {
+            result.haveParams = true;
+            result.params = preview.params;
+        }
+        else if (previewCache != 0)
+        {
+            // Auto-stretch parameters are wanted for the preview anyway,
+            // and kept for the full-size render.
+            const int width = result.fits->getWidth();
+            const int height = result.fits->getHeight();
+            const int sampling = (std::max(width, height) + PreviewCache::getPreviewSize() - 1) /
+                                 PreviewCache::getPreviewSize();
+
+            PreviewCache::Entry entry;
+            QImage *qi = FITSRender::render(result.fits, true, &entry.params, sampling);
+            entry.preview = qi->copy();
+            delete qi;
+
+            ELS::ImageStatistics stats;
+            stats.compute(result.fits, result.fits->isColor() ? 1 : 0);
+            entry.width = width;
+            entry.height = height;
+            entry.background = stats.getBackground();
+            entry.noise = stats.getNoise();
+            entry.minimum = stats.getMinimum();
+            entry.maximum = stats.getMaximum();
+
+            result.haveParams = true;
+            result.params = entry.params;
+            result.noise = entry.noise;
+
+            // Encoding and writing needn't hold up the display.
+            const QString file = QString::fromLocal8Bit(filename.c_str());
+            ELS::Executor::global()->run(ELS::Executor::EL_BACKGROUND, [=]()
+                                         { previewCache->store(file, entry); });
+        }
+
+        // Headers only, and after the pixels so as not to delay them.
+        if (listImages)
+        {
+            result.images = ELS::FITSImage::listImages(filename.c_str());
+            result.listed = true;
+        }
+    }
+    catch (ELS::FITSException *e)
+    {
+        result.errText = e->getErrText();
+        delete e;
+        delete result.fits;
+        delete result.cfa;
+        delete result.uncorrected;
+        result.fits = 0;
+        result.cfa = 0;
+        result.uncorrected = 0;
+    }
+
+    return result;
+}
+
+void FITSWidget::loadFinished()
+{
+    // Abandoned; its watcher cleans up.
+    if (!_loadPending)
+    {
+        return;
+    }
+    _loadPending = false;
+
+    LoadResult result = _loadWatcher.result();
+    _preview = PreviewCache::Entry();
+
+    if (result.fits == 0)
+    {
+        fprintf(stderr, "FITSException: %s for file %s\n", result.errText.c_str(), _pendingFile.c_str());
+        _openStarted = 0;
+        update();
+
+        emit fileFailed(_pendingFile.c_str(), result.errText.c_str());
+        return;
+    }
+
+    cancelStarAnalysis();
+    cancelRegionStatistics();
+    cancelBackgroundFit();
+    waitForDifference();
+
+    // The frame as read goes to the cache, not anything derived from it.
+    ELS::FITSImage *raw = getRawImage();
+    if ((_frameCache != 0) && (raw != 0))
+    {
+        ELS::FrameCache *frameCache = _frameCache;
+        const std::string frameKey = _frameKey;
+        retireImage(raw, [=]()
+                    { frameCache->insertAsync(frameKey, raw); });
+        if (raw == _fits)
+        {
+            _fits = 0;
+        }
+        else if (raw == _cfaFits)
+        {
+            _cfaFits = 0;
+        }
+        else
+        {
+            _uncorrected = 0;
+        }
+    }
+
+    deleteImage(_fits);
+    delete _cfaFits;
+    delete _uncorrected;
+
+    const bool newFile = _filename != _pendingFile;
+    _filename = _pendingFile;
+    _frameKey = _pendingKey;
+    _plane = _pendingPlane;
+    if (result.listed)
+    {
+        _images = result.images;
+    }
+    _fits = result.fits;
+    _cfaFits = result.cfa;
+    _uncorrected = result.uncorrected;
+    _noise = result.noise;
+    // Those loaded with the frame are for it uncorrected, as it is
+    // shown until its background is fitted.
+    _haveParams = result.haveParams;
+    _params = result.params;
+    startBackgroundFit();
+
+    invalidateDiff();
+
+    // The debayer mode changed while the file was loading.
+    if ((_cfaFits != 0) && (result.debayerMode != _debayerMode))
+    {
+        const ELS::Debayer::Mode mode = _debayerMode;
+        _debayerMode = result.debayerMode;
+        setDebayerMode(mode);
+    }
+
+    // Cosmetic correction was switched while the file was loading.
+    if ((_uncorrected != 0) != _cosmetic)
+    {
+        const bool cosmetic = _cosmetic;
+        _cosmetic = !cosmetic;
+        setCosmeticCorrection(cosmetic);
+    }
+
+    startRegionStatistics();
+    update();
+
+    prefetchAround(_plane);
+
+    if (newFile)
+    {
+        emit fileChanged(_filename.c_str());
+    }
+    else
+    {
+        emit planeChanged(_plane);
+    }
+}
+
+/* static */
+PreviewCache::Entry FITSWidget::quickPreview(const std::string &filename,
+                                             ELS::Debayer::Mode debayerMode)
+{
+    ELS_TRACE_SCOPE("FITSWidget::quickPreview");
+
+    PreviewCache::Entry entry = PreviewCache::Entry();
+
+    ELS::FITSImage *image = 0;
+    ELS::FITSImage *debayered = 0;
+    try
+    {
+        ELS::FITSImage::Info info;
+        ELS::FITSImage::probe(filename.c_str(), &info);
+
+        // Small files load whole about as fast.
+        const int factor = std::max(info.width, info.height) / PreviewCache::getPreviewSize();
+        if (factor < 2)
+        {
+            return entry;
+        }
+
+        image = ELS::FITSImage::loadDecimated(filename.c_str(), factor);
+        if (image->isBayered())
+        {
+            debayered = ELS::Debayer::run(image, debayerMode);
+        }
+
+        QImage *qi = FITSRender::render(debayered != 0 ? debayered : image, true);
+        entry.preview = qi->copy();
+        delete qi;
+
+        // Laid out as the full image will be.
+        const bool half = (debayered != 0) && (debayerMode == ELS::Debayer::DM_SUPERPIXEL);
+        entry.width = half ? info.width / 2 : info.width;
+        entry.height = half ? info.height / 2 : info.height;
+    }
+    catch (ELS::FITSException *e)
+    {
+        // The full load reports it.
+        delete e;
+    }
+
+    delete image;
+    delete debayered;
+
+    return entry;
+}
+
+void FITSWidget::quickPreviewFinished()
+{
+    // Only of use while its file is still on the way.
+    if (!_loadPending || (_quickFile != _pendingFile) || !_preview.preview.isNull())
+    {
+        return;
+    }
+
+    PreviewCache::Entry entry = _quickWatcher.result();
+    if (!entry.preview.isNull())
+    {
+        _preview = entry;
+        update();
+    }
+}
+
+// Lets go of a load in progress, if any. What it returns is deleted
+// when it finishes.
+void FITSWidget::abandonLoad()
+{
+    if (_loadPending)
+    {
+        _loadPending = false;
+
+        QFutureWatcher<LoadResult> *stale = new QFutureWatcher<LoadResult>(this);
+        _staleLoads.append(stale);
+        QObject::connect(stale, &QFutureWatcher<LoadResult>::finished,
+                         this, [this, stale]()
+                         { discardLoad(stale); });
+        stale->setFuture(_loadWatcher.future());
+    }
+
+    _preview = PreviewCache::Entry();
+}
+
+void FITSWidget::discardLoad(QFutureWatcher<LoadResult> *watcher)
+{
+    LoadResult result = watcher->result();
+    delete result.fits;
+    delete result.cfa;
+    delete result.uncorrected;
+
+    _staleLoads.removeOne(watcher);
+    watcher->deleteLater();
+}
+
+void FITSWidget::setStretched(bool isStretched)
+{
+    if (_showStretched != isStretched)
+    {
+        _showStretched = isStretched;
+
+        discardRenders();
+        update();
+    }
+}
+
+void FITSWidget::setZoom(float zoom)
+{
+    // Adjust zoom to the closest valid value
+    if (zoom != -1.0)
+    {
+        zoom = adjustZoom(zoom);
+    }
+
+    if (_zoom != zoom)
+    {
+        _internalSetZoom(zoom);
+    }
+}
+
+void FITSWidget::setDebayerMode(ELS::Debayer::Mode mode)
+{
+    if (_debayerMode != mode)
+    {
+        _debayerMode = mode;
+
+        if (_referenceCfa != 0)
+        {
+            try
+            {
+                ELS::FITSImage *tmpFits = ELS::Debayer::run(_referenceCfa, _debayerMode);
+
+                waitForDifference();
+                delete _reference;
+                _reference = tmpFits;
+
+                invalidateDiff();
+                update();
+            }
+            catch (ELS::FITSException *e)
+            {
+                fprintf(stderr, "FITSException: %s\n", e->getErrText());
+                delete e;
+            }
+        }
+
+        if (_cfaFits != 0)
+        {
+            try
+            {
+                ELS::FITSImage *tmpFits = ELS::Debayer::run(_cfaFits, _debayerMode);
+
+                cancelStarAnalysis();
+                cancelRegionStatistics();
+                cancelBackgroundFit();
+                waitForDifference();
+
+                deleteImage(_fits);
+                _fits = tmpFits;
+                _haveParams = false;
+                startBackgroundFit();
+
+                invalidateDiff();
+                startRegionStatistics();
+                update();
+            }
+            catch (ELS::FITSException *e)
+            {
+                fprintf(stderr, "FITSException: %s\n", e->getErrText());
+                delete e;
+            }
+        }
+    }
+}
+
+void FITSWidget::setCosmeticCorrection(bool isCorrected)
+{
+    if (_cosmetic == isCorrected)
+    {
+        return;
+    }
+    _cosmetic = isCorrected;
+
+    ELS::FITSImage *raw = getRawImage();
+    if (raw == 0)
+    {
+        return;
+    }
+
+    ELS_TRACE_SCOPE("FITSWidget::setCosmeticCorrection");
+
+    ELS::FITSImage *corrected = 0;
+    try
+    {
+        if (_cosmetic)
+        {
+            corrected = ELS::CosmeticCorrection::run(raw, ELS::CosmeticCorrection::g_defaultSigmas,
+                                                     raw->isBayered() ? 0.0f : _noise);
+        }
+        ELS::FITSImage *source = corrected != 0 ? corrected : raw;
+        ELS::FITSImage *tmpFits = _cfaFits != 0 ? ELS::Debayer::run(source, _debayerMode) : source;
+
+        cancelStarAnalysis();
+        cancelRegionStatistics();
+        cancelBackgroundFit();
+        waitForDifference();
+
+        // Everything derived from the frame as read goes, but not it.
+        if (_cfaFits != 0)
+        {
+            deleteImage(_fits);
+            if (_cfaFits != raw)
+            {
+                delete _cfaFits;
+            }
+            _cfaFits = source;
+        }
+        else if (_fits != raw)
+        {
+            deleteImage(_fits);
+        }
+        _fits = tmpFits;
+        _uncorrected = corrected != 0 ? raw : 0;
+        _haveParams = false;
+        startBackgroundFit();
+
+        invalidateDiff();
+        startRegionStatistics();
+        update();
+    }
+    catch (ELS::FITSException *e)
+    {
+        fprintf(stderr, "FITSException: %s\n", e->getErrText());
+        delete e;
+        delete corrected;
+    }
+}
+
+void FITSWidget::setBackgroundMode(BackgroundMode mode)
+{
+    if (_backgroundMode != mode)
+    {
+        _backgroundMode = mode;
+        startBackgroundFit();
+
+        // The model stays; the stretch is for the data it makes.
+        _haveParams = false;
+
+        discardRenders();
+        update();
+    }
+}
+
+// The frame as read, before cosmetic correction or debayering.
+ELS::FITSImage *FITSWidget::getRawImage() const
+{
+    if (_uncorrected != 0)
+    {
+        return _uncorrected;
+    }
+
+    return _cfaFits != 0 ? _cfaFits : _fits;
+}
+
+// The background model of the image shown; null if flattening is off,
+// the fit isn't done yet, or the image can't be modelled.
+const ELS::BackgroundModel *FITSWidget::getBackgroundModel()
+{
+    if ((_backgroundMode == BG_OFF) || (_fits == 0) || !_backgroundFitted)
+    {
+        return 0;
+    }
+
+    _background.setCorrection(_backgroundMode == BG_DIVIDE ? ELS::BackgroundModel::BC_DIVIDE
+                                                           : ELS::BackgroundModel::BC_SUBTRACT);
+
+    return _background.isValid() ? &_background : 0;
+}
+
+// Fits the background of the image shown off the GUI thread, if
+// flattening is on and that isn't done or under way. It is rendered
+// as it is until then.
+void FITSWidget::startBackgroundFit()
+{
+    if ((_backgroundMode == BG_OFF) || (_fits == 0) || _backgroundFitted || _backgroundWatcher.isRunning())
+    {
+        return;
+    }
+
+    ELS::BackgroundModel *background = &_background;
+    const ELS::FITSImage *image = _fits;
+    const ELS::CancelToken token;
+    _backgroundCancel = token;
+    _backgroundWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                              { background->fit(image, 2, 64, token.getFlag()); }));
+}
+
+// Must be called before the image the model is for goes away.
+void FITSWidget::cancelBackgroundFit()
+{
+    _backgroundCancel.cancel();
+    _backgroundWatcher.waitForFinished();
+    // Also drops a finish already queued for delivery.
+    _backgroundWatcher.setFuture(QFuture<void>());
+
+    _background.clear();
+    _backgroundFitted = false;
+}
+
+void FITSWidget::backgroundFitFinished()
+{
+    if (_backgroundWatcher.isCanceled() || _backgroundCancel.isCancelled())
+    {
+        return;
+    }
+
+    _backgroundFitted = true;
+
+    // Shown flattened from now on, if still wanted.
+    if (_backgroundMode != BG_OFF)
+    {
+        _haveParams = false;
+        discardRenders();
+        update();
+    }
+}
+
+void FITSWidget::setShowStars(bool showStars)
+{
+    if (_showStars != showStars)
+    {
+        _showStars = showStars;
+
+        update();
+    }
+}
+
+void FITSWidget::setMosaicMode(MosaicMode mode)
+{
+    if (_mosaicMode != mode)
+    {
+        _mosaicMode = mode;
+
+        delete _mosaicImage;
+        _mosaicImage = 0;
+        update();
+    }
+}
+
+void FITSWidget::setMosaicPatchSize(int size)
+{
+    if ((size > 0) && (_mosaicPatch != size))
+    {
+        _mosaicPatch = size;
+
+        delete _mosaicImage;
+        _mosaicImage = 0;
+        update();
+    }
+}
+
+void FITSWidget::setAperture(int size)
+{
+    if ((size > 0) && (_aperture != size))
+    {
+        _aperture = size;
+
+        emitReadout();
+    }
+}
+
+void FITSWidget::setLoupe(int magnification)
+{
+    if (magnification != 0)
+    {
+        magnification = std::max(4, std::min(magnification, 16));
+    }
+
+    if (_loupe != magnification)
+    {
+        update(loupeFrame());
+
+        _loupe = magnification;
+        delete _loupeImage;
+        _loupeImage = 0;
+
+        update(loupeFrame());
+    }
+}
+
+void FITSWidget::setReference(const char *filename)
+{
+    // Only the latest matters.
+    abandonReference();
+
+    const std::string file = filename;
+    const ELS::Debayer::Mode mode = _debayerMode;
+    const int binning = _binning;
+    const ELS::FITSImage::BinMode binMode = _binMode;
+    _referencePending = true;
+    _referenceWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_LOAD, [=]()
+                                                             { return loadReference(file, mode, binning, binMode); }));
+}
+
+void FITSWidget::clearReference()
+{
+    abandonReference();
+
+    if (_reference != 0)
+    {
+        deleteReference();
+
+        invalidateDiff();
+        update();
+
+        emit referenceChanged("");
+    }
+}
+
+void FITSWidget::setDiffView(DiffView view)
+{
+    if (_diffView != view)
+    {
+        _diffView = view;
+
+        // Tiles left from the other view would be in other units.
+        waitForDifference();
+        delete _diffFits;
+        _diffFits = 0;
+
+        invalidateDiff();
+        update();
+    }
+}
+
+void FITSWidget::setReferenceOffset(int dx,
+                                    int dy)
+{
+    if ((_referenceDx != dx) || (_referenceDy != dy))
+    {
+        _referenceDx = dx;
+        _referenceDy = dy;
+
+        invalidateDiff();
+        update();
+    }
+}
+
+/* static */
+FITSWidget::ReferenceResult FITSWidget::loadReference(const std::string &filename,
+                                                      ELS::Debayer::Mode debayerMode,
+                                                      int binning,
+                                                      ELS::FITSImage::BinMode binMode)
+{
+    ELS_TRACE_SCOPE("FITSWidget::loadReference");
+
+    ReferenceResult result = ReferenceResult();
+    result.filename = filename;
+    result.debayerMode = debayerMode;
+    result.binning = binning;
+    result.binMode = binMode;
+
+    try
+    {
+        result.fits = ELS::FITSImage::load(filename.c_str(), 0, 0, binning, binMode);
+        if (result.fits->isBayered())
+        {
+            result.cfa = result.fits;
+            result.fits = 0;
+            result.fits = ELS::Debayer::run(result.cfa, debayerMode);
+        }
+    }
+    catch (ELS::FITSException *e)
+    {
+        delete result.fits;
+        delete result.cfa;
+        result.fits = 0;
+        result.cfa = 0;
+        result.errText = e->getErrText();
+        delete e;
+    }
+
+    return result;
+}
+
+void FITSWidget::referenceFinished()
+{
+    // Abandoned; already cleaned up.
+    if (!_referencePending)
+    {
+        return;
+    }
+    _referencePending = false;
+
+    ReferenceResult result = _referenceWatcher.result();
+    if (result.fits == 0)
+    {
+        fprintf(stderr, "FITSException: %s for file %s\n", result.errText.c_str(), result.filename.c_str());
+
+        emit fileFailed(result.filename.c_str(), result.errText.c_str());
+        return;
+    }
+
+    // The binning changed while it was loading.
+    if ((result.binning != _binning) || (result.binMode != _binMode))
+    {
+        delete result.fits;
+        delete result.cfa;
+        setReference(result.filename.c_str());
+        return;
+    }
+
+    deleteReference();
+    _referenceFile = result.filename;
+    _reference = result.fits;
+    _referenceCfa = result.cfa;
+
+    // The debayer mode changed while it was loading.
+    if ((_referenceCfa != 0) && (result.debayerMode != _debayerMode))
+    {
+        try
+        {
+            ELS::FITSImage *tmpFits = ELS::Debayer::run(_referenceCfa, _debayerMode);
+
+            delete _reference;
+            _reference = tmpFits;
+        }
+        catch (ELS::FITSException *e)
+        {
+            fprintf(stderr, "FITSException: %s\n", e->getErrText());
+            delete e;
+        }
+    }
+
+    invalidateDiff();
+    update();
+
+    emit referenceChanged(_referenceFile.c_str());
+}
+
+// Drops a reference still loading, once it has loaded, without
+// waiting for it.
+void FITSWidget::abandonReference()
+{
+    if (_referencePending)
+    {
+        _referencePending = false;
+
+        QFutureWatcher<ReferenceResult> *stale = new QFutureWatcher<ReferenceResult>(this);
+        _staleReferences.append(stale);
+        QObject::connect(stale, &QFutureWatcher<ReferenceResult>::finished,
+                         this, [this, stale]()
+                         { discardReference(stale); });
+        stale->setFuture(_referenceWatcher.future());
+    }
+}
+
+void FITSWidget::discardReference(QFutureWatcher<ReferenceResult> *watcher)
+{
+    ReferenceResult result = watcher->result();
+    delete result.fits;
+    delete result.cfa;
+
+    _staleReferences.removeOne(watcher);
+    watcher->deleteLater();
+}
+
+void FITSWidget::deleteReference()
+{
+    waitForDifference();
+
+    delete _reference;
+    delete _referenceCfa;
+    delete _diffFits;
+    _reference = 0;
+    _referenceCfa = 0;
+    _diffFits = 0;
+    _referenceFile.clear();
+}
+
+bool FITSWidget::isDiffShown() const
+{
+    return (_diffView != DV_OFF) && (_fits != 0) && (_reference != 0) && !_diffFailed;
+}
+
+// Marks every tile of the diff view for computing again, once on
+// screen, and drops renders, which may show it.
+void FITSWidget::invalidateDiff()
+{
+    _diffGeneration++;
+    std::fill(_diffDirty.begin(), _diffDirty.end(), true);
+    _diffFailed = false;
+    _haveDiffRange = false;
+
+    discardRenders();
+}
+
+// Starts computing the tiles of the diff view that source (in image
+// pixels) covers and that are out of date, unless some already are
+// being computed. differenceFinished() patches them into the render.
+void FITSWidget::startDifference(const QRect &source)
+{
+    if (_diffWatcher.isRunning())
+    {
+        return;
+    }
+
+    const ELS::FrameMath::Op op = _diffView == DV_RATIO ? ELS::FrameMath::FM_RATIO
+                                                        : ELS::FrameMath::FM_DIFFERENCE;
+    const int imgW = _fits->getWidth();
+    const int imgH = _fits->getHeight();
+    const int tilesX = (imgW + g_diffTile - 1) / g_diffTile;
+    const int tilesY = (imgH + g_diffTile - 1) / g_diffTile;
+
+    try
+    {
+        if ((_diffFits == 0) ||
+            (_diffFits->getWidth() != imgW) ||
+            (_diffFits->getHeight() != imgH) ||
+            (_diffFits->getChanAx() != _fits->getChanAx()))
+        {
+            delete _diffFits;
+            _diffFits = 0;
+            _diffFits = ELS::FrameMath::createResult(_fits, _reference);
+
+            // Tiles not computed yet show no difference.
+            float *pixels = (float *)_diffFits->getPixels();
+            std::fill(pixels, pixels + _diffFits->getInfo().numPixels, ELS::FrameMath::getNeutral(op));
+            _diffDirty.assign(tilesX * tilesY, true);
+            discardRenders();
+        }
+    }
+    catch (ELS::FITSException *e)
+    {
+        fprintf(stderr, "FITSException: %s\n", e->getErrText());
+
+        _diffFailed = true;
+        emit fileFailed(_referenceFile.c_str(), e->getErrText());
+        delete e;
+        discardRenders();
+        return;
+    }
+
+    std::vector<ELS::FITSImage::Region> regions;
+    const int firstX = std::max(0, source.left() / g_diffTile);
+    const int lastX = std::min(tilesX - 1, source.right() / g_diffTile);
+    const int firstY = std::max(0, source.top() / g_diffTile);
+    const int lastY = std::min(tilesY - 1, source.bottom() / g_diffTile);
+    for (int ty = firstY; ty <= lastY; ty++)
+    {
+        int tx = firstX;
+        while (tx <= lastX)
+        {
+            if (!_diffDirty[ty * tilesX + tx])
+            {
+                tx++;
+                continue;
+            }
+
+            // A run of out of date tiles goes in one call.
+            int end = tx;
+            while ((end <= lastX) && _diffDirty[ty * tilesX + end])
+            {
+                _diffDirty[ty * tilesX + end] = false;
+                end++;
+            }
+
+            ELS::FITSImage::Region region;
+            region.x = tx * g_diffTile;
+            region.y = ty * g_diffTile;
+            region.width = std::min(end * g_diffTile, imgW) - region.x;
+            region.height = std::min(region.y + g_diffTile, imgH) - region.y;
+            regions.push_back(region);
+
+            tx = end;
+        }
+    }
+
+    // Judged on what is on screen when the view is first shown, then
+    // kept while panning so that the display holds still.
+    const bool wantRange = !_haveDiffRange;
+    if (regions.empty() && !wantRange)
+    {
+        return;
+    }
+
+    ELS::FITSImage::Region visible;
+    visible.x = source.left();
+    visible.y = source.top();
+    visible.width = source.width();
+    visible.height = source.height();
+
+    const int generation = _diffGeneration;
+    const ELS::FITSImage *fits = _fits;
+    const ELS::FITSImage *reference = _reference;
+    ELS::FITSImage *diffFits = _diffFits;
+    const int dx = _referenceDx;
+    const int dy = _referenceDy;
+    _diffWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_INTERACTIVE, [=]()
+                                                        {
+                                                            ELS_TRACE_SCOPE("FITSWidget::startDifference");
+
+                                                            DiffResult result = DiffResult();
+                                                            result.generation = generation;
+                                                            result.regions = regions;
+                                                            try
+                                                            {
+                                                                for (const ELS::FITSImage::Region &region : regions)
+                                                                {
+                                                                    ELS::FrameMath::run(fits, reference, op, dx, dy, diffFits, region);
+                                                                }
+                                                                if (wantRange)
+                                                                {
+                                                                    ELS::FrameMath::symmetricRange(diffFits, op, visible, &result.low, &result.high);
+                                                                    result.haveRange = true;
+                                                                }
+                                                            }
+                                                            catch (ELS::FITSException *e)
+                                                            {
+                                                                result.failed = true;
+                                                                result.errText = e->getErrText();
+                                                                delete e;
+                                                            }
+                                                            return result; }));
+}
+
+// Copies the tiles just computed into the render, rather than
+// rendering the whole frame again; a new range needs that, though.
+void FITSWidget::differenceFinished()
+{
+    DiffResult result = _diffWatcher.result();
+
+    // More may be on screen now, or these went out of date.
+    update();
+    if (result.generation != _diffGeneration)
+    {
+        return;
+    }
+
+    if (result.failed)
+    {
+        fprintf(stderr, "FITSException: %s\n", result.errText.c_str());
+
+        _diffFailed = true;
+        discardRenders();
+        emit fileFailed(_referenceFile.c_str(), result.errText.c_str());
+        return;
+    }
+
+    delete _loupeImage;
+    _loupeImage = 0;
+
+    if (result.haveRange)
+    {
+        _diffLow = result.low;
+        _diffHigh = result.high;
+        _haveDiffRange = true;
+        discardRenders();
+        return;
+    }
+
+    if (_cacheImage == 0)
+    {
+        return;
+    }
 
-void FITSWidget::setFile(const char *filename)
-{
-    if ((_filename == 0) || (strcmp(filename, _filename) != 0))
+    const StretchParams params = FITSRender::linearParams(_diffFits, _diffLow, _diffHigh);
+    const int bytesPerPixel = _cacheImage->depth() / 8;
+    for (const ELS::FITSImage::Region &region : result.regions)
     {
+        QImage *tile = 0;
         try
         {
-            ELS::FITSImage *tmpFits = ELS::FITSImage::load(filename);
-
-            if (_fits != 0)
-            {
-                delete _fits;
-            }
-
-            _filename = filename;
-            _fits = tmpFits;
-
-            emit fileChanged(_filename);
+            tile = FITSRender::renderRegion(_diffFits, region, params);
         }
         catch (ELS::FITSException *e)
         {
-            fprintf(stderr, "FITSException: %s for file %s\n", e->getErrText(), filename);
+            fprintf(stderr, "FITSException: %s\n", e->getErrText());
             delete e;
+            discardRenders();
+            return;
         }
-    }
-}
-
-void FITSWidget::setStretched(bool isStretched)
-{
-    if (_showStretched != isStretched)
-    {
-        _showStretched = isStretched;
 
-        if (_cacheImage != 0)
+        for (int y = 0; y < tile->height(); y++)
         {
-            delete _cacheImage;
-            _cacheImage = 0;
-            update();
+            memcpy(_cacheImage->scanLine(region.y + y) + region.x * bytesPerPixel,
+                   tile->constScanLine(y),
+                   tile->width() * bytesPerPixel);
         }
+        delete tile;
     }
 }
 
-void FITSWidget::setZoom(float zoom)
+// Must be called before any image the diff view reads or writes goes
+// away. Only a screenful of tiles is computed at a time.
+void FITSWidget::waitForDifference()
 {
-    // Adjust zoom to the closest valid value
-    if (zoom != -1.0)
-    {
-        zoom = adjustZoom(zoom);
-    }
+    _diffWatcher.waitForFinished();
+}
 
-    if (_zoom != zoom)
-    {
-        _internalSetZoom(zoom);
-    }
+// Drops everything rendered from the image, for it to be rendered again.
+void FITSWidget::discardRenders()
+{
+    delete _cacheImage;
+    _cacheImage = 0;
+    delete _mosaicImage;
+    _mosaicImage = 0;
+    delete _loupeImage;
+    _loupeImage = 0;
 }
 
 void FITSWidget::wheelEvent(QWheelEvent *event)
@@ -143,8 +1732,25 @@ void FITSWidget::wheelEvent(QWheelEvent *event)
 
 void FITSWidget::paintEvent(QPaintEvent * /* event */)
 {
+    ELS_TRACE_SCOPE("FITSWidget::paintEvent");
+
     QPainter painter(this);
 
+    // A cached preview stands in while the file loads.
+    const bool showPreview = !_preview.preview.isNull();
+    if ((_fits == 0) && !showPreview)
+    {
+        return;
+    }
+
+    // Needs only the patches, never a render of the whole image.
+    if ((_mosaicMode != MM_OFF) && !showPreview)
+    {
+        _lastTarget = QRect();
+        paintMosaic(painter);
+        return;
+    }
+
     int realWidth = width();
     int realHeight = height();
 
@@ -155,13 +1761,8 @@ void FITSWidget::paintEvent(QPaintEvent * /* event */)
     int w = realWidth - (border * 2);
     int h = realHeight - (border * 2);
 
-    if (_cacheImage == 0)
-    {
-        _cacheImage = convertImage();
-    }
-
-    int imgW = _fits->getWidth();
-    int imgH = _fits->getHeight();
+    int imgW = showPreview ? _preview.width : _fits->getWidth();
+    int imgH = showPreview ? _preview.height : _fits->getHeight();
     int imgZoomW = imgW;
     int imgZoomH = imgH;
 
@@ -250,6 +1851,21 @@ void FITSWidget::paintEvent(QPaintEvent * /* event */)
         }
     }
 
+    // Tiles of the diff view are computed as they come on screen, off
+    // the GUI thread. It can't be read while they are, nor shown before
+    // its range is known.
+    const bool diffShown = !showPreview && isDiffShown();
+    if (diffShown)
+    {
+        startDifference(source);
+    }
+    const bool diffPending = diffShown && (!_haveDiffRange || _diffWatcher.isRunning());
+
+    if (!showPreview && (_cacheImage == 0) && !diffPending)
+    {
+        _cacheImage = convertImage();
+    }
+
     if (zoomNow != _actualZoom)
     {
         _actualZoom = zoomNow;
@@ -259,61 +1875,540 @@ void FITSWidget::paintEvent(QPaintEvent * /* event */)
 
     painter.setRenderHint(QPainter::SmoothPixmapTransform);
     painter.setRenderHint(QPainter::Antialiasing);
-    painter.drawImage(target, *_cacheImage, source);
+    {
+        ELS_TRACE_SCOPE("QPainter::drawImage");
+        if (showPreview)
+        {
+            // source is in image pixels; the preview is smaller.
+            const qreal scale = (qreal)_preview.preview.width() / imgW;
+            painter.drawImage(QRectF(target),
+                              _preview.preview,
+                              QRectF(source.left() * scale,
+                                     source.top() * scale,
+                                     source.width() * scale,
+                                     source.height() * scale));
+        }
+        else if (_cacheImage != 0)
+        {
+            painter.drawImage(target, *_cacheImage, source);
+        }
+    }
+
+    // For mapping the cursor back to image pixels.
+    _lastTarget = showPreview ? QRect() : target;
+    _lastSource = source;
+
+    // Until it arrives, what is on screen is the previous file.
+    if ((_openStarted != 0) && (showPreview || !_loadPending))
+    {
+        const float ms = (ELS::FITSTrace::now() - _openStarted) / 1.0e6f;
+        _openStarted = 0;
+
+        emit firstPixelShown(ms);
+    }
+
+    if (_showStars && !showPreview)
+    {
+        // Star analysis runs once the image is on screen, so it never
+        // holds up the first paint.
+        if (!_starsStarted)
+        {
+            startStarAnalysis();
+        }
+
+        paintStars(painter, target, source);
+    }
+
+    if (!showPreview && !diffPending)
+    {
+        paintLoupe(painter);
+    }
+}
+
+// Patches of the image at 1:1, stretched as the whole image would be,
+// in a 3x3 grid with gaps between.
+QImage *FITSWidget::buildMosaic()
+{
+    ELS_TRACE_SCOPE("FITSWidget::buildMosaic");
+
+    const int imgW = _fits->getWidth();
+    const int imgH = _fits->getHeight();
+    const int patch = std::max(1, std::min(_mosaicPatch, std::min(imgW, imgH) / 3));
+    const int gap = 4;
+
+    const ELS::BackgroundModel *background = getBackgroundModel();
+    if (_showStretched && !_haveParams)
+    {
+        _params = FITSRender::computeParams(_fits, background);
+        _haveParams = true;
+    }
+
+    QImage *mosaic = new QImage(patch * 3 + gap * 2, patch * 3 + gap * 2, QImage::Format_RGB32);
+    mosaic->fill(palette().color(QPalette::Dark));
+
+    QPainter painter(mosaic);
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 3; col++)
+        {
+            // Edges are left out of the five-patch layout.
+            if ((_mosaicMode == MM_FIVE) && (((row + col) & 1) != 0))
+            {
+                continue;
+            }
+
+            ELS::FITSImage::Region region;
+            region.x = col * (imgW - patch) / 2;
+            region.y = row * (imgH - patch) / 2;
+            region.width = patch;
+            region.height = patch;
+
+            QImage *qi = 0;
+            try
+            {
+                qi = FITSRender::renderRegion(_fits, region,
+                                              _showStretched ? _params : StretchParams(),
+                                              background);
+                painter.drawImage(QPoint(col * (patch + gap), row * (patch + gap)), *qi);
+            }
+            catch (ELS::FITSException *e)
+            {
+                fprintf(stderr, "FITSException: %s\n", e->getErrText());
+                delete e;
+            }
+
+            delete qi;
+        }
+    }
+
+    return mosaic;
+}
+
+// Draws the mosaic at 1:1, or scaled down to fit if it doesn't.
+void FITSWidget::paintMosaic(QPainter &painter)
+{
+    if (_mosaicImage == 0)
+    {
+        _mosaicImage = buildMosaic();
+    }
+
+    QSize size = _mosaicImage->size();
+    if ((size.width() > width()) || (size.height() > height()))
+    {
+        size.scale(this->size(), Qt::KeepAspectRatio);
+    }
+
+    const QRect target((width() - size.width()) / 2,
+                       (height() - size.height()) / 2,
+                       size.width(),
+                       size.height());
+
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    painter.drawImage(target, *_mosaicImage);
+
+    if ((_openStarted != 0) && !_loadPending)
+    {
+        const float ms = (ELS::FITSTrace::now() - _openStarted) / 1.0e6f;
+        _openStarted = 0;
+
+        emit firstPixelShown(ms);
+    }
+}
+
+QImage *FITSWidget::convertImage()
+{
+    ELS_TRACE_SCOPE("FITSWidget::convertImage");
+
+    // Signed, so always shown linearly about no difference.
+    if (isDiffShown())
+    {
+        return FITSRender::render(_diffFits, FITSRender::linearParams(_diffFits, _diffLow, _diffHigh));
+    }
+
+    std::string key;
+    if (_sharedCache != 0)
+    {
+        key = std::string("render|") + (_showStretched ? "stretched|" : "linear|") +
+              (_backgroundMode == BG_SUBTRACT ? "subtracted|" : (_backgroundMode == BG_DIVIDE ? "divided|" : "")) +
+              (_cfaFits != 0 ? ELS::Debayer::getModeName(_debayerMode) : "") +
+              (_uncorrected != 0 ? "|cosmetic|" : "|") + _frameKey;
+
+        QImage *shared = FITSRender::attachShared(_sharedCache, key);
+        if (shared != 0)
+        {
+            return shared;
+        }
+    }
+
+    // Parameters computed here are kept, for the loupe and the mosaic.
+    const ELS::BackgroundModel *background = getBackgroundModel();
+    QImage *image = 0;
+    if (_showStretched && _haveParams)
+    {
+        image = FITSRender::render(_fits, _params, 1, background);
+    }
+    else if (_showStretched)
+    {
+        image = FITSRender::render(_fits, true, &_params, 1, background);
+        _haveParams = true;
+    }
+    else
+    {
+        image = FITSRender::render(_fits, false, 0, 1, background);
+    }
+
+    if (_sharedCache != 0)
+    {
+        image = FITSRender::publishShared(_sharedCache, key, image);
+    }
+
+    return image;
+}
+
+void FITSWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    const QPoint pos = event->pos();
+
+    // Just the loupe's old and new places are repainted.
+    update(loupeFrame());
+    _mousePos = pos;
+
+    if ((_fits == 0) || !_lastTarget.contains(pos))
+    {
+        if (_cursor.x() != -1)
+        {
+            _cursor = QPoint(-1, -1);
+
+            emit cursorLeft();
+        }
+        return;
+    }
+
+    const float scaleX = (float)_lastSource.width() / _lastTarget.width();
+    const float scaleY = (float)_lastSource.height() / _lastTarget.height();
+    const int x = std::min(_lastSource.left() + (int)((pos.x() - _lastTarget.left()) * scaleX), _fits->getWidth() - 1);
+    const int y = std::min(_lastSource.top() + (int)((pos.y() - _lastTarget.top()) * scaleY), _fits->getHeight() - 1);
+    if (QPoint(x, y) != _cursor)
+    {
+        _cursor = QPoint(x, y);
+
+        emitReadout();
+    }
+
+    update(loupeFrame());
+}
+
+void FITSWidget::leaveEvent(QEvent * /* event */)
+{
+    if (_cursor.x() != -1)
+    {
+        update(loupeFrame());
+        _cursor = QPoint(-1, -1);
+
+        emit cursorLeft();
+    }
+}
+
+// Where the loupe is drawn, centred on the cursor; empty when there is
+// none. Its side is an odd number of source pixels, so the one under
+// the cursor sits in the middle.
+QRect FITSWidget::loupeFrame() const
+{
+    if ((_loupe == 0) || (_cursor.x() == -1))
+    {
+        return QRect();
+    }
+
+    const int side = ((g_loupeSize / _loupe) | 1) * _loupe;
+    return QRect(_mousePos.x() - side / 2, _mousePos.y() - side / 2, side, side);
+}
+
+// The source pixels around the cursor, magnified without smoothing and
+// stretched as the image is. Only those pixels are rendered, again
+// only when the cursor moves to another one.
+void FITSWidget::paintLoupe(QPainter &painter)
+{
+    const QRect frame = loupeFrame();
+    if (frame.isEmpty())
+    {
+        return;
+    }
+
+    const int span = frame.width() / _loupe;
+    const QPoint corner(_cursor.x() - span / 2, _cursor.y() - span / 2);
+    if ((_loupeImage == 0) || (_loupeCenter != _cursor))
+    {
+        delete _loupeImage;
+        _loupeImage = 0;
+
+        ELS::FITSImage::Region region;
+        region.x = std::max(corner.x(), 0);
+        region.y = std::max(corner.y(), 0);
+        region.width = std::min(corner.x() + span, _fits->getWidth()) - region.x;
+        region.height = std::min(corner.y() + span, _fits->getHeight()) - region.y;
+
+        try
+        {
+            if (isDiffShown())
+            {
+                _loupeImage = FITSRender::renderRegion(_diffFits, region,
+                                                       FITSRender::linearParams(_diffFits, _diffLow, _diffHigh));
+            }
+            else
+            {
+                // Once per image, for a render that didn't compute them.
+                const ELS::BackgroundModel *background = getBackgroundModel();
+                if (_showStretched && !_haveParams)
+                {
+                    _params = FITSRender::computeParams(_fits, background);
+                    _haveParams = true;
+                }
+                _loupeImage = FITSRender::renderRegion(_fits, region,
+                                                       _showStretched ? _params : StretchParams(),
+                                                       background);
+            }
+        }
+        catch (ELS::FITSException *e)
+        {
+            fprintf(stderr, "FITSException: %s\n", e->getErrText());
+            delete e;
+            return;
+        }
+
+        _loupeCenter = _cursor;
+        _loupeSource = QRect(region.x, region.y, region.width, region.height);
+    }
+
+    painter.save();
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, false);
+    painter.fillRect(frame, Qt::black);
+    painter.drawImage(QRect(frame.left() + (_loupeSource.left() - corner.x()) * _loupe,
+                            frame.top() + (_loupeSource.top() - corner.y()) * _loupe,
+                            _loupeSource.width() * _loupe,
+                            _loupeSource.height() * _loupe),
+                      *_loupeImage);
+
+    // The pixel under the cursor, and the loupe's edge.
+    painter.setPen(QColor(255, 255, 0, 160));
+    painter.drawRect(frame.left() + (span / 2) * _loupe, frame.top() + (span / 2) * _loupe, _loupe - 1, _loupe - 1);
+    painter.setPen(QColor(255, 255, 255, 160));
+    painter.drawRect(frame.adjusted(0, 0, -1, -1));
+    painter.restore();
+}
+
+// Builds the tables behind the cursor statistics for the image shown.
+void FITSWidget::startRegionStatistics()
+{
+    cancelRegionStatistics();
+
+    ELS::RegionStatistics *stats = &_regionStats;
+    const ELS::FITSImage *image = _fits;
+    _regionJob = ELS::Executor::global()->submit(ELS::Executor::EL_BACKGROUND, [=](const ELS::CancelToken &token)
+                                                 { stats->compute(image, token.getFlag()); });
+}
+
+// Must be called before the image the tables are for goes away.
+void FITSWidget::cancelRegionStatistics()
+{
+    if (_regionJob.isValid())
+    {
+        _regionJob.cancel();
+        _regionJob.waitForFinished();
+        _regionJob = ELS::Executor::Job();
+    }
+
+    _regionStats.clear();
+}
+
+// Only reads, plus four table lookups per channel, so it keeps up with
+// the mouse whatever the aperture.
+void FITSWidget::emitReadout()
+{
+    if ((_fits == 0) || (_cursor.x() < 0) || (_cursor.x() >= _fits->getWidth()) || (_cursor.y() >= _fits->getHeight()))
+    {
+        return;
+    }
+
+    Readout readout = Readout();
+    readout.x = _cursor.x() + _fits->getOriginX();
+    readout.y = _cursor.y() + _fits->getOriginY();
+    readout.channels = _fits->isColor() ? 3 : 1;
+
+    const bool haveTables = _regionJob.isValid() && _regionJob.isFinished() && _regionStats.isValid();
+    if (!haveTables && _regionJob.isValid())
+    {
+        // Someone is waiting on it now.
+        _regionJob.boost();
+    }
+
+    const int half = _aperture / 2;
+    for (int channel = 0; channel < readout.channels; channel++)
+    {
+        readout.value[channel] = ELS::RegionStatistics::getValue(_fits, channel, _cursor.x(), _cursor.y());
+        if (haveTables)
+        {
+            readout.box[channel] = _regionStats.measure(channel, _cursor.x() - half, _cursor.y() - half,
+                                                        _aperture, _aperture);
+        }
+    }
+    readout.haveBox = haveTables;
+
+    emit cursorReadout(readout);
+}
+
+void FITSWidget::startStarAnalysis()
+{
+    cancelStarAnalysis();
+
+    _starsStarted = true;
+
+    // One cancelled on the same image may still be reading it.
+    std::shared_ptr<StarJob> previous;
+    if ((_starJob != 0) && (_starJob->image == _fits))
+    {
+        previous = _starJob;
+    }
+
+    std::shared_ptr<StarJob> job = std::make_shared<StarJob>();
+    job->image = _fits;
+    job->running = true;
+    _starJob = job;
+
+    _starWatcher.setFuture(ELS::Executor::global()->run(ELS::Executor::EL_BACKGROUND, [=]()
+                                                        {
+                                                            ELS::StarAnalysis result = ELS::StarFinder().analyze(job->image, job->token.getFlag());
+                                                            if (previous != 0)
+                                                            {
+                                                                std::unique_lock<std::mutex> lock(previous->mutex);
+                                                                previous->finished.wait(lock, [=]()
+                                                                                        { return !previous->running; });
+                                                            }
+
+                                                            std::function<void()> dispose;
+                                                            {
+                                                                std::lock_guard<std::mutex> lock(job->mutex);
+                                                                job->running = false;
+                                                                dispose = job->dispose;
+                                                            }
+                                                            job->finished.notify_all();
+                                                            if (dispose)
+                                                            {
+                                                                dispose();
+                                                            }
+
+                                                            return result; }));
+}
+
+// Doesn't wait for the analysis to stop; its image must go through
+// retireImage() or deleteImage().
+void FITSWidget::cancelStarAnalysis()
+{
+    if (_starJob != 0)
+    {
+        _starJob->token.cancel();
+    }
+
+    // Also drops a result already queued for delivery.
+    _starWatcher.setFuture(QFuture<ELS::StarAnalysis>());
+
+    _starsStarted = false;
+    _stars = ELS::StarAnalysis();
 }
 
-QImage *FITSWidget::convertImage() const
+void FITSWidget::starAnalysisFinished()
 {
-    int width = _fits->getWidth();
-    int height = _fits->getHeight();
-    bool isColor = _fits->isColor();
+    // Nothing to deliver after a cancel.
+    if (_starWatcher.isCanceled() || (_starJob == 0) || _starJob->token.isCancelled())
+    {
+        return;
+    }
+
+    ELS::StarAnalysis result = _starWatcher.result();
+    if (result.isValid())
+    {
+        _stars = result;
+
+        update();
+
+        emit starsAnalyzed(_stars);
+    }
+}
 
-    QImage::Format format = QImage::Format_ARGB32;
-    if (!isColor)
+// Runs dispose once image is free of the star analysis, now unless the
+// analysis is still reading it.
+void FITSWidget::retireImage(ELS::FITSImage *image,
+                             const std::function<void()> &dispose)
+{
+    if ((image != 0) && (_starJob != 0) && (_starJob->image == image))
     {
-        format = QImage::Format_Grayscale8;
+        std::lock_guard<std::mutex> lock(_starJob->mutex);
+        if (_starJob->running)
+        {
+            _starJob->dispose = dispose;
+            return;
+        }
     }
 
-    const void *pixels = _fits->getPixels();
+    dispose();
+}
+
+void FITSWidget::deleteImage(ELS::FITSImage *image)
+{
+    retireImage(image, [=]()
+                { delete image; });
+}
 
-    int fitsioDataType = 0;
-    switch (_fits->getBitDepth())
+void FITSWidget::paintStars(QPainter &painter,
+                            const QRect &target,
+                            const QRect &source) const
+{
+    if (!_stars.isValid())
     {
-    case ELS::FITSImage::BD_INT_8:
-        fitsioDataType = TBYTE;
-        break;
-    case ELS::FITSImage::BD_INT_16:
-        fitsioDataType = TUSHORT;
-        break;
-    case ELS::FITSImage::BD_INT_32:
-        fitsioDataType = TUINT;
-        break;
-    case ELS::FITSImage::BD_FLOAT:
-        fitsioDataType = TFLOAT;
-        break;
-    case ELS::FITSImage::BD_DOUBLE:
-        fitsioDataType = TDOUBLE;
-        break;
+        painter.setPen(Qt::yellow);
+        painter.drawText(rect().adjusted(8, 8, -8, -8), Qt::AlignLeft | Qt::AlignTop, "Finding stars...");
+        return;
     }
 
-    QImage *qi = new QImage(width,
-                            height,
-                            format);
+    const float scaleX = (float)target.width() / source.width();
+    const float scaleY = (float)target.height() / source.height();
 
-    Stretch cunningham(width,
-                       height,
-                       isColor ? 3 : 1,
-                       fitsioDataType);
+    // Brightest first, so a cap on the count keeps the stars that matter.
+    constexpr int maxDrawn = 5000;
+    int drawn = 0;
 
-    if (_showStretched)
+    painter.setBrush(Qt::NoBrush);
+    for (const ELS::Star &star : _stars.getStars())
     {
-        StretchParams sp = cunningham.computeParams((const uint8_t *)pixels);
-        cunningham.setParams(sp);
+        if ((star.x < source.left()) || (star.x >= source.right() + 1) ||
+            (star.y < source.top()) || (star.y >= source.bottom() + 1))
+        {
+            continue;
+        }
+
+        const float x = target.left() + (star.x + 0.5f - source.left()) * scaleX;
+        const float y = target.top() + (star.y + 0.5f - source.top()) * scaleY;
+        const float radius = std::max(4.0f, 2 * star.hfr * scaleX);
+
+        painter.setPen(star.saturated ? Qt::red : Qt::green);
+        painter.drawEllipse(QPointF(x, y), radius, radius);
+
+        if (++drawn == maxDrawn)
+        {
+            break;
+        }
     }
 
-    cunningham.run((uint8_t const *)pixels, qi);
+    QString summary = QString("%1 stars   HFR %2 px   FWHM %3 px   ecc %4")
+                          .arg(_stars.getStarCount())
+                          .arg(_stars.getMedianHFR(), 0, 'f', 2)
+                          .arg(_stars.getMedianFWHM(), 0, 'f', 2)
+                          .arg(_stars.getMedianEccentricity(), 0, 'f', 2);
 
-    return qi;
+    QRect box = painter.fontMetrics().boundingRect(summary).adjusted(-6, -4, 6, 4);
+    box.moveTopLeft(QPoint(8, 8));
+    painter.fillRect(box, QColor(0, 0, 0, 160));
+    painter.setPen(Qt::green);
+    painter.drawText(box, Qt::AlignCenter, summary);
 }
 
 void FITSWidget::_internalSetZoom(float zoom)
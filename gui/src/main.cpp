@@ -1,14 +1,115 @@
 #include "mainwindow.h"
+#include "singleinstance.h"
+#include "fitstrace.h"
 
+#include <string.h>
 #include <QApplication>
 #include <QLabel>
 
+namespace
+{
+
+    // The files named after the program; what is left of the options
+    // isn't.
+    QStringList getFiles(const QStringList &arguments)
+    {
+        QStringList files;
+        for (int i = 1; i < arguments.size(); i++)
+        {
+            if (!arguments[i].startsWith('-'))
+            {
+                files.append(arguments[i]);
+            }
+        }
+
+        return files;
+    }
+
+}
+
 int main(int argc, char *argv[])
 {
+    const int64_t launchStarted = ELS::FITSTrace::now();
+
+    // Qt's own options, such as -style or -platform, are only taken out
+    // of the arguments by QApplication.
+    bool newInstance = false;
+    bool qtOptions = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--new-instance") == 0)
+        {
+            newInstance = true;
+        }
+        else if (argv[i][0] == '-')
+        {
+            qtOptions = true;
+        }
+    }
+
+    // Files go to a viewer that is already running, unless asked not
+    // to. This happens before QApplication, which is most of the cost
+    // of starting up; the sockets only need a QCoreApplication. With
+    // Qt options it waits for QApplication, below.
+    if (!newInstance && !qtOptions)
+    {
+        QCoreApplication core(argc, argv);
+        if (SingleInstance::forward(getFiles(core.arguments())))
+        {
+            return 0;
+        }
+    }
+
     QApplication a(argc, argv);
+    const QStringList files = getFiles(a.arguments());
+
+    // QTFITS_TRACE=<file> records where the time goes and writes it out
+    // as a Chrome trace on exit.
+    QByteArray traceFile = qgetenv("QTFITS_TRACE");
+    if (!traceFile.isEmpty())
+    {
+        ELS::FITSTrace::setEnabled(true);
+    }
+
     MainWindow w;
+    w.setLaunchStarted(launchStarted);
+
+    SingleInstance instance;
+    if (!newInstance)
+    {
+        QObject::connect(&instance, &SingleInstance::filesReceived,
+                         &w, &MainWindow::openFiles);
+        if (!instance.listen() && SingleInstance::forward(files))
+        {
+            // Another viewer has the socket: it was running and there
+            // were Qt options, or it started at the same time.
+            return 0;
+        }
+    }
+
+    // Loading is asynchronous, so starting it before show() overlaps the
+    // header probe and preview read with the window being mapped.
+    if (files.isEmpty())
+    {
+        printf("No file specified\n");
+        fflush(stdout);
+    }
+    else
+    {
+        w.openFiles(files);
+    }
 
     w.show();
 
-    return a.exec();
+    int result = a.exec();
+
+    if (!traceFile.isEmpty())
+    {
+        if (!ELS::FITSTrace::writeChromeTrace(traceFile.constData()))
+        {
+            fprintf(stderr, "Can't write trace %s\n", traceFile.constData());
+        }
+    }
+
+    return result;
 }
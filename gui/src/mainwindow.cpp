@@ -1,21 +1,63 @@
+#include <algorithm>
+#include <functional>
 #include <QApplication>
+#include <QFileInfo>
+#include <QStatusBar>
+#include <QTimer>
 
 #include "mainwindow.h"
 #include "fitsimage.h"
+#include "fitstrace.h"
+
+namespace
+{
+
+    // What a launch may take to get a frame, or a preview of it, on
+    // screen.
+    const float g_firstPixelBudgetMs = 150.0f;
+
+}
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent),
+      frameCache(),
       mainPane(),
       layout(&mainPane),
+      viewStack(),
       fitsWidget(),
-      onIcon(":/icon/stretch-icon.png"),
-      offIcon(":/icon/stretch-icon-off.png"),
+      compareWidget(),
+      onIcon(),
+      offIcon(),
       bottomLayout(),
-      stretchBtn(offIcon, ""),
+      stretchBtn(""),
       showingStretched(false),
+      debayerCombo(),
+      binCombo(),
+      binModeCombo(),
+      starsBtn("HFR"),
+      cosmeticBtn("Hot"),
+      backgroundCombo(),
+      planeSlider(Qt::Horizontal),
+      planeLabel(),
       currentZoom("--"),
       zoomFitBtn("fit"),
-      zoom100Btn("1:1")
+      zoom100Btn("1:1"),
+      mosaicCombo(),
+      patchCombo(),
+      referenceBtn("B"),
+      diffCombo(),
+      apertureSpin(),
+      loupeCombo(),
+      readoutLabel(),
+      compareBtn("A|B"),
+      compareModeCombo(),
+      blinkRateSpin(),
+      filesDock("Files"),
+      fileList(),
+      memoryDock("Memory"),
+      memoryPanel(),
+      memoryAction("Memory panel"),
+      launchStarted(0)
 {
     const QSize iconSize(20, 20);
     const QSize btnSize(30, 30);
@@ -35,61 +77,296 @@ MainWindow::MainWindow(QWidget *parent)
     zoom100Btn.setMinimumSize(btnSize);
     zoom100Btn.setMaximumSize(btnSize);
 
+    mosaicCombo.addItem("Whole image", FITSWidget::MM_OFF);
+    mosaicCombo.addItem("3x3 at 1:1", FITSWidget::MM_NINE);
+    mosaicCombo.addItem("Corners + centre at 1:1", FITSWidget::MM_FIVE);
+    mosaicCombo.setToolTip("Show the centre and corners at 1:1, to check tilt and coma");
+    patchCombo.addItem("128 px", 128);
+    patchCombo.addItem("256 px", 256);
+    patchCombo.addItem("512 px", 512);
+    patchCombo.setCurrentIndex(patchCombo.findData(fitsWidget.getMosaicPatchSize()));
+    patchCombo.setToolTip("Size of each 1:1 patch");
+    patchCombo.setEnabled(false);
+
+    referenceBtn.setStyleSheet(btnStyle);
+    referenceBtn.setMinimumSize(btnSize);
+    referenceBtn.setMaximumSize(btnSize);
+    referenceBtn.setToolTip("Use the frame shown as the reference B");
+    diffCombo.addItem("A", FITSWidget::DV_OFF);
+    diffCombo.addItem("A - B", FITSWidget::DV_DIFFERENCE);
+    diffCombo.addItem("A / B", FITSWidget::DV_RATIO);
+    diffCombo.setToolTip("Show the frame shown (A) against the reference (B)");
+
+    apertureSpin.setRange(1, 255);
+    apertureSpin.setSingleStep(2);
+    apertureSpin.setValue(fitsWidget.getAperture());
+    apertureSpin.setSuffix(" px");
+    apertureSpin.setToolTip("Aperture for the statistics under the cursor");
+    readoutLabel.setStyleSheet("QLabel{color: #999;}");
+    loupeCombo.addItem("No loupe", 0);
+    loupeCombo.addItem("Loupe 4x", 4);
+    loupeCombo.addItem("Loupe 8x", 8);
+    loupeCombo.addItem("Loupe 16x", 16);
+    loupeCombo.setToolTip("Magnify the raw pixels under the cursor");
+
+    compareBtn.setStyleSheet(btnStyle);
+    compareBtn.setMinimumSize(btnSize);
+    compareBtn.setMaximumSize(btnSize);
+    compareBtn.setCheckable(true);
+    compareBtn.setToolTip("Compare the selected files (or all of them) at the same zoom and stretch");
+    compareModeCombo.addItem("Blink", CompareWidget::CM_BLINK);
+    compareModeCombo.addItem("Side by side", CompareWidget::CM_SIDE_BY_SIDE);
+    compareModeCombo.setEnabled(false);
+    blinkRateSpin.setRange(1, 30);
+    blinkRateSpin.setValue(compareWidget.getBlinkRate());
+    blinkRateSpin.setSuffix(" Hz");
+    blinkRateSpin.setToolTip("Blink rate; space pauses, arrow keys step");
+    blinkRateSpin.setEnabled(false);
+
+    debayerCombo.addItem(ELS::Debayer::getModeName(ELS::Debayer::DM_BILINEAR), ELS::Debayer::DM_BILINEAR);
+    debayerCombo.addItem(ELS::Debayer::getModeName(ELS::Debayer::DM_VNG_LITE), ELS::Debayer::DM_VNG_LITE);
+    debayerCombo.addItem(ELS::Debayer::getModeName(ELS::Debayer::DM_SUPERPIXEL), ELS::Debayer::DM_SUPERPIXEL);
+    debayerCombo.setToolTip("Debayer mode for one-shot-colour frames");
+    debayerCombo.setEnabled(false);
+
+    binCombo.addItem("1x1", 1);
+    binCombo.addItem("Bin 2x2", 2);
+    binCombo.addItem("Bin 3x3", 3);
+    binCombo.setToolTip("Bin pixels as frames are read");
+    binModeCombo.addItem("Average", ELS::FITSImage::BM_AVERAGE);
+    binModeCombo.addItem("Sum", ELS::FITSImage::BM_SUM);
+    binModeCombo.setToolTip("Combine the pixels of a bin by averaging or summing");
+    binModeCombo.setEnabled(false);
+
+    starsBtn.setStyleSheet(btnStyle);
+    starsBtn.setMinimumSize(btnSize);
+    starsBtn.setMaximumSize(btnSize);
+    starsBtn.setCheckable(true);
+    starsBtn.setToolTip("Detect stars and show HFR/FWHM");
+
+    cosmeticBtn.setStyleSheet(btnStyle);
+    cosmeticBtn.setMinimumSize(btnSize);
+    cosmeticBtn.setMaximumSize(btnSize);
+    cosmeticBtn.setCheckable(true);
+    cosmeticBtn.setToolTip("Replace hot and cold pixels by their neighbourhood median");
+
+    backgroundCombo.addItem("No flattening", FITSWidget::BG_OFF);
+    backgroundCombo.addItem("Subtract gradient", FITSWidget::BG_SUBTRACT);
+    backgroundCombo.addItem("Divide gradient", FITSWidget::BG_DIVIDE);
+    backgroundCombo.setToolTip("Take a fitted sky background gradient out of the image shown");
+
+    // Scrubber for cubes and multi-extension files, shown only for them.
+    planeSlider.setToolTip("Plane");
+    planeSlider.setMinimumWidth(200);
+    planeSlider.hide();
+    planeLabel.setStyleSheet("QLabel{color: #999;}");
+    planeLabel.hide();
+
     currentZoom.setStyleSheet("QLabel{border: 1px solid #666;border-radius: 7px;color: #999;}");
     currentZoom.setAlignment(Qt::AlignCenter);
     currentZoom.setMinimumWidth(65);
 
     bottomLayout.addWidget(&stretchBtn);
+    bottomLayout.addWidget(&debayerCombo);
+    bottomLayout.addWidget(&binCombo);
+    bottomLayout.addWidget(&binModeCombo);
+    bottomLayout.addWidget(&starsBtn);
+    bottomLayout.addWidget(&cosmeticBtn);
+    bottomLayout.addWidget(&backgroundCombo);
     bottomLayout.addStretch(1);
+    bottomLayout.addWidget(&planeSlider);
+    bottomLayout.addWidget(&planeLabel);
     bottomLayout.addWidget(&zoomFitBtn);
     bottomLayout.addWidget(&zoom100Btn);
+    bottomLayout.addWidget(&mosaicCombo);
+    bottomLayout.addWidget(&patchCombo);
+    bottomLayout.addWidget(&referenceBtn);
+    bottomLayout.addWidget(&diffCombo);
+    bottomLayout.addWidget(&apertureSpin);
+    bottomLayout.addWidget(&loupeCombo);
+    bottomLayout.addWidget(&compareBtn);
+    bottomLayout.addWidget(&compareModeCombo);
+    bottomLayout.addWidget(&blinkRateSpin);
     bottomLayout.addWidget(&currentZoom);
 
-    layout.addWidget(&fitsWidget);
+    viewStack.addWidget(&fitsWidget);
+    viewStack.addWidget(&compareWidget);
+    layout.addWidget(&viewStack);
     layout.addLayout(&bottomLayout);
 
     setCentralWidget(&mainPane);
+    statusBar()->addPermanentWidget(&readoutLabel);
+
+    fitsWidget.setFrameCache(&frameCache);
+    fitsWidget.setPreviewCache(PreviewCache::global());
+    fitsWidget.setSharedCache(ELS::FITSSharedCache::global());
+
+    // Browse list, shown once there is more than one file.
+    fileList.setSelectionMode(QAbstractItemView::ExtendedSelection);
+    filesDock.setWidget(&fileList);
+    filesDock.hide();
+    addDockWidget(Qt::LeftDockWidgetArea, &filesDock);
+
+    // Debug view of the memory budget, hidden until F12.
+    memoryDock.setWidget(&memoryPanel);
+    memoryDock.hide();
+    addDockWidget(Qt::RightDockWidgetArea, &memoryDock);
+    memoryAction.setShortcut(Qt::Key_F12);
+    memoryAction.setCheckable(true);
+    addAction(&memoryAction);
 
     QObject::connect(&fitsWidget, &FITSWidget::fileChanged,
                      this, &MainWindow::fitsFileChanged);
+    QObject::connect(&fitsWidget, &FITSWidget::planeChanged,
+                     this, &MainWindow::fitsPlaneChanged);
     QObject::connect(&fitsWidget, &FITSWidget::fileFailed,
                      this, &MainWindow::fitsFileFailed);
     QObject::connect(&fitsWidget, &FITSWidget::actualZoomChanged,
                      this, &MainWindow::fitsZoomChanged);
+    QObject::connect(&fitsWidget, &FITSWidget::firstPixelShown,
+                     this, &MainWindow::fitsFirstPixelShown);
     QObject::connect(&stretchBtn, &QPushButton::toggled,
                      this, &MainWindow::stretchToggled);
     QObject::connect(this, &MainWindow::toggleStretched,
                      &fitsWidget, &FITSWidget::setStretched);
+    QObject::connect(&debayerCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::debayerModeChanged);
+    QObject::connect(&starsBtn, &QPushButton::toggled,
+                     this, &MainWindow::starsToggled);
+    QObject::connect(&cosmeticBtn, &QPushButton::toggled,
+                     &fitsWidget, &FITSWidget::setCosmeticCorrection);
+    QObject::connect(&backgroundCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::backgroundChanged);
+    QObject::connect(&planeSlider, &QSlider::valueChanged,
+                     &fitsWidget, &FITSWidget::setPlane);
     QObject::connect(&zoomFitBtn, &QPushButton::clicked,
                      this, &MainWindow::zoomFitClicked);
     QObject::connect(&zoom100Btn, &QPushButton::clicked,
                      this, &MainWindow::zoom100Clicked);
+    QObject::connect(&mosaicCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::mosaicModeChanged);
+    QObject::connect(&patchCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::mosaicPatchChanged);
+    QObject::connect(&binCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::binningChanged);
+    QObject::connect(&binModeCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::binningChanged);
+    QObject::connect(&referenceBtn, &QPushButton::clicked,
+                     this, &MainWindow::referenceClicked);
+    QObject::connect(&diffCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::diffViewChanged);
+    QObject::connect(&fitsWidget, &FITSWidget::referenceChanged,
+                     this, &MainWindow::fitsReferenceChanged);
+    QObject::connect(&apertureSpin, QOverload<int>::of(&QSpinBox::valueChanged),
+                     &fitsWidget, &FITSWidget::setAperture);
+    QObject::connect(&loupeCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::loupeChanged);
+    QObject::connect(&fitsWidget, &FITSWidget::cursorReadout,
+                     this, &MainWindow::fitsCursorReadout);
+    QObject::connect(&fitsWidget, &FITSWidget::cursorLeft,
+                     this, &MainWindow::fitsCursorLeft);
+    QObject::connect(&compareBtn, &QPushButton::toggled,
+                     this, &MainWindow::compareToggled);
+    QObject::connect(&compareModeCombo, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                     this, &MainWindow::compareModeChanged);
+    QObject::connect(&blinkRateSpin, QOverload<int>::of(&QSpinBox::valueChanged),
+                     &compareWidget, &CompareWidget::setBlinkRate);
+    QObject::connect(this, &MainWindow::toggleStretched,
+                     &compareWidget, &CompareWidget::setStretched);
+    QObject::connect(&compareWidget, &CompareWidget::currentChanged,
+                     this, &MainWindow::compareCurrentChanged);
+    QObject::connect(&memoryAction, &QAction::toggled,
+                     this, &MainWindow::memoryPanelToggled);
+    QObject::connect(&memoryDock, &QDockWidget::visibilityChanged,
+                     &memoryAction, &QAction::setChecked);
+    QObject::connect(&fileList, &QListWidget::currentRowChanged,
+                     this, &MainWindow::fileListRowChanged);
 
-    QStringList args = QApplication::arguments();
-    if (args.length() < 2)
+    // Nothing needed for the first frame is loaded until it is shown.
+    QTimer::singleShot(0, this, &MainWindow::finishStartup);
+}
+
+MainWindow::~MainWindow()
+{
+}
+
+void MainWindow::openFiles(const QStringList &files)
+{
+    // Forwarded from another invocation, so come to the front.
+    if (isVisible())
     {
-        printf("No file specified\n");
-        fflush(stdout);
+        if (isMinimized())
+        {
+            showNormal();
+        }
+        raise();
+        activateWindow();
     }
-    else
+
+    int first = -1;
+    for (const QString &file : files)
     {
-        if (args.length() == 2)
+        const QString path = QFileInfo(file).absoluteFilePath();
+
+        int row = 0;
+        while ((row < fileList.count()) && (fileList.item(row)->data(Qt::UserRole).toString() != path))
+        {
+            row++;
+        }
+        if (row == fileList.count())
         {
-            const char *filename = args.at(1).toLocal8Bit().constData();
-            printf("Setting file %s\n", filename);
-            fflush(stdout);
-            fitsWidget.setFile(filename);
+            QListWidgetItem *item = new QListWidgetItem(QFileInfo(path).fileName(), &fileList);
+            item->setData(Qt::UserRole, path);
+            item->setToolTip(path);
+        }
+
+        if (first < 0)
+        {
+            first = row;
+        }
+    }
+
+    if (fileList.count() > 1)
+    {
+        filesDock.show();
+    }
+
+    if (first >= 0)
+    {
+        if (first == fileList.currentRow())
+        {
+            fileListRowChanged(first);
         }
         else
         {
-            fprintf(stderr, "You confused me with all those arguments\n");
-            fflush(stderr);
+            fileList.setCurrentRow(first);
         }
     }
 }
 
-MainWindow::~MainWindow()
+void MainWindow::setLaunchStarted(int64_t started)
 {
+    launchStarted = started;
+}
+
+void MainWindow::finishStartup()
+{
+    onIcon = QIcon(":/icon/stretch-icon.png");
+    offIcon = QIcon(":/icon/stretch-icon-off.png");
+    stretchBtn.setIcon(showingStretched ? onIcon : offIcon);
+}
+
+void MainWindow::fileListRowChanged(int row)
+{
+    if (row < 0)
+    {
+        return;
+    }
+
+    const QByteArray filename = fileList.item(row)->data(Qt::UserRole).toString().toLocal8Bit();
+    printf("Setting file %s\n", filename.constData());
+    fflush(stdout);
+    fitsWidget.setFile(filename.constData());
 }
 
 void MainWindow::fitsFileChanged(const char *filename)
@@ -99,7 +376,33 @@ void MainWindow::fitsFileChanged(const char *filename)
     const ELS::FITSImage *image = fitsWidget.getImage();
     printf("%s\n", image->getImageType());
     printf("%s\n", image->getSizeAndColor());
+    if (fitsWidget.isDebayered())
+    {
+        printf("Debayered (%s)\n", ELS::Debayer::getModeName(fitsWidget.getDebayerMode()));
+    }
     fflush(stdout);
+
+    debayerCombo.setEnabled(fitsWidget.isDebayered());
+
+    const int planeCount = fitsWidget.getPlaneCount();
+    planeSlider.blockSignals(true);
+    planeSlider.setRange(0, std::max(planeCount - 1, 0));
+    planeSlider.setValue(fitsWidget.getPlane());
+    planeSlider.blockSignals(false);
+    planeSlider.setVisible(planeCount > 1);
+    planeLabel.setVisible(planeCount > 1);
+    fitsPlaneChanged(fitsWidget.getPlane());
+}
+
+void MainWindow::fitsPlaneChanged(int plane)
+{
+    const ELS::FITSImage *image = fitsWidget.getImage();
+    QString text = QString("%1 / %2").arg(plane + 1).arg(fitsWidget.getPlaneCount());
+    if (image->getInfo().extName[0] != 0)
+    {
+        text += QString(" (%1)").arg(image->getInfo().extName);
+    }
+    planeLabel.setText(text);
 }
 
 void MainWindow::fitsFileFailed(const char *filename,
@@ -116,6 +419,27 @@ void MainWindow::fitsZoomChanged(float zoom)
     currentZoom.setText(tmp);
 }
 
+void MainWindow::fitsFirstPixelShown(float ms)
+{
+    if (launchStarted != 0)
+    {
+        const float launchMs = (ELS::FITSTrace::now() - launchStarted) / 1.0e6f;
+        launchStarted = 0;
+
+        printf("Launch to first pixel: %.1f ms\n", launchMs);
+        if (launchMs > g_firstPixelBudgetMs)
+        {
+            printf("Over the %.0f ms budget\n", g_firstPixelBudgetMs);
+        }
+        fflush(stdout);
+
+        statusBar()->showMessage(QString("Launch to first pixel: %1 ms").arg(launchMs, 0, 'f', 1));
+        return;
+    }
+
+    statusBar()->showMessage(QString("Open to first pixel: %1 ms").arg(ms, 0, 'f', 1));
+}
+
 void MainWindow::stretchToggled(bool isChecked)
 {
     if (showingStretched != isChecked)
@@ -136,6 +460,16 @@ void MainWindow::stretchToggled(bool isChecked)
     }
 }
 
+void MainWindow::debayerModeChanged(int index)
+{
+    fitsWidget.setDebayerMode((ELS::Debayer::Mode)debayerCombo.itemData(index).toInt());
+}
+
+void MainWindow::starsToggled(bool isChecked)
+{
+    fitsWidget.setShowStars(isChecked);
+}
+
 void MainWindow::zoomFitClicked(bool /* isChecked */)
 {
     fitsWidget.setZoom(-1.0);
@@ -145,3 +479,175 @@ void MainWindow::zoom100Clicked(bool /* isChecked */)
 {
     fitsWidget.setZoom(1.0);
 }
+
+void MainWindow::mosaicModeChanged(int index)
+{
+    const FITSWidget::MosaicMode mode = (FITSWidget::MosaicMode)mosaicCombo.itemData(index).toInt();
+    fitsWidget.setMosaicMode(mode);
+    patchCombo.setEnabled(mode != FITSWidget::MM_OFF);
+}
+
+void MainWindow::mosaicPatchChanged(int index)
+{
+    fitsWidget.setMosaicPatchSize(patchCombo.itemData(index).toInt());
+}
+
+void MainWindow::binningChanged(int /* index */)
+{
+    const int factor = binCombo.currentData().toInt();
+    const ELS::FITSImage::BinMode mode = (ELS::FITSImage::BinMode)binModeCombo.currentData().toInt();
+    fitsWidget.setBinning(factor, mode);
+    binModeCombo.setEnabled(factor > 1);
+}
+
+void MainWindow::backgroundChanged(int index)
+{
+    fitsWidget.setBackgroundMode((FITSWidget::BackgroundMode)backgroundCombo.itemData(index).toInt());
+}
+
+void MainWindow::referenceClicked(bool /* isChecked */)
+{
+    const char *filename = fitsWidget.getFilename();
+    if (filename == 0)
+    {
+        return;
+    }
+
+    fitsWidget.setReference(filename);
+}
+
+void MainWindow::diffViewChanged(int index)
+{
+    const FITSWidget::DiffView view = (FITSWidget::DiffView)diffCombo.itemData(index).toInt();
+    fitsWidget.setDiffView(view);
+
+    if ((view != FITSWidget::DV_OFF) && !fitsWidget.hasReference())
+    {
+        statusBar()->showMessage("Show a frame and press B to make it the reference");
+    }
+}
+
+void MainWindow::fitsReferenceChanged(const char *filename)
+{
+    if (*filename == 0)
+    {
+        statusBar()->showMessage("No reference");
+        return;
+    }
+
+    statusBar()->showMessage(QString("Reference B: %1").arg(QFileInfo(filename).fileName()));
+}
+
+void MainWindow::fitsCursorReadout(const FITSWidget::Readout &readout)
+{
+    // Channels separated by slashes.
+    auto join = [&readout](std::function<double(int)> get)
+    {
+        QStringList parts;
+        for (int channel = 0; channel < readout.channels; channel++)
+        {
+            parts.append(QString::number(get(channel), 'g', 6));
+        }
+        return parts.join('/');
+    };
+
+    QString text = QString("%1, %2: %3")
+                       .arg(readout.x)
+                       .arg(readout.y)
+                       .arg(join([&readout](int c)
+                                 { return readout.value[c]; }));
+    if (readout.haveBox)
+    {
+        text += QString("   %1x%2 mean %3 sd %4 min %5 max %6")
+                    .arg(readout.box[0].width)
+                    .arg(readout.box[0].height)
+                    .arg(join([&readout](int c)
+                              { return readout.box[c].mean; }))
+                    .arg(join([&readout](int c)
+                              { return readout.box[c].sigma; }))
+                    .arg(join([&readout](int c)
+                              { return readout.box[c].minimum; }))
+                    .arg(join([&readout](int c)
+                              { return readout.box[c].maximum; }));
+    }
+
+    readoutLabel.setText(text);
+}
+
+void MainWindow::loupeChanged(int index)
+{
+    fitsWidget.setLoupe(loupeCombo.itemData(index).toInt());
+}
+
+void MainWindow::fitsCursorLeft()
+{
+    readoutLabel.clear();
+}
+
+void MainWindow::compareToggled(bool isChecked)
+{
+    if (!isChecked)
+    {
+        compareWidget.setBlinking(false);
+        compareWidget.clear();
+        viewStack.setCurrentWidget(&fitsWidget);
+        compareModeCombo.setEnabled(false);
+        blinkRateSpin.setEnabled(false);
+        return;
+    }
+
+    QList<QListWidgetItem *> items = fileList.selectedItems();
+    if (items.size() < 2)
+    {
+        items.clear();
+        for (int row = 0; row < fileList.count(); row++)
+        {
+            items.append(fileList.item(row));
+        }
+    }
+    if (items.size() < 2)
+    {
+        statusBar()->showMessage("Open two or more files to compare them");
+        compareBtn.setChecked(false);
+        return;
+    }
+
+    // In list order, whatever order they were selected in.
+    std::sort(items.begin(), items.end(), [this](QListWidgetItem *a, QListWidgetItem *b)
+              { return fileList.row(a) < fileList.row(b); });
+
+    QStringList files;
+    for (QListWidgetItem *item : items)
+    {
+        files.append(item->data(Qt::UserRole).toString());
+    }
+
+    compareWidget.setStretched(showingStretched);
+    compareWidget.setFiles(files);
+    viewStack.setCurrentWidget(&compareWidget);
+    compareWidget.setFocus();
+    compareModeCombo.setEnabled(true);
+    blinkRateSpin.setEnabled(true);
+    compareModeChanged(compareModeCombo.currentIndex());
+}
+
+void MainWindow::compareModeChanged(int index)
+{
+    const CompareWidget::CompareMode mode = (CompareWidget::CompareMode)compareModeCombo.itemData(index).toInt();
+    compareWidget.setMode(mode);
+    compareWidget.setBlinking(compareBtn.isChecked() && (mode == CompareWidget::CM_BLINK));
+}
+
+void MainWindow::compareCurrentChanged(int index,
+                                       const QString &filename)
+{
+    statusBar()->showMessage(QString("%1/%2: %3")
+                                 .arg(index + 1)
+                                 .arg(compareWidget.getFrameCount())
+                                 .arg(filename));
+}
+
+void MainWindow::memoryPanelToggled(bool isChecked)
+{
+    memoryDock.setVisible(isChecked);
+}
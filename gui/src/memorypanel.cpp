@@ -0,0 +1,131 @@
+#include <QHeaderView>
+
+#include "memorypanel.h"
+#include "fitsbufferpool.h"
+#include "fitsmemorybudget.h"
+
+namespace
+{
+
+    const double g_megabyte = 1024.0 * 1024.0;
+
+    QString megabytes(double bytes)
+    {
+        return QString::number(bytes / g_megabyte, 'f', 1);
+    }
+
+}
+
+MemoryPanel::MemoryPanel(QWidget *parent)
+    : QWidget(parent),
+      layout(this),
+      totalLabel(),
+      usageBar(),
+      consumerTable(0, 4),
+      poolLabel(),
+      budgetLayout(),
+      budgetLabel("Budget (MB)"),
+      budgetSpin(),
+      refreshTimer()
+{
+    usageBar.setRange(0, 1000);
+    usageBar.setTextVisible(false);
+
+    consumerTable.setHorizontalHeaderLabels(QStringList() << "Consumer"
+                                                          << "Category"
+                                                          << "Priority"
+                                                          << "MB");
+    consumerTable.verticalHeader()->setVisible(false);
+    consumerTable.horizontalHeader()->setSectionResizeMode(0, QHeaderView::Stretch);
+    consumerTable.setEditTriggers(QAbstractItemView::NoEditTriggers);
+    consumerTable.setSelectionMode(QAbstractItemView::NoSelection);
+
+    budgetSpin.setRange(256, 1024 * 1024);
+    budgetSpin.setSingleStep(256);
+    budgetSpin.setValue(ELS::FITSMemoryBudget::global()->getBudget() / g_megabyte);
+
+    budgetLayout.addWidget(&budgetLabel);
+    budgetLayout.addWidget(&budgetSpin);
+    budgetLayout.addStretch(1);
+
+    layout.addWidget(&totalLabel);
+    layout.addWidget(&usageBar);
+    layout.addWidget(&consumerTable);
+    layout.addWidget(&poolLabel);
+    layout.addLayout(&budgetLayout);
+
+    refreshTimer.setInterval(500);
+
+    QObject::connect(&refreshTimer, &QTimer::timeout,
+                     this, &MemoryPanel::refresh);
+    QObject::connect(&budgetSpin, QOverload<int>::of(&QSpinBox::valueChanged),
+                     this, &MemoryPanel::budgetChanged);
+}
+
+void MemoryPanel::showEvent(QShowEvent * /* event */)
+{
+    refresh();
+    refreshTimer.start();
+}
+
+void MemoryPanel::hideEvent(QHideEvent * /* event */)
+{
+    refreshTimer.stop();
+}
+
+void MemoryPanel::refresh()
+{
+    ELS::FITSMemoryBudget *budget = ELS::FITSMemoryBudget::global();
+
+    const size_t total = budget->getTotalUsage();
+    const size_t limit = budget->getBudget();
+    totalLabel.setText(QString("%1 of %2 MB in use, %3 MB evicted")
+                           .arg(megabytes(total))
+                           .arg(megabytes(limit))
+                           .arg(megabytes(budget->getEvictedBytes())));
+    usageBar.setValue(limit > 0 ? std::min(1000.0, 1000.0 * total / limit) : 0);
+
+    // One row per consumer, then one per category.
+    std::vector<ELS::FITSMemoryBudget::ConsumerInfo> consumers = budget->getConsumers();
+    consumerTable.setRowCount(consumers.size() + ELS::FITSMemoryBudget::MC_COUNT);
+
+    int row = 0;
+    for (const ELS::FITSMemoryBudget::ConsumerInfo &consumer : consumers)
+    {
+        consumerTable.setItem(row, 0, new QTableWidgetItem(QString::fromStdString(consumer.name)));
+        consumerTable.setItem(row, 1, new QTableWidgetItem(ELS::FITSMemoryBudget::getCategoryName(consumer.category)));
+        consumerTable.setItem(row, 2, new QTableWidgetItem(consumer.evictable ? QString::number(consumer.priority) : "pinned"));
+        consumerTable.setItem(row, 3, new QTableWidgetItem(megabytes(consumer.usage)));
+        row++;
+    }
+    for (int category = 0; category < ELS::FITSMemoryBudget::MC_COUNT; category++)
+    {
+        ELS::FITSMemoryBudget::Category c = (ELS::FITSMemoryBudget::Category)category;
+
+        QTableWidgetItem *name = new QTableWidgetItem(QString("All %1").arg(ELS::FITSMemoryBudget::getCategoryName(c)));
+        QFont font = name->font();
+        font.setBold(true);
+        name->setFont(font);
+
+        consumerTable.setItem(row, 0, name);
+        consumerTable.setItem(row, 1, new QTableWidgetItem(ELS::FITSMemoryBudget::getCategoryName(c)));
+        consumerTable.setItem(row, 2, new QTableWidgetItem(""));
+        consumerTable.setItem(row, 3, new QTableWidgetItem(megabytes(budget->getUsage(c))));
+        row++;
+    }
+
+    ELS::FITSBufferPool::Stats stats = ELS::FITSBufferPool::global()->getStats();
+    const uint64_t requests = stats.hits + stats.misses;
+    poolLabel.setText(QString("Pool: %1 MB out, %2 MB idle, %3% of %4 requests reused")
+                          .arg(megabytes(stats.outstandingBytes))
+                          .arg(megabytes(stats.retainedBytes))
+                          .arg(requests > 0 ? 100.0 * stats.hits / requests : 0.0, 0, 'f', 0)
+                          .arg(requests));
+}
+
+void MemoryPanel::budgetChanged(int budgetMB)
+{
+    ELS::FITSMemoryBudget::global()->setBudget((size_t)budgetMB * 1024 * 1024);
+
+    refresh();
+}
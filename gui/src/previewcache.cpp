@@ -0,0 +1,558 @@
+#include <algorithm>
+#include <set>
+#include <string.h>
+#include <vector>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QStandardPaths>
+
+#include "previewcache.h"
+
+namespace
+{
+
+    const char g_indexMagic[8] = {'Q', 'T', 'F', 'P', 'I', 'D', 'X', '2'};
+
+    // 2 MB of index; far more files than anyone keeps a preview of.
+    const int g_indexSlots = 16384;
+
+    // Slots dropped to keep under the capacity. Lookups probe past
+    // them, unlike empty ones.
+    const uint64_t g_removedKey = ~0ull;
+
+    const qint64 g_defaultCapacity = 256ll * 1024 * 1024;
+
+    // Previews no slot refers to, left by a crash or an older index,
+    // are looked for this often.
+    const int64_t g_pruneInterval = 24ll * 60 * 60 * 1000;
+    // A temporary file older than this isn't being written any more.
+    const int64_t g_staleTemporary = 60ll * 60 * 1000;
+
+    // How far a lookup walks from a key's home slot before giving up.
+    const int g_maxProbe = 16;
+
+    const int g_previewSize = 1024;
+
+    // FITS headers are 2880-byte blocks ending with an END card; this
+    // many blocks is enough for any real header.
+    const int g_fitsBlock = 2880;
+    const int g_maxHeaderBlocks = 16;
+
+    struct IndexRecord
+    {
+        uint64_t key;
+        int64_t size;
+        int64_t mtime;
+        uint64_t headerHash;
+        int64_t lastUsed;
+        // Of the PNG.
+        int64_t bytes;
+        int32_t width;
+        int32_t height;
+        float background;
+        float noise;
+        float minimum;
+        float maximum;
+        // Shadows, midtones, highlights of grey/red, green and blue.
+        float params[3][3];
+        char reserved[20];
+    };
+
+    static_assert(sizeof(IndexRecord) == 128, "index records must stay 128 bytes");
+
+    // The magic, then the total bytes of previews and when orphans were
+    // last pruned.
+    const qint64 g_headerSize = 64;
+    const qint64 g_totalBytesOffset = 8;
+    const qint64 g_lastPrunedOffset = 16;
+
+    uint64_t fnv1a(const char *data,
+                   qint64 length,
+                   uint64_t hash = 14695981039346656037ull)
+    {
+        for (qint64 i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char)data[i];
+            hash *= 1099511628211ull;
+        }
+
+        return hash;
+    }
+
+    qint64 slotOffset(uint64_t slot)
+    {
+        return g_headerSize + (qint64)(slot % g_indexSlots) * sizeof(IndexRecord);
+    }
+
+    bool readHeaderValue(QFile *index,
+                         qint64 offset,
+                         int64_t *value)
+    {
+        return index->seek(offset) &&
+               (index->read((char *)value, sizeof(*value)) == sizeof(*value));
+    }
+
+    bool writeHeaderValue(QFile *index,
+                          qint64 offset,
+                          int64_t value)
+    {
+        return index->seek(offset) &&
+               (index->write((const char *)&value, sizeof(value)) == sizeof(value));
+    }
+
+    StretchParams1Channel *channelParams(StretchParams &params,
+                                         int channel)
+    {
+        return channel == 0 ? &params.grey_red : (channel == 1 ? &params.green : &params.blue);
+    }
+
+}
+
+/* static */
+PreviewCache *PreviewCache::global()
+{
+    static PreviewCache cache(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) +
+                              "/qtfits-poc/previews");
+    static bool configured = false;
+    if (!configured)
+    {
+        configured = true;
+
+        bool ok = false;
+        const qint64 megabytes = qgetenv("QTFITS_PREVIEW_CACHE_MB").toLongLong(&ok);
+        if (ok && (megabytes > 0))
+        {
+            cache.setCapacity(megabytes * 1024 * 1024);
+        }
+    }
+    return &cache;
+}
+
+PreviewCache::PreviewCache(const QString &directory)
+    : _directory(directory),
+      _capacity(g_defaultCapacity)
+{
+    QDir().mkpath(_directory);
+}
+
+/* static */
+int PreviewCache::getPreviewSize()
+{
+    return g_previewSize;
+}
+
+void PreviewCache::setCapacity(qint64 bytes)
+{
+    _capacity = bytes;
+}
+
+qint64 PreviewCache::getCapacity() const
+{
+    return _capacity;
+}
+
+bool PreviewCache::lookup(const QString &filename,
+                          Entry *entry) const
+{
+    Identity identity;
+    if (!identify(filename, &identity))
+    {
+        return false;
+    }
+
+    QLockFile lock(_directory + "/index.lock");
+    if (!lock.tryLock(100))
+    {
+        return false;
+    }
+
+    QFile index(_directory + "/index");
+    if (!openIndex(&index))
+    {
+        return false;
+    }
+
+    for (int probe = 0; probe < g_maxProbe; probe++)
+    {
+        const qint64 offset = slotOffset(identity.key + probe);
+
+        IndexRecord record;
+        if (!index.seek(offset) ||
+            (index.read((char *)&record, sizeof(record)) != sizeof(record)))
+        {
+            return false;
+        }
+
+        if (record.key == 0)
+        {
+            return false;
+        }
+        if (record.key != identity.key)
+        {
+            continue;
+        }
+
+        // Same path, but the file changed: stale.
+        if ((record.size != identity.size) ||
+            (record.mtime != identity.mtime) ||
+            (record.headerHash != identity.headerHash))
+        {
+            return false;
+        }
+
+        QImage preview(previewPath(identity.key));
+        if (preview.isNull())
+        {
+            return false;
+        }
+
+        entry->preview = preview;
+        entry->width = record.width;
+        entry->height = record.height;
+        entry->background = record.background;
+        entry->noise = record.noise;
+        entry->minimum = record.minimum;
+        entry->maximum = record.maximum;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            StretchParams1Channel *params = channelParams(entry->params, channel);
+            params->shadows = record.params[channel][0];
+            params->midtones = record.params[channel][1];
+            params->highlights = record.params[channel][2];
+        }
+
+        // Recency is only used to pick a slot to reuse; a failed write
+        // here costs nothing.
+        record.lastUsed = QDateTime::currentMSecsSinceEpoch();
+        if (index.seek(offset))
+        {
+            index.write((const char *)&record, sizeof(record));
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void PreviewCache::store(const QString &filename,
+                         const Entry &entry)
+{
+    Identity identity;
+    if (!identify(filename, &identity))
+    {
+        return;
+    }
+
+    // Written under a temporary name and renamed, so a reader never
+    // sees half a PNG.
+    const QString path = previewPath(identity.key);
+    const QString tmpPath = path + ".tmp";
+    if (!entry.preview.save(tmpPath, "PNG"))
+    {
+        return;
+    }
+
+    QLockFile lock(_directory + "/index.lock");
+    if (!lock.tryLock(1000))
+    {
+        QFile::remove(tmpPath);
+        return;
+    }
+
+    QFile::remove(path);
+    if (!QFile::rename(tmpPath, path))
+    {
+        QFile::remove(tmpPath);
+        return;
+    }
+
+    QFile index(_directory + "/index");
+    if (!openIndex(&index))
+    {
+        return;
+    }
+
+    int64_t totalBytes;
+    if (!readHeaderValue(&index, g_totalBytesOffset, &totalBytes))
+    {
+        return;
+    }
+
+    // Use the key's own slot if it has one, else the first empty or
+    // dropped slot, else evict the least recently used slot in the
+    // probe window.
+    qint64 target = -1;
+    qint64 free = -1;
+    int64_t replacedBytes = 0;
+    qint64 oldest = -1;
+    uint64_t oldestKey = 0;
+    int64_t oldestUse = INT64_MAX;
+    int64_t oldestBytes = 0;
+    for (int probe = 0; probe < g_maxProbe; probe++)
+    {
+        const qint64 offset = slotOffset(identity.key + probe);
+
+        IndexRecord record;
+        if (!index.seek(offset) ||
+            (index.read((char *)&record, sizeof(record)) != sizeof(record)))
+        {
+            return;
+        }
+
+        if (record.key == identity.key)
+        {
+            target = offset;
+            replacedBytes = record.bytes;
+            break;
+        }
+        if ((record.key == 0) || (record.key == g_removedKey))
+        {
+            if (free < 0)
+            {
+                free = offset;
+            }
+            // The key can't be any further on.
+            if (record.key == 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (record.lastUsed < oldestUse)
+        {
+            oldestUse = record.lastUsed;
+            oldest = offset;
+            oldestKey = record.key;
+            oldestBytes = record.bytes;
+        }
+    }
+    if (target < 0)
+    {
+        target = free;
+    }
+    if (target < 0)
+    {
+        // Nothing will find the evicted key's preview any more.
+        target = oldest;
+        replacedBytes = oldestBytes;
+        QFile::remove(previewPath(oldestKey));
+    }
+
+    IndexRecord record;
+    memset(&record, 0, sizeof(record));
+    record.key = identity.key;
+    record.size = identity.size;
+    record.mtime = identity.mtime;
+    record.headerHash = identity.headerHash;
+    record.lastUsed = QDateTime::currentMSecsSinceEpoch();
+    record.width = entry.width;
+    record.height = entry.height;
+    record.background = entry.background;
+    record.noise = entry.noise;
+    record.minimum = entry.minimum;
+    record.maximum = entry.maximum;
+    record.bytes = QFileInfo(path).size();
+    StretchParams params = entry.params;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        const StretchParams1Channel *p = channelParams(params, channel);
+        record.params[channel][0] = p->shadows;
+        record.params[channel][1] = p->midtones;
+        record.params[channel][2] = p->highlights;
+    }
+
+    if (!index.seek(target) ||
+        (index.write((const char *)&record, sizeof(record)) != sizeof(record)))
+    {
+        return;
+    }
+
+    totalBytes = std::max(totalBytes - replacedBytes, (int64_t)0) + record.bytes;
+    if (totalBytes > _capacity)
+    {
+        trim(&index, &totalBytes);
+    }
+    writeHeaderValue(&index, g_totalBytesOffset, totalBytes);
+
+    int64_t lastPruned;
+    const int64_t now = QDateTime::currentMSecsSinceEpoch();
+    if (readHeaderValue(&index, g_lastPrunedOffset, &lastPruned) &&
+        (now - lastPruned > g_pruneInterval))
+    {
+        prune(&index);
+        writeHeaderValue(&index, g_lastPrunedOffset, now);
+    }
+}
+
+// Drops the least recently used previews until the total is a tenth
+// under the capacity. Caller holds the lock.
+void PreviewCache::trim(QFile *index,
+                        int64_t *totalBytes) const
+{
+    std::vector<IndexRecord> records(g_indexSlots);
+    const qint64 size = (qint64)g_indexSlots * sizeof(IndexRecord);
+    if (!index->seek(g_headerSize) ||
+        (index->read((char *)records.data(), size) != size))
+    {
+        return;
+    }
+
+    std::vector<int> used;
+    for (int slot = 0; slot < g_indexSlots; slot++)
+    {
+        if ((records[slot].key != 0) && (records[slot].key != g_removedKey))
+        {
+            used.push_back(slot);
+        }
+    }
+    std::sort(used.begin(), used.end(), [&](int a, int b)
+              { return records[a].lastUsed < records[b].lastUsed; });
+
+    const int64_t goal = _capacity - _capacity / 10;
+    for (int slot : used)
+    {
+        if (*totalBytes <= goal)
+        {
+            break;
+        }
+
+        IndexRecord &record = records[slot];
+        QFile::remove(previewPath(record.key));
+        *totalBytes = std::max(*totalBytes - record.bytes, (int64_t)0);
+
+        record.key = g_removedKey;
+        if (!index->seek(slotOffset(slot)) ||
+            (index->write((const char *)&record, sizeof(record)) != sizeof(record)))
+        {
+            return;
+        }
+    }
+}
+
+// Deletes previews no slot refers to, and temporary files left by
+// writers that died. Caller holds the lock.
+void PreviewCache::prune(QFile *index) const
+{
+    std::vector<IndexRecord> records(g_indexSlots);
+    const qint64 size = (qint64)g_indexSlots * sizeof(IndexRecord);
+    if (!index->seek(g_headerSize) ||
+        (index->read((char *)records.data(), size) != size))
+    {
+        return;
+    }
+
+    std::set<QString> kept;
+    for (const IndexRecord &record : records)
+    {
+        if ((record.key != 0) && (record.key != g_removedKey))
+        {
+            kept.insert(QFileInfo(previewPath(record.key)).fileName());
+        }
+    }
+
+    const QDateTime staleBefore = QDateTime::currentDateTime().addMSecs(-g_staleTemporary);
+    QDir directory(_directory);
+    for (const QFileInfo &file : directory.entryInfoList(QStringList() << "*.png" << "*.tmp", QDir::Files))
+    {
+        const bool orphan = file.suffix() == "png" ? kept.count(file.fileName()) == 0
+                                                   : file.lastModified() < staleBefore;
+        if (orphan)
+        {
+            QFile::remove(file.absoluteFilePath());
+        }
+    }
+}
+
+/* static */
+bool PreviewCache::identify(const QString &filename,
+                            Identity *identity)
+{
+    QFileInfo info(filename);
+    if (!info.isFile())
+    {
+        return false;
+    }
+
+    QByteArray path = info.absoluteFilePath().toUtf8();
+    identity->key = fnv1a(path.constData(), path.size());
+    if ((identity->key == 0) || (identity->key == g_removedKey))
+    {
+        // Both mark slots without an entry.
+        identity->key = 1;
+    }
+    identity->size = info.size();
+    identity->mtime = info.lastModified().toMSecsSinceEpoch();
+
+    // Hash the header up to and including the block holding END.
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+
+    uint64_t hash = 14695981039346656037ull;
+    char block[g_fitsBlock];
+    for (int b = 0; b < g_maxHeaderBlocks; b++)
+    {
+        const qint64 got = file.read(block, g_fitsBlock);
+        if (got <= 0)
+        {
+            break;
+        }
+        hash = fnv1a(block, got, hash);
+
+        bool end = false;
+        for (qint64 card = 0; card + 80 <= got; card += 80)
+        {
+            if ((memcmp(block + card, "END", 3) == 0) && (block[card + 3] == ' '))
+            {
+                end = true;
+                break;
+            }
+        }
+        if (end || (got < g_fitsBlock))
+        {
+            break;
+        }
+    }
+    identity->headerHash = hash;
+
+    return true;
+}
+
+QString PreviewCache::previewPath(uint64_t key) const
+{
+    return QString("%1/%2.png").arg(_directory).arg(key, 16, 16, QChar('0'));
+}
+
+// Opens the index for reading and writing, creating or replacing it
+// if it is missing or isn't one of ours. Caller holds the lock.
+bool PreviewCache::openIndex(QFile *index) const
+{
+    if (!index->open(QIODevice::ReadWrite))
+    {
+        return false;
+    }
+
+    char magic[sizeof(g_indexMagic)];
+    const qint64 expected = g_headerSize + (qint64)g_indexSlots * sizeof(IndexRecord);
+    if ((index->size() == expected) &&
+        (index->read(magic, sizeof(magic)) == sizeof(magic)) &&
+        (memcmp(magic, g_indexMagic, sizeof(magic)) == 0))
+    {
+        return true;
+    }
+
+    // resize() fills with zeros, which is every slot empty.
+    if (!index->resize(0) || !index->resize(expected) || !index->seek(0) ||
+        (index->write(g_indexMagic, sizeof(g_indexMagic)) != sizeof(g_indexMagic)))
+    {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,121 @@
+#include <unistd.h>
+#include <QFileInfo>
+#include <QLocalSocket>
+
+#include "singleinstance.h"
+
+namespace
+{
+
+    const int g_connectTimeoutMs = 200;
+    const int g_writeTimeoutMs = 1000;
+
+    void readPaths(QLocalSocket *socket,
+                   QStringList *files)
+    {
+        while (socket->canReadLine())
+        {
+            QString file = QString::fromUtf8(socket->readLine()).trimmed();
+            if (!file.isEmpty())
+            {
+                files->append(file);
+            }
+        }
+    }
+
+}
+
+/* static */
+bool SingleInstance::forward(const QStringList &files)
+{
+    QLocalSocket socket;
+    socket.connectToServer(serverName());
+    if (!socket.waitForConnected(g_connectTimeoutMs))
+    {
+        return false;
+    }
+
+    // One path per line; the receiver doesn't share our directory.
+    QByteArray message;
+    for (const QString &file : files)
+    {
+        message += QFileInfo(file).absoluteFilePath().toUtf8();
+        message += '\n';
+    }
+
+    socket.write(message);
+    if (!socket.waitForBytesWritten(g_writeTimeoutMs) && (socket.bytesToWrite() > 0))
+    {
+        return false;
+    }
+    socket.disconnectFromServer();
+    if (socket.state() != QLocalSocket::UnconnectedState)
+    {
+        socket.waitForDisconnected(g_writeTimeoutMs);
+    }
+
+    return true;
+}
+
+SingleInstance::SingleInstance(QObject *parent)
+    : QObject(parent),
+      _server()
+{
+    QObject::connect(&_server, &QLocalServer::newConnection,
+                     this, &SingleInstance::newConnection);
+}
+
+bool SingleInstance::listen()
+{
+    _server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (_server.listen(serverName()))
+    {
+        return true;
+    }
+
+    // Either a viewer started at the same time as us got there first,
+    // or it was left behind by one that crashed. Only the latter may be
+    // removed, and only it leaves nobody answering.
+    if (_server.serverError() == QAbstractSocket::AddressInUseError)
+    {
+        QLocalSocket probe;
+        probe.connectToServer(serverName());
+        if (probe.waitForConnected(g_connectTimeoutMs))
+        {
+            probe.abort();
+            return false;
+        }
+
+        QLocalServer::removeServer(serverName());
+        return _server.listen(serverName());
+    }
+
+    return false;
+}
+
+/* static */
+QString SingleInstance::serverName()
+{
+    return QString("qtfits-poc-%1").arg(getuid());
+}
+
+void SingleInstance::newConnection()
+{
+    while (QLocalSocket *socket = _server.nextPendingConnection())
+    {
+        // Paths arrive a line at a time; the sender hanging up marks the
+        // end of the list.
+        QStringList *files = new QStringList();
+
+        QObject::connect(socket, &QLocalSocket::readyRead,
+                         this, [socket, files]()
+                         { readPaths(socket, files); });
+        QObject::connect(socket, &QLocalSocket::disconnected,
+                         this, [this, socket, files]()
+                         {
+                             readPaths(socket, files);
+                             emit filesReceived(*files);
+                             delete files;
+                             socket->deleteLater(); });
+    }
+}
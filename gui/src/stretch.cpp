@@ -7,21 +7,24 @@
 */
 
 #include "stretch.h"
+#include "executor.h"
+#include "fitsbufferpool.h"
+#include "fitstrace.h"
 
 #include <fitsio.h>
 #include <math.h>
-#include <QtConcurrent>
+#include <vector>
 
 namespace
 {
 
-    // Returns the median value of the vector.
-    // The vector is modified in an undefined way.
+    // Returns the median value of the array.
+    // The array is modified in an undefined way.
     template <typename T>
-    T median(std::vector<T> &values)
+    T median(T *values, int size)
     {
-        const int middle = values.size() / 2;
-        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        const int middle = size / 2;
+        std::nth_element(values, values + middle, values + size);
         return values[middle];
     }
 
@@ -42,10 +45,34 @@ namespace
     T median(T const *values, int size, int sampleBy)
     {
         const int downsampled_size = size / sampleBy;
-        std::vector<T> samples(downsampled_size);
+        ELS::FITSPooledArray<T> samples(downsampled_size);
         for (int index = 0, i = 0; i < downsampled_size; ++i, index += sampleBy)
             samples[i] = values[index];
-        return median(samples);
+        return median(samples.data(), downsampled_size);
+    }
+
+    // Scratch for a row of background corrections, count floats for
+    // each of arrays, kept by each thread so row jobs don't go to the pool.
+    float *getCorrectionScratch(int arrays, int count)
+    {
+        thread_local std::vector<float> scratch;
+        if (scratch.size() < (size_t)arrays * count)
+            scratch.resize((size_t)arrays * count);
+        return scratch.data();
+    }
+
+    // Stretches one sample corrected by a background model, as the
+    // loops below do but in float, since the correction is.
+    inline uint8_t stretchSample(float input, float nativeShadows, float nativeHighlights,
+                                 float k1, float k2, float midtones)
+    {
+        constexpr int maxOutput = 255;
+        if (input < nativeShadows)
+            return 0;
+        if (input >= nativeHighlights)
+            return maxOutput;
+        const float inputFloored = input - nativeShadows;
+        return (inputFloored * k1) / (inputFloored * k2 - midtones);
     }
 
     // This stretches one channel given the input parameters.
@@ -55,10 +82,13 @@ namespace
     // The extension parameters are not used.
     // Sampling is applied to the output (that is, with sampling=2, we compute every other output
     // sample both in width and height, so the output would have about 4X fewer pixels.
+    // A background model, if given, is taken out of each sample in the same pass; originX and
+    // originY place the buffer in the image it was fitted to.
     template <typename T>
     void stretchOneChannel(T *input_buffer, QImage *output_image,
                            const StretchParams &stretch_params,
-                           int input_range, int image_height, int image_width, int sampling)
+                           int64_t input_range, int image_height, int image_width, int sampling,
+                           const ELS::BackgroundModel *background, int originX, int originY)
     {
         QVector<QFuture<void>> futures;
 
@@ -78,6 +108,9 @@ namespace
         // Shadow and highlight values translated to the ADU scale.
         const T nativeShadows = shadows * maxInput;
         const T nativeHighlights = highlights * maxInput;
+        // The same, unrounded, for background corrected samples.
+        const float correctedShadows = shadows * maxInput;
+        const float correctedHighlights = highlights * maxInput;
         // Constants based on above needed for the stretch calculations.
         const float k1 = (midtones - 1) * hsRangeFactor * maxOutput / maxInput;
         const float k2 = ((2 * midtones) - 1) * hsRangeFactor / maxInput;
@@ -85,25 +118,39 @@ namespace
         // Increment the input index by the sampling, the output index increments by 1.
         for (int j = 0, jout = 0; j < image_height; j += sampling, jout++)
         {
-            futures.append(QtConcurrent::run([=]()
-                                             {
-                                                 T *inputLine = input_buffer + j * image_width;
-                                                 auto *scanLine = output_image->scanLine(jout);
-
-                                                 for (int i = 0, iout = 0; i < image_width; i += sampling, iout++)
-                                                 {
-                                                     const T input = inputLine[i];
-                                                     if (input < nativeShadows)
-                                                         scanLine[iout] = 0;
-                                                     else if (input >= nativeHighlights)
-                                                         scanLine[iout] = maxOutput;
-                                                     else
-                                                     {
-                                                         const T inputFloored = (input - nativeShadows);
-                                                         scanLine[iout] = (inputFloored * k1) / (inputFloored * k2 - midtones);
-                                                     }
-                                                 }
-                                             }));
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        {
+                                                            T *inputLine = input_buffer + j * image_width;
+                                                            auto *scanLine = output_image->scanLine(jout);
+
+                                                            if (background != 0)
+                                                            {
+                                                                const int count = (image_width + sampling - 1) / sampling;
+                                                                float *scale = getCorrectionScratch(2, count);
+                                                                float *offset = scale + count;
+                                                                background->getCorrectionRow(0, j + originY, originX, sampling, count,
+                                                                                             scale, offset);
+                                                                for (int iout = 0; iout < count; iout++)
+                                                                    scanLine[iout] = stretchSample(inputLine[iout * sampling] * scale[iout] + offset[iout],
+                                                                                                   correctedShadows, correctedHighlights,
+                                                                                                   k1, k2, midtones);
+                                                                return;
+                                                            }
+
+                                                            for (int i = 0, iout = 0; i < image_width; i += sampling, iout++)
+                                                            {
+                                                                const T input = inputLine[i];
+                                                                if (input < nativeShadows)
+                                                                    scanLine[iout] = 0;
+                                                                else if (input >= nativeHighlights)
+                                                                    scanLine[iout] = maxOutput;
+                                                                else
+                                                                {
+                                                                    const T inputFloored = (input - nativeShadows);
+                                                                    scanLine[iout] = (inputFloored * k1) / (inputFloored * k2 - midtones);
+                                                                }
+                                                            }
+                                                        }));
         }
         for (QFuture<void> future : futures)
             future.waitForFinished();
@@ -119,7 +166,8 @@ namespace
     template <typename T>
     void stretchThreeChannels(T *inputBuffer, QImage *outputImage,
                               const StretchParams &stretchParams,
-                              int inputRange, int imageHeight, int imageWidth, int sampling)
+                              int64_t inputRange, int imageHeight, int imageWidth, int sampling,
+                              const ELS::BackgroundModel *background, int originX, int originY)
     {
         QVector<QFuture<void>> futures;
 
@@ -151,6 +199,13 @@ namespace
         const T nativeHighlightsR = highlightsR * maxInput;
         const T nativeHighlightsG = highlightsG * maxInput;
         const T nativeHighlightsB = highlightsB * maxInput;
+        // The same, unrounded, for background corrected samples.
+        const float correctedShadowsR = shadowsR * maxInput;
+        const float correctedShadowsG = shadowsG * maxInput;
+        const float correctedShadowsB = shadowsB * maxInput;
+        const float correctedHighlightsR = highlightsR * maxInput;
+        const float correctedHighlightsG = highlightsG * maxInput;
+        const float correctedHighlightsB = highlightsB * maxInput;
         // Constants based on above needed for the stretch calculations.
         const float k1R = (midtonesR - 1) * hsRangeFactorR * maxOutput / maxInput;
         const float k1G = (midtonesG - 1) * hsRangeFactorG * maxOutput / maxInput;
@@ -163,55 +218,87 @@ namespace
 
         for (int j = 0, jout = 0; j < imageHeight; j += sampling, jout++)
         {
-            futures.append(QtConcurrent::run([=]()
-                                             {
-                                                 // R, G, B input images are stored one after another.
-                                                 T *inputLineR = inputBuffer + j * imageWidth;
-                                                 T *inputLineG = inputLineR + size;
-                                                 T *inputLineB = inputLineG + size;
-
-                                                 auto *scanLine = reinterpret_cast<QRgb *>(outputImage->scanLine(jout));
-
-                                                 for (int i = 0, iout = 0; i < imageWidth; i += sampling, iout++)
-                                                 {
-                                                     const T inputR = inputLineR[i];
-                                                     const T inputG = inputLineG[i];
-                                                     const T inputB = inputLineB[i];
-
-                                                     uint8_t red, green, blue;
-
-                                                     if (inputR < nativeShadowsR)
-                                                         red = 0;
-                                                     else if (inputR >= nativeHighlightsR)
-                                                         red = maxOutput;
-                                                     else
-                                                     {
-                                                         const T inputFloored = (inputR - nativeShadowsR);
-                                                         red = (inputFloored * k1R) / (inputFloored * k2R - midtonesR);
-                                                     }
-
-                                                     if (inputG < nativeShadowsG)
-                                                         green = 0;
-                                                     else if (inputG >= nativeHighlightsG)
-                                                         green = maxOutput;
-                                                     else
-                                                     {
-                                                         const T inputFloored = (inputG - nativeShadowsG);
-                                                         green = (inputFloored * k1G) / (inputFloored * k2G - midtonesG);
-                                                     }
-
-                                                     if (inputB < nativeShadowsB)
-                                                         blue = 0;
-                                                     else if (inputB >= nativeHighlightsB)
-                                                         blue = maxOutput;
-                                                     else
-                                                     {
-                                                         const T inputFloored = (inputB - nativeShadowsB);
-                                                         blue = (inputFloored * k1B) / (inputFloored * k2B - midtonesB);
-                                                     }
-                                                     scanLine[iout] = qRgb(red, green, blue);
-                                                 }
-                                             }));
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        {
+                                                            // R, G, B input images are stored one after another.
+                                                            T *inputLineR = inputBuffer + j * imageWidth;
+                                                            T *inputLineG = inputLineR + size;
+                                                            T *inputLineB = inputLineG + size;
+
+                                                            auto *scanLine = reinterpret_cast<QRgb *>(outputImage->scanLine(jout));
+
+                                                            if (background != 0)
+                                                            {
+                                                                const int count = (imageWidth + sampling - 1) / sampling;
+                                                                float *scaleR = getCorrectionScratch(6, count);
+                                                                float *offsetR = scaleR + count;
+                                                                float *scaleG = offsetR + count;
+                                                                float *offsetG = scaleG + count;
+                                                                float *scaleB = offsetG + count;
+                                                                float *offsetB = scaleB + count;
+                                                                background->getCorrectionRow(0, j + originY, originX, sampling, count,
+                                                                                             scaleR, offsetR);
+                                                                background->getCorrectionRow(1, j + originY, originX, sampling, count,
+                                                                                             scaleG, offsetG);
+                                                                background->getCorrectionRow(2, j + originY, originX, sampling, count,
+                                                                                             scaleB, offsetB);
+                                                                for (int iout = 0; iout < count; iout++)
+                                                                {
+                                                                    const int i = iout * sampling;
+                                                                    const uint8_t red = stretchSample(inputLineR[i] * scaleR[iout] + offsetR[iout],
+                                                                                                      correctedShadowsR, correctedHighlightsR,
+                                                                                                      k1R, k2R, midtonesR);
+                                                                    const uint8_t green = stretchSample(inputLineG[i] * scaleG[iout] + offsetG[iout],
+                                                                                                        correctedShadowsG, correctedHighlightsG,
+                                                                                                        k1G, k2G, midtonesG);
+                                                                    const uint8_t blue = stretchSample(inputLineB[i] * scaleB[iout] + offsetB[iout],
+                                                                                                       correctedShadowsB, correctedHighlightsB,
+                                                                                                       k1B, k2B, midtonesB);
+                                                                    scanLine[iout] = qRgb(red, green, blue);
+                                                                }
+                                                                return;
+                                                            }
+
+                                                            for (int i = 0, iout = 0; i < imageWidth; i += sampling, iout++)
+                                                            {
+                                                                const T inputR = inputLineR[i];
+                                                                const T inputG = inputLineG[i];
+                                                                const T inputB = inputLineB[i];
+
+                                                                uint8_t red, green, blue;
+
+                                                                if (inputR < nativeShadowsR)
+                                                                    red = 0;
+                                                                else if (inputR >= nativeHighlightsR)
+                                                                    red = maxOutput;
+                                                                else
+                                                                {
+                                                                    const T inputFloored = (inputR - nativeShadowsR);
+                                                                    red = (inputFloored * k1R) / (inputFloored * k2R - midtonesR);
+                                                                }
+
+                                                                if (inputG < nativeShadowsG)
+                                                                    green = 0;
+                                                                else if (inputG >= nativeHighlightsG)
+                                                                    green = maxOutput;
+                                                                else
+                                                                {
+                                                                    const T inputFloored = (inputG - nativeShadowsG);
+                                                                    green = (inputFloored * k1G) / (inputFloored * k2G - midtonesG);
+                                                                }
+
+                                                                if (inputB < nativeShadowsB)
+                                                                    blue = 0;
+                                                                else if (inputB >= nativeHighlightsB)
+                                                                    blue = maxOutput;
+                                                                else
+                                                                {
+                                                                    const T inputFloored = (inputB - nativeShadowsB);
+                                                                    blue = (inputFloored * k1B) / (inputFloored * k2B - midtonesB);
+                                                                }
+                                                                scanLine[iout] = qRgb(red, green, blue);
+                                                            }
+                                                        }));
         }
         for (QFuture<void> future : futures)
             future.waitForFinished();
@@ -220,20 +307,21 @@ namespace
     template <typename T>
     void stretchChannels(T *input_buffer, QImage *output_image,
                          const StretchParams &stretch_params,
-                         int input_range, int image_height, int image_width, int num_channels, int sampling)
+                         int64_t input_range, int image_height, int image_width, int num_channels, int sampling,
+                         const ELS::BackgroundModel *background, int originX, int originY)
     {
         if (num_channels == 1)
             stretchOneChannel(input_buffer, output_image, stretch_params, input_range,
-                              image_height, image_width, sampling);
+                              image_height, image_width, sampling, background, originX, originY);
         else if (num_channels == 3)
             stretchThreeChannels(input_buffer, output_image, stretch_params, input_range,
-                                 image_height, image_width, sampling);
+                                 image_height, image_width, sampling, background, originX, originY);
     }
 
     // See section 8.5.7 in above link  https://pixinsight.com/doc/docs/XISF-1.0-spec/XISF-1.0-spec.html
     template <typename T>
     void computeParamsOneChannel(T const *buffer, StretchParams1Channel *params,
-                                 int inputRange, int height, int width)
+                                 int64_t inputRange, int height, int width)
     {
         // Find the median sample.
         constexpr int maxSamples = 500000;
@@ -242,7 +330,7 @@ namespace
         T medianSample = median(buffer, width * height, sampleBy);
         // Find the Median deviation: 1.4826 * median of abs(sample[i] - median).
         const int numSamples = width * height / sampleBy;
-        std::vector<T> deviations(numSamples);
+        ELS::FITSPooledArray<T> deviations(numSamples);
         for (int index = 0, i = 0; i < numSamples; ++i, index += sampleBy)
         {
             if (medianSample > buffer[index])
@@ -252,7 +340,7 @@ namespace
         }
 
         // Shift everything to 0 -> 1.0.
-        const float medDev = median(deviations);
+        const float medDev = median(deviations.data(), numSamples);
         const float normalizedMedian = medianSample / static_cast<float>(inputRange);
         const float MADN = 1.4826 * medDev / static_cast<float>(inputRange);
 
@@ -292,11 +380,44 @@ namespace
         params->highlights_expansion = 1.0;
     }
 
+    // As computeParamsOneChannel, on the channel's samples corrected by background
+    // if there is one. The corrected samples are taken on a grid, a row at a time.
+    template <typename T>
+    void computeParamsChannel(T const *buffer, StretchParams1Channel *params,
+                              int64_t inputRange, int height, int width,
+                              const ELS::BackgroundModel *background, int channel, int originX, int originY)
+    {
+        if (background == 0)
+        {
+            computeParamsOneChannel(buffer, params, inputRange, height, width);
+            return;
+        }
+
+        constexpr int maxSamples = 500000;
+        const int step = std::max(1, (int)sqrt((double)width * height / maxSamples));
+        const int columns = (width + step - 1) / step;
+        const int rows = (height + step - 1) / step;
+
+        ELS::FITSPooledArray<float> samples((size_t)columns * rows);
+        ELS::FITSPooledArray<float> scale(columns);
+        ELS::FITSPooledArray<float> offset(columns);
+        for (int row = 0; row < rows; row++)
+        {
+            T const *line = buffer + (int64_t)row * step * width;
+            float *out = samples.data() + (int64_t)row * columns;
+            background->getCorrectionRow(channel, row * step + originY, originX, step, columns,
+                                         scale.data(), offset.data());
+            for (int i = 0; i < columns; i++)
+                out[i] = line[i * step] * scale[i] + offset[i];
+        }
+        computeParamsOneChannel<float>(samples.data(), params, inputRange, rows, columns);
+    }
+
     // Need to know the possible range of input values.
     // Using the type of the sample and guessing.
     // Perhaps we should examine the contents for the file
     // (e.g. look at maximum value and extrapolate from that).
-    int getRange(int data_type)
+    int64_t getRange(int data_type)
     {
         switch (data_type)
         {
@@ -308,6 +429,8 @@ namespace
             return 64 * 1024;
         case TLONG:
             return 64 * 1024;
+        case TUINT:
+            return 4294967296LL;
         case TFLOAT:
             return 64 * 1024;
         case TLONGLONG:
@@ -328,10 +451,15 @@ Stretch::Stretch(int width, int height, int channels, int data_type)
     image_channels = channels;
     dataType = data_type;
     input_range = getRange(dataType);
+    input_range_fixed = false;
+    background = 0;
+    background_x = 0;
+    background_y = 0;
 }
 
 void Stretch::run(uint8_t const *input, QImage *outputImage, int sampling)
 {
+    ELS_TRACE_SCOPE("Stretch::run");
     Q_ASSERT(outputImage->width() == (image_width + sampling - 1) / sampling);
     Q_ASSERT(outputImage->height() == (image_height + sampling - 1) / sampling);
     recalculateInputRange(input);
@@ -340,31 +468,43 @@ void Stretch::run(uint8_t const *input, QImage *outputImage, int sampling)
     {
     case TBYTE:
         stretchChannels(reinterpret_cast<uint8_t const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TSHORT:
         stretchChannels(reinterpret_cast<short const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TUSHORT:
         stretchChannels(reinterpret_cast<unsigned short const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TLONG:
         stretchChannels(reinterpret_cast<long const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
+        break;
+    case TUINT:
+        stretchChannels(reinterpret_cast<unsigned int const *>(input), outputImage, params,
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TFLOAT:
         stretchChannels(reinterpret_cast<float const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TLONGLONG:
         stretchChannels(reinterpret_cast<long long const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     case TDOUBLE:
         stretchChannels(reinterpret_cast<double const *>(input), outputImage, params,
-                        input_range, image_height, image_width, image_channels, sampling);
+                        input_range, image_height, image_width, image_channels, sampling,
+                        background, background_x, background_y);
         break;
     default:
         break;
@@ -375,7 +515,7 @@ void Stretch::run(uint8_t const *input, QImage *outputImage, int sampling)
 // so we set it to 64K and possibly reduce it when we see the data.
 void Stretch::recalculateInputRange(uint8_t const *input)
 {
-    if (input_range <= 1)
+    if (input_range <= 1 || input_range_fixed)
         return;
     if (dataType != TFLOAT && dataType != TDOUBLE)
         return;
@@ -389,8 +529,28 @@ void Stretch::recalculateInputRange(uint8_t const *input)
         input_range = 1;
 }
 
+int64_t Stretch::getInputRange(uint8_t const *input)
+{
+    recalculateInputRange(input);
+    return input_range;
+}
+
+void Stretch::setInputRange(int64_t range)
+{
+    input_range = range;
+    input_range_fixed = true;
+}
+
+void Stretch::setBackground(const ELS::BackgroundModel *model, int originX, int originY)
+{
+    background = model;
+    background_x = originX;
+    background_y = originY;
+}
+
 StretchParams Stretch::computeParams(uint8_t const *input)
 {
+    ELS_TRACE_SCOPE("Stretch::computeParams");
     recalculateInputRange(input);
     StretchParams result;
     for (int channel = 0; channel < image_channels; ++channel)
@@ -402,50 +562,65 @@ StretchParams Stretch::computeParams(uint8_t const *input)
         case TBYTE:
         {
             auto buffer = reinterpret_cast<uint8_t const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TSHORT:
         {
             auto buffer = reinterpret_cast<short const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TUSHORT:
         {
             auto buffer = reinterpret_cast<unsigned short const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TLONG:
         {
             auto buffer = reinterpret_cast<long const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
+            break;
+        }
+        case TUINT:
+        {
+            auto buffer = reinterpret_cast<unsigned int const *>(input);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TFLOAT:
         {
             auto buffer = reinterpret_cast<float const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TLONGLONG:
         {
             auto buffer = reinterpret_cast<long long const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         case TDOUBLE:
         {
             auto buffer = reinterpret_cast<double const *>(input);
-            computeParamsOneChannel(buffer + offset, params, input_range,
-                                    image_height, image_width);
+            computeParamsChannel(buffer + offset, params, input_range,
+                                 image_height, image_width,
+                                 background, channel, background_x, background_y);
             break;
         }
         default:
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // A smooth model of the sky background, such as a light pollution
+    // gradient, for flattening a frame as it is rendered. Robust tile
+    // levels from ImageStatistics (one pass over the pixels) are fitted
+    // with a low-order 2D polynomial; tiles that are noisier than most,
+    // which is what stars and nebulae make them, or that stand clear of
+    // the fit, are rejected. The model is evaluated a row at a time, so
+    // it never takes the space of an image.
+    class BackgroundModel
+    {
+    public:
+        enum Correction
+        {
+            BC_SUBTRACT,
+            BC_DIVIDE
+        };
+
+    public:
+        BackgroundModel();
+
+        // Fits each channel of image; degree is 1 to 4. Uses multiple
+        // threads, blocks until done. Leaves the model invalid if too
+        // few tiles are left to fit, or for colour interleaved on axis
+        // 1, which ImageStatistics doesn't read. Gives up, leaving it
+        // invalid too, if cancel becomes set.
+        void fit(const FITSImage *image,
+                 int degree = 2,
+                 int tileSize = 64,
+                 const std::atomic<bool> *cancel = 0);
+        void clear();
+
+        bool isValid() const;
+        int getChannels() const;
+        int getDegree() const;
+
+        // Subtracting suits additive light pollution; dividing suits
+        // vignetting. Subtract is the default.
+        Correction getCorrection() const;
+        void setCorrection(Correction correction);
+
+        // The model at pixel (x, y) of the image fitted, in its native
+        // units.
+        float evaluate(int channel,
+                       float x,
+                       float y) const;
+
+        // The median level of the model. Corrections keep it, so a
+        // flattened frame still has a sky for the stretch to set its
+        // black point under.
+        float getPedestal(int channel) const;
+
+        // The correction of count pixels of row y, starting at x and
+        // step pixels apart: each corrected value is value * scale[i] +
+        // offset[i].
+        void getCorrectionRow(int channel,
+                              int y,
+                              int x,
+                              int step,
+                              int count,
+                              float *scale,
+                              float *offset) const;
+
+    private:
+        int _width;
+        int _height;
+        int _channels;
+        int _degree;
+        Correction _correction;
+        // Per channel, the coefficient of u^i v^j at i * (degree + 1)
+        // + j, zero where i + j > degree; u and v run -1 to 1 across
+        // the image.
+        std::vector<std::vector<double>> _coefficients;
+        std::vector<float> _pedestal;
+    };
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Replaces hot and cold pixels by the median of the 3x3
+    // neighbourhood around them. A pixel is an outlier when it lies more
+    // than sigmas times the noise above (or below) every one of its
+    // eight neighbours, while they are flat to within the noise; the
+    // neighbours of a star core fall away from it, so stars are left
+    // alone. On a bayered frame the neighbours are those of the
+    // same filter colour, two pixels away. Pixels at the image edge,
+    // without a full neighbourhood, are left as they are.
+    class CosmeticCorrection
+    {
+    public:
+        static const float g_defaultSigmas;
+
+    public:
+        // Returns a corrected copy of image, of the same type and
+        // layout. noise, in native units, is the background noise of
+        // the frame, such as ImageStatistics gives; 0 estimates it for
+        // each channel. Uses multiple threads, blocks until done.
+        static FITSImage *run(const FITSImage *image,
+                              float sigmas = g_defaultSigmas,
+                              float noise = 0.0f,
+                              int64_t *corrected = 0);
+
+        // A robust noise estimate for one channel, from the differences
+        // of neighbouring samples (of the same filter colour on a
+        // bayered frame).
+        static float estimateNoise(const FITSImage *image,
+                                   int channel);
+    };
+
+}
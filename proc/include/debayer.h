@@ -0,0 +1,31 @@
+#pragma once
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Demosaics a one-shot-colour frame into the planar three channel
+    // layout the stretch expects, honouring BAYERPAT, XBAYROFF and
+    // YBAYROFF.
+    class Debayer
+    {
+    public:
+        enum Mode
+        {
+            DM_BILINEAR,
+            DM_VNG_LITE,
+            DM_SUPERPIXEL
+        };
+
+    public:
+        // Returns a new colour image; the superpixel mode halves both
+        // dimensions. Uses multiple threads, blocks until done. Throws
+        // if image has no usable Bayer pattern.
+        static FITSImage *run(const FITSImage *image,
+                              Mode mode);
+
+        static const char *getModeName(Mode mode);
+    };
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+namespace ELS
+{
+
+    // Shared cancellation flag. Copies refer to the same flag, so one
+    // can be handed to a job and kept to cancel it.
+    class CancelToken
+    {
+    public:
+        CancelToken();
+
+        void cancel() const;
+        bool isCancelled() const;
+
+        // For code that polls a plain flag, such as StarFinder.
+        const std::atomic<bool> *getFlag() const;
+
+    private:
+        std::shared_ptr<std::atomic<bool>> _flag;
+    };
+
+    // Thread pools for the imaging code, one per lane, so that work the
+    // user is waiting on never queues behind work they aren't:
+    //
+    //  - interactive: rendering what is on screen
+    //  - load: reading and preparing the file being opened
+    //  - background: prefetch, analysis, cache writes
+    //
+    // Background threads are few and run at the lowest CPU priority.
+    // Data-parallel kernels submit their pieces with run(lane-less),
+    // which keeps them in the lane of whoever called the kernel.
+    //
+    // Waiting on a queued job runs it on the waiting thread, at that
+    // thread's priority. Waiting on a background job already running
+    // raises its thread to the process's priority until it ends, where
+    // the system allows that (RLIMIT_NICE or CAP_SYS_NICE); otherwise
+    // callers that can should use finishOrCancel(). Jobs from submit()
+    // can also be boosted: if still queued they move to the interactive
+    // lane.
+    class Executor
+    {
+    public:
+        enum Lane
+        {
+            EL_INTERACTIVE,
+            EL_LOAD,
+            EL_BACKGROUND,
+            EL_COUNT
+        };
+
+        class Job
+        {
+        public:
+            Job();
+
+            bool isValid() const;
+            bool isFinished() const;
+
+            // Needed for display now.
+            void boost() const;
+            void cancel() const;
+            const CancelToken &getToken() const;
+
+            // Boosts first.
+            void waitForFinished() const;
+
+            // As waitForFinished(), except that a job already running in
+            // a less urgent lane than this thread's is cancelled rather
+            // than waited on at that lane's priority, for a caller that
+            // can do the work itself.
+            void finishOrCancel() const;
+
+        private:
+            friend class Executor;
+            struct State;
+            class Runnable;
+
+            std::shared_ptr<State> _state;
+        };
+
+    public:
+        static Executor *global();
+
+        Executor();
+        ~Executor();
+
+        static const char *getLaneName(Lane lane);
+
+        QThreadPool *getPool(Lane lane);
+
+        // The lane of the job on this thread; interactive for threads
+        // that aren't running one, such as the GUI thread.
+        static Lane currentLane();
+
+        template <typename F>
+        auto run(Lane lane,
+                 F fn) -> QFuture<decltype(fn())>
+        {
+            return QtConcurrent::run(getPool(lane), [=]()
+                                     {
+                                         LaneScope scope(lane);
+                                         return fn(); });
+        }
+
+        template <typename F>
+        auto run(F fn) -> QFuture<decltype(fn())>
+        {
+            return run(currentLane(), fn);
+        }
+
+        Job submit(Lane lane,
+                   std::function<void(const CancelToken &)> fn);
+
+    private:
+        Executor(const Executor &);
+        Executor &operator=(const Executor &);
+
+        // Marks the thread as working for lane while in scope.
+        class LaneScope
+        {
+        public:
+            explicit LaneScope(Lane lane);
+            ~LaneScope();
+
+        private:
+            Lane _previous;
+        };
+
+        void lowerBackgroundPriority();
+
+    private:
+        QThreadPool _pools[EL_COUNT];
+    };
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <inttypes.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "executor.h"
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Keeps frames that aren't on screen compressed in memory, so going
+    // back to one is a parallel decompress rather than a disk read.
+    // Compression is lossless: integer rasters use cfitsio's Rice coder
+    // on pixel differences where it is available (see proc.pri),
+    // floating point ones a byte-plane shuffle followed by fast
+    // deflate. Each frame is cut into blocks that are
+    // compressed and restored independently in parallel.
+    //
+    // The cache charges its compressed size to the global memory budget,
+    // which can evict from it least recently used first. Thread-safe.
+    class FrameCache
+    {
+    public:
+        FrameCache();
+        ~FrameCache();
+
+        // The most compressed bytes held; beyond this the least recently
+        // used frames are dropped. 0 leaves it to the memory budget.
+        void setCapacity(size_t bytes);
+        size_t getCapacity() const;
+
+        // Compresses image under key, replacing anything already there.
+        // Blocks until done.
+        void insert(const std::string &key,
+                    const FITSImage *image);
+
+        // As insert(), but in the executor's background lane; takes
+        // ownership of image and deletes it once compressed.
+        void insertAsync(const std::string &key,
+                         FITSImage *image);
+
+        // A new image holding the cached frame, or null if key isn't
+        // cached. The frame stays cached. A frame still waiting to be
+        // compressed is copied as it was handed over, rather than waited
+        // for.
+        FITSImage *restore(const std::string &key);
+
+        bool contains(const std::string &key) const;
+        void remove(const std::string &key);
+        void clear();
+
+        int getFrameCount() const;
+        size_t getCompressedBytes() const;
+        size_t getRawBytes() const;
+
+    private:
+        FrameCache(const FrameCache &);
+        FrameCache &operator=(const FrameCache &);
+
+        struct Block
+        {
+            int64_t firstPixel;
+            int pixelCount;
+            // Stored uncompressed when compressing didn't pay.
+            bool raw;
+            std::vector<unsigned char> data;
+        };
+
+        struct Entry
+        {
+            FITSImage::BitDepth bitDepth;
+            FITSImage::Info info;
+            std::vector<Block> blocks;
+            size_t compressedBytes;
+            size_t rawBytes;
+        };
+
+        typedef std::shared_ptr<const Entry> EntryPtr;
+        typedef std::list<std::pair<std::string, EntryPtr>> LRU;
+
+        // Caller holds the lock; returns the bytes freed.
+        size_t dropOldest(size_t bytes);
+        size_t evict(size_t bytes);
+        void charge(int64_t bytes);
+
+        static EntryPtr compress(const FITSImage *image);
+        static FITSImage *decompress(const Entry *entry);
+        static FITSImage *copy(const FITSImage *image);
+
+        // A frame from insertAsync() not compressed yet.
+        struct Pending
+        {
+            std::string key;
+            Executor::Job job;
+            std::shared_ptr<const FITSImage> image;
+        };
+
+    private:
+        mutable std::mutex _mutex;
+        // Most recently used first.
+        LRU _lru;
+        std::map<std::string, LRU::iterator> _index;
+        size_t _capacity;
+        size_t _compressedBytes;
+        size_t _rawBytes;
+        int _budgetId;
+
+        std::mutex _pendingMutex;
+        std::vector<Pending> _pending;
+    };
+
+}
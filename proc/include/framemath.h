@@ -0,0 +1,59 @@
+#pragma once
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Pixel by pixel arithmetic between two frames of the same geometry,
+    // for spotting transients, hot pixels and flat mismatches. Results
+    // are 32-bit float whatever the inputs.
+    //
+    // b may be shifted: result(x, y) = a(x, y) op b(x + offsetX,
+    // y + offsetY). Where that falls outside b the result is the
+    // neutral value, 0 for a difference and 1 for a ratio.
+    class FrameMath
+    {
+    public:
+        enum Op
+        {
+            FM_DIFFERENCE,
+            FM_RATIO
+        };
+
+    public:
+        // An uninitialized result image for a and b. Throws if they
+        // differ in size or colour.
+        static FITSImage *createResult(const FITSImage *a,
+                                       const FITSImage *b);
+
+        // Computes region of result (from createResult()) only. Uses
+        // multiple threads, blocks until done.
+        static void run(const FITSImage *a,
+                        const FITSImage *b,
+                        Op op,
+                        int offsetX,
+                        int offsetY,
+                        FITSImage *result,
+                        const FITSImage::Region &region);
+
+        // The whole result, in a new image.
+        static FITSImage *run(const FITSImage *a,
+                              const FITSImage *b,
+                              Op op,
+                              int offsetX = 0,
+                              int offsetY = 0);
+
+        // A display range centred on the neutral value, wide enough for
+        // the noise of region of result and its offset from neutral, so
+        // that positive and negative differences look alike.
+        static void symmetricRange(const FITSImage *result,
+                                   Op op,
+                                   const FITSImage::Region &region,
+                                   float *low,
+                                   float *high);
+
+        static float getNeutral(Op op);
+    };
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Robust background level and noise of one channel, estimated over
+    // a grid of tiles so gradients and bright objects don't leak into
+    // the whole-image figures. All values are in the image's native
+    // units.
+    class ImageStatistics
+    {
+    public:
+        ImageStatistics();
+
+        // Uses multiple threads, blocks until done.
+        void compute(const FITSImage *image,
+                     int channel,
+                     int tileSize = 64);
+
+        bool isValid() const;
+
+        int getTileSize() const;
+        int getTilesX() const;
+        int getTilesY() const;
+
+        // Sigma-clipped median and 1.4826 * MAD of each tile.
+        float getTileBackground(int tileX,
+                                int tileY) const;
+        float getTileNoise(int tileX,
+                           int tileY) const;
+
+        // Medians of the tile values.
+        float getBackground() const;
+        float getNoise() const;
+
+        float getMinimum() const;
+        float getMaximum() const;
+
+    private:
+        int _tileSize;
+        int _tilesX;
+        int _tilesY;
+        std::vector<float> _tileBackground;
+        std::vector<float> _tileNoise;
+        float _background;
+        float _noise;
+        float _minimum;
+        float _maximum;
+    };
+
+}
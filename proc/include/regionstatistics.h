@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <inttypes.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fitsimage.h"
+
+namespace ELS
+{
+
+    // Mean, standard deviation, minimum and maximum of any box of an
+    // image in constant time (near enough), for cursor readouts. Sums
+    // of the pixels and their squares come from a summed-area table of
+    // tile totals for the tiles inside the box, and from prefix tables
+    // within each tile the box edges cut; extremes from a grid of
+    // per-block extremes, with only the blocks the box edges cut
+    // scanned. All values are in the image's native units.
+    //
+    // compute() keeps well under a byte per pixel. Tiles' prefix tables
+    // are built when a box first needs them and given back to the
+    // memory budget on demand. The image must outlive the tables, as
+    // partial blocks and tiles are read from it.
+    class RegionStatistics
+    {
+    public:
+        struct Box
+        {
+            // The box actually measured, clipped to the image.
+            int x;
+            int y;
+            int width;
+            int height;
+            int64_t count;
+            double mean;
+            double sigma;
+            double minimum;
+            double maximum;
+        };
+
+    public:
+        RegionStatistics();
+        ~RegionStatistics();
+
+        // Uses multiple threads, blocks until done. Gives up, leaving
+        // the object invalid, if cancel becomes set.
+        void compute(const FITSImage *image,
+                     const std::atomic<bool> *cancel = 0);
+        void clear();
+
+        bool isValid() const;
+        int getChannels() const;
+
+        // Of the box at (x, y), width by height. A box entirely outside
+        // the image has a count of 0.
+        Box measure(int channel,
+                    int x,
+                    int y,
+                    int width,
+                    int height) const;
+
+        // The pixel itself, read from the image; (x, y) must lie in it.
+        static double getValue(const FITSImage *image,
+                               int channel,
+                               int x,
+                               int y);
+
+    private:
+        struct Tile;
+
+        RegionStatistics(const RegionStatistics &);
+        RegionStatistics &operator=(const RegionStatistics &);
+
+        const Tile *getTile(int channel,
+                            int tileX,
+                            int tileY) const;
+        size_t evict(size_t bytes);
+        void charge() const;
+
+    private:
+        const FITSImage *_image;
+        int _width;
+        int _height;
+        int _channels;
+        int _blocksX;
+        int _blocksY;
+        int _tilesX;
+        int _tilesY;
+        // (tilesX + 1) x (tilesY + 1) per channel, with a zero first row
+        // and column.
+        std::vector<std::vector<double>> _tileSum;
+        std::vector<std::vector<double>> _tileSumSquares;
+        std::vector<std::vector<double>> _blockMin;
+        std::vector<std::vector<double>> _blockMax;
+        int64_t _tableBytes;
+        // Guards the tiles' prefix tables, built by measure() and
+        // dropped by the budget from any thread.
+        mutable std::mutex _mutex;
+        mutable std::vector<std::unique_ptr<Tile>> _tiles;
+        mutable int64_t _tileBytes;
+        mutable int64_t _charged;
+        int _budgetId;
+    };
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+
+namespace ELS
+{
+
+    // Combines a stack of equally sized pixel bands into one, pixel by
+    // pixel, using a robust estimator across the stack.
+    class StackCombine
+    {
+    public:
+        enum Method
+        {
+            CM_MEDIAN,
+            CM_SIGMA_CLIP,
+            CM_WINSORIZED
+        };
+
+    public:
+        StackCombine(Method method,
+                     float lowSigma = 3.0,
+                     float highSigma = 3.0,
+                     int maxIterations = 5);
+
+        Method getMethod() const;
+        const char *getMethodName() const;
+
+        // frames holds one band per input, each pixelCount floats long.
+        // Uses multiple threads, blocks until done.
+        void combine(const std::vector<const float *> &frames,
+                     int64_t pixelCount,
+                     float *output) const;
+
+    protected:
+        float combinePixel(float *values,
+                           int count) const;
+
+        float median(float *values,
+                     int count) const;
+        float sigmaClippedMean(float *values,
+                               int count) const;
+        float winsorizedMean(float *values,
+                             int count) const;
+
+    private:
+        Method _method;
+        float _lowSigma;
+        float _highSigma;
+        int _maxIterations;
+    };
+
+}
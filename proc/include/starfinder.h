@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "fitsimage.h"
+#include "imagestatistics.h"
+
+namespace ELS
+{
+
+    // One detected star. Positions are in image pixels with (0, 0) at
+    // the centre of the first pixel; sizes are in pixels.
+    struct Star
+    {
+        float x;
+        float y;
+        float flux;
+        float peak;
+        float hfr;
+        float fwhm;
+        float eccentricity;
+        int pixelCount;
+        bool saturated;
+    };
+
+    class StarAnalysis
+    {
+    public:
+        StarAnalysis();
+
+        bool isValid() const;
+        bool wasCancelled() const;
+
+        const std::vector<Star> &getStars() const;
+        int getStarCount() const;
+
+        float getBackground() const;
+        float getNoise() const;
+
+        // Medians over the unsaturated stars, 0 if there were none.
+        float getMedianHFR() const;
+        float getMedianFWHM() const;
+        float getMedianEccentricity() const;
+
+    private:
+        friend class StarFinder;
+
+        bool _valid;
+        bool _cancelled;
+        std::vector<Star> _stars;
+        float _background;
+        float _noise;
+        float _medianHFR;
+        float _medianFWHM;
+        float _medianEccentricity;
+    };
+
+    // Finds stars as connected groups of pixels above the local
+    // background plus a multiple of the local noise, and measures them.
+    class StarFinder
+    {
+    public:
+        StarFinder(float thresholdSigma = 5.0,
+                   int minPixels = 4,
+                   int maxRadius = 24);
+
+        // Colour images are analysed on their green channel. Uses
+        // multiple threads, blocks until done; setting cancel makes it
+        // return early with an invalid result.
+        StarAnalysis analyze(const FITSImage *image,
+                             const std::atomic<bool> *cancel = 0) const;
+
+        // As above, reusing statistics already computed for the channel.
+        StarAnalysis analyze(const FITSImage *image,
+                             const ImageStatistics &stats,
+                             const std::atomic<bool> *cancel = 0) const;
+
+        static int analysisChannel(const FITSImage *image);
+
+    private:
+        float _thresholdSigma;
+        int _minPixels;
+        int _maxRadius;
+    };
+
+}
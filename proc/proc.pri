@@ -0,0 +1,44 @@
+# Image processing kernels, shared by the viewer and the command-line
+# tools. Needs QtConcurrent but nothing from QtWidgets.
+
+QT += concurrent
+
+LIBS += -lz
+
+# FrameCache Rice codes integer frames with cfitsio's own coder. Only
+# fitsio2.h declares it, and cfitsio 3.30 and later are relied on to
+# keep its signatures. Without both, integer frames are shuffled and
+# deflated like floating point ones.
+CFITSIO_INCLUDEDIR = $$system(pkg-config --variable=includedir cfitsio 2>/dev/null)
+system(pkg-config --atleast-version=3.30 cfitsio 2>/dev/null):exists($$CFITSIO_INCLUDEDIR/fitsio2.h) {
+    DEFINES += ELS_HAVE_FITS_RICE
+} else {
+    message("cfitsio 3.30 or later with fitsio2.h not found; frame cache won't Rice code")
+}
+
+INCLUDEPATH += \
+    $$PWD/include
+
+SOURCES += \
+    $$PWD/src/backgroundmodel.cpp \
+    $$PWD/src/cosmeticcorrection.cpp \
+    $$PWD/src/debayer.cpp \
+    $$PWD/src/executor.cpp \
+    $$PWD/src/framecache.cpp \
+    $$PWD/src/framemath.cpp \
+    $$PWD/src/imagestatistics.cpp \
+    $$PWD/src/regionstatistics.cpp \
+    $$PWD/src/stackcombine.cpp \
+    $$PWD/src/starfinder.cpp
+
+HEADERS += \
+    $$PWD/include/backgroundmodel.h \
+    $$PWD/include/cosmeticcorrection.h \
+    $$PWD/include/debayer.h \
+    $$PWD/include/executor.h \
+    $$PWD/include/framecache.h \
+    $$PWD/include/framemath.h \
+    $$PWD/include/imagestatistics.h \
+    $$PWD/include/regionstatistics.h \
+    $$PWD/include/stackcombine.h \
+    $$PWD/include/starfinder.h
@@ -0,0 +1,437 @@
+#include <algorithm>
+#include <math.h>
+
+#include "backgroundmodel.h"
+#include "fitstrace.h"
+#include "imagestatistics.h"
+
+namespace
+{
+
+    constexpr int g_maxDegree = 4;
+
+    // Tiles noisier than this many times the median tile are taken to
+    // hold stars or nebulosity.
+    constexpr float g_noiseRejection = 1.5f;
+
+    // Residuals, in sigmas of all residuals, past which a tile is
+    // dropped and the fit done again. Objects only ever add light, so
+    // above is judged more harshly than below.
+    constexpr float g_highSigmas = 2.0f;
+    constexpr float g_lowSigmas = 3.0f;
+    constexpr int g_iterations = 4;
+
+    float median(std::vector<float> values)
+    {
+        const int middle = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        return values[middle];
+    }
+
+    // Pixel coordinate x along a side of size pixels, as -1 to 1.
+    double normalized(double x, int size)
+    {
+        return size > 1 ? 2.0 * x / (size - 1) - 1.0 : 0.0;
+    }
+
+    // Values of the terms of a polynomial of degree at (u, v), u^i v^j
+    // for i + j <= degree.
+    void termValues(double u, double v, int degree, double *values)
+    {
+        int term = 0;
+        double ui = 1.0;
+        for (int i = 0; i <= degree; i++)
+        {
+            double vj = 1.0;
+            for (int j = 0; i + j <= degree; j++)
+            {
+                values[term++] = ui * vj;
+                vj *= v;
+            }
+            ui *= u;
+        }
+    }
+
+    int termCount(int degree)
+    {
+        return (degree + 1) * (degree + 2) / 2;
+    }
+
+    // Solves the n x n system a x = b in place, by Gaussian elimination
+    // with partial pivoting; false if it is singular.
+    bool solve(std::vector<double> &a, std::vector<double> &b, int n)
+    {
+        for (int col = 0; col < n; col++)
+        {
+            int pivot = col;
+            for (int row = col + 1; row < n; row++)
+            {
+                if (fabs(a[row * n + col]) > fabs(a[pivot * n + col]))
+                {
+                    pivot = row;
+                }
+            }
+            if (fabs(a[pivot * n + col]) < 1e-12)
+            {
+                return false;
+            }
+            if (pivot != col)
+            {
+                for (int k = 0; k < n; k++)
+                {
+                    std::swap(a[col * n + k], a[pivot * n + k]);
+                }
+                std::swap(b[col], b[pivot]);
+            }
+
+            for (int row = col + 1; row < n; row++)
+            {
+                const double factor = a[row * n + col] / a[col * n + col];
+                for (int k = col; k < n; k++)
+                {
+                    a[row * n + k] -= factor * a[col * n + k];
+                }
+                b[row] -= factor * b[col];
+            }
+        }
+
+        for (int row = n - 1; row >= 0; row--)
+        {
+            double sum = b[row];
+            for (int k = row + 1; k < n; k++)
+            {
+                sum -= a[row * n + k] * b[k];
+            }
+            b[row] = sum / a[row * n + row];
+        }
+
+        return true;
+    }
+
+    struct Tile
+    {
+        double u;
+        double v;
+        float level;
+        float noise;
+        bool kept;
+    };
+
+    // Least squares fit of degree to the tiles kept, into terms; false
+    // if there are too few of them.
+    bool fitTiles(const std::vector<Tile> &tiles, int degree, std::vector<double> *terms)
+    {
+        const int n = termCount(degree);
+        std::vector<double> normal(n * n, 0.0);
+        std::vector<double> rhs(n, 0.0);
+        double values[termCount(g_maxDegree)];
+
+        int kept = 0;
+        for (const Tile &tile : tiles)
+        {
+            if (!tile.kept)
+            {
+                continue;
+            }
+            kept++;
+
+            termValues(tile.u, tile.v, degree, values);
+            for (int row = 0; row < n; row++)
+            {
+                for (int col = row; col < n; col++)
+                {
+                    normal[row * n + col] += values[row] * values[col];
+                }
+                rhs[row] += values[row] * tile.level;
+            }
+        }
+        if (kept < 2 * n)
+        {
+            return false;
+        }
+
+        for (int row = 0; row < n; row++)
+        {
+            for (int col = 0; col < row; col++)
+            {
+                normal[row * n + col] = normal[col * n + row];
+            }
+        }
+        if (!solve(normal, rhs, n))
+        {
+            return false;
+        }
+
+        *terms = rhs;
+        return true;
+    }
+
+    double evaluateTerms(const std::vector<double> &terms, int degree, double u, double v)
+    {
+        double values[termCount(g_maxDegree)];
+        termValues(u, v, degree, values);
+
+        double sum = 0.0;
+        for (int term = 0; term < termCount(degree); term++)
+        {
+            sum += terms[term] * values[term];
+        }
+        return sum;
+    }
+
+}
+
+namespace ELS
+{
+
+    BackgroundModel::BackgroundModel()
+        : _width(0),
+          _height(0),
+          _channels(0),
+          _degree(0),
+          _correction(BC_SUBTRACT),
+          _coefficients(),
+          _pedestal()
+    {
+    }
+
+    void BackgroundModel::fit(const FITSImage *image,
+                              int degree /* = 2 */,
+                              int tileSize /* = 64 */,
+                              const std::atomic<bool> *cancel /* = 0 */)
+    {
+        ELS_TRACE_SCOPE("BackgroundModel::fit");
+
+        clear();
+        if (image->getChanAx() == 1)
+        {
+            return;
+        }
+
+        degree = std::min(std::max(degree, 1), g_maxDegree);
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const int channels = image->isColor() ? 3 : 1;
+
+        std::vector<std::vector<double>> coefficients(channels);
+        std::vector<float> pedestal(channels);
+        for (int channel = 0; channel < channels; channel++)
+        {
+            ImageStatistics stats;
+            stats.compute(image, channel, tileSize);
+            if ((cancel != 0) && *cancel)
+            {
+                return;
+            }
+
+            // Each tile's level stands for the middle of the part of it
+            // inside the image.
+            std::vector<Tile> tiles;
+            std::vector<float> noises;
+            for (int tileY = 0; tileY < stats.getTilesY(); tileY++)
+            {
+                const int top = tileY * tileSize;
+                const int bottom = std::min(top + tileSize, height);
+                for (int tileX = 0; tileX < stats.getTilesX(); tileX++)
+                {
+                    const int left = tileX * tileSize;
+                    const int right = std::min(left + tileSize, width);
+
+                    Tile tile;
+                    tile.u = normalized((left + right - 1) / 2.0, width);
+                    tile.v = normalized((top + bottom - 1) / 2.0, height);
+                    tile.level = stats.getTileBackground(tileX, tileY);
+                    tile.noise = stats.getTileNoise(tileX, tileY);
+                    tile.kept = true;
+                    tiles.push_back(tile);
+                    noises.push_back(tile.noise);
+                }
+            }
+
+            const float typicalNoise = median(noises);
+            if (typicalNoise > 0.0f)
+            {
+                for (Tile &tile : tiles)
+                {
+                    tile.kept = tile.noise <= g_noiseRejection * typicalNoise;
+                }
+            }
+
+            std::vector<double> terms;
+            for (int iteration = 0; iteration < g_iterations; iteration++)
+            {
+                if (!fitTiles(tiles, degree, &terms))
+                {
+                    return;
+                }
+
+                std::vector<float> residuals;
+                for (const Tile &tile : tiles)
+                {
+                    if (tile.kept)
+                    {
+                        residuals.push_back(fabsf(tile.level - evaluateTerms(terms, degree, tile.u, tile.v)));
+                    }
+                }
+                const float sigma = 1.4826f * median(residuals);
+                if (sigma <= 0.0f)
+                {
+                    break;
+                }
+
+                bool rejected = false;
+                for (Tile &tile : tiles)
+                {
+                    const float residual = tile.level - evaluateTerms(terms, degree, tile.u, tile.v);
+                    if (tile.kept && ((residual > g_highSigmas * sigma) || (residual < -g_lowSigmas * sigma)))
+                    {
+                        tile.kept = false;
+                        rejected = true;
+                    }
+                }
+                if (!rejected)
+                {
+                    break;
+                }
+            }
+            if (terms.empty() || !fitTiles(tiles, degree, &terms))
+            {
+                return;
+            }
+
+            // Laid out for evaluating a row at a time.
+            coefficients[channel].assign((degree + 1) * (degree + 1), 0.0);
+            int term = 0;
+            for (int i = 0; i <= degree; i++)
+            {
+                for (int j = 0; i + j <= degree; j++)
+                {
+                    coefficients[channel][i * (degree + 1) + j] = terms[term++];
+                }
+            }
+
+            std::vector<float> levels;
+            for (const Tile &tile : tiles)
+            {
+                levels.push_back(evaluateTerms(terms, degree, tile.u, tile.v));
+            }
+            pedestal[channel] = median(levels);
+        }
+
+        _width = width;
+        _height = height;
+        _channels = channels;
+        _degree = degree;
+        _coefficients = coefficients;
+        _pedestal = pedestal;
+    }
+
+    void BackgroundModel::clear()
+    {
+        _width = 0;
+        _height = 0;
+        _channels = 0;
+        _degree = 0;
+        _coefficients.clear();
+        _pedestal.clear();
+    }
+
+    bool BackgroundModel::isValid() const
+    {
+        return _channels != 0;
+    }
+
+    int BackgroundModel::getChannels() const
+    {
+        return _channels;
+    }
+
+    int BackgroundModel::getDegree() const
+    {
+        return _degree;
+    }
+
+    BackgroundModel::Correction BackgroundModel::getCorrection() const
+    {
+        return _correction;
+    }
+
+    void BackgroundModel::setCorrection(Correction correction)
+    {
+        _correction = correction;
+    }
+
+    float BackgroundModel::evaluate(int channel,
+                                    float x,
+                                    float y) const
+    {
+        const std::vector<double> &c = _coefficients[channel];
+        const double u = normalized(x, _width);
+        const double v = normalized(y, _height);
+
+        double sum = 0.0;
+        for (int i = _degree; i >= 0; i--)
+        {
+            double row = 0.0;
+            for (int j = _degree - i; j >= 0; j--)
+            {
+                row = row * v + c[i * (_degree + 1) + j];
+            }
+            sum = sum * u + row;
+        }
+        return sum;
+    }
+
+    float BackgroundModel::getPedestal(int channel) const
+    {
+        return _pedestal[channel];
+    }
+
+    void BackgroundModel::getCorrectionRow(int channel,
+                                           int y,
+                                           int x,
+                                           int step,
+                                           int count,
+                                           float *scale,
+                                           float *offset) const
+    {
+        const std::vector<double> &c = _coefficients[channel];
+        const double v = normalized(y, _height);
+
+        // Along a row the model is a polynomial in u alone.
+        double rowTerms[g_maxDegree + 1];
+        for (int i = 0; i <= _degree; i++)
+        {
+            double sum = 0.0;
+            for (int j = _degree - i; j >= 0; j--)
+            {
+                sum = sum * v + c[i * (_degree + 1) + j];
+            }
+            rowTerms[i] = sum;
+        }
+
+        const float pedestal = _pedestal[channel];
+        const double du = _width > 1 ? 2.0 * step / (_width - 1) : 0.0;
+        double u = normalized(x, _width);
+        for (int i = 0; i < count; i++, u += du)
+        {
+            double model = 0.0;
+            for (int k = _degree; k >= 0; k--)
+            {
+                model = model * u + rowTerms[k];
+            }
+
+            if (_correction == BC_SUBTRACT)
+            {
+                scale[i] = 1.0f;
+                offset[i] = pedestal - model;
+            }
+            else
+            {
+                scale[i] = model > 0.0 ? pedestal / model : 1.0f;
+                offset[i] = 0.0f;
+            }
+        }
+    }
+
+}
@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cosmeticcorrection.h"
+#include "executor.h"
+#include "fitstrace.h"
+
+namespace
+{
+
+    // Rows handed to each worker.
+    constexpr int g_bandRows = 64;
+
+    // Sample pairs used for a noise estimate.
+    constexpr int g_noiseSamples = 100000;
+
+    // How far apart, in noise sigmas, the neighbours of an outlier may
+    // be. Those of a star fall away from its core; those of a defect
+    // are just background.
+    constexpr float g_neighbourSigmas = 5.0f;
+
+    inline float vmin(float a, float b)
+    {
+        return std::min(a, b);
+    }
+
+    inline float vmax(float a, float b)
+    {
+        return std::max(a, b);
+    }
+
+#if defined(__SSE2__)
+    inline __m128 vmin(__m128 a, __m128 b)
+    {
+        return _mm_min_ps(a, b);
+    }
+
+    inline __m128 vmax(__m128 a, __m128 b)
+    {
+        return _mm_max_ps(a, b);
+    }
+#endif
+
+    template <typename V>
+    inline void sort2(V &a, V &b)
+    {
+        const V low = vmin(a, b);
+        b = vmax(a, b);
+        a = low;
+    }
+
+    // Median of nine by a 19 exchange sorting network, branch free so
+    // it runs on four pixels at once as well as on one. Clobbers p.
+    template <typename V>
+    V median9(V *p)
+    {
+        sort2(p[1], p[2]);
+        sort2(p[4], p[5]);
+        sort2(p[7], p[8]);
+        sort2(p[0], p[1]);
+        sort2(p[3], p[4]);
+        sort2(p[6], p[7]);
+        sort2(p[1], p[2]);
+        sort2(p[4], p[5]);
+        sort2(p[7], p[8]);
+        sort2(p[0], p[3]);
+        sort2(p[5], p[8]);
+        sort2(p[4], p[7]);
+        sort2(p[3], p[6]);
+        sort2(p[1], p[4]);
+        sort2(p[2], p[5]);
+        sort2(p[4], p[7]);
+        sort2(p[4], p[2]);
+        sort2(p[6], p[4]);
+        sort2(p[4], p[2]);
+        return p[4];
+    }
+
+    // The eight neighbours of the sample at index i of row mid, step
+    // samples apart along the row, and in rows up and down.
+    template <typename V, typename Load>
+    void gather(Load load, const float *up, const float *mid, const float *down,
+                int64_t i, int step, V *p)
+    {
+        p[0] = load(up + i - step);
+        p[1] = load(up + i);
+        p[2] = load(up + i + step);
+        p[3] = load(mid + i - step);
+        p[4] = load(mid + i + step);
+        p[5] = load(down + i - step);
+        p[6] = load(down + i);
+        p[7] = load(down + i + step);
+    }
+
+    template <typename V>
+    void neighbourRange(const V *p, V *low, V *high)
+    {
+        V lo = p[0];
+        V hi = p[0];
+        for (int n = 1; n < 8; n++)
+        {
+            lo = vmin(lo, p[n]);
+            hi = vmax(hi, p[n]);
+        }
+        *low = lo;
+        *high = hi;
+    }
+
+    template <typename T>
+    T fromFloat(float value)
+    {
+        return std::is_integral<T>::value ? (T)(value + 0.5f) : (T)value;
+    }
+
+    // Corrects samples [first, last) of one row, writing only the
+    // outliers to output. Returns how many there were.
+    template <typename T>
+    int64_t correctRow(const float *up, const float *mid, const float *down, T *output,
+                       int64_t first, int64_t last, int step, float threshold, float flatness)
+    {
+        int64_t corrected = 0;
+        int64_t i = first;
+
+#if defined(__SSE2__)
+        const __m128 limit = _mm_set1_ps(threshold);
+        const __m128 flat = _mm_set1_ps(flatness);
+        auto load = [](const float *at)
+        { return _mm_loadu_ps(at); };
+        for (; i + 4 <= last; i += 4)
+        {
+            __m128 p[9];
+            gather<__m128>(load, up, mid, down, i, step, p);
+            __m128 low;
+            __m128 high;
+            neighbourRange(p, &low, &high);
+
+            const __m128 centre = _mm_loadu_ps(mid + i);
+            __m128 hot = _mm_cmpgt_ps(_mm_sub_ps(centre, high), limit);
+            __m128 cold = _mm_cmpgt_ps(_mm_sub_ps(low, centre), limit);
+
+            // Nearly always clean; the median is only wanted otherwise.
+            if (_mm_movemask_ps(_mm_or_ps(hot, cold)) == 0)
+            {
+                continue;
+            }
+
+            const int mask = _mm_movemask_ps(_mm_and_ps(_mm_or_ps(hot, cold),
+                                                        _mm_cmplt_ps(_mm_sub_ps(high, low), flat)));
+            if (mask == 0)
+            {
+                continue;
+            }
+
+            p[8] = centre;
+            const __m128 middle = median9(p);
+
+            float median[4];
+            _mm_storeu_ps(median, middle);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (mask & (1 << lane))
+                {
+                    output[i + lane] = fromFloat<T>(median[lane]);
+                    corrected++;
+                }
+            }
+        }
+#endif
+
+        auto load1 = [](const float *at)
+        { return *at; };
+        for (; i < last; i++)
+        {
+            float p[9];
+            gather<float>(load1, up, mid, down, i, step, p);
+            float low;
+            float high;
+            neighbourRange(p, &low, &high);
+
+            const float centre = mid[i];
+            if (((centre - high > threshold) || (low - centre > threshold)) && (high - low < flatness))
+            {
+                p[8] = centre;
+                output[i] = fromFloat<T>(median9(p));
+                corrected++;
+            }
+        }
+
+        return corrected;
+    }
+
+    template <typename T>
+    void toFloat(const T *input, float *output, int64_t count)
+    {
+        for (int64_t i = 0; i < count; i++)
+        {
+            output[i] = input[i];
+        }
+    }
+
+    // A plane of rows of samples: a whole mono or planar colour channel,
+    // or interleaved colour, spp samples to the pixel.
+    struct Layout
+    {
+        int64_t rowSamples;
+        int height;
+        // Between a sample and its neighbours, in samples along a row
+        // and in rows.
+        int stepX;
+        int stepY;
+    };
+
+    template <typename T>
+    int64_t correctBand(const T *input, T *output, const Layout &layout,
+                        float sigmas, float noise, int first, int last)
+    {
+        const int64_t rowSamples = layout.rowSamples;
+        memcpy(output + first * rowSamples, input + first * rowSamples, (last - first) * rowSamples * sizeof(T));
+
+        // Without noise to go by, anything would count.
+        if (!(noise > 0.0f))
+        {
+            return 0;
+        }
+
+        // Rows with all their neighbours, and the halo rows above and
+        // below the band that those need.
+        const int top = std::max(first, layout.stepY);
+        const int bottom = std::min(last, layout.height - layout.stepY);
+        if (top >= bottom)
+        {
+            return 0;
+        }
+        const int haloTop = top - layout.stepY;
+        const int haloBottom = bottom + layout.stepY;
+
+        std::vector<float> rows((haloBottom - haloTop) * rowSamples);
+        toFloat(input + haloTop * rowSamples, rows.data(), rows.size());
+
+        int64_t corrected = 0;
+        for (int y = top; y < bottom; y++)
+        {
+            const float *mid = rows.data() + (y - haloTop) * rowSamples;
+            corrected += correctRow(mid - layout.stepY * rowSamples, mid, mid + layout.stepY * rowSamples,
+                                    output + y * rowSamples, layout.stepX, rowSamples - layout.stepX,
+                                    layout.stepX, sigmas * noise, g_neighbourSigmas * noise);
+        }
+
+        return corrected;
+    }
+
+    template <typename T>
+    int64_t correctPlane(const T *input, T *output, const Layout &layout, float sigmas, float noise)
+    {
+        QVector<QFuture<void>> futures;
+        std::atomic<int64_t> corrected(0);
+        std::atomic<int64_t> *total = &corrected;
+
+        for (int first = 0; first < layout.height; first += g_bandRows)
+        {
+            const int last = std::min(first + g_bandRows, layout.height);
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        { *total += correctBand(input, output, layout, sigmas, noise, first, last); }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+
+        return corrected;
+    }
+
+    template <typename T>
+    float planeNoise(const T *plane, int64_t rowSamples, int height, int stride, int stepX)
+    {
+        const int64_t pairs = rowSamples / stride - stepX;
+        if ((pairs <= 0) || (height <= 0))
+        {
+            return 0.0f;
+        }
+
+        const int64_t total = pairs * height;
+        const int step = std::max<int64_t>(1, (int64_t)sqrtf((float)total / g_noiseSamples));
+
+        std::vector<float> differences;
+        for (int y = 0; y < height; y += step)
+        {
+            const T *line = plane + y * rowSamples;
+            for (int64_t x = 0; x < pairs; x += step)
+            {
+                differences.push_back((float)line[x * stride] - (float)line[(x + stepX) * stride]);
+            }
+        }
+
+        for (float &difference : differences)
+        {
+            difference = fabsf(difference);
+        }
+        const int middle = differences.size() / 2;
+        std::nth_element(differences.begin(), differences.begin() + middle, differences.end());
+
+        // The difference of two samples has sqrt(2) times their noise.
+        return 1.4826f * differences[middle] / sqrtf(2.0f);
+    }
+
+    template <typename T>
+    float channelNoise(const ELS::FITSImage *image, int channel)
+    {
+        const T *pixels = (const T *)image->getPixels();
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const int stepX = image->isBayered() ? 2 : 1;
+        if (image->getChanAx() == 1)
+        {
+            return planeNoise(pixels + channel, (int64_t)width * 3, height, 3, stepX);
+        }
+
+        return planeNoise(pixels + (int64_t)channel * width * height, width, height, 1, stepX);
+    }
+
+    template <typename T>
+    int64_t correctImage(const ELS::FITSImage *image, ELS::FITSImage *result,
+                         float sigmas, float noise)
+    {
+        const T *input = (const T *)image->getPixels();
+        T *output = (T *)result->getPixels();
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const int channels = image->isColor() ? 3 : 1;
+        const int step = image->isBayered() ? 2 : 1;
+
+        std::vector<float> noises(channels, noise);
+        for (int channel = 0; channel < channels; channel++)
+        {
+            if (noise <= 0.0f)
+            {
+                noises[channel] = channelNoise<T>(image, channel);
+            }
+
+            // Quiet integer data can have a MAD of nothing; it still
+            // has a quantization step of noise.
+            if (std::is_integral<T>::value)
+            {
+                noises[channel] = std::max(noises[channel], 1.0f);
+            }
+        }
+
+        Layout layout;
+        layout.height = height;
+        layout.stepY = step;
+        if (image->getChanAx() == 1)
+        {
+            // Samples of a pixel side by side: one threshold serves them.
+            std::sort(noises.begin(), noises.end());
+            layout.rowSamples = (int64_t)width * 3;
+            layout.stepX = 3;
+            return correctPlane(input, output, layout, sigmas, noises[1]);
+        }
+
+        layout.rowSamples = width;
+        layout.stepX = step;
+        int64_t corrected = 0;
+        for (int channel = 0; channel < channels; channel++)
+        {
+            const int64_t offset = (int64_t)channel * width * height;
+            corrected += correctPlane(input + offset, output + offset, layout, sigmas, noises[channel]);
+        }
+
+        return corrected;
+    }
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    const float CosmeticCorrection::g_defaultSigmas = 5.0f;
+
+    /* static */
+    FITSImage *CosmeticCorrection::run(const FITSImage *image,
+                                       float sigmas,
+                                       float noise,
+                                       int64_t *corrected)
+    {
+        ELS_TRACE_SCOPE("CosmeticCorrection::run");
+
+        FITSImage *result = FITSImage::create(image->getBitDepth(), image->getInfo());
+
+        int64_t count = 0;
+        switch (image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            count = correctImage<uint8_t>(image, result, sigmas, noise);
+            break;
+        case FITSImage::BD_INT_16:
+            count = correctImage<uint16_t>(image, result, sigmas, noise);
+            break;
+        case FITSImage::BD_INT_32:
+            count = correctImage<uint32_t>(image, result, sigmas, noise);
+            break;
+        case FITSImage::BD_FLOAT:
+            count = correctImage<float>(image, result, sigmas, noise);
+            break;
+        case FITSImage::BD_DOUBLE:
+            count = correctImage<double>(image, result, sigmas, noise);
+            break;
+        }
+
+        if (corrected != 0)
+        {
+            *corrected = count;
+        }
+
+        return result;
+    }
+
+    /* static */
+    float CosmeticCorrection::estimateNoise(const FITSImage *image,
+                                            int channel)
+    {
+        switch (image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            return channelNoise<uint8_t>(image, channel);
+        case FITSImage::BD_INT_16:
+            return channelNoise<uint16_t>(image, channel);
+        case FITSImage::BD_INT_32:
+            return channelNoise<uint32_t>(image, channel);
+        case FITSImage::BD_FLOAT:
+            return channelNoise<float>(image, channel);
+        case FITSImage::BD_DOUBLE:
+            return channelNoise<double>(image, channel);
+        }
+
+        return 0.0f;
+    }
+
+}
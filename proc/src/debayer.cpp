@@ -0,0 +1,685 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "executor.h"
+#include "fitsexception.h"
+#include "fitstrace.h"
+#include "debayer.h"
+
+namespace
+{
+
+    enum Color
+    {
+        RED,
+        GREEN,
+        BLUE
+    };
+
+    // How a missing colour is estimated from the mosaic at a site.
+    enum Estimator
+    {
+        E_SELF,
+        E_HORIZONTAL,
+        E_VERTICAL,
+        E_CROSS,
+        E_DIAGONAL
+    };
+
+    // Rows handed to each worker.
+    constexpr int g_bandRows = 32;
+
+    // The colour filter array, already shifted by the header offsets.
+    class CFA
+    {
+    public:
+        CFA(const char *pattern, int offsetX, int offsetY)
+        {
+            if (strlen(pattern) < 4)
+            {
+                throw new ELS::FITSException("Unrecognized Bayer pattern");
+            }
+
+            for (int i = 0; i < 4; i++)
+            {
+                switch (pattern[i])
+                {
+                case 'R':
+                    _colors[i] = RED;
+                    break;
+                case 'G':
+                    _colors[i] = GREEN;
+                    break;
+                case 'B':
+                    _colors[i] = BLUE;
+                    break;
+                default:
+                    throw new ELS::FITSException("Unrecognized Bayer pattern");
+                }
+            }
+
+            // One red, one blue, and the two greens on a diagonal, which
+            // every mode relies on.
+            const bool greensMain = (_colors[0] == GREEN) && (_colors[3] == GREEN);
+            const bool greensAnti = (_colors[1] == GREEN) && (_colors[2] == GREEN);
+            const int others = greensMain ? 1 : 0;
+            if ((greensMain == greensAnti) ||
+                (_colors[others] == GREEN) ||
+                (_colors[3 - others] == GREEN) ||
+                (_colors[others] == _colors[3 - others]))
+            {
+                throw new ELS::FITSException("Unrecognized Bayer pattern");
+            }
+
+            _offsetX = offsetX & 1;
+            _offsetY = offsetY & 1;
+
+            for (int rowParity = 0; rowParity < 2; rowParity++)
+            {
+                for (int colParity = 0; colParity < 2; colParity++)
+                {
+                    for (int channel = 0; channel < 3; channel++)
+                    {
+                        _estimators[rowParity][colParity][channel] =
+                            pickEstimator(colParity, rowParity, (Color)channel);
+                    }
+                }
+            }
+        }
+
+        Color color(int x, int y) const
+        {
+            return _colors[((y + _offsetY) & 1) * 2 + ((x + _offsetX) & 1)];
+        }
+
+        Estimator estimator(int x, int y, int channel) const
+        {
+            return _estimators[y & 1][x & 1][channel];
+        }
+
+    private:
+        Estimator pickEstimator(int x, int y, Color channel) const
+        {
+            Color site = color(x, y);
+            if (site == channel)
+            {
+                return E_SELF;
+            }
+            if (channel == GREEN)
+            {
+                return E_CROSS;
+            }
+            if (site == GREEN)
+            {
+                return color(x + 1, y) == channel ? E_HORIZONTAL : E_VERTICAL;
+            }
+
+            return E_DIAGONAL;
+        }
+
+    private:
+        Color _colors[4];
+        int _offsetX;
+        int _offsetY;
+        Estimator _estimators[2][2][3];
+    };
+
+    // Reflects an out of range coordinate back in without changing its
+    // parity, so the colour at the reflected site is the one expected.
+    inline int mirror(int i, int size)
+    {
+        if (i < 0)
+            i = -i;
+        else if (i >= size)
+            i = 2 * (size - 1) - i;
+
+        // A side of 2 is too short to reflect the margin of 2 VNG reads.
+        if ((i < 0) || (i >= size))
+            return i & 1;
+        return i;
+    }
+
+    template <typename T>
+    inline T fromAccum(double value)
+    {
+        return value;
+    }
+
+    template <>
+    inline uint8_t fromAccum<uint8_t>(double value)
+    {
+        return value < 0 ? 0 : (value > 255 ? 255 : (uint8_t)(value + 0.5));
+    }
+
+    template <>
+    inline uint16_t fromAccum<uint16_t>(double value)
+    {
+        return value < 0 ? 0 : (value > 65535 ? 65535 : (uint16_t)(value + 0.5));
+    }
+
+    template <>
+    inline uint32_t fromAccum<uint32_t>(double value)
+    {
+        return value < 0 ? 0 : (value > 4294967295.0 ? 4294967295u : (uint32_t)(value + 0.5));
+    }
+
+    // Reads the mosaic with mirrored edges.
+    template <typename T>
+    class Mosaic
+    {
+    public:
+        Mosaic(const T *pixels, int width, int height)
+            : _pixels(pixels), _width(width), _height(height)
+        {
+        }
+
+        double at(int x, int y) const
+        {
+            return _pixels[(int64_t)mirror(y, _height) * _width + mirror(x, _width)];
+        }
+
+    private:
+        const T *_pixels;
+        int _width;
+        int _height;
+    };
+
+    // Reads the mosaic away from the edges, where no mirroring is needed.
+    template <typename T>
+    class Interior
+    {
+    public:
+        Interior(const T *pixels, int width, int /* height */)
+            : _pixels(pixels), _width(width)
+        {
+        }
+
+        double at(int x, int y) const
+        {
+            return _pixels[(int64_t)y * _width + x];
+        }
+
+    private:
+        const T *_pixels;
+        int _width;
+    };
+
+    // Calls spanFunc(reader, first, last) for the parts of columns
+    // [firstCol, lastCol) of row y, using the mirroring reader only
+    // within margin pixels of an edge.
+    template <template <typename> class Reader, typename T, typename F>
+    void splitSpan(const T *pixels, int width, int height, int margin,
+                   int y, int firstCol, int lastCol, F spanFunc)
+    {
+        Mosaic<T> edge(pixels, width, height);
+
+        if ((y < margin) || (y >= height - margin) || (width <= 2 * margin))
+        {
+            spanFunc(edge, firstCol, lastCol);
+            return;
+        }
+
+        Reader<T> interior(pixels, width, height);
+        const int left = std::min(std::max(firstCol, margin), lastCol);
+        const int right = std::max(std::min(lastCol, width - margin), left);
+
+        spanFunc(edge, firstCol, left);
+        spanFunc(interior, left, right);
+        spanFunc(edge, right, lastCol);
+    }
+
+    template <typename M>
+    double estimate(const M &m, int x, int y, Estimator estimator)
+    {
+        switch (estimator)
+        {
+        case E_SELF:
+            return m.at(x, y);
+        case E_HORIZONTAL:
+            return (m.at(x - 1, y) + m.at(x + 1, y)) / 2;
+        case E_VERTICAL:
+            return (m.at(x, y - 1) + m.at(x, y + 1)) / 2;
+        case E_CROSS:
+            return (m.at(x - 1, y) + m.at(x + 1, y) + m.at(x, y - 1) + m.at(x, y + 1)) / 4;
+        case E_DIAGONAL:
+            return (m.at(x - 1, y - 1) + m.at(x + 1, y - 1) + m.at(x - 1, y + 1) + m.at(x + 1, y + 1)) / 4;
+        }
+
+        return 0;
+    }
+
+    template <typename T>
+    struct BilinearSpan
+    {
+        T *outLine;
+        int64_t size;
+        const CFA *cfa;
+        int y;
+
+        template <typename M>
+        void operator()(const M &m, int first, int last) const
+        {
+            for (int x = first; x < last; x++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    outLine[c * size + x] = fromAccum<T>(estimate(m, x, y, cfa->estimator(x, y, c)));
+                }
+            }
+        }
+    };
+
+    // Bilinear interpolation of columns [firstCol, lastCol) of row y.
+    template <typename T>
+    void bilinearSpan(const T *input, T *output, const CFA &cfa,
+                      int width, int height, int y, int firstCol, int lastCol)
+    {
+        BilinearSpan<T> span;
+        span.outLine = output + (int64_t)y * width;
+        span.size = (int64_t)width * height;
+        span.cfa = &cfa;
+        span.y = y;
+
+        splitSpan<Interior>(input, width, height, 1, y, firstCol, lastCol, span);
+    }
+
+    template <typename T>
+    void bilinearRow(const T *input, T *output, const CFA &cfa,
+                     int width, int height, int y)
+    {
+        bilinearSpan(input, output, cfa, width, height, y, 0, width);
+    }
+
+#if defined(__SSE2__)
+    // 16-bit rows away from the top and bottom edge are done eight
+    // pixels at a time: every estimator is computed for the whole
+    // vector and the right one picked per column parity. Averages use
+    // pavgw, so they round half up exactly as the scalar path does for
+    // pairs, and within one ADU of it for the four pixel averages.
+    template <>
+    void bilinearRow<uint16_t>(const uint16_t *input, uint16_t *output, const CFA &cfa,
+                               int width, int height, int y)
+    {
+        if ((y == 0) || (y == height - 1) || (width < 12))
+        {
+            bilinearSpan(input, output, cfa, width, height, y, 0, width);
+            return;
+        }
+
+        const int64_t size = (int64_t)width * height;
+        const uint16_t *up = input + (int64_t)(y - 1) * width;
+        const uint16_t *mid = up + width;
+        const uint16_t *down = mid + width;
+        uint16_t *outLine = output + (int64_t)y * width;
+
+        // Lane 0 always lands on an even column.
+        const __m128i evenLanes = _mm_set_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+
+        Estimator even[3], odd[3];
+        for (int c = 0; c < 3; c++)
+        {
+            even[c] = cfa.estimator(0, y, c);
+            odd[c] = cfa.estimator(1, y, c);
+        }
+
+        bilinearSpan(input, output, cfa, width, height, y, 0, 2);
+
+        int x = 2;
+        for (; x + 9 <= width; x += 8)
+        {
+            __m128i candidates[5];
+            const __m128i left = _mm_loadu_si128((const __m128i *)(mid + x - 1));
+            const __m128i right = _mm_loadu_si128((const __m128i *)(mid + x + 1));
+            const __m128i above = _mm_loadu_si128((const __m128i *)(up + x));
+            const __m128i below = _mm_loadu_si128((const __m128i *)(down + x));
+            const __m128i upperDiag = _mm_avg_epu16(_mm_loadu_si128((const __m128i *)(up + x - 1)),
+                                                    _mm_loadu_si128((const __m128i *)(up + x + 1)));
+            const __m128i lowerDiag = _mm_avg_epu16(_mm_loadu_si128((const __m128i *)(down + x - 1)),
+                                                    _mm_loadu_si128((const __m128i *)(down + x + 1)));
+
+            candidates[E_SELF] = _mm_loadu_si128((const __m128i *)(mid + x));
+            candidates[E_HORIZONTAL] = _mm_avg_epu16(left, right);
+            candidates[E_VERTICAL] = _mm_avg_epu16(above, below);
+            candidates[E_CROSS] = _mm_avg_epu16(candidates[E_HORIZONTAL], candidates[E_VERTICAL]);
+            candidates[E_DIAGONAL] = _mm_avg_epu16(upperDiag, lowerDiag);
+
+            for (int c = 0; c < 3; c++)
+            {
+                const __m128i result = _mm_or_si128(_mm_and_si128(evenLanes, candidates[even[c]]),
+                                                    _mm_andnot_si128(evenLanes, candidates[odd[c]]));
+                _mm_storeu_si128((__m128i *)(outLine + c * size + x), result);
+            }
+        }
+
+        bilinearSpan(input, output, cfa, width, height, y, x, width);
+    }
+#endif
+
+    // VNG-lite, pass one: green everywhere. At red and blue sites the
+    // four compass directions are scored by gradient, and green is the
+    // colour-difference corrected average over the directions whose
+    // gradient is within half the spread of the smoothest one.
+    template <typename T>
+    struct VNGGreenSpan
+    {
+        T *outLine;
+        const CFA *cfa;
+        int y;
+
+        template <typename M>
+        void operator()(const M &m, int first, int last) const
+        {
+            for (int x = first; x < last; x++)
+            {
+                const double center = m.at(x, y);
+                if (cfa->color(x, y) == GREEN)
+                {
+                    outLine[x] = fromAccum<T>(center);
+                    continue;
+                }
+
+                const double n = m.at(x, y - 1), s = m.at(x, y + 1);
+                const double e = m.at(x + 1, y), w = m.at(x - 1, y);
+                const double nn = m.at(x, y - 2), ss = m.at(x, y + 2);
+                const double ee = m.at(x + 2, y), ww = m.at(x - 2, y);
+
+                const double gradients[4] = {
+                    fabs(n - s) + fabs(nn - center),
+                    fabs(s - n) + fabs(ss - center),
+                    fabs(e - w) + fabs(ee - center),
+                    fabs(w - e) + fabs(ww - center)};
+                const double estimates[4] = {
+                    n + (center - nn) / 2,
+                    s + (center - ss) / 2,
+                    e + (center - ee) / 2,
+                    w + (center - ww) / 2};
+
+                double lo = gradients[0], hi = gradients[0];
+                for (int d = 1; d < 4; d++)
+                {
+                    lo = std::min(lo, gradients[d]);
+                    hi = std::max(hi, gradients[d]);
+                }
+                const double threshold = lo + (hi - lo) / 2;
+
+                double sum = 0;
+                int count = 0;
+                for (int d = 0; d < 4; d++)
+                {
+                    if (gradients[d] <= threshold)
+                    {
+                        sum += estimates[d];
+                        count++;
+                    }
+                }
+
+                // Clamp the corrected estimate to its neighbours so the
+                // correction can't overshoot into ringing.
+                const double low = std::min(std::min(n, s), std::min(e, w));
+                const double high = std::max(std::max(n, s), std::max(e, w));
+                outLine[x] = fromAccum<T>(std::min(high, std::max(low, sum / count)));
+            }
+        }
+    };
+
+    template <typename T>
+    void vngGreenRow(const T *input, T *green, const CFA &cfa,
+                     int width, int height, int y)
+    {
+        VNGGreenSpan<T> span;
+        span.outLine = green + (int64_t)y * width;
+        span.cfa = &cfa;
+        span.y = y;
+
+        splitSpan<Interior>(input, width, height, 2, y, 0, width, span);
+    }
+
+    // VNG-lite, pass two: red and blue interpolated as differences
+    // against the completed green plane.
+    template <typename T>
+    struct VNGColorSpan
+    {
+        T *outLine;
+        const T *green;
+        int64_t size;
+        int width;
+        int height;
+        const CFA *cfa;
+        int y;
+
+        template <typename M>
+        void operator()(const M &m, int first, int last) const
+        {
+            M g(green, width, height);
+
+            for (int x = first; x < last; x++)
+            {
+                for (int c = 0; c < 3; c += 2)
+                {
+                    double value;
+                    switch (cfa->estimator(x, y, c))
+                    {
+                    case E_SELF:
+                        value = m.at(x, y);
+                        break;
+                    case E_HORIZONTAL:
+                        value = g.at(x, y) + ((m.at(x - 1, y) - g.at(x - 1, y)) +
+                                              (m.at(x + 1, y) - g.at(x + 1, y))) /
+                                                 2;
+                        break;
+                    case E_VERTICAL:
+                        value = g.at(x, y) + ((m.at(x, y - 1) - g.at(x, y - 1)) +
+                                              (m.at(x, y + 1) - g.at(x, y + 1))) /
+                                                 2;
+                        break;
+                    default:
+                        value = g.at(x, y) + ((m.at(x - 1, y - 1) - g.at(x - 1, y - 1)) +
+                                              (m.at(x + 1, y - 1) - g.at(x + 1, y - 1)) +
+                                              (m.at(x - 1, y + 1) - g.at(x - 1, y + 1)) +
+                                              (m.at(x + 1, y + 1) - g.at(x + 1, y + 1))) /
+                                                 4;
+                        break;
+                    }
+
+                    outLine[c * size + x] = fromAccum<T>(value);
+                }
+            }
+        }
+    };
+
+    template <typename T>
+    void vngColorRow(const T *input, T *output, const CFA &cfa,
+                     int width, int height, int y)
+    {
+        VNGColorSpan<T> span;
+        span.size = (int64_t)width * height;
+        span.outLine = output + (int64_t)y * width;
+        span.green = output + span.size;
+        span.width = width;
+        span.height = height;
+        span.cfa = &cfa;
+        span.y = y;
+
+        splitSpan<Interior>(input, width, height, 1, y, 0, width, span);
+    }
+
+    // Each 2x2 cell becomes one output pixel: its red, its blue and the
+    // mean of its two greens.
+    template <typename T>
+    void superpixelRow(const T *input, T *output, const CFA &cfa,
+                       int width, int outWidth, int outHeight, int y)
+    {
+        const int64_t size = (int64_t)outWidth * outHeight;
+        const T *rows[2] = {input + (int64_t)(2 * y) * width,
+                            input + (int64_t)(2 * y + 1) * width};
+        T *outLine = output + (int64_t)y * outWidth;
+
+        // Where each colour sits within the cell.
+        int red = 0, blue = 0, green1 = -1, green2 = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            switch (cfa.color(i & 1, (2 * y) + (i >> 1)))
+            {
+            case RED:
+                red = i;
+                break;
+            case BLUE:
+                blue = i;
+                break;
+            case GREEN:
+                if (green1 < 0)
+                    green1 = i;
+                else
+                    green2 = i;
+                break;
+            }
+        }
+
+        const T *redRow = rows[red >> 1] + (red & 1);
+        const T *blueRow = rows[blue >> 1] + (blue & 1);
+        const T *green1Row = rows[green1 >> 1] + (green1 & 1);
+        const T *green2Row = rows[green2 >> 1] + (green2 & 1);
+
+        for (int x = 0; x < outWidth; x++)
+        {
+            outLine[x] = redRow[2 * x];
+            outLine[size + x] = fromAccum<T>(((double)green1Row[2 * x] + green2Row[2 * x]) / 2);
+            outLine[2 * size + x] = blueRow[2 * x];
+        }
+    }
+
+    // Runs rowFunc(y) over [0, height) in bands across the thread pool.
+    template <typename F>
+    void forEachRow(int height, F rowFunc)
+    {
+        QVector<QFuture<void>> futures;
+
+        for (int first = 0; first < height; first += g_bandRows)
+        {
+            const int last = std::min(first + g_bandRows, height);
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        {
+                                                            for (int y = first; y < last; y++)
+                                                                rowFunc(y);
+                                                        }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+    }
+
+    template <typename T>
+    void debayer(const T *input, T *output, const CFA &cfa,
+                 int width, int height, ELS::Debayer::Mode mode)
+    {
+        switch (mode)
+        {
+        case ELS::Debayer::DM_BILINEAR:
+            forEachRow(height, [=, &cfa](int y)
+                       { bilinearRow(input, output, cfa, width, height, y); });
+            break;
+        case ELS::Debayer::DM_VNG_LITE:
+        {
+            // Green goes straight into the output's green plane; the
+            // colour pass needs all of it, so the passes don't overlap.
+            T *green = output + (int64_t)width * height;
+            forEachRow(height, [=, &cfa](int y)
+                       { vngGreenRow(input, green, cfa, width, height, y); });
+            forEachRow(height, [=, &cfa](int y)
+                       { vngColorRow(input, output, cfa, width, height, y); });
+            break;
+        }
+        case ELS::Debayer::DM_SUPERPIXEL:
+        {
+            const int outWidth = width / 2;
+            const int outHeight = height / 2;
+            forEachRow(outHeight, [=, &cfa](int y)
+                       { superpixelRow(input, output, cfa, width, outWidth, outHeight, y); });
+            break;
+        }
+        }
+    }
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    FITSImage *Debayer::run(const FITSImage *image,
+                            Mode mode)
+    {
+        ELS_TRACE_SCOPE("Debayer::run");
+
+        if (!image->isBayered() || image->isColor())
+        {
+            throw new FITSException("Image has no Bayer pattern");
+        }
+
+        CFA cfa(image->getBayerPattern(),
+                image->getBayerOffsetX(),
+                image->getBayerOffsetY());
+
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        if ((width < 2) || (height < 2))
+        {
+            throw new FITSException("Image is too small to debayer");
+        }
+
+        FITSImage *result;
+        if (mode == DM_SUPERPIXEL)
+        {
+            result = FITSImage::create(image->getBitDepth(), width / 2, height / 2, true);
+        }
+        else
+        {
+            result = FITSImage::create(image->getBitDepth(), width, height, true);
+        }
+
+        const void *input = image->getPixels();
+        void *output = result->getPixels();
+
+        switch (image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            debayer((const uint8_t *)input, (uint8_t *)output, cfa, width, height, mode);
+            break;
+        case FITSImage::BD_INT_16:
+            debayer((const uint16_t *)input, (uint16_t *)output, cfa, width, height, mode);
+            break;
+        case FITSImage::BD_INT_32:
+            debayer((const uint32_t *)input, (uint32_t *)output, cfa, width, height, mode);
+            break;
+        case FITSImage::BD_FLOAT:
+            debayer((const float *)input, (float *)output, cfa, width, height, mode);
+            break;
+        case FITSImage::BD_DOUBLE:
+            debayer((const double *)input, (double *)output, cfa, width, height, mode);
+            break;
+        }
+
+        return result;
+    }
+
+    /* static */
+    const char *Debayer::getModeName(Mode mode)
+    {
+        switch (mode)
+        {
+        case DM_BILINEAR:
+            return "Bilinear";
+        case DM_VNG_LITE:
+            return "VNG-lite";
+        case DM_SUPERPIXEL:
+            return "Superpixel";
+        }
+
+        return "unknown";
+    }
+
+}
@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <QThread>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "executor.h"
+#include "fitsexception.h"
+
+namespace
+{
+
+    // EL_COUNT outside any job.
+    thread_local ELS::Executor::Lane t_lane = ELS::Executor::EL_COUNT;
+
+    // Background work only gets the CPU nobody else wants.
+    const int g_backgroundNice = 19;
+
+    // The process's own, which a background thread running a job that
+    // someone more urgent waits on is given for the while.
+    int g_baseNice = 0;
+
+    long currentThread()
+    {
+#ifdef __linux__
+        return syscall(SYS_gettid);
+#else
+        return 0;
+#endif
+    }
+
+}
+
+namespace ELS
+{
+
+    CancelToken::CancelToken()
+        : _flag(std::make_shared<std::atomic<bool>>(false))
+    {
+    }
+
+    void CancelToken::cancel() const
+    {
+        *_flag = true;
+    }
+
+    bool CancelToken::isCancelled() const
+    {
+        return *_flag;
+    }
+
+    const std::atomic<bool> *CancelToken::getFlag() const
+    {
+        return _flag.get();
+    }
+
+    struct Executor::Job::State
+    {
+        enum Status
+        {
+            JS_QUEUED,
+            JS_RUNNING,
+            JS_DONE
+        };
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        Status status;
+        std::function<void(const CancelToken &)> fn;
+        CancelToken token;
+        Executor *executor;
+        Lane lane;
+        // Only valid while queued.
+        Runnable *runnable;
+        // Only valid while running.
+        long thread;
+        bool reniced;
+
+        // Caller holds the lock. A running job takes a waiter's lane
+        // if that is more urgent, and its thread that lane's priority
+        // where the system allows raising it back.
+        void inherit(Lane waiter)
+        {
+            if ((status != JS_RUNNING) || (lane <= waiter))
+            {
+                return;
+            }
+
+#ifdef __linux__
+            if ((lane == EL_BACKGROUND) && !reniced && (thread != 0))
+            {
+                reniced = setpriority(PRIO_PROCESS, thread, g_baseNice) == 0;
+            }
+#endif
+            lane = waiter;
+        }
+    };
+
+    class Executor::Job::Runnable : public QRunnable
+    {
+    public:
+        explicit Runnable(const std::shared_ptr<State> &state)
+            : _state(state)
+        {
+            setAutoDelete(true);
+        }
+
+        void run() override
+        {
+            Lane lane;
+            {
+                std::lock_guard<std::mutex> lock(_state->mutex);
+                _state->status = State::JS_RUNNING;
+                _state->thread = currentThread();
+                lane = _state->lane;
+            }
+
+            if (!_state->token.isCancelled())
+            {
+                LaneScope scope(lane);
+                try
+                {
+                    _state->fn(_state->token);
+                }
+                catch (FITSException *e)
+                {
+                    // Jobs report their own errors; nobody is left to
+                    // catch this one.
+                    delete e;
+                }
+            }
+            _state->fn = std::function<void(const CancelToken &)>();
+
+            {
+                std::lock_guard<std::mutex> lock(_state->mutex);
+                _state->status = State::JS_DONE;
+
+                // Back to the lowest, for the next background job.
+#ifdef __linux__
+                if (_state->reniced)
+                {
+                    setpriority(PRIO_PROCESS, _state->thread, g_backgroundNice);
+                }
+#endif
+                _state->reniced = false;
+                _state->thread = 0;
+            }
+            _state->finished.notify_all();
+        }
+
+    private:
+        std::shared_ptr<State> _state;
+    };
+
+    Executor::Job::Job()
+        : _state()
+    {
+    }
+
+    bool Executor::Job::isValid() const
+    {
+        return _state != 0;
+    }
+
+    bool Executor::Job::isFinished() const
+    {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        return _state->status == State::JS_DONE;
+    }
+
+    void Executor::Job::boost() const
+    {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        if ((_state->status == State::JS_QUEUED) &&
+            (_state->lane != EL_INTERACTIVE) &&
+            _state->executor->getPool(_state->lane)->tryTake(_state->runnable))
+        {
+            _state->lane = EL_INTERACTIVE;
+            _state->executor->getPool(EL_INTERACTIVE)->start(_state->runnable, 1);
+        }
+    }
+
+    void Executor::Job::cancel() const
+    {
+        _state->token.cancel();
+
+        // Never started, so it never will.
+        bool dropped = false;
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            if ((_state->status == State::JS_QUEUED) &&
+                _state->executor->getPool(_state->lane)->tryTake(_state->runnable))
+            {
+                delete _state->runnable;
+                _state->status = State::JS_DONE;
+                dropped = true;
+            }
+        }
+        if (dropped)
+        {
+            _state->finished.notify_all();
+        }
+    }
+
+    const CancelToken &Executor::Job::getToken() const
+    {
+        return _state->token;
+    }
+
+    void Executor::Job::waitForFinished() const
+    {
+        // Still queued: run it here and now, at this thread's priority.
+        Runnable *runnable = 0;
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            if ((_state->status == State::JS_QUEUED) &&
+                _state->executor->getPool(_state->lane)->tryTake(_state->runnable))
+            {
+                runnable = _state->runnable;
+                _state->lane = std::min(_state->lane, currentLane());
+            }
+        }
+        if (runnable != 0)
+        {
+            runnable->run();
+            delete runnable;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_state->mutex);
+        _state->inherit(currentLane());
+        _state->finished.wait(lock, [this]()
+                              { return _state->status == State::JS_DONE; });
+    }
+
+    void Executor::Job::finishOrCancel() const
+    {
+        Runnable *runnable = 0;
+        bool cancel = false;
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            if ((_state->status == State::JS_QUEUED) &&
+                _state->executor->getPool(_state->lane)->tryTake(_state->runnable))
+            {
+                runnable = _state->runnable;
+                _state->lane = std::min(_state->lane, currentLane());
+            }
+            else
+            {
+                // Includes one that started as we looked.
+                cancel = (_state->status != State::JS_DONE) && (_state->lane > currentLane());
+            }
+        }
+        if (runnable != 0)
+        {
+            runnable->run();
+            delete runnable;
+            return;
+        }
+        if (cancel)
+        {
+            _state->token.cancel();
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_state->mutex);
+        _state->inherit(currentLane());
+        _state->finished.wait(lock, [this]()
+                              { return _state->status == State::JS_DONE; });
+    }
+
+    /* static */
+    Executor *Executor::global()
+    {
+        static Executor executor;
+        return &executor;
+    }
+
+    Executor::Executor()
+    {
+        const int threads = QThread::idealThreadCount();
+
+        _pools[EL_INTERACTIVE].setMaxThreadCount(threads);
+        _pools[EL_LOAD].setMaxThreadCount(threads);
+        _pools[EL_BACKGROUND].setMaxThreadCount(std::max(1, threads / 4));
+
+        lowerBackgroundPriority();
+    }
+
+    Executor::~Executor()
+    {
+        for (int lane = 0; lane < EL_COUNT; lane++)
+        {
+            _pools[lane].waitForDone();
+        }
+    }
+
+    /* static */
+    const char *Executor::getLaneName(Lane lane)
+    {
+        switch (lane)
+        {
+        case EL_INTERACTIVE:
+            return "Interactive";
+        case EL_LOAD:
+            return "Load";
+        case EL_BACKGROUND:
+            return "Background";
+        case EL_COUNT:
+            break;
+        }
+
+        return "Unknown";
+    }
+
+    QThreadPool *Executor::getPool(Lane lane)
+    {
+        return &_pools[lane];
+    }
+
+    /* static */
+    Executor::Lane Executor::currentLane()
+    {
+        return t_lane == EL_COUNT ? EL_INTERACTIVE : t_lane;
+    }
+
+    Executor::Job Executor::submit(Lane lane,
+                                   std::function<void(const CancelToken &)> fn)
+    {
+        Job job;
+        job._state = std::make_shared<Job::State>();
+        job._state->status = Job::State::JS_QUEUED;
+        job._state->fn = fn;
+        job._state->executor = this;
+        job._state->lane = lane;
+        job._state->runnable = new Job::Runnable(job._state);
+        job._state->thread = 0;
+        job._state->reniced = false;
+
+        _pools[lane].start(job._state->runnable);
+
+        return job;
+    }
+
+    // A job run by a thread that was waiting on it takes the waiter's
+    // lane if that is more urgent, and so does everything it submits.
+    Executor::LaneScope::LaneScope(Lane lane)
+        : _previous(t_lane)
+    {
+        t_lane = t_lane == EL_COUNT ? lane : std::min(lane, t_lane);
+    }
+
+    Executor::LaneScope::~LaneScope()
+    {
+        t_lane = _previous;
+    }
+
+    // Starts every background thread at once and renices each. Threads
+    // can't be reniced back up without privileges, so they are kept for
+    // good and work stolen by a waiting thread runs at its priority.
+    void Executor::lowerBackgroundPriority()
+    {
+        QThreadPool &pool = _pools[EL_BACKGROUND];
+        pool.setExpiryTimeout(-1);
+
+#ifdef __linux__
+        errno = 0;
+        const int nice = getpriority(PRIO_PROCESS, 0);
+        g_baseNice = errno == 0 ? nice : 0;
+
+        const int threads = pool.maxThreadCount();
+
+        std::mutex mutex;
+        std::condition_variable allStarted;
+        int started = 0;
+        for (int i = 0; i < threads; i++)
+        {
+            QtConcurrent::run(&pool, [&]()
+                              {
+                                  setpriority(PRIO_PROCESS, syscall(SYS_gettid), g_backgroundNice);
+
+                                  // Held until all have started, so each
+                                  // lands on a thread of its own.
+                                  std::unique_lock<std::mutex> lock(mutex);
+                                  started++;
+                                  allStarted.notify_all();
+                                  allStarted.wait(lock, [&]()
+                                                  { return started == threads; }); });
+        }
+
+        pool.waitForDone();
+#endif
+    }
+
+}
@@ -0,0 +1,576 @@
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+#include <zlib.h>
+#include <fitsio.h>
+
+#include "executor.h"
+#include "fitsexception.h"
+#include "fitsmemorybudget.h"
+#include "fitstrace.h"
+#include "framecache.h"
+
+// cfitsio's Rice coder (ricecomp.c) is declared only in its internal
+// header, which has no C++ guards. proc.pri checks for it and for a
+// cfitsio recent enough to rely on.
+#ifdef ELS_HAVE_FITS_RICE
+extern "C"
+{
+#include <fitsio2.h>
+}
+#endif
+
+namespace
+{
+
+    // Pixels per independently compressed block: enough to amortise the
+    // per-block overhead, small enough to spread over every core.
+    constexpr int g_blockPixels = 1 << 20;
+
+    // Pixels per Rice coding block, as fpack uses.
+    constexpr int g_riceBlock = 32;
+
+    int pixelSize(ELS::FITSImage::BitDepth bitDepth)
+    {
+        switch (bitDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            return 1;
+        case ELS::FITSImage::BD_INT_16:
+            return 2;
+        case ELS::FITSImage::BD_INT_32:
+        case ELS::FITSImage::BD_FLOAT:
+            return 4;
+        case ELS::FITSImage::BD_DOUBLE:
+            return 8;
+        }
+
+        return 1;
+    }
+
+    // Integer frames, if cfitsio's coder is there; everything else is
+    // shuffled and deflated.
+    bool isRiceCoded(ELS::FITSImage::BitDepth bitDepth)
+    {
+#ifdef ELS_HAVE_FITS_RICE
+        return (bitDepth == ELS::FITSImage::BD_INT_8) ||
+               (bitDepth == ELS::FITSImage::BD_INT_16) ||
+               (bitDepth == ELS::FITSImage::BD_INT_32);
+#else
+        (void)bitDepth;
+        return false;
+#endif
+    }
+
+    // Rice codes the differences between neighbouring pixels, which for
+    // sky background are a few bits wide. The coder works modulo the
+    // pixel width, so unsigned data survives the signed casts.
+    int riceCompress(ELS::FITSImage::BitDepth bitDepth,
+                     const void *pixels,
+                     int count,
+                     unsigned char *out,
+                     int outSize)
+    {
+#ifdef ELS_HAVE_FITS_RICE
+        switch (bitDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            return fits_rcomp_byte((signed char *)pixels, count, out, outSize, g_riceBlock);
+        case ELS::FITSImage::BD_INT_16:
+            return fits_rcomp_short((short *)pixels, count, out, outSize, g_riceBlock);
+        case ELS::FITSImage::BD_INT_32:
+            return fits_rcomp((int *)pixels, count, out, outSize, g_riceBlock);
+        default:
+            break;
+        }
+#else
+        (void)bitDepth;
+        (void)pixels;
+        (void)count;
+        (void)out;
+        (void)outSize;
+#endif
+        return -1;
+    }
+
+    bool riceDecompress(ELS::FITSImage::BitDepth bitDepth,
+                        const std::vector<unsigned char> &in,
+                        int count,
+                        void *pixels)
+    {
+#ifdef ELS_HAVE_FITS_RICE
+        unsigned char *data = (unsigned char *)&in[0];
+        switch (bitDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            return fits_rdecomp_byte(data, in.size(), (unsigned char *)pixels, count, g_riceBlock) == 0;
+        case ELS::FITSImage::BD_INT_16:
+            return fits_rdecomp_short(data, in.size(), (unsigned short *)pixels, count, g_riceBlock) == 0;
+        case ELS::FITSImage::BD_INT_32:
+            return fits_rdecomp(data, in.size(), (unsigned int *)pixels, count, g_riceBlock) == 0;
+        default:
+            break;
+        }
+#else
+        (void)bitDepth;
+        (void)in;
+        (void)count;
+        (void)pixels;
+#endif
+        return false;
+    }
+
+    // Floating point noise doesn't difference well, but the sign and
+    // exponent bytes barely change from pixel to pixel. Gathering each
+    // byte position into its own plane hands deflate long, repetitive
+    // runs.
+    void shuffle(const unsigned char *in,
+                 int count,
+                 int size,
+                 unsigned char *out)
+    {
+        for (int b = 0; b < size; b++)
+        {
+            unsigned char *plane = out + (size_t)b * count;
+            for (int i = 0; i < count; i++)
+            {
+                plane[i] = in[(size_t)i * size + b];
+            }
+        }
+    }
+
+    void unshuffle(const unsigned char *in,
+                   int count,
+                   int size,
+                   unsigned char *out)
+    {
+        for (int b = 0; b < size; b++)
+        {
+            const unsigned char *plane = in + (size_t)b * count;
+            for (int i = 0; i < count; i++)
+            {
+                out[(size_t)i * size + b] = plane[i];
+            }
+        }
+    }
+
+}
+
+namespace ELS
+{
+
+    FrameCache::FrameCache()
+        : _capacity(0),
+          _compressedBytes(0),
+          _rawBytes(0)
+    {
+        // Cheaper to lose than tiles or prefetched frames, dearer than
+        // idle pool memory.
+        _budgetId = FITSMemoryBudget::global()->addConsumer("Compressed frames",
+                                                            FITSMemoryBudget::MC_CACHE,
+                                                            10,
+                                                            [this](size_t bytes)
+                                                            { return evict(bytes); });
+    }
+
+    FrameCache::~FrameCache()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_pendingMutex);
+            for (const Pending &pending : _pending)
+                pending.job.waitForFinished();
+            _pending.clear();
+        }
+
+        FITSMemoryBudget::global()->removeConsumer(_budgetId);
+        clear();
+    }
+
+    void FrameCache::setCapacity(size_t bytes)
+    {
+        size_t freed = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _capacity = bytes;
+            if ((_capacity != 0) && (_compressedBytes > _capacity))
+            {
+                freed = dropOldest(_compressedBytes - _capacity);
+            }
+        }
+
+        charge(-(int64_t)freed);
+    }
+
+    size_t FrameCache::getCapacity() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _capacity;
+    }
+
+    void FrameCache::insert(const std::string &key,
+                            const FITSImage *image)
+    {
+        EntryPtr entry = compress(image);
+
+        int64_t change = entry->compressedBytes;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::map<std::string, LRU::iterator>::iterator it = _index.find(key);
+            if (it != _index.end())
+            {
+                const Entry *old = it->second->second.get();
+                _compressedBytes -= old->compressedBytes;
+                _rawBytes -= old->rawBytes;
+                change -= old->compressedBytes;
+                _lru.erase(it->second);
+                _index.erase(it);
+            }
+
+            _lru.push_front(std::make_pair(key, entry));
+            _index[key] = _lru.begin();
+            _compressedBytes += entry->compressedBytes;
+            _rawBytes += entry->rawBytes;
+
+            if ((_capacity != 0) && (_compressedBytes > _capacity))
+            {
+                change -= dropOldest(_compressedBytes - _capacity);
+            }
+        }
+
+        charge(change);
+    }
+
+    void FrameCache::insertAsync(const std::string &key,
+                                 FITSImage *image)
+    {
+        std::lock_guard<std::mutex> lock(_pendingMutex);
+
+        std::vector<Pending> running;
+        for (const Pending &pending : _pending)
+        {
+            if (!pending.job.isFinished())
+            {
+                running.push_back(pending);
+            }
+        }
+        _pending.swap(running);
+
+        // Shared with restore(), which may copy it meanwhile.
+        std::shared_ptr<const FITSImage> owned(image);
+
+        Pending pending;
+        pending.key = key;
+        pending.image = owned;
+        pending.job = Executor::global()->submit(Executor::EL_BACKGROUND,
+                                                 [=](const CancelToken &)
+                                                 {
+                                                     try
+                                                     {
+                                                         insert(key, owned.get());
+                                                     }
+                                                     catch (FITSException *e)
+                                                     {
+                                                         delete e;
+                                                     }
+                                                 });
+        _pending.push_back(pending);
+    }
+
+    FITSImage *FrameCache::restore(const std::string &key)
+    {
+        // Wanted on screen now, so it can't wait for the background
+        // compressor; the frame it was handed is still here to copy.
+        std::shared_ptr<const FITSImage> unfinished;
+        {
+            std::lock_guard<std::mutex> lock(_pendingMutex);
+            for (const Pending &pending : _pending)
+            {
+                if ((pending.key == key) && !pending.job.isFinished())
+                {
+                    unfinished = pending.image;
+                }
+            }
+        }
+        if (unfinished != 0)
+        {
+            return copy(unfinished.get());
+        }
+
+        EntryPtr entry;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::map<std::string, LRU::iterator>::iterator it = _index.find(key);
+            if (it == _index.end())
+            {
+                return 0;
+            }
+
+            _lru.splice(_lru.begin(), _lru, it->second);
+            entry = it->second->second;
+        }
+
+        FITSMemoryBudget::global()->touch(_budgetId);
+
+        // The entry can be evicted meanwhile; this reference keeps it
+        // alive until it is restored.
+        return decompress(entry.get());
+    }
+
+    bool FrameCache::contains(const std::string &key) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _index.find(key) != _index.end();
+    }
+
+    void FrameCache::remove(const std::string &key)
+    {
+        size_t freed = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::map<std::string, LRU::iterator>::iterator it = _index.find(key);
+            if (it != _index.end())
+            {
+                const Entry *entry = it->second->second.get();
+                freed = entry->compressedBytes;
+                _compressedBytes -= entry->compressedBytes;
+                _rawBytes -= entry->rawBytes;
+                _lru.erase(it->second);
+                _index.erase(it);
+            }
+        }
+
+        charge(-(int64_t)freed);
+    }
+
+    void FrameCache::clear()
+    {
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            freed = _compressedBytes;
+            _lru.clear();
+            _index.clear();
+            _compressedBytes = 0;
+            _rawBytes = 0;
+        }
+
+        charge(-(int64_t)freed);
+    }
+
+    int FrameCache::getFrameCount() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _index.size();
+    }
+
+    size_t FrameCache::getCompressedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _compressedBytes;
+    }
+
+    size_t FrameCache::getRawBytes() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _rawBytes;
+    }
+
+    size_t FrameCache::dropOldest(size_t bytes)
+    {
+        size_t freed = 0;
+        while ((freed < bytes) && !_lru.empty())
+        {
+            const Entry *entry = _lru.back().second.get();
+            freed += entry->compressedBytes;
+            _compressedBytes -= entry->compressedBytes;
+            _rawBytes -= entry->rawBytes;
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+
+        return freed;
+    }
+
+    size_t FrameCache::evict(size_t bytes)
+    {
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            freed = dropOldest(bytes);
+        }
+
+        charge(-(int64_t)freed);
+        return freed;
+    }
+
+    // Must be called without the lock, as charging can evict from here.
+    void FrameCache::charge(int64_t bytes)
+    {
+        if (bytes != 0)
+        {
+            FITSMemoryBudget::global()->charge(_budgetId, bytes);
+        }
+    }
+
+    /* static */
+    FrameCache::EntryPtr FrameCache::compress(const FITSImage *image)
+    {
+        ELS_TRACE_SCOPE("FrameCache::compress");
+
+        std::shared_ptr<Entry> entry(new Entry());
+        entry->bitDepth = image->getBitDepth();
+        entry->info = image->getInfo();
+        entry->rawBytes = image->getPixelBytes();
+        entry->compressedBytes = 0;
+
+        const FITSImage::BitDepth bitDepth = image->getBitDepth();
+        const int size = pixelSize(bitDepth);
+        const bool rice = isRiceCoded(bitDepth);
+        const int64_t pixelCount = image->getInfo().numPixels;
+        const unsigned char *pixels = (const unsigned char *)image->getPixels();
+
+        for (int64_t first = 0; first < pixelCount; first += g_blockPixels)
+        {
+            Block block;
+            block.firstPixel = first;
+            block.pixelCount = std::min((int64_t)g_blockPixels, pixelCount - first);
+            block.raw = false;
+            entry->blocks.push_back(block);
+        }
+
+        QVector<QFuture<void>> futures;
+        for (Block &b : entry->blocks)
+        {
+            Block *block = &b;
+            futures.append(Executor::global()->run([=]()
+                                                   {
+                                                       const unsigned char *in = pixels + block->firstPixel * size;
+                                                       const size_t inBytes = (size_t)block->pixelCount * size;
+
+                                                       int outBytes = -1;
+                                                       if (rice)
+                                                       {
+                                                           // Incompressible blocks cost a little over their raw
+                                                           // size before the coder gives up on them.
+                                                           block->data.resize(inBytes + inBytes / 8 + 256);
+                                                           outBytes = riceCompress(bitDepth, in, block->pixelCount,
+                                                                                   &block->data[0], block->data.size());
+                                                       }
+                                                       else
+                                                       {
+                                                           std::vector<unsigned char> shuffled(inBytes);
+                                                           shuffle(in, block->pixelCount, size, &shuffled[0]);
+
+                                                           uLongf deflated = compressBound(inBytes);
+                                                           block->data.resize(deflated);
+                                                           if (compress2(&block->data[0], &deflated,
+                                                                         &shuffled[0], inBytes, 1) == Z_OK)
+                                                           {
+                                                               outBytes = deflated;
+                                                           }
+                                                       }
+
+                                                       if ((outBytes < 0) || ((size_t)outBytes >= inBytes))
+                                                       {
+                                                           block->raw = true;
+                                                           block->data.assign(in, in + inBytes);
+                                                       }
+                                                       else
+                                                       {
+                                                           block->data.resize(outBytes);
+                                                           block->data.shrink_to_fit();
+                                                       }
+                                                   }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+
+        for (const Block &block : entry->blocks)
+        {
+            entry->compressedBytes += block.data.size();
+        }
+
+        return entry;
+    }
+
+    /* static */
+    FITSImage *FrameCache::decompress(const Entry *entry)
+    {
+        ELS_TRACE_SCOPE("FrameCache::decompress");
+
+        FITSImage *image = FITSImage::create(entry->bitDepth, entry->info);
+
+        const FITSImage::BitDepth bitDepth = entry->bitDepth;
+        const int size = pixelSize(bitDepth);
+        unsigned char *pixels = (unsigned char *)image->getPixels();
+
+        std::atomic<bool> failed(false);
+        std::atomic<bool> *fail = &failed;
+
+        QVector<QFuture<void>> futures;
+        for (const Block &b : entry->blocks)
+        {
+            const Block *block = &b;
+            futures.append(Executor::global()->run([=]()
+                                                   {
+                                                       unsigned char *out = pixels + block->firstPixel * size;
+                                                       const size_t outBytes = (size_t)block->pixelCount * size;
+
+                                                       bool ok;
+                                                       if (block->raw)
+                                                       {
+                                                           ok = block->data.size() == outBytes;
+                                                           if (ok)
+                                                           {
+                                                               memcpy(out, &block->data[0], outBytes);
+                                                           }
+                                                       }
+                                                       else if (!isRiceCoded(bitDepth))
+                                                       {
+                                                           std::vector<unsigned char> shuffled(outBytes);
+                                                           uLongf inflated = outBytes;
+                                                           ok = (uncompress(&shuffled[0], &inflated,
+                                                                            &block->data[0], block->data.size()) == Z_OK) &&
+                                                                (inflated == outBytes);
+                                                           if (ok)
+                                                           {
+                                                               unshuffle(&shuffled[0], block->pixelCount, size, out);
+                                                           }
+                                                       }
+                                                       else
+                                                       {
+                                                           ok = riceDecompress(bitDepth, block->data, block->pixelCount, out);
+                                                       }
+
+                                                       if (!ok)
+                                                       {
+                                                           *fail = true;
+                                                       }
+                                                   }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+
+        if (failed)
+        {
+            delete image;
+            throw new FITSException("Cached frame is corrupt");
+        }
+
+        return image;
+    }
+
+    FITSImage *FrameCache::copy(const FITSImage *image)
+    {
+        ELS_TRACE_SCOPE("FrameCache::copy");
+
+        FITSImage *result = FITSImage::create(image->getBitDepth(), image->getInfo());
+        memcpy(result->getPixels(), image->getPixels(), image->getPixelBytes());
+
+        return result;
+    }
+
+}
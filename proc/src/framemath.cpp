@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "executor.h"
+#include "fitsexception.h"
+#include "fitstrace.h"
+#include "framemath.h"
+
+namespace
+{
+
+    // Rows handed to each worker.
+    constexpr int g_bandRows = 32;
+
+    // Samples used for the display range.
+    constexpr int g_rangeSamples = 100000;
+
+    // Half the display range, in noise sigmas.
+    constexpr float g_rangeSigmas = 5.0f;
+
+    template <typename T>
+    void toFloat(const T *input, float *output, int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            output[i] = input[i];
+        }
+    }
+
+    template <>
+    void toFloat<float>(const float *input, float *output, int count)
+    {
+        memcpy(output, input, count * sizeof(float));
+    }
+
+    void differenceRow(const float *a, const float *b, float *output, int count)
+    {
+        int i = 0;
+#if defined(__SSE2__)
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm_storeu_ps(output + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        }
+#endif
+        for (; i < count; i++)
+        {
+            output[i] = a[i] - b[i];
+        }
+    }
+
+    // Division by zero gives zero rather than infinity.
+    void ratioRow(const float *a, const float *b, float *output, int count)
+    {
+        int i = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128 divisor = _mm_loadu_ps(b + i);
+            const __m128 valid = _mm_cmpneq_ps(divisor, _mm_castsi128_ps(zero));
+            const __m128 quotient = _mm_div_ps(_mm_loadu_ps(a + i), divisor);
+            _mm_storeu_ps(output + i, _mm_and_ps(valid, quotient));
+        }
+#endif
+        for (; i < count; i++)
+        {
+            output[i] = b[i] != 0.0f ? a[i] / b[i] : 0.0f;
+        }
+    }
+
+    // Layout shared by a, b and the result: planes of rows of samples,
+    // where a sample is a pixel, or one channel of one for colour
+    // interleaved on axis 1.
+    struct Layout
+    {
+        int width;
+        int height;
+        int planes;
+        int samplesPerPixel;
+    };
+
+    template <typename T>
+    void runBand(const T *a, const T *b, float *output, const Layout &layout,
+                 ELS::FrameMath::Op op, int offsetX, int offsetY,
+                 int plane, int firstRow, int lastRow, int firstCol, int lastCol)
+    {
+        const int spp = layout.samplesPerPixel;
+        const int count = (lastCol - firstCol) * spp;
+        const float neutral = ELS::FrameMath::getNeutral(op);
+
+        // The columns of b that exist for this span of a.
+        const int validFirst = std::max(firstCol, -offsetX);
+        const int validLast = std::min(lastCol, layout.width - offsetX);
+
+        std::vector<float> rowA(count);
+        std::vector<float> rowB(count);
+        for (int y = firstRow; y < lastRow; y++)
+        {
+            const int64_t lineA = ((int64_t)plane * layout.height + y) * layout.width;
+            float *out = output + (lineA + firstCol) * spp;
+
+            const int yb = y + offsetY;
+            if ((yb < 0) || (yb >= layout.height) || (validFirst >= validLast))
+            {
+                std::fill(out, out + count, neutral);
+                continue;
+            }
+
+            const int64_t lineB = ((int64_t)plane * layout.height + yb) * layout.width;
+            const int lead = (validFirst - firstCol) * spp;
+            const int valid = (validLast - validFirst) * spp;
+
+            toFloat(a + (lineA + validFirst) * spp, rowA.data(), valid);
+            toFloat(b + (lineB + validFirst + offsetX) * spp, rowB.data(), valid);
+
+            std::fill(out, out + lead, neutral);
+            if (op == ELS::FrameMath::FM_DIFFERENCE)
+            {
+                differenceRow(rowA.data(), rowB.data(), out + lead, valid);
+            }
+            else
+            {
+                ratioRow(rowA.data(), rowB.data(), out + lead, valid);
+            }
+            std::fill(out + lead + valid, out + count, neutral);
+        }
+    }
+
+    template <typename T>
+    void runRegion(const T *a, const T *b, float *output, const Layout &layout,
+                   ELS::FrameMath::Op op, int offsetX, int offsetY,
+                   const ELS::FITSImage::Region &region)
+    {
+        QVector<QFuture<void>> futures;
+
+        for (int plane = 0; plane < layout.planes; plane++)
+        {
+            for (int first = region.y; first < region.y + region.height; first += g_bandRows)
+            {
+                const int last = std::min(first + g_bandRows, region.y + region.height);
+                futures.append(ELS::Executor::global()->run([=]()
+                                                            { runBand(a, b, output, layout, op, offsetX, offsetY,
+                                                                      plane, first, last, region.x, region.x + region.width); }));
+            }
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+    }
+
+    float median(std::vector<float> &values)
+    {
+        const int middle = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        return values[middle];
+    }
+
+}
+
+namespace ELS
+{
+
+    /* static */
+    FITSImage *FrameMath::createResult(const FITSImage *a,
+                                       const FITSImage *b)
+    {
+        if ((a->getWidth() != b->getWidth()) ||
+            (a->getHeight() != b->getHeight()) ||
+            (a->getChanAx() != b->getChanAx()))
+        {
+            throw new FITSException("Frames differ in size or colour");
+        }
+        if (a->getBitDepth() != b->getBitDepth())
+        {
+            throw new FITSException("Frames differ in pixel type");
+        }
+
+        FITSImage::Info info = a->getInfo();
+        info.bitDepthEnum = FLOAT_IMG;
+        strcpy(info.imageType, "32-bit floating point pixels");
+        info.bayerPattern[0] = 0;
+        // Judged from the result, which needn't stay in the inputs' range.
+        info.range = 0;
+
+        return FITSImage::create(FITSImage::BD_FLOAT, info);
+    }
+
+    /* static */
+    void FrameMath::run(const FITSImage *a,
+                        const FITSImage *b,
+                        Op op,
+                        int offsetX,
+                        int offsetY,
+                        FITSImage *result,
+                        const FITSImage::Region &region)
+    {
+        ELS_TRACE_SCOPE("FrameMath::run");
+
+        FITSImage::Region clipped;
+        clipped.x = std::max(region.x, 0);
+        clipped.y = std::max(region.y, 0);
+        clipped.width = std::min(region.x + region.width, a->getWidth()) - clipped.x;
+        clipped.height = std::min(region.y + region.height, a->getHeight()) - clipped.y;
+        if ((clipped.width <= 0) || (clipped.height <= 0))
+        {
+            return;
+        }
+
+        Layout layout;
+        layout.width = a->getWidth();
+        layout.height = a->getHeight();
+        layout.planes = a->getChanAx() == 3 ? 3 : 1;
+        layout.samplesPerPixel = a->getChanAx() == 1 ? 3 : 1;
+
+        float *output = (float *)result->getPixels();
+        switch (a->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            runRegion((const uint8_t *)a->getPixels(), (const uint8_t *)b->getPixels(),
+                      output, layout, op, offsetX, offsetY, clipped);
+            break;
+        case FITSImage::BD_INT_16:
+            runRegion((const uint16_t *)a->getPixels(), (const uint16_t *)b->getPixels(),
+                      output, layout, op, offsetX, offsetY, clipped);
+            break;
+        case FITSImage::BD_INT_32:
+            runRegion((const uint32_t *)a->getPixels(), (const uint32_t *)b->getPixels(),
+                      output, layout, op, offsetX, offsetY, clipped);
+            break;
+        case FITSImage::BD_FLOAT:
+            runRegion((const float *)a->getPixels(), (const float *)b->getPixels(),
+                      output, layout, op, offsetX, offsetY, clipped);
+            break;
+        case FITSImage::BD_DOUBLE:
+            runRegion((const double *)a->getPixels(), (const double *)b->getPixels(),
+                      output, layout, op, offsetX, offsetY, clipped);
+            break;
+        }
+    }
+
+    /* static */
+    FITSImage *FrameMath::run(const FITSImage *a,
+                              const FITSImage *b,
+                              Op op,
+                              int offsetX,
+                              int offsetY)
+    {
+        FITSImage *result = createResult(a, b);
+
+        FITSImage::Region region;
+        region.x = 0;
+        region.y = 0;
+        region.width = a->getWidth();
+        region.height = a->getHeight();
+        run(a, b, op, offsetX, offsetY, result, region);
+
+        return result;
+    }
+
+    /* static */
+    void FrameMath::symmetricRange(const FITSImage *result,
+                                   Op op,
+                                   const FITSImage::Region &region,
+                                   float *low,
+                                   float *high)
+    {
+        ELS_TRACE_SCOPE("FrameMath::symmetricRange");
+
+        const float neutral = getNeutral(op);
+        const int x0 = std::max(region.x, 0);
+        const int y0 = std::max(region.y, 0);
+        const int x1 = std::min(region.x + region.width, result->getWidth());
+        const int y1 = std::min(region.y + region.height, result->getHeight());
+        const int spp = result->getChanAx() == 1 ? 3 : 1;
+
+        // The first plane is enough to judge the spread.
+        std::vector<float> samples;
+        const int64_t area = (int64_t)std::max(x1 - x0, 0) * std::max(y1 - y0, 0);
+        const int step = std::max(1, (int)sqrtf((float)area / g_rangeSamples));
+        const float *pixels = (const float *)result->getPixels();
+        for (int y = y0; y < y1; y += step)
+        {
+            const float *line = pixels + (int64_t)y * result->getWidth() * spp;
+            for (int x = x0; x < x1; x += step)
+            {
+                if (isfinite(line[x * spp]))
+                {
+                    samples.push_back(line[x * spp]);
+                }
+            }
+        }
+
+        float spread = 0.0f;
+        if (!samples.empty())
+        {
+            const float center = median(samples);
+            for (float &sample : samples)
+            {
+                sample = fabsf(sample - center);
+            }
+            const float sigma = 1.4826f * median(samples);
+            spread = fabsf(center - neutral) + g_rangeSigmas * sigma;
+        }
+        if (spread <= 0.0f)
+        {
+            spread = op == FM_RATIO ? 0.01f : 1.0f;
+        }
+
+        *low = neutral - spread;
+        *high = neutral + spread;
+    }
+
+    /* static */
+    float FrameMath::getNeutral(Op op)
+    {
+        return op == FM_RATIO ? 1.0f : 0.0f;
+    }
+
+}
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <math.h>
+
+#include "executor.h"
+#include "fitstrace.h"
+#include "imagestatistics.h"
+
+namespace
+{
+
+    // Every other pixel in both directions is plenty for a tile median
+    // and quarters the sorting.
+    constexpr int g_sampleStep = 2;
+
+    float median(std::vector<float> &values)
+    {
+        const int middle = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        return values[middle];
+    }
+
+    // Median and MAD noise of samples, after dropping anything more than
+    // three sigma above a first estimate so stars don't bias the tile.
+    void robustLevel(std::vector<float> &samples,
+                     std::vector<float> &scratch,
+                     float *level,
+                     float *noise)
+    {
+        float center = median(samples);
+
+        scratch.resize(samples.size());
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            scratch[i] = fabsf(samples[i] - center);
+        }
+        float sigma = 1.4826f * median(scratch);
+
+        const float limit = center + 3 * sigma;
+        samples.erase(std::remove_if(samples.begin(), samples.end(),
+                                     [=](float v)
+                                     { return v > limit; }),
+                      samples.end());
+        if (!samples.empty())
+        {
+            center = median(samples);
+
+            scratch.resize(samples.size());
+            for (size_t i = 0; i < samples.size(); i++)
+            {
+                scratch[i] = fabsf(samples[i] - center);
+            }
+            sigma = 1.4826f * median(scratch);
+        }
+
+        *level = center;
+        *noise = sigma;
+    }
+
+    template <typename T>
+    void tileRow(const T *plane, int width, int height, int tileSize,
+                 int tileY, int tilesX, float *levels, float *noises,
+                 float *minimum, float *maximum)
+    {
+        std::vector<float> samples;
+        std::vector<float> scratch;
+        samples.reserve((tileSize / g_sampleStep + 1) * (tileSize / g_sampleStep + 1));
+
+        const int top = tileY * tileSize;
+        const int bottom = std::min(top + tileSize, height);
+
+        float lo = plane[(int64_t)top * width];
+        float hi = lo;
+        for (int y = top; y < bottom; y++)
+        {
+            const T *line = plane + (int64_t)y * width;
+            for (int x = 0; x < width; x++)
+            {
+                lo = std::min(lo, (float)line[x]);
+                hi = std::max(hi, (float)line[x]);
+            }
+        }
+        *minimum = lo;
+        *maximum = hi;
+
+        for (int tileX = 0; tileX < tilesX; tileX++)
+        {
+            const int left = tileX * tileSize;
+            const int right = std::min(left + tileSize, width);
+
+            samples.clear();
+            for (int y = top; y < bottom; y += g_sampleStep)
+            {
+                const T *line = plane + (int64_t)y * width;
+                for (int x = left; x < right; x += g_sampleStep)
+                {
+                    samples.push_back(line[x]);
+                }
+            }
+
+            robustLevel(samples, scratch, &levels[tileX], &noises[tileX]);
+        }
+    }
+
+    template <typename T>
+    void computeTiles(const T *plane, int width, int height, int tileSize,
+                      int tilesX, int tilesY, float *levels, float *noises,
+                      float *minimums, float *maximums)
+    {
+        QVector<QFuture<void>> futures;
+
+        for (int tileY = 0; tileY < tilesY; tileY++)
+        {
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        { tileRow(plane, width, height, tileSize, tileY, tilesX,
+                                                                  levels + tileY * tilesX, noises + tileY * tilesX,
+                                                                  minimums + tileY, maximums + tileY); }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+    }
+
+}
+
+namespace ELS
+{
+
+    ImageStatistics::ImageStatistics()
+        : _tileSize(0),
+          _tilesX(0),
+          _tilesY(0),
+          _background(0),
+          _noise(0),
+          _minimum(0),
+          _maximum(0)
+    {
+    }
+
+    void ImageStatistics::compute(const FITSImage *image,
+                                  int channel,
+                                  int tileSize /* = 64 */)
+    {
+        ELS_TRACE_SCOPE("ImageStatistics::compute");
+
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+
+        _tileSize = tileSize;
+        _tilesX = (width + tileSize - 1) / tileSize;
+        _tilesY = (height + tileSize - 1) / tileSize;
+        _tileBackground.resize(_tilesX * _tilesY);
+        _tileNoise.resize(_tilesX * _tilesY);
+
+        std::vector<float> minimums(_tilesY);
+        std::vector<float> maximums(_tilesY);
+
+        const int64_t offset = (int64_t)channel * width * height;
+        const void *pixels = image->getPixels();
+
+        switch (image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            computeTiles((const uint8_t *)pixels + offset, width, height, tileSize, _tilesX, _tilesY,
+                         _tileBackground.data(), _tileNoise.data(), minimums.data(), maximums.data());
+            break;
+        case FITSImage::BD_INT_16:
+            computeTiles((const uint16_t *)pixels + offset, width, height, tileSize, _tilesX, _tilesY,
+                         _tileBackground.data(), _tileNoise.data(), minimums.data(), maximums.data());
+            break;
+        case FITSImage::BD_INT_32:
+            computeTiles((const uint32_t *)pixels + offset, width, height, tileSize, _tilesX, _tilesY,
+                         _tileBackground.data(), _tileNoise.data(), minimums.data(), maximums.data());
+            break;
+        case FITSImage::BD_FLOAT:
+            computeTiles((const float *)pixels + offset, width, height, tileSize, _tilesX, _tilesY,
+                         _tileBackground.data(), _tileNoise.data(), minimums.data(), maximums.data());
+            break;
+        case FITSImage::BD_DOUBLE:
+            computeTiles((const double *)pixels + offset, width, height, tileSize, _tilesX, _tilesY,
+                         _tileBackground.data(), _tileNoise.data(), minimums.data(), maximums.data());
+            break;
+        }
+
+        _minimum = *std::min_element(minimums.begin(), minimums.end());
+        _maximum = *std::max_element(maximums.begin(), maximums.end());
+
+        std::vector<float> tmp(_tileBackground);
+        _background = median(tmp);
+        tmp = _tileNoise;
+        _noise = median(tmp);
+    }
+
+    bool ImageStatistics::isValid() const
+    {
+        return _tileSize != 0;
+    }
+
+    int ImageStatistics::getTileSize() const
+    {
+        return _tileSize;
+    }
+
+    int ImageStatistics::getTilesX() const
+    {
+        return _tilesX;
+    }
+
+    int ImageStatistics::getTilesY() const
+    {
+        return _tilesY;
+    }
+
+    float ImageStatistics::getTileBackground(int tileX,
+                                             int tileY) const
+    {
+        return _tileBackground[tileY * _tilesX + tileX];
+    }
+
+    float ImageStatistics::getTileNoise(int tileX,
+                                        int tileY) const
+    {
+        return _tileNoise[tileY * _tilesX + tileX];
+    }
+
+    float ImageStatistics::getBackground() const
+    {
+        return _background;
+    }
+
+    float ImageStatistics::getNoise() const
+    {
+        return _noise;
+    }
+
+    float ImageStatistics::getMinimum() const
+    {
+        return _minimum;
+    }
+
+    float ImageStatistics::getMaximum() const
+    {
+        return _maximum;
+    }
+
+}
@@ -0,0 +1,602 @@
+#include <algorithm>
+#include <math.h>
+
+#include "executor.h"
+#include "fitsmemorybudget.h"
+#include "fitstrace.h"
+#include "regionstatistics.h"
+
+namespace
+{
+
+    // Width and height of the tiles whose totals are kept, and whose
+    // prefix tables are built on demand. A whole number of blocks.
+    constexpr int g_tile = 64;
+
+    // Width and height of the blocks whose extremes are kept.
+    constexpr int g_block = 16;
+
+    // Tiles' prefix tables kept at most; they take microseconds to build
+    // again.
+    constexpr int64_t g_maxTileBytes = 64 * 1024 * 1024;
+
+    // Where sample (channel, x, y) lies in the raster: planar colour,
+    // interleaved colour (channel axis 1) or mono.
+    struct Layout
+    {
+        int64_t planeStride;
+        int64_t rowStride;
+        int pixelStride;
+
+        explicit Layout(const ELS::FITSImage *image)
+        {
+            const int width = image->getWidth();
+            const int height = image->getHeight();
+            if (image->getChanAx() == 1)
+            {
+                planeStride = 1;
+                rowStride = (int64_t)width * 3;
+                pixelStride = 3;
+            }
+            else
+            {
+                planeStride = (int64_t)width * height;
+                rowStride = width;
+                pixelStride = 1;
+            }
+        }
+
+        int64_t index(int channel, int x, int y) const
+        {
+            return channel * planeStride + y * rowStride + (int64_t)x * pixelStride;
+        }
+    };
+
+    // Totals of the tiles in tile row tileY, into row tileY + 1 of the
+    // tile tables, and the extremes of the blocks the row covers.
+    template <typename T>
+    void sumTileRow(const T *pixels, const Layout &layout, int channel,
+                    int width, int height, int tileY, int tilesX,
+                    double *tileSum, double *tileSumSquares,
+                    double *blockMin, double *blockMax, int blocksX)
+    {
+        double *sumLine = tileSum + (tileY + 1) * (int64_t)(tilesX + 1) + 1;
+        double *sumSquaresLine = tileSumSquares + (tileY + 1) * (int64_t)(tilesX + 1) + 1;
+        const int lastRow = std::min((tileY + 1) * g_tile, height);
+        for (int y = tileY * g_tile; y < lastRow; y++)
+        {
+            const T *line = pixels + layout.index(channel, 0, y);
+            double *minLine = blockMin + (y / g_block) * blocksX;
+            double *maxLine = blockMax + (y / g_block) * blocksX;
+
+            for (int x = 0; x < width; x++)
+            {
+                const double value = line[(int64_t)x * layout.pixelStride];
+                sumLine[x / g_tile] += value;
+                sumSquaresLine[x / g_tile] += value * value;
+
+                const int block = x / g_block;
+                minLine[block] = std::min(minLine[block], value);
+                maxLine[block] = std::max(maxLine[block], value);
+            }
+        }
+    }
+
+    // Adds each row of the tile tables to the one below, turning tile
+    // totals into area sums.
+    void sumTileColumns(double *table, int tilesX, int tilesY)
+    {
+        const int64_t stride = tilesX + 1;
+        for (int y = 1; y <= tilesY; y++)
+        {
+            double *line = table + y * stride;
+            double running = 0.0;
+            for (int x = 1; x <= tilesX; x++)
+            {
+                running += line[x];
+                line[x] = running + line[x - stride];
+            }
+        }
+    }
+
+    // Inclusive prefix sums of the width by height tile at (x0, y0).
+    template <typename T>
+    void sumTile(const T *pixels, const Layout &layout, int channel,
+                 int x0, int y0, int width, int height,
+                 double *sum, double *sumSquares)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            const T *line = pixels + layout.index(channel, x0, y0 + y);
+            double *sumLine = sum + y * width;
+            double *sumSquaresLine = sumSquares + y * width;
+
+            double running = 0.0;
+            double runningSquares = 0.0;
+            for (int x = 0; x < width; x++)
+            {
+                const double value = line[(int64_t)x * layout.pixelStride];
+                running += value;
+                runningSquares += value * value;
+                sumLine[x] = running + (y > 0 ? sumLine[x - width] : 0.0);
+                sumSquaresLine[x] = runningSquares + (y > 0 ? sumSquaresLine[x - width] : 0.0);
+            }
+        }
+    }
+
+    template <typename T>
+    void scanExtremes(const T *pixels, const Layout &layout, int channel,
+                      int x0, int y0, int x1, int y1,
+                      double *minimum, double *maximum)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            const T *line = pixels + layout.index(channel, 0, y);
+            for (int x = x0; x < x1; x++)
+            {
+                const double value = line[(int64_t)x * layout.pixelStride];
+                *minimum = std::min(*minimum, value);
+                *maximum = std::max(*maximum, value);
+            }
+        }
+    }
+
+    void scanImage(const ELS::FITSImage *image, int channel,
+                   int x0, int y0, int x1, int y1,
+                   double *minimum, double *maximum)
+    {
+        if ((x0 >= x1) || (y0 >= y1))
+        {
+            return;
+        }
+
+        const Layout layout(image);
+        switch (image->getBitDepth())
+        {
+        case ELS::FITSImage::BD_INT_8:
+            scanExtremes((const uint8_t *)image->getPixels(), layout, channel, x0, y0, x1, y1, minimum, maximum);
+            break;
+        case ELS::FITSImage::BD_INT_16:
+            scanExtremes((const uint16_t *)image->getPixels(), layout, channel, x0, y0, x1, y1, minimum, maximum);
+            break;
+        case ELS::FITSImage::BD_INT_32:
+            scanExtremes((const uint32_t *)image->getPixels(), layout, channel, x0, y0, x1, y1, minimum, maximum);
+            break;
+        case ELS::FITSImage::BD_FLOAT:
+            scanExtremes((const float *)image->getPixels(), layout, channel, x0, y0, x1, y1, minimum, maximum);
+            break;
+        case ELS::FITSImage::BD_DOUBLE:
+            scanExtremes((const double *)image->getPixels(), layout, channel, x0, y0, x1, y1, minimum, maximum);
+            break;
+        }
+    }
+
+    template <typename T>
+    void computeChannel(const T *pixels, const Layout &layout, int channel,
+                        int width, int height, int tilesX, int tilesY, int blocksX,
+                        double *tileSum, double *tileSumSquares,
+                        double *blockMin, double *blockMax,
+                        const std::atomic<bool> *cancel)
+    {
+        QVector<QFuture<void>> futures;
+
+        for (int tileY = 0; tileY < tilesY; tileY++)
+        {
+            futures.append(ELS::Executor::global()->run([=]()
+                                                        {
+                                                            if ((cancel == 0) || !*cancel)
+                                                            {
+                                                                sumTileRow(pixels, layout, channel, width, height, tileY, tilesX,
+                                                                           tileSum, tileSumSquares, blockMin, blockMax, blocksX);
+                                                            } }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+
+        if ((cancel != 0) && *cancel)
+        {
+            return;
+        }
+
+        sumTileColumns(tileSum, tilesX, tilesY);
+        sumTileColumns(tileSumSquares, tilesX, tilesY);
+    }
+
+}
+
+namespace ELS
+{
+
+    // Inclusive prefix sums within one tile, row-major.
+    struct RegionStatistics::Tile
+    {
+        int width;
+        int height;
+        std::vector<double> sum;
+        std::vector<double> sumSquares;
+
+        // Of [x0, x1) x [y0, y1), relative to the tile.
+        double total(const std::vector<double> &table,
+                     int x0, int y0, int x1, int y1) const
+        {
+            return at(table, x1, y1) - at(table, x0, y1) - at(table, x1, y0) + at(table, x0, y0);
+        }
+
+        double at(const std::vector<double> &table,
+                  int x, int y) const
+        {
+            return (x == 0) || (y == 0) ? 0.0 : table[(y - 1) * width + x - 1];
+        }
+    };
+
+    RegionStatistics::RegionStatistics()
+        : _image(0),
+          _width(0),
+          _height(0),
+          _channels(0),
+          _blocksX(0),
+          _blocksY(0),
+          _tilesX(0),
+          _tilesY(0),
+          _tileSum(),
+          _tileSumSquares(),
+          _blockMin(),
+          _blockMax(),
+          _tableBytes(0),
+          _mutex(),
+          _tiles(),
+          _tileBytes(0),
+          _charged(0),
+          _budgetId(-1)
+    {
+        // Dearer than compressed frames: these are in use.
+        _budgetId = FITSMemoryBudget::global()->addConsumer("Region statistics tables",
+                                                            FITSMemoryBudget::MC_TILES,
+                                                            20,
+                                                            [this](size_t bytes)
+                                                            { return evict(bytes); });
+    }
+
+    RegionStatistics::~RegionStatistics()
+    {
+        FITSMemoryBudget::global()->removeConsumer(_budgetId);
+        clear();
+    }
+
+    void RegionStatistics::compute(const FITSImage *image,
+                                   const std::atomic<bool> *cancel)
+    {
+        ELS_TRACE_SCOPE("RegionStatistics::compute");
+
+        clear();
+
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const int channels = image->isColor() ? 3 : 1;
+        const int blocksX = (width + g_block - 1) / g_block;
+        const int blocksY = (height + g_block - 1) / g_block;
+        const int tilesX = (width + g_tile - 1) / g_tile;
+        const int tilesY = (height + g_tile - 1) / g_tile;
+        const int64_t tableSize = (int64_t)(tilesX + 1) * (tilesY + 1);
+        const int64_t blockCount = (int64_t)blocksX * blocksY;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tableBytes = channels * (tableSize * 2 + blockCount * 2) * (int64_t)sizeof(double);
+        }
+        charge();
+
+        const Layout layout(image);
+        for (int channel = 0; channel < channels; channel++)
+        {
+            _tileSum.push_back(std::vector<double>(tableSize, 0.0));
+            _tileSumSquares.push_back(std::vector<double>(tableSize, 0.0));
+            _blockMin.push_back(std::vector<double>(blockCount, HUGE_VAL));
+            _blockMax.push_back(std::vector<double>(blockCount, -HUGE_VAL));
+
+            double *tileSum = _tileSum.back().data();
+            double *tileSumSquares = _tileSumSquares.back().data();
+            double *blockMin = _blockMin.back().data();
+            double *blockMax = _blockMax.back().data();
+            switch (image->getBitDepth())
+            {
+            case FITSImage::BD_INT_8:
+                computeChannel((const uint8_t *)image->getPixels(), layout, channel, width, height, tilesX, tilesY, blocksX,
+                               tileSum, tileSumSquares, blockMin, blockMax, cancel);
+                break;
+            case FITSImage::BD_INT_16:
+                computeChannel((const uint16_t *)image->getPixels(), layout, channel, width, height, tilesX, tilesY, blocksX,
+                               tileSum, tileSumSquares, blockMin, blockMax, cancel);
+                break;
+            case FITSImage::BD_INT_32:
+                computeChannel((const uint32_t *)image->getPixels(), layout, channel, width, height, tilesX, tilesY, blocksX,
+                               tileSum, tileSumSquares, blockMin, blockMax, cancel);
+                break;
+            case FITSImage::BD_FLOAT:
+                computeChannel((const float *)image->getPixels(), layout, channel, width, height, tilesX, tilesY, blocksX,
+                               tileSum, tileSumSquares, blockMin, blockMax, cancel);
+                break;
+            case FITSImage::BD_DOUBLE:
+                computeChannel((const double *)image->getPixels(), layout, channel, width, height, tilesX, tilesY, blocksX,
+                               tileSum, tileSumSquares, blockMin, blockMax, cancel);
+                break;
+            }
+
+            if ((cancel != 0) && *cancel)
+            {
+                clear();
+                return;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tiles.resize((size_t)channels * tilesX * tilesY);
+        }
+
+        _image = image;
+        _width = width;
+        _height = height;
+        _channels = channels;
+        _blocksX = blocksX;
+        _blocksY = blocksY;
+        _tilesX = tilesX;
+        _tilesY = tilesY;
+    }
+
+    void RegionStatistics::clear()
+    {
+        _image = 0;
+        _width = 0;
+        _height = 0;
+        _channels = 0;
+        _blocksX = 0;
+        _blocksY = 0;
+        _tilesX = 0;
+        _tilesY = 0;
+        _tileSum.clear();
+        _tileSumSquares.clear();
+        _blockMin.clear();
+        _blockMax.clear();
+        _tileSum.shrink_to_fit();
+        _tileSumSquares.shrink_to_fit();
+        _blockMin.shrink_to_fit();
+        _blockMax.shrink_to_fit();
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tiles.clear();
+            _tiles.shrink_to_fit();
+            _tileBytes = 0;
+            _tableBytes = 0;
+        }
+        charge();
+    }
+
+    bool RegionStatistics::isValid() const
+    {
+        return _image != 0;
+    }
+
+    int RegionStatistics::getChannels() const
+    {
+        return _channels;
+    }
+
+    RegionStatistics::Box RegionStatistics::measure(int channel,
+                                                    int x,
+                                                    int y,
+                                                    int width,
+                                                    int height) const
+    {
+        Box box = Box();
+
+        const int x0 = std::max(x, 0);
+        const int y0 = std::max(y, 0);
+        const int x1 = std::min(x + width, _width);
+        const int y1 = std::min(y + height, _height);
+        if (!isValid() || (channel < 0) || (channel >= _channels) || (x0 >= x1) || (y0 >= y1))
+        {
+            return box;
+        }
+
+        box.x = x0;
+        box.y = y0;
+        box.width = x1 - x0;
+        box.height = y1 - y0;
+        box.count = (int64_t)box.width * box.height;
+
+        // Tiles wholly inside the box come from the tile tables...
+        double total = 0.0;
+        double totalSquares = 0.0;
+        const int fx0 = (x0 + g_tile - 1) / g_tile;
+        const int fy0 = (y0 + g_tile - 1) / g_tile;
+        const int fx1 = x1 / g_tile;
+        const int fy1 = y1 / g_tile;
+        if ((fx0 < fx1) && (fy0 < fy1))
+        {
+            const int64_t stride = _tilesX + 1;
+            const double *tileSum = _tileSum[channel].data();
+            const double *tileSumSquares = _tileSumSquares[channel].data();
+            const int64_t topLeft = fy0 * stride + fx0;
+            const int64_t topRight = fy0 * stride + fx1;
+            const int64_t bottomLeft = fy1 * stride + fx0;
+            const int64_t bottomRight = fy1 * stride + fx1;
+            total = tileSum[bottomRight] - tileSum[topRight] - tileSum[bottomLeft] + tileSum[topLeft];
+            totalSquares = tileSumSquares[bottomRight] - tileSumSquares[topRight] -
+                           tileSumSquares[bottomLeft] + tileSumSquares[topLeft];
+        }
+
+        // ...and the ring of tiles the box edges cut from their own.
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (int ty = y0 / g_tile; ty * g_tile < y1; ty++)
+            {
+                for (int tx = x0 / g_tile; tx * g_tile < x1; tx++)
+                {
+                    if ((ty >= fy0) && (ty < fy1) && (tx >= fx0) && (tx < fx1))
+                    {
+                        tx = fx1 - 1;
+                        continue;
+                    }
+
+                    const Tile *tile = getTile(channel, tx, ty);
+                    const int lx0 = std::max(x0 - tx * g_tile, 0);
+                    const int ly0 = std::max(y0 - ty * g_tile, 0);
+                    const int lx1 = std::min(x1 - tx * g_tile, tile->width);
+                    const int ly1 = std::min(y1 - ty * g_tile, tile->height);
+                    total += tile->total(tile->sum, lx0, ly0, lx1, ly1);
+                    totalSquares += tile->total(tile->sumSquares, lx0, ly0, lx1, ly1);
+                }
+            }
+        }
+        charge();
+
+        box.mean = total / box.count;
+        box.sigma = sqrt(std::max(0.0, totalSquares / box.count - box.mean * box.mean));
+
+        // Whole blocks come from the grid, the strips around them from
+        // the image.
+        box.minimum = HUGE_VAL;
+        box.maximum = -HUGE_VAL;
+        const int bx0 = (x0 + g_block - 1) / g_block;
+        const int by0 = (y0 + g_block - 1) / g_block;
+        const int bx1 = x1 / g_block;
+        const int by1 = y1 / g_block;
+        if ((bx0 < bx1) && (by0 < by1))
+        {
+            const double *blockMin = _blockMin[channel].data();
+            const double *blockMax = _blockMax[channel].data();
+            for (int by = by0; by < by1; by++)
+            {
+                for (int bx = bx0; bx < bx1; bx++)
+                {
+                    box.minimum = std::min(box.minimum, blockMin[by * _blocksX + bx]);
+                    box.maximum = std::max(box.maximum, blockMax[by * _blocksX + bx]);
+                }
+            }
+
+            const int ix0 = bx0 * g_block;
+            const int iy0 = by0 * g_block;
+            const int ix1 = bx1 * g_block;
+            const int iy1 = by1 * g_block;
+            scanImage(_image, channel, x0, y0, x1, iy0, &box.minimum, &box.maximum);
+            scanImage(_image, channel, x0, iy1, x1, y1, &box.minimum, &box.maximum);
+            scanImage(_image, channel, x0, iy0, ix0, iy1, &box.minimum, &box.maximum);
+            scanImage(_image, channel, ix1, iy0, x1, iy1, &box.minimum, &box.maximum);
+        }
+        else
+        {
+            scanImage(_image, channel, x0, y0, x1, y1, &box.minimum, &box.maximum);
+        }
+
+        return box;
+    }
+
+    /* static */
+    double RegionStatistics::getValue(const FITSImage *image,
+                                      int channel,
+                                      int x,
+                                      int y)
+    {
+        double minimum = HUGE_VAL;
+        double maximum = -HUGE_VAL;
+        scanImage(image, channel, x, y, x + 1, y + 1, &minimum, &maximum);
+
+        return minimum;
+    }
+
+    // Builds the prefix tables of a tile the first time they are needed.
+    // Caller holds _mutex.
+    const RegionStatistics::Tile *RegionStatistics::getTile(int channel,
+                                                            int tileX,
+                                                            int tileY) const
+    {
+        std::unique_ptr<Tile> &slot = _tiles[((size_t)channel * _tilesY + tileY) * _tilesX + tileX];
+        if (slot)
+        {
+            return slot.get();
+        }
+
+        std::unique_ptr<Tile> tile(new Tile());
+        tile->width = std::min(g_tile, _width - tileX * g_tile);
+        tile->height = std::min(g_tile, _height - tileY * g_tile);
+        tile->sum.resize((size_t)tile->width * tile->height);
+        tile->sumSquares.resize((size_t)tile->width * tile->height);
+        const int64_t bytes = (int64_t)tile->sum.size() * 2 * sizeof(double);
+
+        // Rather than track which were used last, start over.
+        if (_tileBytes + bytes > g_maxTileBytes)
+        {
+            for (std::unique_ptr<Tile> &other : _tiles)
+                other.reset();
+            _tileBytes = 0;
+        }
+
+        const Layout layout(_image);
+        const int x0 = tileX * g_tile;
+        const int y0 = tileY * g_tile;
+        double *sum = tile->sum.data();
+        double *sumSquares = tile->sumSquares.data();
+        switch (_image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            sumTile((const uint8_t *)_image->getPixels(), layout, channel, x0, y0, tile->width, tile->height, sum, sumSquares);
+            break;
+        case FITSImage::BD_INT_16:
+            sumTile((const uint16_t *)_image->getPixels(), layout, channel, x0, y0, tile->width, tile->height, sum, sumSquares);
+            break;
+        case FITSImage::BD_INT_32:
+            sumTile((const uint32_t *)_image->getPixels(), layout, channel, x0, y0, tile->width, tile->height, sum, sumSquares);
+            break;
+        case FITSImage::BD_FLOAT:
+            sumTile((const float *)_image->getPixels(), layout, channel, x0, y0, tile->width, tile->height, sum, sumSquares);
+            break;
+        case FITSImage::BD_DOUBLE:
+            sumTile((const double *)_image->getPixels(), layout, channel, x0, y0, tile->width, tile->height, sum, sumSquares);
+            break;
+        }
+
+        _tileBytes += bytes;
+        slot = std::move(tile);
+
+        return slot.get();
+    }
+
+    // For the memory budget. Tiles' prefix tables are rebuilt when next
+    // needed; the rest is in use.
+    size_t RegionStatistics::evict(size_t bytes)
+    {
+        (void)bytes;
+
+        size_t freed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (std::unique_ptr<Tile> &tile : _tiles)
+                tile.reset();
+            freed = _tileBytes;
+            _tileBytes = 0;
+        }
+
+        charge();
+        return freed;
+    }
+
+    // Brings the charge in line with the tables held. Must be called
+    // without _mutex held, as charging can evict from here.
+    void RegionStatistics::charge() const
+    {
+        int64_t change;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            change = _tableBytes + _tileBytes - _charged;
+            _charged += change;
+        }
+
+        if (change != 0)
+        {
+            FITSMemoryBudget::global()->charge(_budgetId, change);
+        }
+    }
+
+}
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <math.h>
+
+#include "executor.h"
+#include "stackcombine.h"
+
+namespace
+{
+
+    // Pixels handed to each worker; large enough to amortize the
+    // scheduling, small enough to keep every core busy on a thin band.
+    constexpr int64_t g_chunkPixels = 16 * 1024;
+
+    // Mean and standard deviation of values[0..count).
+    void meanAndSigma(const float *values,
+                      int count,
+                      float *mean,
+                      float *sigma)
+    {
+        double sum = 0.0;
+        double sumSq = 0.0;
+        for (int i = 0; i < count; i++)
+        {
+            sum += values[i];
+            sumSq += (double)values[i] * values[i];
+        }
+
+        double m = sum / count;
+        double var = sumSq / count - m * m;
+
+        *mean = m;
+        *sigma = var > 0.0 ? sqrt(var) : 0.0;
+    }
+
+}
+
+namespace ELS
+{
+
+    StackCombine::StackCombine(Method method,
+                               float lowSigma /* = 3.0 */,
+                               float highSigma /* = 3.0 */,
+                               int maxIterations /* = 5 */)
+        : _method(method),
+          _lowSigma(lowSigma),
+          _highSigma(highSigma),
+          _maxIterations(maxIterations)
+    {
+    }
+
+    StackCombine::Method StackCombine::getMethod() const
+    {
+        return _method;
+    }
+
+    const char *StackCombine::getMethodName() const
+    {
+        switch (_method)
+        {
+        case CM_MEDIAN:
+            return "median";
+        case CM_SIGMA_CLIP:
+            return "sigma-clipped mean";
+        case CM_WINSORIZED:
+            return "winsorized mean";
+        }
+
+        return "unknown";
+    }
+
+    void StackCombine::combine(const std::vector<const float *> &frames,
+                               int64_t pixelCount,
+                               float *output) const
+    {
+        QVector<QFuture<void>> futures;
+
+        const int count = frames.size();
+        const float *const *bands = frames.data();
+
+        for (int64_t first = 0; first < pixelCount; first += g_chunkPixels)
+        {
+            const int64_t last = std::min(first + g_chunkPixels, pixelCount);
+
+            futures.append(Executor::global()->run([=]()
+                                                   {
+                                                       // Per-pixel scratch; the estimators reorder it.
+                                                       std::vector<float> values(count);
+
+                                                       for (int64_t p = first; p < last; p++)
+                                                       {
+                                                           for (int f = 0; f < count; f++)
+                                                               values[f] = bands[f][p];
+
+                                                           output[p] = combinePixel(values.data(), count);
+                                                       }
+                                                   }));
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+    }
+
+    /* protected */
+    float StackCombine::combinePixel(float *values,
+                                     int count) const
+    {
+        if (count == 1)
+        {
+            return values[0];
+        }
+
+        switch (_method)
+        {
+        case CM_MEDIAN:
+            return median(values, count);
+        case CM_SIGMA_CLIP:
+            return sigmaClippedMean(values, count);
+        case CM_WINSORIZED:
+            return winsorizedMean(values, count);
+        }
+
+        return values[0];
+    }
+
+    /* protected */
+    float StackCombine::median(float *values,
+                               int count) const
+    {
+        const int middle = count / 2;
+        std::nth_element(values, values + middle, values + count);
+        float result = values[middle];
+
+        if ((count & 1) == 0)
+        {
+            // Even stacks average the two central values; the lower one
+            // is the largest of the lower half nth_element left behind.
+            result = (result + *std::max_element(values, values + middle)) / 2;
+        }
+
+        return result;
+    }
+
+    /* protected */
+    float StackCombine::sigmaClippedMean(float *values,
+                                         int count) const
+    {
+        // Rejected values are swapped past the end of the live range,
+        // so each iteration works on values[0..count).
+        for (int iteration = 0; iteration < _maxIterations; iteration++)
+        {
+            if (count < 3)
+            {
+                break;
+            }
+
+            float mean, sigma;
+            meanAndSigma(values, count, &mean, &sigma);
+            if (sigma == 0.0f)
+            {
+                break;
+            }
+
+            const float center = median(values, count);
+            const float low = center - _lowSigma * sigma;
+            const float high = center + _highSigma * sigma;
+
+            int kept = 0;
+            for (int i = 0; i < count; i++)
+            {
+                if ((values[i] >= low) && (values[i] <= high))
+                {
+                    std::swap(values[kept++], values[i]);
+                }
+            }
+
+            if ((kept == count) || (kept == 0))
+            {
+                break;
+            }
+
+            count = kept;
+        }
+
+        float mean, sigma;
+        meanAndSigma(values, count, &mean, &sigma);
+
+        return mean;
+    }
+
+    /* protected */
+    float StackCombine::winsorizedMean(float *values,
+                                       int count) const
+    {
+        // Outliers are clamped to the clip bounds rather than dropped,
+        // and the bounds re-derived until nothing moves.
+        float mean, sigma;
+        for (int iteration = 0; iteration < _maxIterations; iteration++)
+        {
+            meanAndSigma(values, count, &mean, &sigma);
+            if (sigma == 0.0f)
+            {
+                break;
+            }
+
+            const float center = median(values, count);
+            const float low = center - _lowSigma * sigma;
+            const float high = center + _highSigma * sigma;
+
+            bool clamped = false;
+            for (int i = 0; i < count; i++)
+            {
+                if (values[i] < low)
+                {
+                    values[i] = low;
+                    clamped = true;
+                }
+                else if (values[i] > high)
+                {
+                    values[i] = high;
+                    clamped = true;
+                }
+            }
+
+            if (!clamped)
+            {
+                break;
+            }
+        }
+
+        meanAndSigma(values, count, &mean, &sigma);
+
+        return mean;
+    }
+
+}
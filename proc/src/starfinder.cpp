@@ -0,0 +1,478 @@
+#include <algorithm>
+#include <math.h>
+
+#include "executor.h"
+#include "fitstrace.h"
+#include "starfinder.h"
+
+namespace
+{
+
+    // Side of the square regions detection is split into for threading.
+    constexpr int g_detectTile = 256;
+
+    // Stars closer than this to the frame edge can't be measured fully.
+    constexpr int g_edgeMargin = 2;
+
+    float median(std::vector<float> values)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        const int middle = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        return values[middle];
+    }
+
+    template <typename T>
+    class Detector
+    {
+    public:
+        Detector(const T *plane, int width, int height,
+                 const ELS::ImageStatistics &stats,
+                 float thresholdSigma, int minPixels, int maxRadius)
+            : _plane(plane),
+              _width(width),
+              _height(height),
+              _stats(stats),
+              _thresholdSigma(thresholdSigma),
+              _minPixels(minPixels),
+              _maxRadius(maxRadius)
+        {
+        }
+
+        void detect(int left, int top, int right, int bottom,
+                    const std::atomic<bool> *cancel,
+                    std::vector<ELS::Star> *stars) const
+        {
+            const int window = 2 * _maxRadius + 1;
+            std::vector<uint8_t> visited(window * window);
+            std::vector<int> component;
+            std::vector<int> stack;
+
+            left = std::max(left, g_edgeMargin);
+            top = std::max(top, g_edgeMargin);
+            right = std::min(right, _width - g_edgeMargin);
+            bottom = std::min(bottom, _height - g_edgeMargin);
+
+            const int tileSize = _stats.getTileSize();
+
+            for (int y = top; y < bottom; y++)
+            {
+                if ((cancel != 0) && cancel->load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+
+                const T *line = _plane + (int64_t)y * _width;
+                for (int x = left; x < right; x++)
+                {
+                    const float background = _stats.getTileBackground(x / tileSize, y / tileSize);
+                    const float threshold = background + _thresholdSigma * _stats.getTileNoise(x / tileSize, y / tileSize);
+                    if ((line[x] <= threshold) || !isPeak(x, y))
+                    {
+                        continue;
+                    }
+
+                    if (!grow(x, y, threshold, &visited, &component, &stack))
+                    {
+                        continue;
+                    }
+
+                    stars->push_back(measure(x, y, background, component));
+                }
+            }
+        }
+
+    private:
+        float at(int x, int y) const
+        {
+            return _plane[(int64_t)y * _width + x];
+        }
+
+        // True if (x, y) outranks all 8 neighbours. Ties go to the
+        // earlier pixel in raster order so a flat top has one peak.
+        bool isPeak(int x, int y) const
+        {
+            const float v = at(x, y);
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    if ((dx == 0) && (dy == 0))
+                        continue;
+
+                    const float n = at(x + dx, y + dy);
+                    const bool before = (dy < 0) || ((dy == 0) && (dx < 0));
+                    if ((n > v) || (before && (n == v)))
+                        return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Flood fills the pixels above threshold connected to the peak
+        // at (px, py), within maxRadius of it. Rejects the group if it
+        // spills out of that window (too big to be a star), has a
+        // brighter pixel than the peak (another peak owns it) or is too
+        // small (a hot pixel).
+        bool grow(int px, int py, float threshold,
+                  std::vector<uint8_t> *visited,
+                  std::vector<int> *component,
+                  std::vector<int> *stack) const
+        {
+            const int window = 2 * _maxRadius + 1;
+            const int originX = px - _maxRadius;
+            const int originY = py - _maxRadius;
+            const float peak = at(px, py);
+
+            std::fill(visited->begin(), visited->end(), 0);
+            component->clear();
+            stack->clear();
+
+            stack->push_back(_maxRadius * window + _maxRadius);
+            (*visited)[stack->back()] = 1;
+
+            bool ok = true;
+            while (!stack->empty())
+            {
+                const int index = stack->back();
+                stack->pop_back();
+                component->push_back(index);
+
+                const int wx = index % window;
+                const int wy = index / window;
+                if ((wx == 0) || (wy == 0) || (wx == window - 1) || (wy == window - 1))
+                {
+                    ok = false;
+                    continue;
+                }
+
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        const int ix = originX + wx + dx;
+                        const int iy = originY + wy + dy;
+                        const int neighbour = index + dy * window + dx;
+                        if ((ix < 0) || (iy < 0) || (ix >= _width) || (iy >= _height) ||
+                            (*visited)[neighbour])
+                        {
+                            continue;
+                        }
+
+                        const float v = at(ix, iy);
+                        if (v <= threshold)
+                        {
+                            continue;
+                        }
+                        if (v > peak)
+                        {
+                            ok = false;
+                        }
+
+                        (*visited)[neighbour] = 1;
+                        stack->push_back(neighbour);
+                    }
+                }
+            }
+
+            return ok && ((int)component->size() >= _minPixels);
+        }
+
+        ELS::Star measure(int px, int py, float background,
+                          const std::vector<int> &component) const
+        {
+            const int window = 2 * _maxRadius + 1;
+            const float saturation = _stats.getMaximum();
+
+            ELS::Star star;
+            star.pixelCount = component.size();
+            star.peak = at(px, py) - background;
+
+            // A flat top at the image maximum means clipped data.
+            int clipped = 0;
+            for (int index : component)
+            {
+                if (at(px - _maxRadius + index % window, py - _maxRadius + index / window) >= saturation)
+                {
+                    clipped++;
+                }
+            }
+            star.saturated = clipped >= 2;
+
+            // Measure over an aperture comfortably larger than the
+            // detected footprint so the wings count. Weights aren't
+            // clipped at zero, so the noise in the wings averages out
+            // instead of inflating the moments.
+            const float footprint = sqrtf(component.size() / (float)M_PI);
+            const float radius = std::min((float)_maxRadius, std::max(3.0f, 2.5f * footprint));
+            const int r = ceilf(radius);
+            const int left = std::max(0, px - r);
+            const int right = std::min(_width - 1, px + r);
+            const int top = std::max(0, py - r);
+            const int bottom = std::min(_height - 1, py + r);
+
+            double sum = 0, sumX = 0, sumY = 0;
+            for (int y = top; y <= bottom; y++)
+            {
+                for (int x = left; x <= right; x++)
+                {
+                    if ((x - px) * (x - px) + (y - py) * (y - py) > radius * radius)
+                        continue;
+
+                    const float f = at(x, y) - background;
+                    sum += f;
+                    sumX += f * x;
+                    sumY += f * y;
+                }
+            }
+
+            star.flux = sum;
+            star.x = sum > 0 ? sumX / sum : px;
+            star.y = sum > 0 ? sumY / sum : py;
+
+            double sumR = 0, mxx = 0, myy = 0, mxy = 0;
+            for (int y = top; y <= bottom; y++)
+            {
+                for (int x = left; x <= right; x++)
+                {
+                    if ((x - px) * (x - px) + (y - py) * (y - py) > radius * radius)
+                        continue;
+
+                    const float f = at(x, y) - background;
+                    const double dx = x - star.x;
+                    const double dy = y - star.y;
+                    sumR += f * sqrt(dx * dx + dy * dy);
+                    mxx += f * dx * dx;
+                    myy += f * dy * dy;
+                    mxy += f * dx * dy;
+                }
+            }
+
+            if (sum > 0)
+            {
+                mxx /= sum;
+                myy /= sum;
+                mxy /= sum;
+            }
+
+            // Principal axes of the light distribution: a Gaussian with
+            // sigma s has second moment s^2 along each axis.
+            const double mean = (mxx + myy) / 2;
+            const double spread = sqrt((mxx - myy) * (mxx - myy) / 4 + mxy * mxy);
+            const double major = mean + spread;
+            const double minor = std::max(0.0, mean - spread);
+
+            star.hfr = sum > 0 ? std::max(0.0, sumR / sum) : 0;
+            star.fwhm = mean > 0 ? 2.3548 * sqrt(mean) : 0;
+            star.eccentricity = major > 0 ? sqrt(1 - minor / major) : 0;
+
+            return star;
+        }
+
+    private:
+        const T *_plane;
+        int _width;
+        int _height;
+        const ELS::ImageStatistics &_stats;
+        float _thresholdSigma;
+        int _minPixels;
+        int _maxRadius;
+    };
+
+    template <typename T>
+    std::vector<ELS::Star> detectStars(const T *plane, int width, int height,
+                                       const ELS::ImageStatistics &stats,
+                                       float thresholdSigma, int minPixels, int maxRadius,
+                                       const std::atomic<bool> *cancel)
+    {
+        Detector<T> detector(plane, width, height, stats, thresholdSigma, minPixels, maxRadius);
+
+        const int tilesX = (width + g_detectTile - 1) / g_detectTile;
+        const int tilesY = (height + g_detectTile - 1) / g_detectTile;
+        std::vector<std::vector<ELS::Star>> found(tilesX * tilesY);
+
+        QVector<QFuture<void>> futures;
+        for (int tileY = 0; tileY < tilesY; tileY++)
+        {
+            for (int tileX = 0; tileX < tilesX; tileX++)
+            {
+                std::vector<ELS::Star> *stars = &found[tileY * tilesX + tileX];
+                const Detector<T> *d = &detector;
+                futures.append(ELS::Executor::global()->run([=]()
+                                                            { d->detect(tileX * g_detectTile, tileY * g_detectTile,
+                                                                        (tileX + 1) * g_detectTile, (tileY + 1) * g_detectTile,
+                                                                        cancel, stars); }));
+            }
+        }
+        for (QFuture<void> future : futures)
+            future.waitForFinished();
+
+        std::vector<ELS::Star> stars;
+        for (const std::vector<ELS::Star> &tileStars : found)
+        {
+            stars.insert(stars.end(), tileStars.begin(), tileStars.end());
+        }
+
+        return stars;
+    }
+
+}
+
+namespace ELS
+{
+
+    StarAnalysis::StarAnalysis()
+        : _valid(false),
+          _cancelled(false),
+          _background(0),
+          _noise(0),
+          _medianHFR(0),
+          _medianFWHM(0),
+          _medianEccentricity(0)
+    {
+    }
+
+    bool StarAnalysis::isValid() const
+    {
+        return _valid;
+    }
+
+    bool StarAnalysis::wasCancelled() const
+    {
+        return _cancelled;
+    }
+
+    const std::vector<Star> &StarAnalysis::getStars() const
+    {
+        return _stars;
+    }
+
+    int StarAnalysis::getStarCount() const
+    {
+        return _stars.size();
+    }
+
+    float StarAnalysis::getBackground() const
+    {
+        return _background;
+    }
+
+    float StarAnalysis::getNoise() const
+    {
+        return _noise;
+    }
+
+    float StarAnalysis::getMedianHFR() const
+    {
+        return _medianHFR;
+    }
+
+    float StarAnalysis::getMedianFWHM() const
+    {
+        return _medianFWHM;
+    }
+
+    float StarAnalysis::getMedianEccentricity() const
+    {
+        return _medianEccentricity;
+    }
+
+    StarFinder::StarFinder(float thresholdSigma /* = 5.0 */,
+                           int minPixels /* = 4 */,
+                           int maxRadius /* = 24 */)
+        : _thresholdSigma(thresholdSigma),
+          _minPixels(minPixels),
+          _maxRadius(maxRadius)
+    {
+    }
+
+    StarAnalysis StarFinder::analyze(const FITSImage *image,
+                                     const std::atomic<bool> *cancel /* = 0 */) const
+    {
+        ImageStatistics stats;
+        stats.compute(image, analysisChannel(image));
+
+        return analyze(image, stats, cancel);
+    }
+
+    StarAnalysis StarFinder::analyze(const FITSImage *image,
+                                     const ImageStatistics &stats,
+                                     const std::atomic<bool> *cancel /* = 0 */) const
+    {
+        ELS_TRACE_SCOPE("StarFinder::analyze");
+
+        StarAnalysis result;
+
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const int64_t offset = (int64_t)analysisChannel(image) * width * height;
+        const void *pixels = image->getPixels();
+
+        switch (image->getBitDepth())
+        {
+        case FITSImage::BD_INT_8:
+            result._stars = detectStars((const uint8_t *)pixels + offset, width, height, stats,
+                                        _thresholdSigma, _minPixels, _maxRadius, cancel);
+            break;
+        case FITSImage::BD_INT_16:
+            result._stars = detectStars((const uint16_t *)pixels + offset, width, height, stats,
+                                        _thresholdSigma, _minPixels, _maxRadius, cancel);
+            break;
+        case FITSImage::BD_INT_32:
+            result._stars = detectStars((const uint32_t *)pixels + offset, width, height, stats,
+                                        _thresholdSigma, _minPixels, _maxRadius, cancel);
+            break;
+        case FITSImage::BD_FLOAT:
+            result._stars = detectStars((const float *)pixels + offset, width, height, stats,
+                                        _thresholdSigma, _minPixels, _maxRadius, cancel);
+            break;
+        case FITSImage::BD_DOUBLE:
+            result._stars = detectStars((const double *)pixels + offset, width, height, stats,
+                                        _thresholdSigma, _minPixels, _maxRadius, cancel);
+            break;
+        }
+
+        if ((cancel != 0) && cancel->load())
+        {
+            result._cancelled = true;
+            result._stars.clear();
+            return result;
+        }
+
+        std::sort(result._stars.begin(), result._stars.end(),
+                  [](const Star &a, const Star &b)
+                  { return a.flux > b.flux; });
+
+        std::vector<float> hfrs, fwhms, eccentricities;
+        for (const Star &star : result._stars)
+        {
+            if (!star.saturated)
+            {
+                hfrs.push_back(star.hfr);
+                fwhms.push_back(star.fwhm);
+                eccentricities.push_back(star.eccentricity);
+            }
+        }
+
+        result._background = stats.getBackground();
+        result._noise = stats.getNoise();
+        result._medianHFR = median(hfrs);
+        result._medianFWHM = median(fwhms);
+        result._medianEccentricity = median(eccentricities);
+        result._valid = true;
+
+        return result;
+    }
+
+    /* static */
+    int StarFinder::analysisChannel(const FITSImage *image)
+    {
+        return image->isColor() ? 1 : 0;
+    }
+
+}
@@ -1,33 +1,27 @@
-QT += core gui concurrent
+QT += core gui concurrent network
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++11
 
-LIBS += -lcfitsio
-
-INCLUDEPATH += \
-    fits/include \
-    gui/include
+include(fits/fits.pri)
+include(proc/proc.pri)
+include(gui/render.pri)
 
 SOURCES += \
-    fits/src/fitsexception.cpp \
-    fits/src/fitsimage.cpp \
-    fits/src/fitsraster.cpp \
-    fits/src/fitstantrum.cpp \
     gui/src/main.cpp \
     gui/src/mainwindow.cpp \
     gui/src/fitswidget.cpp \
-    gui/src/stretch.cpp
+    gui/src/comparewidget.cpp \
+    gui/src/memorypanel.cpp \
+    gui/src/singleinstance.cpp
 
 HEADERS += \
-    fits/include/fitsexception.h \
-    fits/include/fitsimage.h \
-    fits/include/fitsraster.h \
-    fits/include/fitstantrum.h \
     gui/include/mainwindow.h \
     gui/include/fitswidget.h \
-    gui/include/stretch.h
+    gui/include/comparewidget.h \
+    gui/include/memorypanel.h \
+    gui/include/singleinstance.h
 
 RESOURCES += \
     icon/icon.qrc
@@ -0,0 +1,10 @@
+# Helpers shared by the command-line tools.
+
+INCLUDEPATH += \
+    $$PWD
+
+SOURCES += \
+    $$PWD/inputfiles.cpp
+
+HEADERS += \
+    $$PWD/inputfiles.h
@@ -0,0 +1,32 @@
+#include <QDir>
+#include <QFileInfo>
+
+#include "inputfiles.h"
+
+QStringList expandInputFiles(const QStringList &args)
+{
+    QStringList files;
+    for (const QString &arg : args)
+    {
+        QFileInfo info(arg);
+        if (info.isDir())
+        {
+            QDir dir(arg);
+            QStringList entries = dir.entryList(QStringList() << "*.fits"
+                                                              << "*.fit"
+                                                              << "*.fts",
+                                                QDir::Files,
+                                                QDir::Name);
+            for (const QString &entry : entries)
+            {
+                files.append(dir.filePath(entry));
+            }
+        }
+        else
+        {
+            files.append(arg);
+        }
+    }
+
+    return files;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <QStringList>
+
+// Expands command-line inputs into a list of FITS files: directories
+// contribute their *.fits, *.fit and *.fts files in name order, anything
+// else is taken as a file.
+QStringList expandInputFiles(const QStringList &args);
@@ -0,0 +1,467 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSysInfo>
+#include <QTextStream>
+#include <QThread>
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "fitsexception.h"
+#include "fitsimage.h"
+#include "fitsrender.h"
+#include "imagestatistics.h"
+#include "stretch.h"
+#include "synthfits.h"
+
+namespace
+{
+
+    struct DepthInfo
+    {
+        ELS::FITSImage::BitDepth bitDepth;
+        int bitpix;
+        const char *name;
+    };
+
+    const DepthInfo g_depths[] = {
+        {ELS::FITSImage::BD_INT_8, 8, "int8"},
+        {ELS::FITSImage::BD_INT_16, 16, "int16"},
+        {ELS::FITSImage::BD_INT_32, 32, "int32"},
+        {ELS::FITSImage::BD_FLOAT, -32, "float"},
+        {ELS::FITSImage::BD_DOUBLE, -64, "double"}};
+
+    // Milliseconds taken by each repetition of one phase.
+    typedef std::vector<double> Samples;
+
+    struct Phases
+    {
+        Samples open;
+        Samples read;
+        Samples statistics;
+        Samples computeParams;
+        Samples run;
+        Samples convertImage;
+    };
+
+    double elapsedMs(const QElapsedTimer &timer)
+    {
+        return timer.nsecsElapsed() / 1.0e6;
+    }
+
+    QJsonObject summarize(Samples samples)
+    {
+        std::sort(samples.begin(), samples.end());
+
+        double sum = 0;
+        for (double s : samples)
+        {
+            sum += s;
+        }
+
+        QJsonArray all;
+        for (double s : samples)
+        {
+            all.append(s);
+        }
+
+        QJsonObject object;
+        object["min"] = samples.front();
+        object["median"] = samples[samples.size() / 2];
+        object["mean"] = sum / samples.size();
+        object["max"] = samples.back();
+        object["samples"] = all;
+        return object;
+    }
+
+    // Drops the file from the page cache so the next read comes from
+    // the disk. Only clean pages can be dropped, hence the sync.
+    bool evictFromCache(const QString &filename)
+    {
+#ifdef Q_OS_LINUX
+        int fd = ::open(filename.toLocal8Bit().constData(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        fdatasync(fd);
+        bool ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+        ::close(fd);
+        return ok;
+#else
+        Q_UNUSED(filename);
+        return false;
+#endif
+    }
+
+    void warmCache(const QString &filename)
+    {
+        QFile file(filename);
+        if (file.open(QIODevice::ReadOnly))
+        {
+            std::vector<char> buffer(4 * 1024 * 1024);
+            while (file.read(&buffer[0], buffer.size()) > 0)
+            {
+            }
+        }
+    }
+
+    // Times the disk-bound phases: header parse and full load.
+    void timeLoad(const QString &filename,
+                  bool cold,
+                  Phases *phases)
+    {
+        QByteArray name = filename.toLocal8Bit();
+        QElapsedTimer timer;
+
+        if (cold)
+        {
+            evictFromCache(filename);
+        }
+
+        ELS::FITSImage::Info info;
+        timer.start();
+        ELS::FITSImage::probe(name.constData(), &info);
+        phases->open.push_back(elapsedMs(timer));
+
+        // The header is cached now, the pixels still aren't.
+        timer.start();
+        ELS::FITSImage *image = ELS::FITSImage::load(name.constData());
+        phases->read.push_back(elapsedMs(timer));
+        delete image;
+    }
+
+    // Times the CPU-bound phases on an image already in memory, each
+    // exactly as the viewer runs it.
+    // A comma-separated option's values.
+    QStringList splitList(const QString &value)
+    {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+        return value.split(',', Qt::SkipEmptyParts);
+#else
+        return value.split(',', QString::SkipEmptyParts);
+#endif
+    }
+
+    // One flat colour, as a stretch that can't handle the pixel type
+    // leaves it; timing that would time nothing.
+    bool isBlank(const QImage *image)
+    {
+        const QRgb first = image->pixel(0, 0);
+        for (int y = 0; y < image->height(); y += 7)
+        {
+            for (int x = 0; x < image->width(); x += 7)
+            {
+                if (image->pixel(x, y) != first)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void timeRender(const ELS::FITSImage *image,
+                    Phases *phases)
+    {
+        QElapsedTimer timer;
+
+        timer.start();
+        ELS::ImageStatistics stats;
+        stats.compute(image, 0);
+        phases->statistics.push_back(elapsedMs(timer));
+
+        const int width = image->getWidth();
+        const int height = image->getHeight();
+        const uint8_t *pixels = (const uint8_t *)image->getPixels();
+
+        Stretch stretch(width,
+                        height,
+                        image->isColor() ? 3 : 1,
+                        FITSRender::getFITSIODataType(image->getBitDepth()));
+        if (image->getInfo().range > 0)
+        {
+            stretch.setInputRange(image->getInfo().range);
+        }
+
+        timer.start();
+        stretch.setParams(stretch.computeParams(pixels));
+        phases->computeParams.push_back(elapsedMs(timer));
+
+        QImage *output = FITSRender::createImage(width, height, image->isColor());
+        timer.start();
+        stretch.run(pixels, output);
+        phases->run.push_back(elapsedMs(timer));
+        const bool runBlank = isBlank(output);
+        delete output;
+        if (runBlank)
+        {
+            throw new ELS::FITSException("Stretch produced a blank image");
+        }
+
+        timer.start();
+        QImage *rendered = FITSRender::render(image, true);
+        phases->convertImage.push_back(elapsedMs(timer));
+        const bool renderBlank = isBlank(rendered);
+        delete rendered;
+        if (renderBlank)
+        {
+            throw new ELS::FITSException("Render produced a blank image");
+        }
+    }
+
+    QJsonObject describeHost()
+    {
+        QJsonObject host;
+        host["cpuArchitecture"] = QSysInfo::currentCpuArchitecture();
+        host["kernel"] = QSysInfo::kernelType() + " " + QSysInfo::kernelVersion();
+        host["os"] = QSysInfo::prettyProductName();
+        host["hostname"] = QSysInfo::machineHostName();
+        host["threads"] = QThread::idealThreadCount();
+        host["qtVersion"] = QString(qVersion());
+        return host;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtfits-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Generates synthetic FITS files and times loading and stretching them.");
+    parser.addHelpOption();
+
+    QCommandLineOption sizesOpt("sizes", "Image sizes in megapixels.", "list", "1,4,16,62,150");
+    QCommandLineOption depthsOpt("depths", "BITPIX values to test.", "list", "8,16,32,-32,-64");
+    QCommandLineOption layoutsOpt("layouts", "mono, rgb or both.", "list", "mono,rgb");
+    QCommandLineOption repeatOpt(QStringList() << "r"
+                                               << "repeat",
+                                 "Runs of each phase.", "count", "3");
+    QCommandLineOption seedOpt("seed", "Seed for the synthetic images.", "seed", "1");
+    QCommandLineOption workDirOpt("work-dir", "Where to write the synthetic files.", "dir",
+                                  QDir(QDir::tempPath()).filePath("qtfits-bench"));
+    QCommandLineOption keepOpt("keep", "Keep the synthetic files, and reuse any already there.");
+    QCommandLineOption noColdOpt("no-cold", "Skip the cold page cache runs.");
+    QCommandLineOption outputOpt(QStringList() << "o"
+                                               << "output",
+                                 "Write the results here instead of stdout.", "file");
+    parser.addOption(sizesOpt);
+    parser.addOption(depthsOpt);
+    parser.addOption(layoutsOpt);
+    parser.addOption(repeatOpt);
+    parser.addOption(seedOpt);
+    parser.addOption(workDirOpt);
+    parser.addOption(keepOpt);
+    parser.addOption(noColdOpt);
+    parser.addOption(outputOpt);
+    parser.process(app);
+
+    const int repeat = std::max(1, parser.value(repeatOpt).toInt());
+    const unsigned seed = parser.value(seedOpt).toUInt();
+    const bool keep = parser.isSet(keepOpt);
+    const QDir workDir(parser.value(workDirOpt));
+
+    std::vector<double> sizes;
+    for (const QString &size : splitList(parser.value(sizesOpt)))
+    {
+        sizes.push_back(size.toDouble());
+    }
+
+    std::vector<DepthInfo> depths;
+    for (const QString &depth : splitList(parser.value(depthsOpt)))
+    {
+        bool found = false;
+        for (const DepthInfo &info : g_depths)
+        {
+            if (info.bitpix == depth.toInt())
+            {
+                depths.push_back(info);
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Unknown BITPIX %s\n", depth.toLocal8Bit().constData());
+            return 1;
+        }
+    }
+
+    std::vector<bool> layouts;
+    for (const QString &layout : splitList(parser.value(layoutsOpt)))
+    {
+        if ((layout != "mono") && (layout != "rgb"))
+        {
+            fprintf(stderr, "Unknown layout %s\n", layout.toLocal8Bit().constData());
+            return 1;
+        }
+        layouts.push_back(layout == "rgb");
+    }
+
+    if (!workDir.exists() && !QDir().mkpath(workDir.path()))
+    {
+        fprintf(stderr, "Can't create %s\n", workDir.path().toLocal8Bit().constData());
+        return 1;
+    }
+
+    bool cold = !parser.isSet(noColdOpt);
+#ifndef Q_OS_LINUX
+    if (cold)
+    {
+        fprintf(stderr, "Can't drop files from the page cache on this platform; skipping cold runs\n");
+        cold = false;
+    }
+#endif
+
+    QFile file;
+    if (parser.isSet(outputOpt))
+    {
+        file.setFileName(parser.value(outputOpt));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        {
+            fprintf(stderr, "Can't write %s\n", parser.value(outputOpt).toLocal8Bit().constData());
+            return 1;
+        }
+    }
+    else
+    {
+        file.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    }
+
+    QJsonArray results;
+    int failed = 0;
+
+    for (double megapixels : sizes)
+    {
+        // 3:2, like most sensors.
+        const int width = (int)(sqrt(megapixels * 1.0e6 * 1.5) + 0.5);
+        const int height = (int)(width / 1.5 + 0.5);
+
+        for (bool isColor : layouts)
+        {
+            for (const DepthInfo &depth : depths)
+            {
+                QString filename = workDir.filePath(QString("synth-%1x%2-%3-%4-s%5.fits")
+                                                        .arg(width)
+                                                        .arg(height)
+                                                        .arg(isColor ? "rgb" : "mono")
+                                                        .arg(depth.name)
+                                                        .arg(seed));
+                QByteArray name = filename.toLocal8Bit();
+
+                QJsonObject result;
+                result["bitpix"] = depth.bitpix;
+                result["bitDepth"] = QString(depth.name);
+                result["layout"] = QString(isColor ? "rgb" : "mono");
+                result["width"] = width;
+                result["height"] = height;
+                result["megapixels"] = (double)width * height / 1.0e6;
+
+                fprintf(stderr, "%dx%d %s %s\n", width, height, isColor ? "rgb" : "mono", depth.name);
+
+                Phases warmPhases;
+                Phases coldPhases;
+                try
+                {
+                    if (!keep || !QFile::exists(filename))
+                    {
+                        // cfitsio won't overwrite without the "!" prefix.
+                        SynthSpec spec = {depth.bitDepth, width, height, isColor, seed};
+                        writeSynthFITS(("!" + name).constData(), spec);
+                    }
+                    result["fileBytes"] = QFileInfo(filename).size();
+
+                    if (cold)
+                    {
+                        for (int i = 0; i < repeat; i++)
+                        {
+                            timeLoad(filename, true, &coldPhases);
+                        }
+                    }
+
+                    warmCache(filename);
+                    for (int i = 0; i < repeat; i++)
+                    {
+                        timeLoad(filename, false, &warmPhases);
+                    }
+
+                    ELS::FITSImage *image = ELS::FITSImage::load(name.constData());
+                    try
+                    {
+                        for (int i = 0; i < repeat; i++)
+                        {
+                            timeRender(image, &warmPhases);
+                        }
+                    }
+                    catch (ELS::FITSException *)
+                    {
+                        delete image;
+                        throw;
+                    }
+                    delete image;
+                }
+                catch (ELS::FITSException *e)
+                {
+                    fprintf(stderr, "FITSException: %s for file %s\n", e->getErrText(), name.constData());
+                    result["error"] = QString(e->getErrText());
+                    delete e;
+                    failed++;
+                }
+
+                if (!result.contains("error"))
+                {
+                    QJsonObject warm;
+                    warm["open"] = summarize(warmPhases.open);
+                    warm["read"] = summarize(warmPhases.read);
+                    warm["statistics"] = summarize(warmPhases.statistics);
+                    warm["computeParams"] = summarize(warmPhases.computeParams);
+                    warm["run"] = summarize(warmPhases.run);
+                    warm["convertImage"] = summarize(warmPhases.convertImage);
+                    result["warm"] = warm;
+
+                    if (cold)
+                    {
+                        QJsonObject coldResult;
+                        coldResult["open"] = summarize(coldPhases.open);
+                        coldResult["read"] = summarize(coldPhases.read);
+                        result["cold"] = coldResult;
+                    }
+                }
+                results.append(result);
+
+                if (!keep)
+                {
+                    QFile::remove(filename);
+                }
+            }
+        }
+    }
+
+    QJsonObject report;
+    report["tool"] = QString("qtfits-bench");
+    report["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    report["host"] = describeHost();
+    report["repeat"] = repeat;
+    report["seed"] = (int)seed;
+    report["results"] = results;
+
+    QTextStream out(&file);
+    out << QJsonDocument(report).toJson();
+
+    return failed ? 1 : 0;
+}
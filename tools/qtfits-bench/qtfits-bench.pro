@@ -0,0 +1,19 @@
+# Load and stretch benchmarks on synthetic FITS files.
+
+QT += core gui concurrent
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = qtfits-bench
+
+include(../../fits/fits.pri)
+include(../../proc/proc.pri)
+include(../../gui/render.pri)
+
+SOURCES += \
+    main.cpp \
+    synthfits.cpp
+
+HEADERS += \
+    synthfits.h
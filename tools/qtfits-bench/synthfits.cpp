@@ -0,0 +1,169 @@
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <math.h>
+#include <random>
+#include <vector>
+
+#include "fitsbandwriter.h"
+#include "synthfits.h"
+
+namespace
+{
+
+    struct SynthStar
+    {
+        float x;
+        float y;
+        float flux;
+        float sigma;
+    };
+
+    const int g_bandRows = 64;
+
+    // Star light reaches this many sigmas before it is lost in the noise.
+    const float g_starReach = 4.0f;
+
+    // Everything is modelled in 16-bit ADU and scaled on the way out.
+    const float g_readNoise = 6.0f;
+    const float g_gain = 1.5f;
+    const float g_skyLevel = 900.0f;
+    const float g_gradient = 350.0f;
+    const float g_fullWell = 65535.0f;
+
+    float outputScale(ELS::FITSImage::BitDepth bitDepth)
+    {
+        switch (bitDepth)
+        {
+        case ELS::FITSImage::BD_INT_8:
+            // Keeps the sky a few counts above zero and lets the brighter
+            // stars saturate, as an 8-bit capture would.
+            return 255.0f / 8192.0f;
+        case ELS::FITSImage::BD_INT_16:
+        case ELS::FITSImage::BD_INT_32:
+            return 1.0f;
+        case ELS::FITSImage::BD_FLOAT:
+        case ELS::FITSImage::BD_DOUBLE:
+            return 1.0f / g_fullWell;
+        }
+
+        return 1.0f;
+    }
+
+    // Roughly one star per 2500 pixels, most of them faint.
+    std::vector<SynthStar> makeStars(const SynthSpec &spec)
+    {
+        std::mt19937 rng(spec.seed);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        const int count = std::max(10, (int)((int64_t)spec.width * spec.height / 2500));
+        std::vector<SynthStar> stars(count);
+        for (SynthStar &star : stars)
+        {
+            star.x = unit(rng) * spec.width;
+            star.y = unit(rng) * spec.height;
+            star.flux = 2000.0f * powf(1.0f - unit(rng) * 0.999f, -1.2f);
+            star.sigma = 1.1f + 0.6f * unit(rng);
+        }
+
+        std::sort(stars.begin(), stars.end(),
+                  [](const SynthStar &a, const SynthStar &b)
+                  { return a.y < b.y; });
+
+        return stars;
+    }
+
+    void renderRow(const SynthSpec &spec,
+                   const std::vector<SynthStar> &stars,
+                   int channel,
+                   int row,
+                   float *out)
+    {
+        // Rows get their own generator so bands can be made in any order.
+        std::mt19937 rng(spec.seed ^ (0x9e3779b9u * (row + 1)) ^ (0x85ebca6bu * (channel + 1)));
+        std::normal_distribution<float> gauss(0.0f, 1.0f);
+
+        // Colour images get a slightly tinted sky and bluer stars.
+        static const float skyTint[3] = {1.15f, 1.0f, 0.8f};
+        static const float starTint[3] = {0.85f, 1.0f, 1.1f};
+        const float sky = g_skyLevel * (spec.isColor ? skyTint[channel] : 1.0f);
+        const float starGain = spec.isColor ? starTint[channel] : 1.0f;
+
+        const float cy = (row - spec.height * 0.5f) / spec.height;
+        for (int x = 0; x < spec.width; x++)
+        {
+            const float cx = (x - spec.width * 0.5f) / spec.width;
+            const float vignette = 1.0f - 0.35f * (cx * cx + cy * cy);
+            out[x] = (sky + g_gradient * ((float)x / spec.width + 0.5f * row / spec.height)) * vignette;
+        }
+
+        const float reach = 1.7f * g_starReach;
+        std::vector<SynthStar>::const_iterator it =
+            std::lower_bound(stars.begin(), stars.end(), row - reach,
+                             [](const SynthStar &star, float y)
+                             { return star.y < y; });
+        for (; (it != stars.end()) && (it->y <= row + reach); ++it)
+        {
+            const float dy = row - it->y;
+            const float r = g_starReach * it->sigma;
+            if (fabsf(dy) > r)
+            {
+                continue;
+            }
+
+            const float norm = starGain * it->flux / (2.0f * (float)M_PI * it->sigma * it->sigma);
+            const float rowWeight = expf(-dy * dy / (2.0f * it->sigma * it->sigma));
+            const int x0 = std::max(0, (int)(it->x - r));
+            const int x1 = std::min(spec.width - 1, (int)(it->x + r));
+            for (int x = x0; x <= x1; x++)
+            {
+                const float dx = x - it->x;
+                out[x] += norm * rowWeight * expf(-dx * dx / (2.0f * it->sigma * it->sigma));
+            }
+        }
+
+        const float scale = outputScale(spec.bitDepth);
+        const float top = spec.bitDepth == ELS::FITSImage::BD_INT_8 ? 255.0f : g_fullWell * scale;
+        for (int x = 0; x < spec.width; x++)
+        {
+            const float signal = out[x];
+            const float noisy = signal + gauss(rng) * sqrtf(signal / g_gain + g_readNoise * g_readNoise);
+            out[x] = std::min(top, std::max(0.0f, noisy * scale));
+        }
+    }
+
+}
+
+void writeSynthFITS(const char *filename,
+                    const SynthSpec &spec)
+{
+    const int channels = spec.isColor ? 3 : 1;
+    const std::vector<SynthStar> stars = makeStars(spec);
+
+    ELS::FITSBandWriter writer(filename, spec.width, spec.height, channels, spec.bitDepth);
+
+    std::vector<float> band((size_t)spec.width * g_bandRows);
+    std::vector<int> rows;
+    for (int channel = 0; channel < channels; channel++)
+    {
+        for (int firstRow = 0; firstRow < spec.height; firstRow += g_bandRows)
+        {
+            const int numRows = std::min(g_bandRows, spec.height - firstRow);
+
+            rows.clear();
+            for (int i = 0; i < numRows; i++)
+            {
+                rows.push_back(i);
+            }
+
+            float *bandPixels = &band[0];
+            QtConcurrent::blockingMap(rows, [&](int i)
+                                      { renderRow(spec, stars, channel, firstRow + i,
+                                                  bandPixels + (size_t)i * spec.width); });
+
+            writer.writeBand(channel, firstRow, numRows, bandPixels);
+        }
+    }
+
+    writer.close();
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "fitsimage.h"
+
+// A synthetic sky: a sloped, vignetted background, Gaussian stars with
+// a power-law brightness distribution, and shot plus read noise. The
+// same seed always produces the same file.
+struct SynthSpec
+{
+    ELS::FITSImage::BitDepth bitDepth;
+    int width;
+    int height;
+    bool isColor;
+    unsigned seed;
+};
+
+// Writes the image a band of rows at a time, generating each band on
+// the global thread pool. Integer images span their full unsigned
+// range except 32-bit ones, which hold 16-bit data as stacked frames
+// usually do; floating point images are normalised to 0-1.
+void writeSynthFITS(const char *filename,
+                    const SynthSpec &spec);
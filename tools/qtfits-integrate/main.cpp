@@ -0,0 +1,295 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "fitsbandreader.h"
+#include "fitsbandwriter.h"
+#include "fitsexception.h"
+#include "inputfiles.h"
+#include "stackcombine.h"
+
+namespace
+{
+
+    // One band of rows from every input, plus somewhere to put any
+    // read errors (exceptions can't cross QtConcurrent::run).
+    struct BandSet
+    {
+        std::vector<std::vector<float>> frames;
+        std::vector<std::string> errors;
+    };
+
+    struct BandJob
+    {
+        int channel;
+        int firstRow;
+        int numRows;
+    };
+
+    // Starts reading job into set, one task per input file on ioPool.
+    QVector<QFuture<void>> startRead(std::vector<ELS::FITSBandReader *> &readers,
+                                     const BandJob &job,
+                                     BandSet *set,
+                                     QThreadPool *ioPool)
+    {
+        QVector<QFuture<void>> futures;
+
+        for (size_t i = 0; i < readers.size(); i++)
+        {
+            ELS::FITSBandReader *reader = readers[i];
+            float *pixels = set->frames[i].data();
+            std::string *error = &set->errors[i];
+
+            futures.append(QtConcurrent::run(ioPool, [=]()
+                                             {
+                                                 try
+                                                 {
+                                                     reader->readBand(job.channel, job.firstRow, job.numRows, pixels);
+                                                 }
+                                                 catch (ELS::FITSException *e)
+                                                 {
+                                                     *error = e->getErrText();
+                                                     delete e;
+                                                 }
+                                             }));
+        }
+
+        return futures;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtfits-integrate");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Integrates a stack of FITS frames into a master frame, "
+                                     "a band of rows at a time.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("inputs", "FITS files or directories to integrate.", "inputs...");
+
+    QCommandLineOption outputOpt(QStringList() << "o"
+                                               << "output",
+                                 "Master frame to write.", "file", "master.fits");
+    QCommandLineOption methodOpt(QStringList() << "m"
+                                               << "method",
+                                 "median, sigma or winsor.", "method", "median");
+    QCommandLineOption lowOpt("low", "Low rejection threshold in sigma.", "sigma", "3.0");
+    QCommandLineOption highOpt("high", "High rejection threshold in sigma.", "sigma", "3.0");
+    QCommandLineOption iterOpt("iterations", "Maximum rejection iterations.", "count", "5");
+    QCommandLineOption memoryOpt("memory", "Band buffer budget in MB.", "MB", "1024");
+    QCommandLineOption ioOpt("io-threads", "Files read concurrently.", "count", "4");
+    QCommandLineOption forceOpt(QStringList() << "f"
+                                              << "force",
+                                "Overwrite the output if it exists.");
+    parser.addOption(outputOpt);
+    parser.addOption(methodOpt);
+    parser.addOption(lowOpt);
+    parser.addOption(highOpt);
+    parser.addOption(iterOpt);
+    parser.addOption(memoryOpt);
+    parser.addOption(ioOpt);
+    parser.addOption(forceOpt);
+    parser.process(app);
+
+    ELS::StackCombine::Method method;
+    QString methodName = parser.value(methodOpt);
+    if (methodName == "median")
+    {
+        method = ELS::StackCombine::CM_MEDIAN;
+    }
+    else if (methodName == "sigma")
+    {
+        method = ELS::StackCombine::CM_SIGMA_CLIP;
+    }
+    else if (methodName == "winsor")
+    {
+        method = ELS::StackCombine::CM_WINSORIZED;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown method %s\n", methodName.toLocal8Bit().constData());
+        return 1;
+    }
+
+    ELS::StackCombine combiner(method,
+                               parser.value(lowOpt).toFloat(),
+                               parser.value(highOpt).toFloat(),
+                               parser.value(iterOpt).toInt());
+
+    QStringList files = expandInputFiles(parser.positionalArguments());
+    if (files.isEmpty())
+    {
+        parser.showHelp(1);
+    }
+
+    std::vector<ELS::FITSBandReader *> readers;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    try
+    {
+        for (const QString &file : files)
+        {
+            ELS::FITSBandReader *reader = new ELS::FITSBandReader(file.toLocal8Bit().constData());
+            readers.push_back(reader);
+
+            if (readers.size() == 1)
+            {
+                width = reader->getWidth();
+                height = reader->getHeight();
+                channels = reader->getChannels();
+            }
+            else if ((reader->getWidth() != width) ||
+                     (reader->getHeight() != height) ||
+                     (reader->getChannels() != channels))
+            {
+                fprintf(stderr, "%s does not match the geometry of %s\n",
+                        reader->getFilename(), readers[0]->getFilename());
+                return 1;
+            }
+        }
+    }
+    catch (ELS::FITSException *e)
+    {
+        fprintf(stderr, "FITSException: %s\n", e->getErrText());
+        delete e;
+        return 1;
+    }
+
+    const int frameCount = readers.size();
+
+    // Two band sets are live at once: one being combined while the
+    // next is read, so the budget is split across both.
+    const int64_t budget = parser.value(memoryOpt).toLongLong() * 1024 * 1024;
+    const int64_t bytesPerRow = (int64_t)width * frameCount * sizeof(float);
+    int bandRows = budget / (2 * bytesPerRow);
+    if (bandRows < 1)
+    {
+        bandRows = 1;
+    }
+    else if (bandRows > height)
+    {
+        bandRows = height;
+    }
+
+    printf("Integrating %d frames of %dx%dx%d, %s, %d rows per band\n",
+           frameCount, width, height, channels, combiner.getMethodName(), bandRows);
+    fflush(stdout);
+
+    std::vector<BandJob> jobs;
+    for (int channel = 0; channel < channels; channel++)
+    {
+        for (int row = 0; row < height; row += bandRows)
+        {
+            BandJob job;
+            job.channel = channel;
+            job.firstRow = row;
+            job.numRows = std::min(bandRows, height - row);
+            jobs.push_back(job);
+        }
+    }
+
+    BandSet sets[2];
+    for (BandSet &set : sets)
+    {
+        set.frames.resize(frameCount);
+        set.errors.resize(frameCount);
+        for (std::vector<float> &frame : set.frames)
+        {
+            frame.resize((size_t)width * bandRows);
+        }
+    }
+    std::vector<float> master((size_t)width * bandRows);
+
+    QThreadPool ioPool;
+    ioPool.setMaxThreadCount(std::max(1, parser.value(ioOpt).toInt()));
+
+    QString output = parser.value(outputOpt);
+    if (parser.isSet(forceOpt))
+    {
+        // cfitsio's clobber prefix
+        output.prepend('!');
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    int status = 0;
+    try
+    {
+        ELS::FITSBandWriter writer(output.toLocal8Bit().constData(), width, height, channels);
+
+        QVector<QFuture<void>> reads = startRead(readers, jobs[0], &sets[0], &ioPool);
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            BandSet &set = sets[i % 2];
+            for (QFuture<void> future : reads)
+                future.waitForFinished();
+
+            for (int f = 0; f < frameCount; f++)
+            {
+                if (!set.errors[f].empty())
+                {
+                    throw new ELS::FITSException(set.errors[f].c_str());
+                }
+            }
+
+            // Keep the disk busy with the next band while this one is
+            // combined.
+            if (i + 1 < jobs.size())
+            {
+                reads = startRead(readers, jobs[i + 1], &sets[(i + 1) % 2], &ioPool);
+            }
+
+            const BandJob &job = jobs[i];
+            std::vector<const float *> frames;
+            for (std::vector<float> &frame : set.frames)
+            {
+                frames.push_back(frame.data());
+            }
+
+            combiner.combine(frames, (int64_t)width * job.numRows, master.data());
+            writer.writeBand(job.channel, job.firstRow, job.numRows, master.data());
+        }
+
+        char history[80];
+        snprintf(history, sizeof(history), "qtfits-integrate: %s of %d frames",
+                 combiner.getMethodName(), frameCount);
+        writer.writeKey("NCOMBINE", frameCount, "Number of frames integrated");
+        writer.writeHistory(history);
+        writer.close();
+    }
+    catch (ELS::FITSException *e)
+    {
+        fprintf(stderr, "FITSException: %s\n", e->getErrText());
+        delete e;
+        status = 1;
+    }
+
+    // Let any read still in flight land before its buffers go away.
+    ioPool.waitForDone();
+
+    for (ELS::FITSBandReader *reader : readers)
+    {
+        delete reader;
+    }
+
+    if (status == 0)
+    {
+        double seconds = timer.elapsed() / 1000.0;
+        double megapixels = (double)width * height * channels * frameCount / 1e6;
+        printf("Wrote %s in %.1f s (%.0f Mpx/s across the stack)\n",
+               parser.value(outputOpt).toLocal8Bit().constData(), seconds, megapixels / seconds);
+    }
+
+    return status;
+}
@@ -0,0 +1,16 @@
+# Command-line master frame integration (darks, flats, bias).
+
+QT += core concurrent
+QT -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = qtfits-integrate
+
+include(../../fits/fits.pri)
+include(../../proc/proc.pri)
+include(../common/common.pri)
+
+SOURCES += \
+    main.cpp
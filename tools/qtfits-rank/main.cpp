@@ -0,0 +1,302 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include "debayer.h"
+#include "fitsexception.h"
+#include "fitsimage.h"
+#include "inputfiles.h"
+#include "starfinder.h"
+
+namespace
+{
+
+    struct FrameQuality
+    {
+        QString filename;
+        bool ok;
+        std::string error;
+        int width;
+        int height;
+        float background;
+        float noise;
+        int starCount;
+        float fwhm;
+        float hfr;
+        float eccentricity;
+        float score;
+    };
+
+    // Everything the viewer's star overlay measures, for one file. Only
+    // the file being measured is in memory on this thread.
+    void measure(FrameQuality *frame)
+    {
+        ELS::FITSImage *image = 0;
+        try
+        {
+            image = ELS::FITSImage::load(frame->filename.toLocal8Bit().constData());
+
+            // Superpixel keeps the colour planes aligned at a quarter of
+            // the cost; sizes are scaled back to sensor pixels.
+            float scale = 1.0f;
+            if (image->isBayered())
+            {
+                ELS::FITSImage *rgb = ELS::Debayer::run(image, ELS::Debayer::DM_SUPERPIXEL);
+                delete image;
+                image = rgb;
+                scale = 2.0f;
+            }
+
+            ELS::StarAnalysis analysis = ELS::StarFinder().analyze(image);
+
+            frame->width = image->getWidth() * scale;
+            frame->height = image->getHeight() * scale;
+            frame->background = analysis.getBackground();
+            frame->noise = analysis.getNoise();
+            frame->starCount = analysis.getStarCount();
+            frame->fwhm = analysis.getMedianFWHM() * scale;
+            frame->hfr = analysis.getMedianHFR() * scale;
+            frame->eccentricity = analysis.getMedianEccentricity();
+            frame->ok = true;
+        }
+        catch (ELS::FITSException *e)
+        {
+            frame->error = e->getErrText();
+            delete e;
+        }
+
+        delete image;
+    }
+
+    float median(std::vector<float> values)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        const int middle = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + middle, values.end());
+        return values[middle];
+    }
+
+    // Scores each frame against the session's medians, so 100 is a
+    // typical frame: sharper, rounder, more stars and less noise score
+    // higher. Frames with no stars score 0.
+    void score(std::vector<FrameQuality> &frames)
+    {
+        std::vector<float> fwhms, stars, noises;
+        for (const FrameQuality &frame : frames)
+        {
+            if (frame.ok && (frame.starCount > 0))
+            {
+                fwhms.push_back(frame.fwhm);
+                stars.push_back(frame.starCount);
+                noises.push_back(frame.noise);
+            }
+        }
+
+        const float sessionFWHM = median(fwhms);
+        const float sessionStars = median(stars);
+        const float sessionNoise = median(noises);
+
+        for (FrameQuality &frame : frames)
+        {
+            if (!frame.ok || (frame.starCount == 0) || (frame.fwhm <= 0))
+            {
+                frame.score = 0;
+                continue;
+            }
+
+            const float sharpness = (sessionFWHM / frame.fwhm) * (sessionFWHM / frame.fwhm);
+            const float transparency = sqrtf(std::min(1.5f, frame.starCount / sessionStars));
+            const float roundness = 1.0f - std::max(0.0f, frame.eccentricity - 0.4f);
+            const float quietness = frame.noise > 0 ? sqrtf(std::min(1.5f, sessionNoise / frame.noise)) : 1.0f;
+
+            frame.score = 100 * sharpness * transparency * roundness * quietness;
+        }
+    }
+
+    void writeCSV(QTextStream &out, const std::vector<FrameQuality> &frames)
+    {
+        out << "rank,file,score,background,noise,stars,fwhm,hfr,eccentricity\n";
+
+        int rank = 1;
+        for (const FrameQuality &frame : frames)
+        {
+            if (!frame.ok)
+            {
+                continue;
+            }
+
+            QString name = frame.filename;
+            name.replace('"', "\"\"");
+
+            out << rank++ << ",\"" << name << "\","
+                << QString::number(frame.score, 'f', 1) << ","
+                << QString::number(frame.background, 'f', 1) << ","
+                << QString::number(frame.noise, 'f', 2) << ","
+                << frame.starCount << ","
+                << QString::number(frame.fwhm, 'f', 2) << ","
+                << QString::number(frame.hfr, 'f', 2) << ","
+                << QString::number(frame.eccentricity, 'f', 3) << "\n";
+        }
+    }
+
+    void writeJSON(QTextStream &out, const std::vector<FrameQuality> &frames)
+    {
+        QJsonArray array;
+
+        int rank = 1;
+        for (const FrameQuality &frame : frames)
+        {
+            QJsonObject object;
+            object["file"] = frame.filename;
+            if (!frame.ok)
+            {
+                object["error"] = QString::fromStdString(frame.error);
+            }
+            else
+            {
+                object["rank"] = rank++;
+                object["score"] = frame.score;
+                object["width"] = frame.width;
+                object["height"] = frame.height;
+                object["background"] = frame.background;
+                object["noise"] = frame.noise;
+                object["stars"] = frame.starCount;
+                object["fwhm"] = frame.fwhm;
+                object["hfr"] = frame.hfr;
+                object["eccentricity"] = frame.eccentricity;
+            }
+            array.append(object);
+        }
+
+        out << QJsonDocument(array).toJson();
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtfits-rank");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures background, noise, star count, FWHM and eccentricity "
+                                     "of every frame and lists them best first.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("inputs", "FITS files or directories to rank.", "inputs...");
+
+    QCommandLineOption formatOpt("format", "csv or json.", "format", "csv");
+    QCommandLineOption outputOpt(QStringList() << "o"
+                                               << "output",
+                                 "Write the ranking here instead of stdout.", "file");
+    QCommandLineOption jobsOpt(QStringList() << "j"
+                                             << "jobs",
+                               "Frames in memory at once.", "count",
+                               QString::number(std::max(1, QThread::idealThreadCount() / 2)));
+    parser.addOption(formatOpt);
+    parser.addOption(outputOpt);
+    parser.addOption(jobsOpt);
+    parser.process(app);
+
+    const QString format = parser.value(formatOpt);
+    if ((format != "csv") && (format != "json"))
+    {
+        fprintf(stderr, "Unknown format %s\n", format.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QStringList files = expandInputFiles(parser.positionalArguments());
+    if (files.isEmpty())
+    {
+        parser.showHelp(1);
+    }
+
+    std::vector<FrameQuality> frames(files.size());
+    for (int i = 0; i < files.size(); i++)
+    {
+        frames[i].filename = files[i];
+        frames[i].ok = false;
+        frames[i].score = 0;
+    }
+
+    // Each job holds one whole frame, so the job count is the memory
+    // bound; the analysis inside a job is threaded on the global pool.
+    QThreadPool framePool;
+    framePool.setMaxThreadCount(std::max(1, parser.value(jobsOpt).toInt()));
+
+    std::atomic<int> done(0);
+    const int total = frames.size();
+
+    QVector<QFuture<void>> futures;
+    for (FrameQuality &frame : frames)
+    {
+        FrameQuality *f = &frame;
+        std::atomic<int> *counter = &done;
+        futures.append(QtConcurrent::run(&framePool, [=]()
+                                         {
+                                             measure(f);
+                                             fprintf(stderr, "[%d/%d] %s\n", ++*counter, total,
+                                                     f->filename.toLocal8Bit().constData());
+                                         }));
+    }
+    for (QFuture<void> future : futures)
+        future.waitForFinished();
+
+    score(frames);
+    std::stable_sort(frames.begin(), frames.end(),
+                     [](const FrameQuality &a, const FrameQuality &b)
+                     { return a.score > b.score; });
+
+    int failed = 0;
+    for (const FrameQuality &frame : frames)
+    {
+        if (!frame.ok)
+        {
+            fprintf(stderr, "FITSException: %s for file %s\n",
+                    frame.error.c_str(), frame.filename.toLocal8Bit().constData());
+            failed++;
+        }
+    }
+
+    QFile file;
+    if (parser.isSet(outputOpt))
+    {
+        file.setFileName(parser.value(outputOpt));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+        {
+            fprintf(stderr, "Can't write %s\n", parser.value(outputOpt).toLocal8Bit().constData());
+            return 1;
+        }
+    }
+    else
+    {
+        file.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    }
+
+    QTextStream out(&file);
+    if (format == "json")
+    {
+        writeJSON(out, frames);
+    }
+    else
+    {
+        writeCSV(out, frames);
+    }
+
+    return failed == total ? 1 : 0;
+}
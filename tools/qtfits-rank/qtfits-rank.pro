@@ -0,0 +1,16 @@
+# Command-line frame quality ranking for culling a session.
+
+QT += core concurrent
+QT -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = qtfits-rank
+
+include(../../fits/fits.pri)
+include(../../proc/proc.pri)
+include(../common/common.pri)
+
+SOURCES += \
+    main.cpp
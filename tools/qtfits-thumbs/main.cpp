@@ -0,0 +1,240 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFileInfo>
+#include <QPainter>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "debayer.h"
+#include "fitsexception.h"
+#include "fitsimage.h"
+#include "fitsrender.h"
+#include "inputfiles.h"
+
+namespace
+{
+
+    struct Thumbnail
+    {
+        QString filename;
+        QImage image;
+        std::string error;
+    };
+
+    // Loads only as many pixels as the preview needs, then stretches
+    // them exactly as the viewer would.
+    QImage makePreview(const QString &filename, int size, bool stretched)
+    {
+        QByteArray name = filename.toLocal8Bit();
+
+        ELS::FITSImage::Info info;
+        ELS::FITSImage::probe(name.constData(), &info);
+
+        // Decimate to no less than the requested size; the final
+        // resample to size is done smoothly from there.
+        const int factor = std::max(1, std::max(info.width, info.height) / size);
+        ELS::FITSImage *image = ELS::FITSImage::loadDecimated(name.constData(), factor);
+
+        if (image->isBayered())
+        {
+            // Superpixel halves the size again, so only use it when
+            // there is room to spare.
+            const bool halve = std::max(image->getWidth(), image->getHeight()) >= 2 * size;
+            ELS::FITSImage *rgb = 0;
+            try
+            {
+                rgb = ELS::Debayer::run(image, halve ? ELS::Debayer::DM_SUPERPIXEL : ELS::Debayer::DM_BILINEAR);
+            }
+            catch (ELS::FITSException *e)
+            {
+                delete image;
+                throw e;
+            }
+            delete image;
+            image = rgb;
+        }
+
+        QImage *rendered = FITSRender::render(image, stretched);
+        delete image;
+
+        QImage preview = rendered->scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        delete rendered;
+
+        return preview;
+    }
+
+    QImage makeContactSheet(const std::vector<Thumbnail> &thumbs, int size, int columns)
+    {
+        const int margin = 8;
+        const int label = 18;
+        const int cellW = size + margin;
+        const int cellH = size + label + margin;
+        const int rows = (thumbs.size() + columns - 1) / columns;
+
+        QImage sheet(margin + columns * cellW, margin + rows * cellH, QImage::Format_RGB32);
+        sheet.fill(QColor(32, 32, 32));
+
+        QPainter painter(&sheet);
+        painter.setPen(QColor(200, 200, 200));
+        QFont font = painter.font();
+        font.setPixelSize(12);
+        painter.setFont(font);
+
+        for (size_t i = 0; i < thumbs.size(); i++)
+        {
+            const int x = margin + (i % columns) * cellW;
+            const int y = margin + (i / columns) * cellH;
+
+            const QImage &image = thumbs[i].image;
+            if (!image.isNull())
+            {
+                painter.drawImage(x + (size - image.width()) / 2, y + (size - image.height()) / 2, image);
+            }
+
+            QString name = QFileInfo(thumbs[i].filename).fileName();
+            name = painter.fontMetrics().elidedText(name, Qt::ElideMiddle, size);
+            painter.drawText(QRect(x, y + size, size, label), Qt::AlignCenter, name);
+        }
+
+        return sheet;
+    }
+
+}
+
+int main(int argc, char *argv[])
+{
+    // Rendering text into the contact sheet needs a platform plugin;
+    // offscreen keeps this working on machines without a display.
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
+    QGuiApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtfits-thumbs");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Writes stretched previews of FITS files, and optionally a contact sheet.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("inputs", "FITS files or directories.", "inputs...");
+
+    QCommandLineOption sizeOpt(QStringList() << "s"
+                                             << "size",
+                               "Longest side of each preview in pixels.", "pixels", "512");
+    QCommandLineOption outDirOpt(QStringList() << "o"
+                                               << "output-dir",
+                                 "Where to write the previews.", "dir", ".");
+    QCommandLineOption formatOpt("format", "png or jpg.", "format", "png");
+    QCommandLineOption qualityOpt("quality", "JPEG quality, 0-100.", "quality", "85");
+    QCommandLineOption linearOpt("linear", "Don't auto-stretch.");
+    QCommandLineOption sheetOpt("sheet", "Also write a contact sheet of all previews.", "file");
+    QCommandLineOption columnsOpt("columns", "Contact sheet columns.", "count", "6");
+    QCommandLineOption noPreviewsOpt("sheet-only", "Write only the contact sheet.");
+    QCommandLineOption jobsOpt(QStringList() << "j"
+                                             << "jobs",
+                               "Files processed at once.", "count",
+                               QString::number(QThread::idealThreadCount()));
+    parser.addOption(sizeOpt);
+    parser.addOption(outDirOpt);
+    parser.addOption(formatOpt);
+    parser.addOption(qualityOpt);
+    parser.addOption(linearOpt);
+    parser.addOption(sheetOpt);
+    parser.addOption(columnsOpt);
+    parser.addOption(noPreviewsOpt);
+    parser.addOption(jobsOpt);
+    parser.process(app);
+
+    const int size = std::max(16, parser.value(sizeOpt).toInt());
+    const QString format = parser.value(formatOpt);
+    const int quality = parser.value(qualityOpt).toInt();
+    const bool stretched = !parser.isSet(linearOpt);
+    const bool writePreviews = !parser.isSet(noPreviewsOpt);
+    const QDir outDir(parser.value(outDirOpt));
+
+    if ((format != "png") && (format != "jpg"))
+    {
+        fprintf(stderr, "Unknown format %s\n", format.toLocal8Bit().constData());
+        return 1;
+    }
+    if (writePreviews && !outDir.exists() && !QDir().mkpath(outDir.path()))
+    {
+        fprintf(stderr, "Can't create %s\n", outDir.path().toLocal8Bit().constData());
+        return 1;
+    }
+
+    QStringList files = expandInputFiles(parser.positionalArguments());
+    if (files.isEmpty())
+    {
+        parser.showHelp(1);
+    }
+
+    std::vector<Thumbnail> thumbs(files.size());
+    for (int i = 0; i < files.size(); i++)
+    {
+        thumbs[i].filename = files[i];
+    }
+
+    QThreadPool filePool;
+    filePool.setMaxThreadCount(std::max(1, parser.value(jobsOpt).toInt()));
+
+    std::atomic<int> failed(0);
+    QVector<QFuture<void>> futures;
+    for (Thumbnail &thumb : thumbs)
+    {
+        Thumbnail *t = &thumb;
+        std::atomic<int> *failures = &failed;
+        futures.append(QtConcurrent::run(&filePool, [=]()
+                                         {
+                                             try
+                                             {
+                                                 t->image = makePreview(t->filename, size, stretched);
+                                             }
+                                             catch (ELS::FITSException *e)
+                                             {
+                                                 t->error = e->getErrText();
+                                                 delete e;
+                                                 ++*failures;
+                                                 return;
+                                             }
+
+                                             if (writePreviews)
+                                             {
+                                                 QString out = outDir.filePath(QFileInfo(t->filename).completeBaseName() + "." + format);
+                                                 if (!t->image.save(out, format.toLatin1().constData(), quality))
+                                                 {
+                                                     t->error = "can't write " + out.toStdString();
+                                                     ++*failures;
+                                                 }
+                                             }
+                                         }));
+    }
+    for (QFuture<void> future : futures)
+        future.waitForFinished();
+
+    for (const Thumbnail &thumb : thumbs)
+    {
+        if (!thumb.error.empty())
+        {
+            fprintf(stderr, "%s: %s\n", thumb.filename.toLocal8Bit().constData(), thumb.error.c_str());
+        }
+    }
+
+    if (parser.isSet(sheetOpt))
+    {
+        QImage sheet = makeContactSheet(thumbs, size, std::max(1, parser.value(columnsOpt).toInt()));
+        if (!sheet.save(parser.value(sheetOpt), 0, quality))
+        {
+            fprintf(stderr, "Can't write %s\n", parser.value(sheetOpt).toLocal8Bit().constData());
+            return 1;
+        }
+    }
+
+    return failed == (int)thumbs.size() ? 1 : 0;
+}
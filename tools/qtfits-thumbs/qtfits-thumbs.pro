@@ -0,0 +1,16 @@
+# Headless stretched preview and contact sheet export.
+
+QT += core gui concurrent
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = qtfits-thumbs
+
+include(../../fits/fits.pri)
+include(../../proc/proc.pri)
+include(../../gui/render.pri)
+include(../common/common.pri)
+
+SOURCES += \
+    main.cpp